@@ -1,3 +1,5 @@
 require 'mkmf'
 # have_library('ws2_32')
+have_header('ruby/fiber/scheduler.h')
+have_library('rt', 'shm_open')
 create_makefile("mg_ruby")
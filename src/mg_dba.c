@@ -91,6 +91,53 @@ Version 1.3.16 15 June 2022:
 Version 1.3.17 12 January 2023:
    Remove the need to prefix global names with the '^' character for API-based connections to YottaDB.
 
+Version 1.3.18 17 October 2026:
+   Release the connection table slot (and method block) when a network connection is closed by mg_db_disconnect().
+   Replace the unsynchronized scan for a free network connection with a mutex-protected connection pool.
+   - Released connections are kept on a free list.
+   - Connections can (optionally) be reserved for the thread that last used them.
+   - A request waits (for a configurable period) for a connection to be released when all are busy.
+   The connection pool grows on demand up to a configurable maximum (no longer fixed at MG_MAXCON) and closes connections left idle for longer than a configurable period.
+   Each connection owns a request/response buffer that is reused by every request made on it (mg_db_buffer()).
+   Correct mg_realloc() (the previous content was lost) and the resizing of the receive buffer for responses larger than the buffer.
+   Buffers grow geometrically rather than in fixed increments.
+   mg_db_receive() mode MG_RECV_PARTIAL and mg_db_receive_body(): read a large payload directly into memory supplied by the caller.
+
+Version 1.3.19 17 October 2026:
+   Request pipelining: mg_request_batch_header() and mg_request_batch_end() place several requests in one buffer.
+   mg_db_receive_batch() collects the responses to a batch of pipelined requests.
+
+Version 1.3.20 17 October 2026:
+   Large values are no longer copied into the request buffer: mg_request_add() records them and mg_db_send() writes them with writev().
+
+Version 1.3.21 17 October 2026:
+   Connect to a DB Superserver listening on a Unix domain socket: host name 'unix:/path/to/socket'.
+
+Version 1.3.22 17 October 2026:
+   API mode: mg_api_global() invokes the global commands (S, G, K, D, O, P, I) directly through dbx_*_ex() instead of through ifc^%zmgsis.
+   YottaDB: the 5 byte block header is no longer counted as space available for the value returned by dbx_get_ex(), dbx_increment_ex(), dbx_next_ex(), dbx_previous_ex() and dbx_function_ex().
+
+Version 1.3.23 17 October 2026:
+   Non-blocking connections: a caller can install a wait function (DBXCON p_wait) through which mg_db_send() and mg_db_receive() yield while the socket is busy.
+   mg_db_connect_ex() context MG_CONNECT_NOWAIT: return MG_POOL_BUSY instead of waiting for a free connection.
+   mg_db_connect_ex() context MG_CONNECT_NOOPEN: return MG_POOL_NEW for a new connection, which the caller opens with mg_db_connect_open() once it has installed its wait function (the TCP connect also waits through p_wait).
+   mg_db_wait_wake(): a wait function can be woken by another thread (mg_db_wake()) without closing the connection.
+
+Version 1.3.24 17 October 2026:
+   mg_db_poll(): check, without blocking, whether the response to a request sent on a connection has arrived.
+
+Version 1.3.25 17 October 2026:
+   mg_api_request(): API mode: process an encoded global command (for example, one queued in a pipeline) through mg_api_global().
+
+Version 1.3.26 17 October 2026:
+   Count the requests that change the database (MGSRV.write_seq: see mg_request_writes()) so that data cached by the client can be invalidated.
+
+Version 1.3.27 17 October 2026:
+   Batched global commands: OB and PB return up to n subscripts that follow (or precede) a key, optionally with their data, in one request.
+   API mode: mg_api_global() answers the batched commands with a loop over the API (mg_api_batch()).
+   API mode: commands ON and PN return the next (or previous) subscript with its data from a single call to dbx_next_ex() (or dbx_previous_ex()).
+   Batched global command: QB returns the nodes of a subtree in $query order, in one request (or one per batch of nodes).
+
 */
 
 
@@ -415,9 +462,7 @@ DBX_EXTFUN(int) dbx_open(unsigned char *input, unsigned char *output)
          strcpy(((MGSRV *) pcon->p_srv)->username, "");
          strcpy(((MGSRV *) pcon->p_srv)->password, "");
 
-         for (n = 0; n < MG_MAXCON; n ++) {
-            ((MGSRV *) pcon->p_srv)->pcon[n] = NULL;
-         }
+         mg_pool_init((MGSRV *) pcon->p_srv); /* v1.3.18 */
          ((MGSRV *) pcon->p_srv)->pcon[chndle] = pcon;
 
          rc = netx_tcp_connect(pcon, 0);
@@ -740,10 +785,12 @@ DBX_EXTFUN(int) dbx_get_ex(DBXMETH *pmeth)
 
       pmeth->output_val.svalue.len_used = 0;
       pmeth->output_val.svalue.buf_addr += 5;
+      pmeth->output_val.svalue.len_alloc -= 5; /* v1.3.22 */
 
       rc = pcon->p_ydb_so->p_ydb_get_s(&(pmeth->args[0].svalue), pmeth->argc - 1, &pmeth->yargs[0], &(pmeth->output_val.svalue));
 
       pmeth->output_val.svalue.buf_addr -= 5;
+      pmeth->output_val.svalue.len_alloc += 5;
       mg_add_block_size(&(pmeth->output_val.svalue), 0, (unsigned long) pmeth->output_val.svalue.len_used, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
    }
    else {
@@ -931,10 +978,12 @@ DBX_EXTFUN(int) dbx_next_ex(DBXMETH *pmeth)
 
          pmeth->output_val.svalue.len_used = 0;
          pmeth->output_val.svalue.buf_addr += 5;
+         pmeth->output_val.svalue.len_alloc -= 5; /* v1.3.22 */
 
          rc = pcon->p_ydb_so->p_ydb_subscript_next_s(&(pmeth->args[0].svalue), pmeth->argc - 1, &pmeth->yargs[0], &(pmeth->output_val.svalue));
 
          pmeth->output_val.svalue.buf_addr -= 5;
+         pmeth->output_val.svalue.len_alloc += 5;
          mg_add_block_size(&(pmeth->output_val.svalue), 0, (unsigned long) pmeth->output_val.svalue.len_used, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
       }
    }
@@ -1136,10 +1185,12 @@ DBX_EXTFUN(int) dbx_previous_ex(DBXMETH *pmeth)
       else {
          pmeth->output_val.svalue.len_used = 0;
          pmeth->output_val.svalue.buf_addr += 5;
+         pmeth->output_val.svalue.len_alloc -= 5; /* v1.3.22 */
 
          rc = pcon->p_ydb_so->p_ydb_subscript_previous_s(&(pmeth->args[0].svalue), pmeth->argc - 1, &pmeth->yargs[0], &(pmeth->output_val.svalue));
 
          pmeth->output_val.svalue.buf_addr -= 5;
+         pmeth->output_val.svalue.len_alloc += 5;
          mg_add_block_size(&(pmeth->output_val.svalue), 0, (unsigned long) pmeth->output_val.svalue.len_used, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
       }
    }
@@ -1425,10 +1476,12 @@ DBX_EXTFUN(int) dbx_increment_ex(DBXMETH *pmeth)
 
       pmeth->output_val.svalue.len_used = 0;
       pmeth->output_val.svalue.buf_addr += 5;
+      pmeth->output_val.svalue.len_alloc -= 5; /* v1.3.22 */
 
       rc = pcon->p_ydb_so->p_ydb_incr_s(&(pmeth->args[0].svalue), pmeth->argc - 2, &pmeth->yargs[0], &(pmeth->args[pmeth->argc - 1].svalue), &(pmeth->output_val.svalue));
 
       pmeth->output_val.svalue.buf_addr -= 5;
+      pmeth->output_val.svalue.len_alloc += 5;
       mg_add_block_size(&(pmeth->output_val.svalue), 0, (unsigned long) pmeth->output_val.svalue.len_used, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
    }
    else {
@@ -2256,10 +2309,12 @@ DBX_EXTFUN(int) dbx_function_ex(DBXMETH *pmeth)
 
       pmeth->output_val.svalue.len_used = 0;
       pmeth->output_val.svalue.buf_addr += 5;
+      pmeth->output_val.svalue.len_alloc -= 5; /* v1.3.22 */
 
       rc = ydb_function(pmeth, pmeth->pfun);
 
       pmeth->output_val.svalue.buf_addr -= 5;
+      pmeth->output_val.svalue.len_alloc += 5;
       mg_add_block_size(&(pmeth->output_val.svalue), 0, (unsigned long) pmeth->output_val.svalue.len_used, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
    }
    else {
@@ -5303,13 +5358,19 @@ int mg_buf_init(MGBUF *p_buf, int size, int increment_size)
 
 int mg_buf_resize(MGBUF *p_buf, unsigned long size)
 {
+   unsigned char *p_buffer;
+
    if (size < MG_BUFSIZE)
       return 1;
 
    if (size < p_buf->size)
       return 1;
 
-   p_buf->p_buffer = (unsigned char *) mg_realloc((void *) p_buf->p_buffer, 0, sizeof(char) * size, 0);
+   p_buffer = (unsigned char *) mg_realloc((void *) p_buf->p_buffer, (int) p_buf->size + 1, sizeof(char) * (size + 1), 0);
+   if (!p_buffer) /* v1.3.18 */
+      return 0;
+
+   p_buf->p_buffer = p_buffer;
    p_buf->size = size;
 
    return 1;
@@ -5354,9 +5415,9 @@ int mg_buf_cpy(LPMGBUF p_buf, char *buffer, unsigned long size)
       csize = p_buf->size;
       increment_size = p_buf->increment_size;
       while (req_size > csize)
-         csize = csize + p_buf->increment_size;
+         csize = csize + (csize > p_buf->increment_size ? csize : p_buf->increment_size); /* v1.3.18 */
       mg_buf_free(p_buf);
-      result = mg_buf_init(p_buf, (int) size, (int) increment_size);
+      result = mg_buf_init(p_buf, (int) csize, (int) increment_size);
    }
    if (result) {
       memcpy((void *) p_buf->p_buffer, (void *) buffer, size);
@@ -5388,7 +5449,7 @@ int mg_buf_cat(LPMGBUF p_buf, char *buffer, unsigned long size)
       csize = p_buf->size;
       increment_size = p_buf->increment_size;
       while (req_size > csize)
-         csize = csize + p_buf->increment_size;
+         csize = csize + (csize > p_buf->increment_size ? csize : p_buf->increment_size); /* v1.3.18 */
       p_temp = p_buf->p_buffer;
       result = mg_buf_init(p_buf, (int) csize, (int) increment_size);
       if (result) {
@@ -5417,15 +5478,14 @@ void * mg_realloc(void *p, int curr_size, int new_size, short id)
       p = (void *) dbx_ext_realloc((void *) p, (unsigned long) new_size);
    }
    else {
-      if (new_size >= curr_size) {
-         if (p) {
-            mg_free((void *) p, 0);
-         }
-
+      if (new_size >= curr_size) { /* v1.3.18: preserve the existing content */
 #if defined(_WIN32)
-         p = (void *) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, new_size + 32);
+         if (p)
+            p = (void *) HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, p, new_size + 32);
+         else
+            p = (void *) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, new_size + 32);
 #else
-         p = (void *) mg_malloc(new_size, id);
+         p = (void *) realloc(p, new_size);
 #endif
       }
    }
@@ -5794,6 +5854,20 @@ unsigned long mg_current_process_id(void)
 }
 
 
+/* v1.3.18 */
+unsigned long mg_current_time_ms(void)
+{
+#if defined(_WIN32)
+   return (unsigned long) GetTickCount();
+#else
+   struct timeval tp;
+
+   gettimeofday(&tp, NULL);
+   return ((unsigned long) tp.tv_sec * 1000) + ((unsigned long) tp.tv_usec / 1000);
+#endif
+}
+
+
 int mg_error_message(DBXMETH *pmeth, int error_code)
 {
    int rc;
@@ -6332,7 +6406,7 @@ int netx_tcp_connect(DBXCON *pcon, int context)
    int n, errorno;
    unsigned long inetaddr;
    DWORD spin_count;
-   char ansi_ip_address[64];
+   char ansi_ip_address[128];
    struct sockaddr_in srv_addr, cli_addr;
    struct hostent *hp;
    struct in_addr **pptr;
@@ -6350,6 +6424,11 @@ int netx_tcp_connect(DBXCON *pcon, int context)
 
    strcpy(ansi_ip_address, (char *) pcon->ip_address);
 
+   /* v1.3.21 */
+   if (!strncmp(ansi_ip_address, MG_UNIX_PREFIX, strlen(MG_UNIX_PREFIX))) {
+      return netx_unix_connect(pcon, ansi_ip_address + strlen(MG_UNIX_PREFIX));
+   }
+
 #if defined(_WIN32)
 
    if (!netx_so.load_attempted) {
@@ -6854,7 +6933,7 @@ int netx_tcp_connect_ex(DBXCON *pcon, xLPSOCKADDR p_srv_addr, socklen_netx srv_a
    timeout = 0;
 #endif
 
-   if (timeout != 0) {
+   if (timeout != 0 || pcon->p_wait) {
 
 #if defined(_WIN32)
 
@@ -6887,7 +6966,27 @@ int netx_tcp_connect_ex(DBXCON *pcon, xLPSOCKADDR p_srv_addr, socklen_netx srv_a
          }
       }
 
-      if (n != 0) {
+      if (n != 0 && pcon->p_wait) { /* v1.3.23 */
+         /* wait through the caller (for example, yielding to other fibers) for the connection to complete */
+         n = pcon->p_wait(pcon, MG_WAIT_WRITE, timeout);
+         if (n == 0) {
+            close(pcon->cli_socket);
+            errno = ETIMEDOUT;
+
+            return (-2);
+         }
+         if (n < 0) {
+            close(pcon->cli_socket);
+            errno = ECONNABORTED;
+
+            return (-1);
+         }
+         len = sizeof(error);
+         if (NETX_GETSOCKOPT(pcon->cli_socket, SOL_SOCKET, SO_ERROR, (void *) &error, &len) < 0) {
+            error = errno;
+         }
+      }
+      else if (n != 0) {
 
          FD_ZERO(&rset);
          FD_SET(pcon->cli_socket, &rset);
@@ -6943,6 +7042,55 @@ int netx_tcp_connect_ex(DBXCON *pcon, xLPSOCKADDR p_srv_addr, socklen_netx srv_a
 }
 
 
+/* v1.3.21 */
+int netx_unix_connect(DBXCON *pcon, char *path)
+{
+#if defined(_WIN32)
+   sprintf(pcon->error, "Connection Error: Cannot Connect to Server (%s%s): Unix domain sockets are not supported on this platform", MG_UNIX_PREFIX, path);
+   return -5;
+#else
+   int n, errorno;
+   struct sockaddr_un srv_addr;
+
+   if (!path[0] || strlen(path) >= sizeof(srv_addr.sun_path)) {
+      sprintf(pcon->error, "Connection Error: Invalid Unix domain socket path (%s%s)", MG_UNIX_PREFIX, path);
+      return -5;
+   }
+
+   memset((void *) &srv_addr, 0, sizeof(srv_addr));
+   srv_addr.sun_family = AF_UNIX;
+   strcpy(srv_addr.sun_path, path);
+
+   pcon->cli_socket = (SOCKET) NETX_SOCKET(AF_UNIX, SOCK_STREAM, 0);
+   if (INVALID_SOCK(pcon->cli_socket)) {
+      char message[256];
+
+      errorno = (int) netx_get_last_error(0);
+      netx_get_error_message(errorno, message, 250, 0);
+      sprintf(pcon->error, "Connection Error: Cannot open a Unix domain socket: Error Code: %d (%s)", errorno, message);
+      return -5;
+   }
+
+   n = netx_tcp_connect_ex(pcon, (xLPSOCKADDR) &srv_addr, (socklen_netx) sizeof(srv_addr), pcon->timeout);
+   if (n == -2 || SOCK_ERROR(n)) {
+      char message[256];
+
+      errorno = (n == -2) ? ETIMEDOUT : (int) netx_get_last_error(0);
+      netx_get_error_message(errorno, message, 250, 0);
+      sprintf(pcon->error, "Connection Error: Cannot Connect to Server (%s%s): Error Code: %d (%s)", MG_UNIX_PREFIX, path, errorno, message);
+      if (n == -2)
+         pcon->cli_socket = (SOCKET) 0; /* already closed */
+      else
+         netx_tcp_disconnect(pcon, 0);
+      return -5;
+   }
+
+   pcon->connected = 1;
+   return 0;
+#endif
+}
+
+
 int netx_tcp_disconnect(DBXCON *pcon, int context)
 {
    if (!pcon) {
@@ -7628,61 +7776,153 @@ int mg_db_command(DBXMETH *pmeth, int context)
 
 int mg_db_connect(MGSRV *p_srv, int *p_chndle, short context)
 {
-   int rc, n, free;
+   return mg_db_connect_ex(p_srv, p_chndle, context, NULL);
+}
+
+
+/* v1.3.18 */
+int mg_db_connect_ex(MGSRV *p_srv, int *p_chndle, short context, volatile short *p_cancel)
+{
+   int n, chndle, wait, waited;
+   unsigned long start;
    DBXCON *pcon;
-   DBXMETH *pmeth;
 
    if (p_srv->mode == 2) {
+      *p_chndle = 0; /* the connection bound by mg_bind_server_api() */
       return 1;
    }
 
-   free = -1;
    *p_chndle = -1;
-   for (n = 0; n < MG_MAXCON; n ++) {
-      if (connection[n]) {
-         if (!connection[n]->in_use) {
-            *p_chndle = n;
-            connection[*p_chndle]->in_use = 1;
-            connection[*p_chndle]->eod = 0;
-            break;
+   if (!mg_pool_init(p_srv)) {
+      strcpy(p_srv->error_mess, "Unable to allocate memory for the connection pool");
+      return 0;
+   }
+
+   if (p_srv->pool.idle_timeout > 0) {
+      mg_pool_reap(p_srv, 0);
+   }
+
+   start = mg_current_time_ms();
+   chndle = -1;
+   pcon = NULL;
+   waited = 0;
+
+   mg_enter_critical_section((void *) &(p_srv->pool.mutex));
+   for (;;) {
+      /* a connection returned to the pool */
+      chndle = mg_pool_get_free(p_srv);
+      if (chndle >= 0) {
+         pcon = p_srv->pcon[chndle];
+         break;
+      }
+
+      /* an empty slot in which a new connection can be made */
+      if (p_srv->pool.size < p_srv->pool.max) {
+         if (p_srv->pool.size >= p_srv->pool.capacity) {
+            mg_pool_grow(p_srv);
+         }
+         for (n = 0; n < p_srv->pool.capacity; n ++) {
+            if (!p_srv->pcon[n]) {
+               chndle = n;
+               break;
+            }
          }
       }
-      else {
-         if (free == -1) {
-            free = n;
+      if (chndle >= 0) {
+         pcon = (PDBXCON) mg_malloc(sizeof(DBXCON), 0);
+         if (pcon == NULL) {
+            mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+            strcpy(p_srv->error_mess, "Unable to allocate memory for the connection");
+            return 0;
+         }
+         memset((void *) pcon, 0, sizeof(DBXCON));
+         pcon->chndle = chndle;
+         pcon->in_use = 1;
+         p_srv->pcon[chndle] = pcon;
+         p_srv->pool.size ++;
+         p_srv->pool.created_count ++;
+         if (p_srv->pool.size > p_srv->pool.peak) {
+            p_srv->pool.peak = p_srv->pool.size;
          }
+         break;
       }
+
+      /* all connections are busy: wait for one to be released */
+      if (p_cancel && *p_cancel) {
+         mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+         strcpy(p_srv->error_mess, "Connection pool: wait for a free connection interrupted");
+         return 0;
+      }
+      wait = p_srv->pool.wait_timeout;
+      if (wait > 0) {
+         wait -= (int) (mg_current_time_ms() - start);
+      }
+      if (wait == 0 || (wait < 0 && p_srv->pool.wait_timeout > 0)) {
+         p_srv->pool.timeout_count ++;
+         mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+         sprintf(p_srv->error_mess, "Connection pool exhausted: no connection became free within %d ms (maximum %d connections)", p_srv->pool.wait_timeout, p_srv->pool.max);
+         return 0;
+      }
+      if (context & MG_CONNECT_NOWAIT) { /* v1.3.23 */
+         /* the caller waits for a connection to be released in its own way */
+         mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+         return MG_POOL_BUSY;
+      }
+      if (!waited) {
+         p_srv->pool.wait_count ++;
+         waited = 1;
+      }
+      mg_pool_wait(p_srv, wait);
    }
+   pcon->owner_tid = mg_current_thread_id();
+   mg_leave_critical_section((void *) &(p_srv->pool.mutex));
 
-   if (*p_chndle != -1) {
-      p_srv->pcon[*p_chndle] = connection[*p_chndle];
+   *p_chndle = chndle;
+   pcon->eod = 0;
+
+   if (pcon->pmeth_base) {
       return 1;
    }
 
-   if (free == -1) {
-      return 0;
+   if (context & MG_CONNECT_NOOPEN) { /* v1.3.23 */
+      /* the caller opens the connection itself (mg_db_connect_open()) */
+      return MG_POOL_NEW;
    }
 
-   *p_chndle = free;
-
-   pcon = (PDBXCON) mg_malloc(sizeof(DBXCON), 0);
-   if (pcon == NULL) {
+   /* complete the new connection outside the pool lock */
+   if (!mg_db_connect_open(p_srv, chndle)) {
+      *p_chndle = -1;
       return 0;
    }
-   memset((void *) pcon, 0, sizeof(DBXCON));
+
+   return 1;
+}
+
+
+/* v1.3.23 */
+/*
+   Open a new connection reserved by mg_db_connect_ex() (context MG_CONNECT_NOOPEN).  If the caller has
+   installed a wait function (pcon->p_wait) the TCP connect waits through it.  On failure the connection
+   is released and 0 is returned.
+*/
+int mg_db_connect_open(MGSRV *p_srv, int chndle)
+{
+   int rc;
+   DBXCON *pcon;
+   DBXMETH *pmeth;
+
+   pcon = p_srv->pcon[chndle];
+
    pmeth = (PDBXMETH) mg_malloc(sizeof(DBXMETH), 0);
    if (pmeth == NULL) {
-      mg_free((void *) pcon, 0);
+      strcpy(p_srv->error_mess, "Unable to allocate memory for the connection");
+      mg_db_disconnect(p_srv, chndle, 0);
       return 0;
    }
    memset((void *) pmeth, 0, sizeof(DBXMETH));
    pcon->pmeth_base = (void *) pmeth;
    pmeth->pcon = pcon;
 
-   connection[*p_chndle] = pcon;
-   pcon->chndle = *p_chndle;
-   p_srv->pcon[*p_chndle] = connection[*p_chndle];
-
    pcon->use_db_mutex = 0; /* v1.3.12 */
    pcon->tlevel = 0;
    pcon->p_isc_so = NULL;
@@ -7696,7 +7936,6 @@ int mg_db_connect(MGSRV *p_srv, int *p_chndle, short context)
 
    mg_log_init(pcon->p_log);
 
-   pcon->in_use = 1;
    pcon->keep_alive = 0;
 
    strcpy(pcon->ip_address, p_srv->ip_address);
@@ -7711,6 +7950,10 @@ int mg_db_connect(MGSRV *p_srv, int *p_chndle, short context)
       pcon->connected = 0;
       rc = CACHE_NOCON;
       mg_error_message(pmeth, rc);
+      if (!p_srv->error_mess[0]) {
+         strcpy(p_srv->error_mess, pcon->error);
+      }
+      mg_db_disconnect(p_srv, chndle, 0);
       return 0;
    }
 
@@ -7727,149 +7970,573 @@ int mg_db_disconnect(MGSRV *p_srv, int chndle, short context)
       return 1;
    }
 
-   if (!p_srv->pcon[chndle])
+   if (!p_srv->pool.created || chndle < 0 || chndle >= p_srv->pool.capacity || !p_srv->pcon[chndle])
       return 0;
 
-   if (p_srv->mode == 1) {
-      p_srv->pcon[chndle]->in_use = 0;
+   pcon = p_srv->pcon[chndle];
+
+   /* v1.3.18 */
+   mg_enter_critical_section((void *) &(p_srv->pool.mutex));
+   if (!pcon->in_use) {
+      /* already released to the pool */
+      mg_leave_critical_section((void *) &(p_srv->pool.mutex));
       return 1;
    }
-
-   if (context == 1 && p_srv->pcon[chndle]->keep_alive) {
-      p_srv->pcon[chndle]->in_use = 0;
+   if (p_srv->mode == 1 || (context == 1 && pcon->keep_alive)) {
+      pcon->in_use = 0;
+      pcon->last_used = mg_current_time_ms();
+      p_srv->pool.free_list[p_srv->pool.free_count ++] = chndle;
+      mg_pool_wakeup(p_srv);
+      mg_leave_critical_section((void *) &(p_srv->pool.mutex));
       return 1;
    }
+   p_srv->pcon[chndle] = NULL;
+   p_srv->pool.size --;
+   p_srv->pool.closed_count ++;
+   mg_pool_wakeup(p_srv);
+   mg_leave_critical_section((void *) &(p_srv->pool.mutex));
 
-   pcon = p_srv->pcon[chndle];
+   /* callers read the response before releasing the connection so its buffer is freed with it */
+   mg_pool_close_connection(pcon);
+
+   return 1;
+}
+
+
+/* v1.3.18 */
+int mg_pool_init(MGSRV *p_srv)
+{
+   if (p_srv->pool.created) {
+      return 1;
+   }
 
+   mg_enter_critical_section((void *) &dbx_global_mutex);
+   if (!p_srv->pool.created) {
+      p_srv->pcon = (PDBXCON *) mg_malloc(sizeof(PDBXCON) * MG_MAXCON, 0);
+      p_srv->pool.free_list = (int *) mg_malloc(sizeof(int) * MG_MAXCON, 0);
+      if (!p_srv->pcon || !p_srv->pool.free_list) {
+         if (p_srv->pcon) {
+            mg_free((void *) p_srv->pcon, 0);
+            p_srv->pcon = NULL;
+         }
+         if (p_srv->pool.free_list) {
+            mg_free((void *) p_srv->pool.free_list, 0);
+            p_srv->pool.free_list = NULL;
+         }
+         mg_leave_critical_section((void *) &dbx_global_mutex);
+         return 0;
+      }
+      memset((void *) p_srv->pcon, 0, sizeof(PDBXCON) * MG_MAXCON);
 #if defined(_WIN32)
-   NETX_CLOSESOCKET(pcon->cli_socket);
-   NETX_WSACLEANUP();
+      InitializeCriticalSection(&(p_srv->pool.mutex));
+      InitializeConditionVariable(&(p_srv->pool.cv));
 #else
-   close(pcon->cli_socket);
+      pthread_mutex_init(&(p_srv->pool.mutex), NULL);
+      pthread_cond_init(&(p_srv->pool.cv), NULL);
 #endif
-
-   mg_free((void *) p_srv->pcon[chndle], 0);
-   p_srv->pcon[chndle] = NULL;
+      p_srv->pool.capacity = MG_MAXCON;
+      if (p_srv->pool.max < 1) {
+         p_srv->pool.max = MG_MAXCON;
+      }
+      p_srv->pool.size = 0;
+      p_srv->pool.peak = 0;
+      p_srv->pool.free_count = 0;
+      p_srv->pool.retired_count = 0;
+      p_srv->pool.last_reap = mg_current_time_ms();
+      p_srv->pool.created = 1;
+   }
+   mg_leave_critical_section((void *) &dbx_global_mutex);
 
    return 1;
 }
 
-int mg_db_send(MGSRV *p_srv, int chndle, MGBUF *p_buf, int mode)
+
+/* Wake all threads waiting for a connection: the pool mutex should be held */
+int mg_pool_wakeup(MGSRV *p_srv)
 {
-   int result, n, n1, len, total;
-   char *request;
-   unsigned char esize[8];
-   DBXCON *pcon;
+   if (!p_srv->pool.created) {
+      return 0;
+   }
+#if defined(_WIN32)
+   WakeAllConditionVariable(&(p_srv->pool.cv));
+#else
+   pthread_cond_broadcast(&(p_srv->pool.cv));
+#endif
+   return 1;
+}
 
-   result = 1;
 
-   if (p_srv->p_log && p_srv->p_log->log_transmissions) {
-      char buffer[64];
+/* Take a connection off the free list: the pool mutex must be held */
+int mg_pool_get_free(MGSRV *p_srv)
+{
+   int n, chndle;
+   DBXTHID tid;
 
-      sprintf(buffer, "Transmission: Send to Host (size=%lu)", p_buf->data_size);
-      mg_log_buffer(p_srv->p_log, (char *) p_buf->p_buffer, p_buf->data_size, buffer, 0);
+   if (!p_srv->pool.free_count) {
+      return -1;
    }
 
-   if (mode) {
-      len = mg_encode_size(esize, p_buf->data_size - p_srv->header_len, MG_CHUNK_SIZE_BASE);
-      strncpy((char *) (p_buf->p_buffer + (p_srv->header_len - 6) + (5 - len)), (char *) esize, len);
+   /* the most recently released connection unless this thread has one of its own waiting */
+   n = p_srv->pool.free_count - 1;
+   if (p_srv->pool.affinity) {
+      tid = mg_current_thread_id();
+      for (; n >= 0; n --) {
+         if (p_srv->pcon[p_srv->pool.free_list[n]]->owner_tid == tid) {
+            break;
+         }
+      }
+      if (n < 0) {
+         n = p_srv->pool.free_count - 1;
+      }
    }
 
-   if (p_srv->mode == 2) {
-      return 1;
-   }
+   chndle = p_srv->pool.free_list[n];
+   p_srv->pool.free_list[n] = p_srv->pool.free_list[-- p_srv->pool.free_count];
+   p_srv->pcon[chndle]->in_use = 1;
 
-   pcon = p_srv->pcon[chndle];
+   return chndle;
+}
 
-   pcon->eod = 0;
 
-   request = (char *) p_buf->p_buffer;
-   len = p_buf->data_size;
+/* Wait (for up to msecs, or indefinitely if negative) for the pool to change: the pool mutex must be held */
+int mg_pool_wait(MGSRV *p_srv, int msecs)
+{
+   int rc;
+#if !defined(_WIN32)
+   unsigned long long nsec;
+   struct timeval tp;
+   struct timespec ts;
+#endif
 
-   total = 0;
+#if defined(_WIN32)
+   rc = SleepConditionVariableCS(&(p_srv->pool.cv), &(p_srv->pool.mutex), msecs < 0 ? INFINITE : (DWORD) msecs) ? 0 : 1;
+#else
+   if (msecs < 0) {
+      rc = pthread_cond_wait(&(p_srv->pool.cv), &(p_srv->pool.mutex));
+   }
+   else {
+      gettimeofday(&tp, NULL);
+      nsec = ((unsigned long long) tp.tv_usec * 1000) + ((unsigned long long) msecs * 1000000);
+      ts.tv_sec = tp.tv_sec + (time_t) (nsec / 1000000000);
+      ts.tv_nsec = (long) (nsec % 1000000000);
+      rc = pthread_cond_timedwait(&(p_srv->pool.cv), &(p_srv->pool.mutex), &ts);
+   }
+#endif
 
-   n1= 0;
-   for (;;) {
-      n = NETX_SEND(pcon->cli_socket, request + total, len - total, 0);
-      if (n < 0) {
-         result = 0;
-         break;
-      }
+   return rc;
+}
 
-      total += n;
 
-      if (total == len)
-         break;
+/* Enlarge the connection table: the pool mutex must be held */
+int mg_pool_grow(MGSRV *p_srv)
+{
+   int capacity;
+   int *free_list;
+   PDBXCON *pcon;
 
-      n1 ++;
-      if (n1 > 100000)
-         break;
+   if (p_srv->pool.capacity >= p_srv->pool.max || p_srv->pool.retired_count >= MG_POOL_RETIRED) {
+      return 0;
+   }
 
+   capacity = p_srv->pool.capacity * 2;
+   if (capacity > p_srv->pool.max) {
+      capacity = p_srv->pool.max;
    }
 
-   return result;
+   pcon = (PDBXCON *) mg_malloc(sizeof(PDBXCON) * capacity, 0);
+   free_list = (int *) mg_malloc(sizeof(int) * capacity, 0);
+   if (!pcon || !free_list) {
+      if (pcon) {
+         mg_free((void *) pcon, 0);
+      }
+      if (free_list) {
+         mg_free((void *) free_list, 0);
+      }
+      return 0;
+   }
+   memset((void *) pcon, 0, sizeof(PDBXCON) * capacity);
+   memcpy((void *) pcon, (void *) p_srv->pcon, sizeof(PDBXCON) * p_srv->pool.capacity);
+   memcpy((void *) free_list, (void *) p_srv->pool.free_list, sizeof(int) * p_srv->pool.free_count);
+
+   /*
+      Threads already holding a connection may still be reading the old table (without the pool mutex)
+      so it is retired rather than freed.  The slot of a connection in use is never changed.
+   */
+   p_srv->pool.retired[p_srv->pool.retired_count ++] = (void *) p_srv->pcon;
+   p_srv->pcon = pcon;
+
+   mg_free((void *) p_srv->pool.free_list, 0);
+   p_srv->pool.free_list = free_list;
+   p_srv->pool.capacity = capacity;
+
+   return 1;
 }
 
 
-int mg_db_receive(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
+/* Close free connections that have been idle for longer than the idle timeout (keeping at least 'min' open) */
+int mg_pool_reap(MGSRV *p_srv, int force)
 {
-   int result, n;
-   unsigned long len, total, ssize;
-   fd_set rset, eset;
-   struct timeval tval;
+   int n, max, total, chndle;
+   unsigned long now, idle;
    DBXCON *pcon;
-   unsigned long spin_count;
+   DBXCON *reaped[MG_POOL_REAP_BATCH];
 
-   if (p_srv->mode == 2) {
-      return mg_invoke_server_api(p_srv, chndle, p_buf, size, mode);
+   if (!p_srv->pool.created || p_srv->pool.idle_timeout <= 0) {
+      return 0;
    }
 
-   pcon = p_srv->pcon[chndle];
+   now = mg_current_time_ms();
+   if (!force && (now - p_srv->pool.last_reap) < 1000) {
+      return 0;
+   }
 
-   result = 0;
-   ssize = 0;
-   p_buf->p_buffer[0] = '\0';
-   p_buf->data_size = 0;
+   idle = (unsigned long) p_srv->pool.idle_timeout * 1000;
+   total = 0;
 
-   /* v1.2.8 */
-   pcon->timeout = p_srv->timeout;
-   tval.tv_sec = pcon->timeout;
-   tval.tv_usec = 0;
+mg_pool_reap_batch:
 
-   if (pcon->eod) {
-      pcon->eod = 0;
-      return 0;
+   max = 0;
+   mg_enter_critical_section((void *) &(p_srv->pool.mutex));
+   p_srv->pool.last_reap = now;
+   for (n = 0; n < p_srv->pool.free_count && max < MG_POOL_REAP_BATCH; ) {
+      chndle = p_srv->pool.free_list[n];
+      pcon = p_srv->pcon[chndle];
+      if (p_srv->pool.size > p_srv->pool.min && (now - pcon->last_used) > idle) {
+         p_srv->pool.free_list[n] = p_srv->pool.free_list[-- p_srv->pool.free_count];
+         p_srv->pcon[chndle] = NULL;
+         p_srv->pool.size --;
+         p_srv->pool.closed_count ++;
+         reaped[max ++] = pcon;
+         continue;
+      }
+      n ++;
    }
-   pcon->eod = 0;
+   if (max) {
+      mg_pool_wakeup(p_srv);
+   }
+   mg_leave_critical_section((void *) &(p_srv->pool.mutex));
 
-   len = 0;
+   for (n = 0; n < max; n ++) {
+      mg_pool_close_connection(reaped[n]);
+   }
+   total += max;
 
-   if (mode)
-      total = size;
-   else
-      total = p_buf->size;
+   if (max == MG_POOL_REAP_BATCH) {
+      goto mg_pool_reap_batch;
+   }
 
-   spin_count = 0;
-   for (;;) {
-      spin_count ++;
+   return total;
+}
 
-      if (pcon->timeout) {
-         FD_ZERO(&rset);
-         FD_ZERO(&eset);
-         FD_SET(pcon->cli_socket, &rset);
-         FD_SET(pcon->cli_socket, &eset);
 
-         n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, NULL, &eset, &tval);
+/* Close the socket of a connection that has been removed from the pool and free it */
+int mg_pool_close_connection(DBXCON *pcon)
+{
+   if (!pcon) {
+      return 0;
+   }
 
-         if (n == 0) {
-            sprintf(pcon->error, "TCP Read Error: Server did not respond within the timeout period (%d seconds)", pcon->timeout);
-            result = NETX_READ_TIMEOUT;
+   if (pcon->connected) {
+#if defined(_WIN32)
+      NETX_CLOSESOCKET(pcon->cli_socket);
+      NETX_WSACLEANUP();
+#else
+      close(pcon->cli_socket);
+#endif
+   }
+
+   if (pcon->pmeth_base) {
+      mg_free((void *) pcon->pmeth_base, 0);
+   }
+   if (pcon->p_buf) {
+      mg_buf_free(pcon->p_buf);
+      mg_free((void *) pcon->p_buf, 0);
+   }
+#if !defined(_WIN32)
+   if (pcon->wake_open) {
+      close(pcon->wake[0]);
+      close(pcon->wake[1]);
+   }
+#endif
+   mg_free((void *) pcon, 0);
+
+   return 1;
+}
+
+
+/* Close every connection and release the pool: the server object must no longer be in use by any thread */
+int mg_pool_destroy(MGSRV *p_srv)
+{
+   int n;
+   DBXCON *pcon;
+
+   if (!p_srv->pool.created) {
+      return 0;
+   }
+
+   for (n = 0; n < p_srv->pool.capacity; n ++) {
+      pcon = p_srv->pcon[n];
+      if (!pcon) {
+         continue;
+      }
+      p_srv->pcon[n] = NULL;
+      if (pcon->connected == 1) {
+         continue; /* bound to the database API: the library remains loaded for the life of the process */
+      }
+      mg_pool_close_connection(pcon);
+   }
+
+   for (n = 0; n < p_srv->pool.retired_count; n ++) {
+      mg_free(p_srv->pool.retired[n], 0);
+   }
+   mg_free((void *) p_srv->pcon, 0);
+   mg_free((void *) p_srv->pool.free_list, 0);
+   p_srv->pcon = NULL;
+   p_srv->pool.free_list = NULL;
+   p_srv->pool.retired_count = 0;
+   p_srv->pool.capacity = 0;
+   p_srv->pool.size = 0;
+   p_srv->pool.free_count = 0;
+
+#if defined(_WIN32)
+   DeleteCriticalSection(&(p_srv->pool.mutex));
+#else
+   pthread_cond_destroy(&(p_srv->pool.cv));
+   pthread_mutex_destroy(&(p_srv->pool.mutex));
+#endif
+   p_srv->pool.created = 0;
+
+   return 1;
+}
+
+
+int mg_db_send(MGSRV *p_srv, int chndle, MGBUF *p_buf, int mode)
+{
+   int result, n, n1, len, total;
+   unsigned long iov_size;
+   char *request;
+   unsigned char esize[8];
+   DBXCON *pcon;
+
+   result = 1;
+
+   /* v1.3.20 */
+   pcon = NULL;
+   iov_size = 0;
+   if (p_srv->mode != 2) {
+      pcon = p_srv->pcon[chndle];
+      if (pcon->iov_count && pcon->p_iov_buf == p_buf) {
+         iov_size = pcon->iov_size;
+      }
+   }
+
+   if (p_srv->p_log && p_srv->p_log->log_transmissions) {
+      char buffer[128];
+
+      if (iov_size)
+         sprintf(buffer, "Transmission: Send to Host (size=%lu; not shown: %lu bytes of data)", p_buf->data_size + iov_size, iov_size);
+      else
+         sprintf(buffer, "Transmission: Send to Host (size=%lu)", p_buf->data_size);
+      mg_log_buffer(p_srv->p_log, (char *) p_buf->p_buffer, p_buf->data_size, buffer, 0);
+   }
+
+   if (mode) {
+      len = mg_encode_size(esize, p_buf->data_size + iov_size - p_srv->header_len, MG_CHUNK_SIZE_BASE);
+      strncpy((char *) (p_buf->p_buffer + (p_srv->header_len - 6) + (5 - len)), (char *) esize, len);
+   }
+
+   if (p_srv->mode == 2) {
+      return 1;
+   }
+
+   pcon->eod = 0;
+
+   if (iov_size) {
+      result = mg_db_send_iov(p_srv, pcon, p_buf);
+      pcon->p_iov_buf = NULL;
+      pcon->iov_count = 0;
+      pcon->iov_size = 0;
+      return result;
+   }
+
+   request = (char *) p_buf->p_buffer;
+   len = p_buf->data_size;
+
+   total = 0;
+
+   n1= 0;
+   for (;;) {
+      n = NETX_SEND(pcon->cli_socket, request + total, len - total, 0);
+      if (n < 0) {
+         if (mg_db_would_block(pcon) && mg_db_wait(pcon, MG_WAIT_WRITE) > 0) { /* v1.3.23 */
+            continue;
+         }
+         result = 0;
+         break;
+      }
+
+      total += n;
+
+      if (total == len)
+         break;
+
+      n1 ++;
+      if (n1 > 100000)
+         break;
+
+   }
+
+   return result;
+}
+
+
+/* v1.3.20 */
+int mg_db_send_iov(MGSRV *p_srv, DBXCON *pcon, MGBUF *p_buf)
+{
+#if defined(_WIN32)
+   int n, len, total;
+   unsigned long offset;
+   unsigned char *data[MG_IOV_MAX * 2 + 1];
+   unsigned long size[MG_IOV_MAX * 2 + 1];
+   int count, seg;
+
+   count = 0;
+   offset = 0;
+   for (n = 0; n < pcon->iov_count; n ++) {
+      data[count] = p_buf->p_buffer + offset;
+      size[count ++] = pcon->iov[n].offset - offset;
+      data[count] = pcon->iov[n].p_data;
+      size[count ++] = pcon->iov[n].size;
+      offset = pcon->iov[n].offset;
+   }
+   data[count] = p_buf->p_buffer + offset;
+   size[count ++] = p_buf->data_size - offset;
+
+   for (seg = 0; seg < count; seg ++) {
+      len = (int) size[seg];
+      for (total = 0; total < len; total += n) {
+         n = NETX_SEND(pcon->cli_socket, (xLPSENDBUF) (data[seg] + total), len - total, 0);
+         if (n < 0) {
+            return 0;
+         }
+      }
+   }
+
+   return 1;
+#else
+   int n, iovcnt;
+   ssize_t sent;
+   unsigned long offset;
+   struct iovec iov[MG_IOV_MAX * 2 + 1], *p_iov;
+
+   /* interleave the request buffer with the values held outside it */
+   iovcnt = 0;
+   offset = 0;
+   for (n = 0; n < pcon->iov_count; n ++) {
+      if (pcon->iov[n].offset > offset) {
+         iov[iovcnt].iov_base = (void *) (p_buf->p_buffer + offset);
+         iov[iovcnt ++].iov_len = (size_t) (pcon->iov[n].offset - offset);
+      }
+      iov[iovcnt].iov_base = (void *) pcon->iov[n].p_data;
+      iov[iovcnt ++].iov_len = (size_t) pcon->iov[n].size;
+      offset = pcon->iov[n].offset;
+   }
+   if (p_buf->data_size > offset) {
+      iov[iovcnt].iov_base = (void *) (p_buf->p_buffer + offset);
+      iov[iovcnt ++].iov_len = (size_t) (p_buf->data_size - offset);
+   }
+
+   p_iov = iov;
+   while (iovcnt) {
+      sent = writev(pcon->cli_socket, p_iov, iovcnt);
+      if (sent < 0) {
+         if (mg_db_would_block(pcon) && mg_db_wait(pcon, MG_WAIT_WRITE) > 0) { /* v1.3.23 */
+            continue;
+         }
+         return 0;
+      }
+      while (iovcnt && (size_t) sent >= p_iov->iov_len) {
+         sent -= (ssize_t) p_iov->iov_len;
+         p_iov ++;
+         iovcnt --;
+      }
+      if (iovcnt) {
+         p_iov->iov_base = (void *) ((char *) p_iov->iov_base + sent);
+         p_iov->iov_len -= (size_t) sent;
+      }
+   }
+
+   return 1;
+#endif
+}
+
+
+int mg_db_receive(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
+{
+   int result, n;
+   unsigned long len, total, ssize;
+   fd_set rset, eset;
+   struct timeval tval;
+   DBXCON *pcon;
+   unsigned long spin_count;
+
+   if (p_srv->mode == 2) {
+      return mg_invoke_server_api(p_srv, chndle, p_buf, size, mode);
+   }
+
+   pcon = p_srv->pcon[chndle];
+
+   result = 0;
+   ssize = 0;
+   p_buf->p_buffer[0] = '\0';
+   p_buf->data_size = 0;
+
+   /* v1.2.8 */
+   pcon->timeout = p_srv->timeout;
+   tval.tv_sec = pcon->timeout;
+   tval.tv_usec = 0;
+
+   if (pcon->eod) {
+      pcon->eod = 0;
+      return 0;
+   }
+   pcon->eod = 0;
+
+   len = 0;
+
+   if (mode && mode != MG_RECV_PARTIAL)
+      total = size;
+   else
+      total = p_buf->size;
+
+   spin_count = 0;
+   for (;;) {
+      spin_count ++;
+
+      if (pcon->timeout || pcon->nonblock) {
+         if (pcon->nonblock) {
+            n = mg_db_wait(pcon, MG_WAIT_READ); /* v1.3.23 */
+         }
+         else {
+            FD_ZERO(&rset);
+            FD_ZERO(&eset);
+            FD_SET(pcon->cli_socket, &rset);
+            FD_SET(pcon->cli_socket, &eset);
+
+            n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, NULL, &eset, &tval);
+            if (n > 0 && !NETX_FD_ISSET(pcon->cli_socket, &rset)) {
+               n = -1;
+            }
+         }
+
+         if (n == 0) {
+            sprintf(pcon->error, "TCP Read Error: Server did not respond within the timeout period (%d seconds)", pcon->timeout);
+            result = NETX_READ_TIMEOUT;
             pcon->eod = 1;
             break;
          }
 
-         if (n < 0 || !NETX_FD_ISSET(pcon->cli_socket, &rset)) {
+         if (n < 0) {
             strcpy(pcon->error, "TCP Read Error: Server closed the connection without having returned any data");
             result = NETX_READ_ERROR;
             pcon->eod = 1;
@@ -7879,6 +8546,9 @@ int mg_db_receive(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
 
       n = NETX_RECV(pcon->cli_socket, p_buf->p_buffer + len, total - len, 0);
 
+      if (n < 0 && mg_db_would_block(pcon)) { /* v1.3.23 */
+         continue;
+      }
       if (n < 0) {
          result = len;
          pcon->eod = 1;
@@ -7900,8 +8570,13 @@ int mg_db_receive(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
          ssize = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
          total = ssize + MG_RECV_HEAD;
 
-         if (ssize && (ssize + MG_RECV_HEAD) > total) {
-            if (!mg_buf_resize(p_buf, ssize + MG_RECV_HEAD + 32)) {
+         if (ssize && total > p_buf->size) { /* v1.3.18 */
+            if (mode == MG_RECV_PARTIAL) {
+               /* the caller collects the rest of the payload with mg_db_receive_body() */
+               result = len;
+               break;
+            }
+            if (!mg_buf_resize(p_buf, total + 32)) {
                p_srv->mem_error = 1;
                break;
             }
@@ -7928,6 +8603,70 @@ int mg_db_receive(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
 }
 
 
+/* v1.3.18 */
+/* Read the remainder of a response received with MG_RECV_PARTIAL directly into the caller's memory */
+int mg_db_receive_body(MGSRV *p_srv, int chndle, unsigned char *p_data, unsigned long size)
+{
+   int n;
+   unsigned long len;
+   fd_set rset, eset;
+   struct timeval tval;
+   DBXCON *pcon;
+
+   pcon = p_srv->pcon[chndle];
+
+   tval.tv_sec = pcon->timeout;
+   tval.tv_usec = 0;
+
+   len = 0;
+   while (len < size) {
+
+      if (pcon->timeout || pcon->nonblock) {
+         if (pcon->nonblock) {
+            n = mg_db_wait(pcon, MG_WAIT_READ); /* v1.3.23 */
+         }
+         else {
+            FD_ZERO(&rset);
+            FD_ZERO(&eset);
+            FD_SET(pcon->cli_socket, &rset);
+            FD_SET(pcon->cli_socket, &eset);
+
+            n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, NULL, &eset, &tval);
+            if (n > 0 && !NETX_FD_ISSET(pcon->cli_socket, &rset)) {
+               n = -1;
+            }
+         }
+
+         if (n == 0) {
+            sprintf(pcon->error, "TCP Read Error: Server did not respond within the timeout period (%d seconds)", pcon->timeout);
+            break;
+         }
+         if (n < 0) {
+            strcpy(pcon->error, "TCP Read Error: Server closed the connection before the response was complete");
+            break;
+         }
+      }
+
+      n = NETX_RECV(pcon->cli_socket, p_data + len, size - len, 0);
+
+      if (n < 0 && mg_db_would_block(pcon)) { /* v1.3.23 */
+         continue;
+      }
+      if (n < 1) {
+         strcpy(pcon->error, "TCP Read Error: Server closed the connection before the response was complete");
+         break;
+      }
+      len += n;
+   }
+
+   pcon->eod = 1;
+   /* a connection left part way through a response cannot be reused */
+   pcon->keep_alive = (len == size) ? 1 : 0;
+
+   return (int) len;
+}
+
+
 int mg_db_connect_init(MGSRV *p_srv, int chndle)
 {
    int result, n, buffer_actual_size, child_port;
@@ -8098,15 +8837,486 @@ int mg_db_get_last_error(int context)
 }
 
 
-int mg_request_header(MGSRV *p_srv, MGBUF *p_buf, char *command, char *product)
+/* v1.3.19 */
+/*
+   Receive the responses to 'count' pipelined requests.  The responses are placed one after the other
+   in the buffer (each with its own header).  Returns the number of complete responses received.
+*/
+int mg_db_receive_batch(MGSRV *p_srv, int chndle, MGBUF *p_buf, int count)
+{
+   int n, done;
+   unsigned long len, next, ssize, size;
+   fd_set rset, eset;
+   struct timeval tval;
+   DBXCON *pcon;
+
+   pcon = p_srv->pcon[chndle];
+
+   p_buf->p_buffer[0] = '\0';
+   p_buf->data_size = 0;
+
+   pcon->timeout = p_srv->timeout;
+   tval.tv_sec = pcon->timeout;
+   tval.tv_usec = 0;
+
+   len = 0;
+   next = 0;
+   done = 0;
+
+   for (;;) {
+      /* step over the responses received in full */
+      while (done < count && len >= (next + MG_RECV_HEAD)) {
+         ssize = mg_decode_size(p_buf->p_buffer + next, 5, MG_CHUNK_SIZE_BASE);
+         if (len < (next + MG_RECV_HEAD + ssize)) {
+            size = next + MG_RECV_HEAD + ssize;
+            if (size > p_buf->size) {
+               if (size < (p_buf->size * 2)) {
+                  size = p_buf->size * 2;
+               }
+               if (!mg_buf_resize(p_buf, size)) {
+                  p_srv->mem_error = 1;
+                  pcon->keep_alive = 0;
+                  return done;
+               }
+            }
+            break;
+         }
+         next += (MG_RECV_HEAD + ssize);
+         done ++;
+      }
+      if (done == count) {
+         break;
+      }
+
+      if (len >= p_buf->size) {
+         if (!mg_buf_resize(p_buf, p_buf->size * 2)) {
+            p_srv->mem_error = 1;
+            pcon->keep_alive = 0;
+            return done;
+         }
+      }
+
+      if (pcon->timeout || pcon->nonblock) {
+         if (pcon->nonblock) {
+            n = mg_db_wait(pcon, MG_WAIT_READ); /* v1.3.23 */
+         }
+         else {
+            FD_ZERO(&rset);
+            FD_ZERO(&eset);
+            FD_SET(pcon->cli_socket, &rset);
+            FD_SET(pcon->cli_socket, &eset);
+
+            n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, NULL, &eset, &tval);
+            if (n > 0 && !NETX_FD_ISSET(pcon->cli_socket, &rset)) {
+               n = -1;
+            }
+         }
+
+         if (n == 0) {
+            sprintf(pcon->error, "TCP Read Error: Server did not respond within the timeout period (%d seconds)", pcon->timeout);
+            break;
+         }
+         if (n < 0) {
+            strcpy(pcon->error, "TCP Read Error: Server closed the connection before all responses were returned");
+            break;
+         }
+      }
+
+      n = NETX_RECV(pcon->cli_socket, p_buf->p_buffer + len, p_buf->size - len, 0);
+
+      if (n < 0 && mg_db_would_block(pcon)) { /* v1.3.23 */
+         continue;
+      }
+      if (n < 1) {
+         strcpy(pcon->error, "TCP Read Error: Server closed the connection before all responses were returned");
+         break;
+      }
+
+      len += n;
+      p_buf->data_size = len;
+      p_buf->p_buffer[len] = '\0';
+   }
+
+   pcon->eod = 1;
+   /* the connection can only be reused if it is positioned at the end of the last response */
+   pcon->keep_alive = (done == count && len == next) ? 1 : 0;
+
+   return done;
+}
+
+
+/* v1.3.23 */
+/*
+   Switch a connection's socket in or out of non-blocking mode.  A non-blocking socket is used
+   when the caller installs a wait function (pcon->p_wait) through which it can yield (for example,
+   to other fibers) while the socket is busy.  Not available under Windows.
+*/
+int mg_db_set_nonblocking(DBXCON *pcon, int nonblock)
+{
+#if defined(_WIN32)
+   return (nonblock ? 0 : 1);
+#else
+   int flags;
+
+   if (pcon->nonblock == nonblock) {
+      return 1;
+   }
+
+   flags = fcntl(pcon->cli_socket, F_GETFL, 0);
+   if (flags < 0) {
+      return 0;
+   }
+   if (nonblock)
+      flags |= O_NONBLOCK;
+   else
+      flags &= ~O_NONBLOCK;
+   if (fcntl(pcon->cli_socket, F_SETFL, flags) < 0) {
+      return 0;
+   }
+   pcon->nonblock = (short) nonblock;
+
+   return 1;
+#endif
+}
+
+
+/* Wait for a non-blocking socket to become ready: 1 = ready; 0 = timed out; -1 = error */
+int mg_db_wait(DBXCON *pcon, int events)
+{
+   int n;
+   fd_set rset, wset, eset;
+   struct timeval tval;
+
+   if (pcon->p_wait) {
+      return pcon->p_wait(pcon, events, pcon->timeout);
+   }
+
+   FD_ZERO(&rset);
+   FD_ZERO(&wset);
+   FD_ZERO(&eset);
+   if (events & MG_WAIT_READ)
+      FD_SET(pcon->cli_socket, &rset);
+   if (events & MG_WAIT_WRITE)
+      FD_SET(pcon->cli_socket, &wset);
+   FD_SET(pcon->cli_socket, &eset);
+   tval.tv_sec = pcon->timeout;
+   tval.tv_usec = 0;
+
+   n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, &wset, &eset, pcon->timeout ? &tval : NULL);
+   if (n < 1) {
+      return (n == 0 ? 0 : -1);
+   }
+   if (NETX_FD_ISSET(pcon->cli_socket, &rset) || NETX_FD_ISSET(pcon->cli_socket, &wset)) {
+      return 1;
+   }
+
+   return -1;
+}
+
+
+/*
+   As mg_db_wait() (ignoring any wait function) but also returning MG_WAIT_WOKEN if another thread calls
+   mg_db_wake() first: 'msecs' is the time to wait (-1 to wait indefinitely).
+*/
+int mg_db_wait_wake(DBXCON *pcon, int events, long msecs)
+{
+#if defined(_WIN32)
+   return mg_db_wait(pcon, events);
+#else
+   int n, max;
+   char drain[16];
+   fd_set rset, wset, eset;
+   struct timeval tval;
+
+   FD_ZERO(&rset);
+   FD_ZERO(&wset);
+   FD_ZERO(&eset);
+   if (events & MG_WAIT_READ)
+      FD_SET(pcon->cli_socket, &rset);
+   if (events & MG_WAIT_WRITE)
+      FD_SET(pcon->cli_socket, &wset);
+   FD_SET(pcon->cli_socket, &eset);
+   max = (int) pcon->cli_socket;
+   if (pcon->wake_open) {
+      FD_SET(pcon->wake[0], &rset);
+      if (pcon->wake[0] > max)
+         max = pcon->wake[0];
+   }
+   tval.tv_sec = msecs / 1000;
+   tval.tv_usec = (msecs % 1000) * 1000;
+
+   n = NETX_SELECT(max + 1, &rset, &wset, &eset, msecs >= 0 ? &tval : NULL);
+   if (n < 0 && errno == EINTR) {
+      return MG_WAIT_WOKEN;
+   }
+   if (n < 1) {
+      return (n == 0 ? 0 : -1);
+   }
+   if (pcon->wake_open && FD_ISSET(pcon->wake[0], &rset)) {
+      while (read(pcon->wake[0], drain, sizeof(drain)) > 0)
+         ;
+      return MG_WAIT_WOKEN;
+   }
+   if (FD_ISSET(pcon->cli_socket, &rset) || FD_ISSET(pcon->cli_socket, &wset)) {
+      return 1;
+   }
+
+   return -1;
+#endif
+}
+
+
+/* Create the pipe through which mg_db_wake() interrupts mg_db_wait_wake() */
+int mg_db_wake_open(DBXCON *pcon)
+{
+#if defined(_WIN32)
+   return 0;
+#else
+   int n;
+
+   if (pcon->wake_open) {
+      return 1;
+   }
+   if (pipe(pcon->wake) != 0) {
+      return 0;
+   }
+   for (n = 0; n < 2; n ++) {
+      fcntl(pcon->wake[n], F_SETFL, fcntl(pcon->wake[n], F_GETFL, 0) | O_NONBLOCK);
+      fcntl(pcon->wake[n], F_SETFD, FD_CLOEXEC);
+   }
+   pcon->wake_open = 1;
+
+   return 1;
+#endif
+}
+
+
+/* Wake a thread waiting in mg_db_wait_wake(): safe to call from any thread */
+int mg_db_wake(DBXCON *pcon)
+{
+#if defined(_WIN32)
+   return 0;
+#else
+   if (!pcon->wake_open) {
+      return 0;
+   }
+   /* if the pipe is full a wake-up is already pending */
+   if (write(pcon->wake[1], "w", 1) < 0 && errno != EAGAIN) {
+      return 0;
+   }
+
+   return 1;
+#endif
+}
+
+
+/* v1.3.24 */
+/* Returns true if a response (or the end of the connection) is waiting to be read: does not block */
+int mg_db_poll(MGSRV *p_srv, int chndle)
+{
+   int n;
+   fd_set rset, eset;
+   struct timeval tval;
+   DBXCON *pcon;
+
+   if (p_srv->mode == 2) {
+      return 1;
+   }
+   if (!p_srv->pool.created || chndle < 0 || chndle >= p_srv->pool.capacity || !p_srv->pcon[chndle]) {
+      return 1;
+   }
+   pcon = p_srv->pcon[chndle];
+
+   FD_ZERO(&rset);
+   FD_ZERO(&eset);
+   FD_SET(pcon->cli_socket, &rset);
+   FD_SET(pcon->cli_socket, &eset);
+   tval.tv_sec = 0;
+   tval.tv_usec = 0;
+
+   n = NETX_SELECT((int) (pcon->cli_socket + 1), &rset, NULL, &eset, &tval);
+
+   return (n != 0);
+}
+
+
+/* Returns true if the last send/recv on a non-blocking socket failed only because it would have blocked */
+int mg_db_would_block(DBXCON *pcon)
+{
+   if (!pcon->nonblock) {
+      return 0;
+   }
+#if defined(_WIN32)
+   return 0;
+#else
+   return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+}
+
+
+/*
+   Return the request/response buffer of a connection, emptied and ready for the next request.
+   The buffer belongs to the connection and is reused by every request made on it, so the response
+   must be consumed before the connection can be picked up by another thread.
+*/
+MGBUF * mg_db_buffer(MGSRV *p_srv, int chndle)
+{
+   DBXCON *pcon;
+   MGBUF *p_buf;
+
+   if (!p_srv->pcon || chndle < 0 || chndle >= p_srv->pool.capacity) {
+      return NULL;
+   }
+   pcon = p_srv->pcon[chndle];
+   if (!pcon) {
+      return NULL;
+   }
+
+   p_buf = pcon->p_buf;
+   if (!p_buf) {
+      p_buf = (MGBUF *) mg_malloc(sizeof(MGBUF), 0);
+      if (!p_buf) {
+         return NULL;
+      }
+      if (!mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE)) {
+         mg_buf_free(p_buf);
+         mg_free((void *) p_buf, 0);
+         return NULL;
+      }
+      pcon->p_buf = p_buf;
+   }
+   else if (p_buf->size > MG_BUFRETAIN) {
+      /* give back the memory claimed by an unusually large request or response */
+      mg_buf_free(p_buf);
+      mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   }
+
+   p_buf->data_size = 0;
+   p_buf->p_buffer[0] = '\0';
+
+   pcon->p_iov_buf = NULL; /* v1.3.20 */
+   pcon->iov_count = 0;
+   pcon->iov_size = 0;
+
+   return p_buf;
+}
+
+
+/*
+   Record a large value to be sent from the caller's memory instead of copying it into the request buffer.
+   The value must stay in place until the request has been sent by mg_db_send().
+*/
+int mg_request_defer(MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *element, int size)
+{
+   int n;
+   DBXCON *pcon;
+
+   /* local records (and pipelines) are built without a connection and are never sent by mg_db_send() */
+   if (!p_srv || chndle < 0 || p_srv->mode == 2 || !p_srv->pcon || chndle >= p_srv->pool.capacity) {
+      return 0;
+   }
+   pcon = p_srv->pcon[chndle];
+   if (!pcon) {
+      return 0;
+   }
+
+   if (pcon->p_iov_buf != p_buf || (pcon->iov_count && pcon->iov[pcon->iov_count - 1].offset > p_buf->data_size)) {
+      /* discard anything left by a request that was never sent */
+      pcon->p_iov_buf = p_buf;
+      pcon->iov_count = 0;
+      pcon->iov_size = 0;
+   }
+   if (pcon->iov_count >= MG_IOV_MAX) {
+      return 0;
+   }
+
+   n = pcon->iov_count ++;
+   pcon->iov[n].offset = p_buf->data_size;
+   pcon->iov[n].p_data = element;
+   pcon->iov[n].size = (unsigned long) size;
+   pcon->iov_size += (unsigned long) size;
+
+   return 1;
+}
+
+
+int mg_request_header(MGSRV *p_srv, MGBUF *p_buf, char *command, char *product)
+{
+   char buffer[256];
+
+   sprintf(buffer, "PHP%s^P^%s#%s#0#%d#%d#%s#%d^%s^00000\n", product, p_srv->server, p_srv->uci, p_srv->timeout, p_srv->no_retry, DBX_VERSION, p_srv->storage_mode, command);
+
+   p_srv->header_len = (int) strlen(buffer);
+   mg_request_note(p_srv, command); /* v1.3.26 */
+
+   mg_buf_cpy(p_buf, buffer, (int) strlen(buffer));
+
+   return 1;
+}
+
+
+/* v1.3.19 */
+/* Start a request after those already in the buffer (pipelining): returns the offset of the new request */
+unsigned long mg_request_batch_header(MGSRV *p_srv, MGBUF *p_buf, char *command, char *product)
+{
+   unsigned long offset;
+   char buffer[256];
+
+   sprintf(buffer, "PHP%s^P^%s#%s#0#%d#%d#%s#%d^%s^00000\n", product, p_srv->server, p_srv->uci, p_srv->timeout, p_srv->no_retry, DBX_VERSION, p_srv->storage_mode, command);
+
+   offset = p_buf->data_size;
+   mg_buf_cat(p_buf, buffer, (int) strlen(buffer));
+   mg_request_note(p_srv, command); /* v1.3.26 */
+
+   return offset;
+}
+
+
+/* v1.3.26 */
+/* Count a request that changes the database */
+int mg_request_note(MGSRV *p_srv, char *command)
+{
+   if (mg_request_writes(command)) {
+      p_srv->write_seq ++;
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/*
+   The commands that change the database: set, kill, increment, merge into the database, and the end of a
+   transaction (commit, or a rollback which undoes the writes already counted).  Functions and class methods
+   are not counted: what they do is not known here.
+*/
+int mg_request_writes(char *command)
+{
+   if (command[0] && !command[1] && strchr("SKIMcd", command[0])) {
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/* v1.3.19 */
+/* Complete a request started by mg_request_batch_header(): record the size of its body in the header */
+int mg_request_batch_end(MGSRV *p_srv, MGBUF *p_buf, unsigned long offset)
 {
-   char buffer[256];
-
-   sprintf(buffer, "PHP%s^P^%s#%s#0#%d#%d#%s#%d^%s^00000\n", product, p_srv->server, p_srv->uci, p_srv->timeout, p_srv->no_retry, DBX_VERSION, p_srv->storage_mode, command);
+   int len;
+   unsigned long header_len;
+   unsigned char esize[8];
+   char *p;
 
-   p_srv->header_len = (int) strlen(buffer);
+   p = strchr((char *) p_buf->p_buffer + offset, '\n');
+   if (!p) {
+      return 0;
+   }
+   header_len = (unsigned long) (p - (char *) p_buf->p_buffer) + 1 - offset;
 
-   mg_buf_cpy(p_buf, buffer, (int) strlen(buffer));
+   len = mg_encode_size(esize, (int) (p_buf->data_size - offset - header_len), MG_CHUNK_SIZE_BASE);
+   strncpy((char *) (p_buf->p_buffer + offset + (header_len - 6) + (5 - len)), (char *) esize, len);
 
    return 1;
 }
@@ -8124,6 +9334,8 @@ int mg_request_add(MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *elemen
    }
    hlen = mg_encode_item_header(head, size, byref, type);
    mg_buf_cat(p_buf, (char *) head, hlen);
+   if (size >= MG_IOV_MIN && mg_request_defer(p_srv, chndle, p_buf, element, size)) /* v1.3.20 */
+      return 1;
    if (size)
       mg_buf_cat(p_buf, (char *) element, size);
    return 1;
@@ -8420,6 +9632,12 @@ int mg_bind_server_api(MGSRV *p_srv, short context)
    chndle = 0;
    result = 0;
 
+   /* v1.3.18 */
+   if (!mg_pool_init(p_srv)) {
+      strcpy(p_srv->error_mess, "Unable to allocate memory for the connection");
+      return 0;
+   }
+
    if (!p_srv->pcon[chndle]) {
       p_srv->pcon[chndle] = (DBXCON *) mg_malloc(sizeof(DBXCON), 0);
       if (!p_srv->pcon[chndle]) { /* 1.3.10 */
@@ -8640,6 +9858,548 @@ int mg_release_server_api(MGSRV *p_srv, short context)
 }
 
 
+/*
+   API mode: invoke a global command directly through the dbx_*_ex() functions rather than by passing
+   a Superserver request to ifc^%zmgsis.  The response is placed in p_buf in the form returned by the
+   Superserver.  Returns 0 if the command must be sent through the Superserver protocol instead.
+*/
+int mg_api_global(MGSRV *p_srv, int chndle, MGBUF *p_buf, char *command, MGSTR *args, int argc)
+{
+   int rc, n, dsort, dtype, retry, getdata, hlen;
+   unsigned long offset, len, len1, len2;
+   char head[16];
+   char *p, *p1, *p2;
+   unsigned char ihead[16];
+   DBXSTR input;
+   DBXCON *pcon;
+   DBXMETH *pmeth;
+   int (* p_dbxfun) (struct tagDBXMETH * pmeth);
+
+   if (p_srv->mode != 2 || argc < 1 || argc > (DBX_MAXARGS - 1) || !p_srv->pcon || chndle < 0 || chndle >= p_srv->pool.capacity) {
+      return 0;
+   }
+   pcon = p_srv->pcon[chndle];
+   if (!pcon || pcon->connected != 1 || !pcon->pmeth_base) {
+      return 0;
+   }
+   if (pcon->dbtype == DBX_DBTYPE_YOTTADB) {
+      if (!pcon->p_ydb_so || !pcon->p_ydb_so->loaded) {
+         return 0;
+      }
+   }
+   else if (pcon->dbtype == DBX_DBTYPE_CACHE || pcon->dbtype == DBX_DBTYPE_IRIS) {
+      if (!pcon->p_isc_so || !pcon->p_isc_so->loaded) {
+         return 0;
+      }
+   }
+   else {
+      return 0;
+   }
+
+   getdata = 0;
+   if (command[0] && command[1]) { /* v1.3.27 */
+      if (command[1] == 'B' && !command[2] && strchr("OPQ", command[0])) {
+         return mg_api_batch(p_srv, chndle, p_buf, command, args, argc);
+      }
+      if (command[1] != 'N' || command[2] || (command[0] != 'O' && command[0] != 'P')) {
+         return 0;
+      }
+      getdata = 1; /* the next (or previous) subscript with its data */
+   }
+
+   switch (command[0]) {
+      case 'S':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_set_ex;
+         break;
+      case 'G':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_get_ex;
+         break;
+      case 'K':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_delete_ex;
+         break;
+      case 'D':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_defined_ex;
+         break;
+      case 'O':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_next_ex;
+         break;
+      case 'P':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_previous_ex;
+         break;
+      case 'I':
+         p_dbxfun = (int (*) (struct tagDBXMETH * pmeth)) dbx_increment_ex;
+         break;
+      default:
+         return 0;
+   }
+   if ((command[0] == 'S' || command[0] == 'I') && argc < 2) {
+      return 0;
+   }
+   mg_request_note(p_srv, command); /* v1.3.26 */
+
+   /* encode the arguments as a list of blocks */
+   len = 5 + 1;
+   for (n = 0; n < argc; n ++) {
+      len += (5 + args[n].size);
+   }
+   if (len > p_buf->size && !mg_buf_resize(p_buf, len)) {
+      return 0;
+   }
+   input.buf_addr = (char *) p_buf->p_buffer;
+   input.len_alloc = (unsigned int) p_buf->size;
+   offset = 0;
+   for (n = 0; n < argc; n ++) {
+      if (n == 0)
+         dsort = DBX_DSORT_GLOBAL;
+      else if (n == (argc - 1) && command[0] == 'S')
+         dsort = DBX_DSORT_DATA;
+      else
+         dsort = DBX_DSORT_SUBSCRIPT;
+      mg_add_block_size(&input, offset, (unsigned long) args[n].size, dsort, DBX_DTYPE_STR);
+      offset += 5;
+      if (args[n].size) {
+         memcpy((void *) (input.buf_addr + offset), (void *) args[n].ps, args[n].size);
+      }
+      offset += args[n].size;
+   }
+   mg_add_block_size(&input, offset, 0, DBX_DSORT_EOD, DBX_DTYPE_STR);
+   offset += 5;
+   input.len_used = (unsigned int) offset;
+
+   pmeth = (DBXMETH *) pcon->pmeth_base;
+   pmeth->pcon = pcon;
+   pmeth->argc = 0;
+   pmeth->offset = 0;
+   pmeth->input_str = input;
+   pmeth->output_val.offset = 5;
+   pmeth->output_val.svalue.len_used = 5;
+   pmeth->getdata = getdata;
+   pmeth->increment = (command[0] == 'I') ? 1 : 0;
+   pmeth->merge = 0;
+   pmeth->lock = 0;
+   pcon->error[0] = '\0';
+
+   DBX_LOCK(rc, 0);
+
+   rc = mg_global_reference(pmeth);
+   for (retry = 0; rc == CACHE_SUCCESS; retry ++) {
+      pmeth->output_val.offset = 5;
+      pmeth->output_val.svalue.len_used = 5;
+      if (pcon->dbtype == DBX_DBTYPE_YOTTADB && pcon->tlevel > 0) {
+         pmeth->p_dbxfun = p_dbxfun;
+         rc = ydb_transaction_task(pmeth, YDB_TPCTX_DB);
+      }
+      else {
+         rc = p_dbxfun(pmeth);
+      }
+      if (rc != YDB_ERR_INVSTRLEN || pcon->dbtype != DBX_DBTYPE_YOTTADB || retry > 0 || pmeth->output_val.realloc != 2) {
+         break;
+      }
+      /* YottaDB has reported the size required: enlarge the output buffer and try again */
+      len = (unsigned long) pmeth->output_val.svalue.len_used + 16;
+      p = (char *) mg_malloc(sizeof(char) * len, 0);
+      if (!p) {
+         break;
+      }
+      mg_free((void *) pmeth->output_val.svalue.buf_addr, 0);
+      pmeth->output_val.svalue.buf_addr = p;
+      pmeth->output_val.svalue.len_alloc = (unsigned int) len;
+      rc = CACHE_SUCCESS;
+   }
+
+   if (pcon->dbtype == DBX_DBTYPE_YOTTADB) {
+      if ((command[0] == 'G' && (rc == YDB_ERR_GVUNDEF || rc == YDB_ERR_LVUNDEF)) || ((command[0] == 'O' || command[0] == 'P') && rc == YDB_ERR_NODEEND)) {
+         /* the Superserver returns an empty string for these */
+         rc = CACHE_SUCCESS;
+         pmeth->output_val.svalue.len_used = 5;
+         mg_add_block_size(&(pmeth->output_val.svalue), 0, 0, DBX_DSORT_DATA, DBX_DTYPE_DBXSTR);
+      }
+      else if (getdata && (rc == YDB_ERR_GVUNDEF || rc == YDB_ERR_LVUNDEF)) {
+         rc = CACHE_SUCCESS; /* the next node has no data of its own: the data block is empty */
+      }
+      else if (rc == YDB_ERR_INVSTRLEN) {
+         /* too large for the API output buffer: leave it to the Superserver protocol */
+         DBX_UNLOCK(rc);
+         mg_cleanup(pmeth);
+         return 0;
+      }
+   }
+   if (rc != CACHE_SUCCESS) {
+      pmeth->output_val.svalue.len_used = 5; /* discard any partial output */
+      mg_error_message(pmeth, rc);
+      strcpy(head, "00000ce\n");
+   }
+   else {
+      strcpy(head, "00000cv\n");
+   }
+
+   DBX_UNLOCK(rc);
+
+   mg_cleanup(pmeth);
+
+   len = mg_get_block_size(&(pmeth->output_val.svalue), 0, &dsort, &dtype);
+   if (dsort == DBX_DSORT_ERROR) {
+      strcpy(head, "00000ce\n");
+   }
+   if (!mg_buf_cpy(p_buf, head, MG_RECV_HEAD)) {
+      return 0;
+   }
+   if (getdata && head[6] == 'v') { /* v1.3.27 */
+      /* the key and data blocks follow the header block (YottaDB), or the data and key blocks (InterSystems): return the key and data as items */
+      p1 = pmeth->output_val.svalue.buf_addr;
+      p2 = pmeth->output_val.svalue.buf_addr;
+      len1 = 0;
+      len2 = 0;
+      if (len >= 10) {
+         len1 = mg_get_block_size(&(pmeth->output_val.svalue), 5, &dsort, &dtype);
+         p1 = pmeth->output_val.svalue.buf_addr + 10;
+         len2 = mg_get_block_size(&(pmeth->output_val.svalue), 10 + len1, &dsort, &dtype);
+         p2 = pmeth->output_val.svalue.buf_addr + 15 + len1;
+         if (pcon->dbtype != DBX_DBTYPE_YOTTADB) {
+            p = p1;
+            p1 = p2;
+            p2 = p;
+            offset = len1;
+            len1 = len2;
+            len2 = offset;
+         }
+      }
+      hlen = mg_encode_item_header(ihead, (int) len1, 0, MG_TX_DATA);
+      if (!mg_buf_cat(p_buf, (char *) ihead, hlen) || (len1 > 0 && !mg_buf_cat(p_buf, p1, len1))) {
+         return 0;
+      }
+      hlen = mg_encode_item_header(ihead, (int) len2, 0, MG_TX_DATA);
+      if (!mg_buf_cat(p_buf, (char *) ihead, hlen) || (len2 > 0 && !mg_buf_cat(p_buf, p2, len2))) {
+         return 0;
+      }
+      return 1;
+   }
+   if (len > 0 && !mg_buf_cat(p_buf, pmeth->output_val.svalue.buf_addr + 5, len)) {
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* v1.3.27 */
+/*
+   API mode: the batched global commands, answered by a loop over the API instead of a request for each step.
+   "OB" and "PB" return up to 'count' of the subscripts that follow (or precede) the last key given, each with its
+   data if 'data' is 1, or with its $data and data if 'data' is 2 (options "count#data", the last argument).
+   "QB" returns up to 'count' nodes of the subtree below the first 'nhead' subscripts in $query order, descending
+   no more than 'depth' levels (0 for all), and starting after the node given by any further subscripts (options
+   "count#depth#nhead").  The response is a list of items headed by the number of nodes ("count#more" for "QB":
+   'more' is set if the subtree continues beyond the last node).  Each node of a subtree is an item "nsubs#$data"
+   followed by its 'nsubs' subscripts below the head and then its data, if it has any.
+*/
+int mg_api_batch(MGSRV *p_srv, int chndle, MGBUF *p_buf, char *command, MGSTR *args, int argc)
+{
+   int rc, n, nargs, nhead, level, data, depth, dvalue, more, hlen;
+   long count, nodes;
+   unsigned long offset, koff[DBX_MAXARGS];
+   char buffer[64], step_cmnd[4];
+   unsigned char ihead[16];
+   MGBUF step, keys;
+   MGSTR sargs[DBX_MAXARGS], items[2];
+
+   if (argc < 3 || argc > (DBX_MAXARGS - 1) || args[argc - 1].size >= (int) sizeof(buffer)) {
+      return 0;
+   }
+   memcpy((void *) buffer, (void *) args[argc - 1].ps, (size_t) args[argc - 1].size);
+   buffer[args[argc - 1].size] = '\0';
+   count = 0;
+   data = 0;
+   depth = 0;
+   nhead = 0;
+   if (command[0] == 'Q') {
+      if (sscanf(buffer, "%ld#%d#%d", &count, &depth, &nhead) != 3 || nhead < 0 || nhead > (argc - 2)) {
+         return 0;
+      }
+   }
+   else if (sscanf(buffer, "%ld#%d", &count, &data) != 2) {
+      return 0;
+   }
+   if (count < 1) {
+      count = 1;
+   }
+   nargs = argc - 1;
+
+   if (!mg_buf_init(&step, MG_BUFSIZE, MG_BUFSIZE)) {
+      return 0;
+   }
+   if (!mg_buf_init(&keys, MG_BUFSIZE, MG_BUFSIZE)) {
+      mg_buf_free(&step);
+      return 0;
+   }
+   for (n = 0; n < nargs; n ++) {
+      sargs[n] = args[n];
+   }
+
+   /* the count heads the response: it is filled in once known */
+   strcpy(buffer, "00000cv\n");
+   mg_buf_cpy(p_buf, buffer, MG_RECV_HEAD);
+   hlen = mg_encode_item_header(ihead, 12, 0, MG_TX_DATA);
+   mg_buf_cat(p_buf, (char *) ihead, hlen);
+   offset = p_buf->data_size;
+   mg_buf_cat(p_buf, "000000000000", 12);
+
+   nodes = 0;
+   more = 0;
+   rc = 1;
+
+   if (command[0] != 'Q') {
+      /* the keys at one level */
+      level = nargs - 1;
+      strcpy(step_cmnd, command[0] == 'P' ? "P" : "O");
+      if (data == 1) {
+         strcat(step_cmnd, "N");
+      }
+      while (nodes < count) {
+         if ((rc = mg_api_step(p_srv, chndle, &step, step_cmnd, sargs, nargs, items)) != 1) {
+            break;
+         }
+         if (items[0].size == 0) {
+            break;
+         }
+         keys.data_size = 0;
+         if (!mg_buf_cat(&keys, (char *) items[0].ps, items[0].size) || !mg_api_batch_add(p_buf, items[0].ps, items[0].size) || (data == 1 && !mg_api_batch_add(p_buf, items[1].ps, items[1].size))) {
+            rc = 0;
+            break;
+         }
+         sargs[level].ps = keys.p_buffer;
+         sargs[level].size = items[0].size;
+         if (data == 2) {
+            if ((rc = mg_api_step(p_srv, chndle, &step, "D", sargs, nargs, items)) != 1) {
+               break;
+            }
+            dvalue = (int) strtol((char *) items[0].ps, NULL, 10);
+            if (!mg_api_batch_add(p_buf, items[0].ps, items[0].size)) {
+               rc = 0;
+               break;
+            }
+            items[0].size = 0;
+            if ((dvalue % 10) && (rc = mg_api_step(p_srv, chndle, &step, "G", sargs, nargs, items)) != 1) {
+               break;
+            }
+            if (!mg_api_batch_add(p_buf, items[0].ps, items[0].size)) {
+               rc = 0;
+               break;
+            }
+         }
+         nodes ++;
+      }
+   }
+   else {
+      /* a subtree: the subscripts below the head are held in 'keys' */
+      level = nargs - 1;
+      for (n = nhead + 1; n <= level; n ++) {
+         koff[n] = keys.data_size;
+         if (sargs[n].size && !mg_buf_cat(&keys, (char *) sargs[n].ps, sargs[n].size)) {
+            rc = 0;
+         }
+      }
+      if (rc == 1) {
+         /* the node to start from (or after) */
+         rc = mg_api_step(p_srv, chndle, &step, "D", sargs, level + 1, items);
+      }
+      if (rc == 1) {
+         dvalue = (int) strtol((char *) items[0].ps, NULL, 10);
+         if (level == nhead && dvalue) {
+            /* starting at the head: it is the first node */
+            items[0].size = 0;
+            if (!(dvalue % 10) || (rc = mg_api_step(p_srv, chndle, &step, "G", sargs, level + 1, items)) == 1) {
+               sprintf(buffer, "0#%d", dvalue);
+               if (!mg_api_batch_add(p_buf, (unsigned char *) buffer, (unsigned long) strlen(buffer)) || ((dvalue % 10) && !mg_api_batch_add(p_buf, items[0].ps, items[0].size))) {
+                  rc = 0;
+               }
+               nodes ++;
+            }
+         }
+         if (dvalue >= 10 && (!depth || (level - nhead) < depth) && level < (DBX_MAXARGS - 3)) {
+            level ++;
+            koff[level] = keys.data_size;
+            sargs[level].size = 0;
+         }
+         else if (level == nhead) {
+            level = -1; /* nothing below the head */
+         }
+      }
+      while (rc == 1 && level > nhead) {
+         for (n = nhead + 1; n <= level; n ++) {
+            sargs[n].ps = keys.p_buffer + koff[n];
+         }
+         if ((rc = mg_api_step(p_srv, chndle, &step, "O", sargs, level + 1, items)) != 1) {
+            break;
+         }
+         if (items[0].size == 0) {
+            level --; /* the end of this level: continue after the parent */
+            continue;
+         }
+         if (nodes >= count) {
+            more = 1;
+            break;
+         }
+         keys.data_size = koff[level];
+         if (!mg_buf_cat(&keys, (char *) items[0].ps, items[0].size)) {
+            rc = 0;
+            break;
+         }
+         sargs[level].ps = keys.p_buffer + koff[level];
+         sargs[level].size = items[0].size;
+         if ((rc = mg_api_step(p_srv, chndle, &step, "D", sargs, level + 1, items)) != 1) {
+            break;
+         }
+         dvalue = (int) strtol((char *) items[0].ps, NULL, 10);
+         sprintf(buffer, "%d#%d", level - nhead, dvalue);
+         if (!mg_api_batch_add(p_buf, (unsigned char *) buffer, (unsigned long) strlen(buffer))) {
+            rc = 0;
+            break;
+         }
+         for (n = nhead + 1; n <= level; n ++) {
+            if (!mg_api_batch_add(p_buf, keys.p_buffer + koff[n], (unsigned long) sargs[n].size)) {
+               rc = 0;
+            }
+         }
+         if (rc == 1 && (dvalue % 10)) {
+            if ((rc = mg_api_step(p_srv, chndle, &step, "G", sargs, level + 1, items)) != 1) {
+               break;
+            }
+            if (!mg_api_batch_add(p_buf, items[0].ps, items[0].size)) {
+               rc = 0;
+            }
+         }
+         nodes ++;
+         if (dvalue >= 10 && (!depth || (level - nhead) < depth) && level < (DBX_MAXARGS - 3)) {
+            level ++;
+            koff[level] = keys.data_size;
+            sargs[level].size = 0;
+         }
+      }
+   }
+
+   if (rc == -1) {
+      /* return the error */
+      rc = mg_buf_cpy(p_buf, (char *) step.p_buffer, step.data_size);
+   }
+   else if (rc == 1) {
+      if (command[0] == 'Q')
+         sprintf(buffer, "%010ld#%d", nodes, more);
+      else
+         sprintf(buffer, "%012ld", nodes);
+      memcpy((void *) (p_buf->p_buffer + offset), (void *) buffer, 12);
+   }
+
+   mg_buf_free(&step);
+   mg_buf_free(&keys);
+
+   return (rc ? 1 : 0);
+}
+
+
+/* Make one step of a batched command: returns 1 with the response in 'items' (two for ON and PN), -1 if it failed (the error is in p_step), or 0 */
+int mg_api_step(MGSRV *p_srv, int chndle, MGBUF *p_step, char *command, MGSTR *args, int argc, MGSTR *items)
+{
+   int n, hlen, size;
+   short byref, type;
+   unsigned long offset;
+
+   if (!mg_api_global(p_srv, chndle, p_step, command, args, argc)) {
+      return 0;
+   }
+   if (p_step->data_size < MG_RECV_HEAD || p_step->p_buffer[6] != 'v') {
+      return -1;
+   }
+
+   if (!command[1]) {
+      items[0].ps = p_step->p_buffer + MG_RECV_HEAD;
+      items[0].size = (int) (p_step->data_size - MG_RECV_HEAD);
+      return 1;
+   }
+   offset = MG_RECV_HEAD;
+   for (n = 0; n < 2; n ++) {
+      if (offset >= p_step->data_size) {
+         return 0;
+      }
+      hlen = mg_decode_item_header(p_step->p_buffer + offset, &size, &byref, &type);
+      items[n].ps = p_step->p_buffer + offset + hlen;
+      items[n].size = size;
+      offset += (hlen + size);
+   }
+
+   return 1;
+}
+
+
+/* Add an item to the response to a batched command */
+int mg_api_batch_add(MGBUF *p_buf, unsigned char *data, unsigned long size)
+{
+   int hlen;
+   unsigned char head[16];
+
+   hlen = mg_encode_item_header(head, (int) size, 0, MG_TX_DATA);
+   if (!mg_buf_cat(p_buf, (char *) head, hlen)) {
+      return 0;
+   }
+   if (size > 0 && !mg_buf_cat(p_buf, (char *) data, size)) {
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* v1.3.25 */
+/*
+   API mode: process a global command held as an encoded Superserver request (for example, one queued
+   in a pipeline) through mg_api_global().  Returns 0 if the request must be passed to ifc^%zmgsis instead.
+*/
+int mg_api_request(MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *request, unsigned long len)
+{
+   int argc, hlen, size;
+   short byref, type;
+   unsigned long offset;
+   char command[8];
+   unsigned char *p, *p1;
+   MGSTR args[DBX_MAXARGS];
+
+   if (p_srv->mode != 2) {
+      return 0;
+   }
+
+   /* the header ends ^<command>^<size>\n */
+   p = (unsigned char *) memchr((void *) request, '\n', (size_t) len);
+   if (!p || (p - request) < 8 || *(p - 6) != '^') {
+      return 0;
+   }
+   for (p1 = p - 7; p1 > request && *p1 != '^'; p1 --)
+      ;
+   if (*p1 != '^' || (p - 6 - p1 - 1) < 1 || (p - 6 - p1 - 1) > 7) {
+      return 0;
+   }
+   strncpy(command, (char *) p1 + 1, (size_t) (p - 6 - p1 - 1));
+   command[p - 6 - p1 - 1] = '\0';
+
+   argc = 0;
+   offset = (unsigned long) (p - request) + 1;
+   while (offset < len) {
+      if (argc == (DBX_MAXARGS - 1)) {
+         return 0;
+      }
+      hlen = mg_decode_item_header(request + offset, &size, &byref, &type);
+      offset += hlen;
+      if (type != MG_TX_DATA || (offset + size) > len) {
+         return 0;
+      }
+      args[argc].ps = request + offset;
+      args[argc ++].size = size;
+      offset += size;
+   }
+
+   return mg_api_global(p_srv, chndle, p_buf, command, args, argc);
+}
+
+
 int mg_invoke_server_api(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
 {
    int result, rc, rc1, ne, ex;
@@ -89,6 +89,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/resource.h>
 #if !defined(HPUX) && !defined(HPUX10) && !defined(HPUX11)
@@ -218,6 +219,12 @@ typedef struct {
 #define YDB_FAILURE -1
 #define YDB_DEL_TREE 1
 
+/* v1.3.22 */
+#define YDB_ERR_GVUNDEF       -150372994
+#define YDB_ERR_LVUNDEF       -150373850
+#define YDB_ERR_INVSTRLEN     -150375522
+#define YDB_ERR_NODEEND       -151027922
+
 typedef int                ydb_int_t;
 typedef unsigned int       ydb_uint_t;
 typedef long               ydb_long_t;
@@ -1003,6 +1010,25 @@ typedef struct tagDBXGTMSO {
 } DBXGTMSO, *PDBXGTMSO;
 
 
+/* v1.3.20 */
+#define MG_IOV_MAX               32
+#define MG_IOV_MIN               (MG_BUFSIZE / 2)
+
+typedef struct tagMGIOV {
+   unsigned long     offset;
+   unsigned char *   p_data;
+   unsigned long     size;
+} MGIOV, *LPMGIOV;
+
+/* v1.3.23 */
+#define MG_WAIT_READ             1
+#define MG_WAIT_WRITE            4
+#define MG_WAIT_WOKEN            2
+#define MG_CONNECT_NOWAIT        0x10
+#define MG_CONNECT_NOOPEN        0x20
+#define MG_POOL_BUSY             -1
+#define MG_POOL_NEW              -2
+
 typedef struct tagDBXCON {
    short          dbtype;
    unsigned long  pid;
@@ -1054,6 +1080,24 @@ typedef struct tagDBXCON {
    char           zmgsi_version[8];
    void *         p_srv;
 
+   /* v1.3.18 */
+   DBXTHID        owner_tid;
+   unsigned long  last_used;
+   struct tagMGBUF * p_buf;
+
+   /* v1.3.20 */
+   struct tagMGBUF * p_iov_buf;
+   int            iov_count;
+   unsigned long  iov_size;
+   MGIOV          iov[MG_IOV_MAX];
+
+   /* v1.3.23 */
+   short          nonblock;
+   int            (* p_wait) (struct tagDBXCON *pcon, int events, int timeout);
+   void *         p_wait_arg;
+   short          wake_open;
+   int            wake[2];
+
 } DBXCON, *PDBXCON;
 
 
@@ -1102,6 +1146,7 @@ typedef struct tagDBXTHRT {
 #define MG_PORT                  7041
 #endif
 #define MG_SERVER                "LOCAL"
+#define MG_UNIX_PREFIX           "unix:" /* v1.3.21 */
 #define MG_UCI                   "USER"
 
 #if defined(MG_DBA_DSO)
@@ -1116,6 +1161,11 @@ typedef struct tagDBXTHRT {
 
 #define MG_MAXCON                32
 
+/* v1.3.18 */
+#define MG_POOL_WAIT             10000
+#define MG_POOL_RETIRED          32
+#define MG_POOL_REAP_BATCH       16
+
 #define MG_TX_DATA               0
 #define MG_TX_AKEY               1
 #define MG_TX_AREC               2
@@ -1124,11 +1174,13 @@ typedef struct tagDBXTHRT {
 #define MG_TX_AREC_FORMATTED     9
 
 #define MG_RECV_HEAD             8
+#define MG_RECV_PARTIAL          2 /* v1.3.18 */
 
 #define MG_CHUNK_SIZE_BASE       62
 
 #define MG_BUFSIZE               32768
 #define MG_BUFMAX                32767
+#define MG_BUFRETAIN             (MG_BUFSIZE * 32) /* v1.3.18 */
 
 #define MG_ES_DELIM              0
 #define MG_ES_BLOCK              1
@@ -1145,6 +1197,35 @@ typedef struct tagMGSTR {
    unsigned char *   ps;
 } MGSTR, *LPMGSTR;
 
+/* v1.3.18 */
+typedef struct tagMGPOOL {
+   short             created;
+   short             affinity;
+   int               wait_timeout;
+   int               min;
+   int               max;
+   int               idle_timeout;
+   int               capacity;
+   int               size;
+   int               peak;
+   int               free_count;
+   int *             free_list;
+   int               retired_count;
+   void *            retired[MG_POOL_RETIRED];
+   unsigned long     last_reap;
+   unsigned long     created_count;
+   unsigned long     closed_count;
+   unsigned long     wait_count;
+   unsigned long     timeout_count;
+#if defined(_WIN32)
+   CRITICAL_SECTION  mutex;
+   CONDITION_VARIABLE cv;
+#else
+   pthread_mutex_t   mutex;
+   pthread_cond_t    cv;
+#endif
+} MGPOOL, *LPMGPOOL;
+
 typedef struct tagMGSRV {
    short       mem_error;
    short       storage_mode;
@@ -1158,7 +1239,7 @@ typedef struct tagMGSRV {
    char        server[64];
    char        uci[128];
    char        shdir[256];
-   char        ip_address[64];
+   char        ip_address[128];
    int         port;
    int         timeout;
    int         no_retry;
@@ -1170,7 +1251,9 @@ typedef struct tagMGSRV {
    MGBUF *     p_env;
    MGBUF *     p_params;
    DBXLOG *    p_log;
-   PDBXCON     pcon[MG_MAXCON];
+   PDBXCON *   pcon; /* v1.3.18 */
+   MGPOOL      pool;
+   unsigned long write_seq; /* v1.3.26: incremented for each request that may change the database */
 } MGSRV, *LPMGSRV;
 
 
@@ -1311,6 +1394,7 @@ DBXPROC                 mg_dso_sym                    (DBXPLIB p_library, char *
 int                     mg_dso_unload                 (DBXPLIB p_library);
 DBXTHID                 mg_current_thread_id          (void);
 unsigned long           mg_current_process_id         (void);
+unsigned long           mg_current_time_ms            (void);
 int                     mg_error_message              (DBXMETH *pmeth, int error_code);
 int                     mg_set_error_message          (DBXMETH *pmeth);
 int                     mg_set_error_message_ex       (unsigned char *output, char *error_message);
@@ -1332,6 +1416,7 @@ int                     netx_tcp_connect              (DBXCON *pcon, int context
 int                     netx_tcp_handshake            (DBXCON *pcon, int context);
 int                     netx_tcp_command              (DBXMETH *pmeth, int context);
 int                     netx_tcp_connect_ex           (DBXCON *pcon, xLPSOCKADDR p_srv_addr, socklen_netx srv_addr_len, int timeout);
+int                     netx_unix_connect             (DBXCON *pcon, char *path);
 int                     netx_tcp_disconnect           (DBXCON *pcon, int context);
 int                     netx_tcp_write                (DBXCON *pcon, unsigned char *data, int size);
 int                     netx_tcp_read                 (DBXCON *pcon, unsigned char *data, int size, int timeout, int context);
@@ -1342,15 +1427,42 @@ int                     netx_get_std_error_message    (int error_code, char *mes
 
 int                     mg_db_command                 (DBXMETH *pmeth, int context);
 int                     mg_db_connect                 (MGSRV *p_srv, int *chndle, short context);
+int                     mg_db_connect_ex              (MGSRV *p_srv, int *chndle, short context, volatile short *p_cancel);
+int                     mg_db_connect_open            (MGSRV *p_srv, int chndle);
 int                     mg_db_disconnect              (MGSRV *p_srv, int chndle, short context);
 int                     mg_db_send                    (MGSRV *p_srv, int chndle, MGBUF *p_buf, int mode);
+int                     mg_db_send_iov                (MGSRV *p_srv, DBXCON *pcon, MGBUF *p_buf);
 int                     mg_db_receive                 (MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode);
+int                     mg_db_receive_body            (MGSRV *p_srv, int chndle, unsigned char *p_data, unsigned long size);
+int                     mg_db_receive_batch           (MGSRV *p_srv, int chndle, MGBUF *p_buf, int count);
+int                     mg_db_set_nonblocking         (DBXCON *pcon, int nonblock);
+int                     mg_db_wait                    (DBXCON *pcon, int events);
+int                     mg_db_wait_wake               (DBXCON *pcon, int events, long msecs);
+int                     mg_db_wake_open               (DBXCON *pcon);
+int                     mg_db_wake                    (DBXCON *pcon);
+int                     mg_db_would_block             (DBXCON *pcon);
+int                     mg_db_poll                    (MGSRV *p_srv, int chndle);
+MGBUF *                 mg_db_buffer                  (MGSRV *p_srv, int chndle);
 int                     mg_db_connect_init            (MGSRV *p_srv, int chndle);
 int                     mg_db_ayt                     (MGSRV *p_srv, int chndle);
 int                     mg_db_get_last_error          (int context);
 
+int                     mg_pool_init                  (MGSRV *p_srv);
+int                     mg_pool_wakeup                (MGSRV *p_srv);
+int                     mg_pool_get_free              (MGSRV *p_srv);
+int                     mg_pool_wait                  (MGSRV *p_srv, int msecs);
+int                     mg_pool_grow                  (MGSRV *p_srv);
+int                     mg_pool_reap                  (MGSRV *p_srv, int force);
+int                     mg_pool_close_connection      (DBXCON *pcon);
+int                     mg_pool_destroy               (MGSRV *p_srv);
+
 int                     mg_request_header             (MGSRV *p_srv, MGBUF *p_buf, char *command, char *product);
+unsigned long           mg_request_batch_header       (MGSRV *p_srv, MGBUF *p_buf, char *command, char *product);
+int                     mg_request_note               (MGSRV *p_srv, char *command);
+int                     mg_request_writes             (char *command);
+int                     mg_request_batch_end          (MGSRV *p_srv, MGBUF *p_buf, unsigned long offset);
 int                     mg_request_add                (MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *element, int size, short byref, short type);
+int                     mg_request_defer              (MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *element, int size);
 
 int                     mg_encode_size64              (int n10);
 int                     mg_decode_size64              (int nxx);
@@ -1366,6 +1478,11 @@ int                     mg_replace_substrings         (char * tbuffer, char *fbu
 
 int                     mg_bind_server_api            (MGSRV *p_srv, short context);
 int                     mg_release_server_api         (MGSRV *p_srv, short context);
+int                     mg_api_global                 (MGSRV *p_srv, int chndle, MGBUF *p_buf, char *command, MGSTR *args, int argc);
+int                     mg_api_request                (MGSRV *p_srv, int chndle, MGBUF *p_buf, unsigned char *request, unsigned long len);
+int                     mg_api_batch                  (MGSRV *p_srv, int chndle, MGBUF *p_buf, char *command, MGSTR *args, int argc);
+int                     mg_api_step                   (MGSRV *p_srv, int chndle, MGBUF *p_step, char *command, MGSTR *args, int argc, MGSTR *items);
+int                     mg_api_batch_add              (MGBUF *p_buf, unsigned char *data, unsigned long size);
 int                     mg_invoke_server_api          (MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode);
 
 #ifdef __cplusplus
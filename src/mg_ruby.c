@@ -54,14 +54,86 @@ Version 2.3.44 27 October 2021:
 Version 2.3.44a 23 June 2023:
    Documentation update.
 
+Version 2.4.45 17 October 2026:
+   Release the Ruby GVL while waiting on the network in mg_db_send() and mg_db_receive().
+   - Other Ruby threads now run while a request is in flight.
+   - A blocked request can be interrupted by Thread#raise and Timeout; the interrupted connection is closed.
+   - Other interrupts (Thread#wakeup, a trapped signal whose handler does not raise) are serviced and the request resumes on the same connection.
+   Network connections are now drawn from a thread-safe pool.
+   - mg_ruby.m_set_pool_wait(<msecs>): time to wait for a free connection when all are busy.
+   - mg_ruby.m_set_pool_affinity(<0|1>): keep using the same connection for each Ruby thread.
+   - mg_ruby.m_set_pool_size(<min>,<max>): the pool grows on demand up to <max> connections.
+   - mg_ruby.m_set_pool_idle_timeout(<secs>): close connections left idle for longer than this (keeping <min> open).
+   - mg_ruby.m_get_pool_stats(): current and peak pool size, connections in use, waits and timeouts.
+   Each MG_RUBY object now holds its own server definition and connection pool (previously shared by all objects).
+   Requests and responses use a buffer held by the connection instead of allocating (and leaking) a 32KB buffer for every call.
+   Correct the handling of responses larger than 32KB.
+   Large values returned by m_get(), ma_get(), m_function() and the class methods are read from the network directly into the Ruby string.
+
+Version 2.4.46 17 October 2026:
+   Request pipelining: mg_ruby.m_pipeline { |p| p.m_get(...); p.m_set(...) }
+   - The requests are sent together and the responses are returned (in order) as an array.
+   Large values (16KB and above) are sent directly from the Ruby string instead of being copied into the request buffer.
+   Connect to a DB Superserver through a Unix domain socket: mg_ruby.m_set_host("unix:/path/to/socket", 0, "", "")
+   API mode: m_set(), m_get(), m_kill(), m_data(), m_order(), m_previous() and m_increment() call the database API directly instead of through the Superserver protocol.
+   Fiber::Scheduler support: under a scheduler (for example, the async gem) a request waiting on the network yields to other fibers instead of blocking the thread.
+   Split-phase requests: m_set_async(), m_get_async(), m_kill_async(), m_data_async(), m_order_async(), m_previous_async(), m_increment_async() and m_function_async() return an MG_FUTURE.
+   - future.value, future.ready? and MG_FUTURE.wait_all([future, ...]).
+   - When the connection pool is exhausted the request is deferred until the future's value is collected.
+   m_get_multi([[global, key, ...], ...]): get a set of records in a single round trip.
+   m_set_multi([[global, key, ..., value], ...]) and m_kill_multi([[global, key, ...], ...]): returning a status (0 or the error text) for each record.
+   API mode: pipelined global commands call the database API directly.
+   m_order_batch(global, key, ..., count: n, with_data: false, reverse: false): return the next n subscripts (optionally with their data).
+   - The batch is returned by a single request (OB or PB), with a fallback to a request per key for a DB Superserver without the batched commands.
+   m_order_data(global, key, ...) and m_previous_data(global, key, ...): return the next (or previous) key with its data as [key, data].
+   - A single request returns both (in API mode, a single call to the database API: DBX_CMND_GNEXTDATA).
+   each_node(global, key, ..., depth: :all, prefetch: 100): enumerate the nodes in a global subtree as [subscripts, data] (lazily without a block).
+   - The subtree is read prefetch nodes at a time by a single request (QB), the next batch being requested while the block runs.
+   parallel_scan(global, key, ..., partitions: 8, batch: 100): scan the keys at one level (with their data) in several ranges at once, each over its own pooled connection.
+   - The partitions are bounded by real keys, sampled with $order probes, and each is read a batch at a time with a single request (OB).
+   Sequential prefetch: m_order()/m_previous() loops that read each record with m_get() are answered from records fetched ahead of the loop: mg_ruby.m_set_prefetch(<max>) (0 to disable).
+   - The records are fetched a window at a time by a single request (OB or PB), for the loop most recently started by a thread (or fiber).
+   m_get_tree(global, key, ..., max_nodes: 10000): return a subtree as nested Hashes (the data for each node under :_value).
+   - The subtree is read by a single request (QB), or one for each batch of nodes in a large subtree.
+   m_set_tree(global, key, ..., hash, kill_first: false): store a nested Hash (as returned by m_get_tree) below a node in a single pipelined request.
+   MG_RUBY::LocalGlobal: a local global held in a skiplist in collating sequence, as a faster alternative to the ma_local_* record arrays.
+   ma_local_sort: sort the records in-process in M collating sequence (no longer a call to sort^%ZMGS); ma_local_order/ma_local_previous use the same collation.
+   - The ma_local_* methods read records of any size (previously copied into a fixed 32KB buffer), such as those returned by LocalGlobal#to_records.
+   Client-side cache for m_get()/m_data() below registered key paths, with LRU eviction, a TTL and invalidation on writes: m_set_cache(), m_clear_cache(), m_get_cache_stats().
+   - Only set, kill, increment, merge into the database, commit and rollback count as writes: m_invalidate_cache(global, key, ...) for changes made by functions.
+   - Changing the ttl of a key path discards the results cached for it under the old ttl.
+   The cache can be held in a named POSIX shared-memory segment and shared by the processes on a host: m_set_cache(..., shared: <name>).
+   - A write invalidates the results cached for that global only; the segment is sized by the process that creates it.
+
 */
 
 
-#define MG_VERSION               "2.3.44"
+#define MG_VERSION               "2.4.46"
 
 #define MG_MAX_KEY               256
-#define MG_MAX_PAGE              256
 #define MG_MAX_VARGS             32
+#define MG_LOCAL_MAX_LEVEL       16
+#define MG_EACH_NODE_PREFETCH    100
+#define MG_TREE_MAX_NODES        10000
+#define MG_SCAN_PARTITIONS       8
+#define MG_SCAN_MAX_PARTITIONS   64
+#define MG_SCAN_SAMPLES          4
+#define MG_SCAN_ROUNDS           4
+#define MG_PREFETCH_MAX          64
+#define MG_PREFETCH_MIN          4
+#define MG_PREFETCH_STREAK       2
+#define MG_CACHE_SIZE            10000
+#define MG_CACHE_TTL             5000
+#define MG_CACHE_MAX_PREFIX      16
+#define MG_CACHE_MAX_KEY         512
+#define MG_CACHE_MAX_DATA        8192
+#define MG_SHM_SLOT              1024
+#define MG_SHM_PROBE             8
+#define MG_SHM_GENERATIONS       256
+#define MG_SHM_MAGIC             0x4d475243
+#define MG_SHM_WAIT              1000
+#define MG_PIPELINE_BATCH        65536
+#define MG_FIBER_POOL_POLL       0.001
 
 #define MG_T_VAR                 0
 #define MG_T_STRING              1
@@ -78,6 +150,14 @@ Version 2.3.44a 23 June 2023:
 /* include standard header */
 
 #include <ruby.h>
+#include <ruby/thread.h>
+#if !defined(_WIN32)
+#include <sys/mman.h> /* v2.4.46 */
+#endif
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#endif
 
 
 #define MG_ERROR(e) \
@@ -95,6 +175,15 @@ Version 2.3.44a 23 June 2023:
       return mg_r_nil; \
    } \
 
+/* v2.4.45 */
+#define MG_DB_BUFFER(p_buf) \
+   p_buf = mg_db_buffer(p_page->p_srv, chndle); \
+   if (!p_buf) { \
+      mg_db_disconnect(p_page->p_srv, chndle, 0); \
+      rb_raise(rb_eRuntimeError, "%s", (char *) "Insufficient memory to process request"); \
+      return mg_r_nil; \
+   } \
+
 #define MG_FTRACE(e) \
 
 typedef struct tagMGPTYPE {
@@ -116,19 +205,249 @@ typedef struct tagMGUSER {
    char buffer[MG_BUFSIZE];
 } MGUSER;
 
+/* v2.4.46 */
+/* Sequential $order prefetch: the level being walked and the [key, data] records fetched ahead of the walk */
+/* The walk belongs to the fiber (and so the thread) that started it; 'seq' changes whenever a walk is started */
+typedef struct tagMGPREFETCH {
+   VALUE       prefix;
+   VALUE       records;
+   VALUE       last;
+   VALUE       owner;
+   long        next;
+   unsigned long seq;
+   unsigned long write_seq;
+   int         window;
+   int         max;
+   int         streak;
+   int         gets;
+   short       end;
+   char        command;
+} MGPREFETCH;
+
+/* v2.4.46 */
+/* A cached m_get/m_data result: the key (command and encoded key path) and data share one allocation */
+typedef struct tagMGCENTRY {
+   char *      key;
+   int         key_len;
+   int         data_len;
+   unsigned long hash;
+   unsigned long generation;
+   unsigned long expires;
+   int         chain;
+   int         older;
+   int         newer;
+} MGCENTRY;
+
+/* A key path registered for caching: its generation changes whenever its cached entries become invalid */
+typedef struct tagMGCPREFIX {
+   char        key[MG_CACHE_MAX_KEY];
+   int         key_len;
+   long        ttl;
+   unsigned long generation;
+} MGCPREFIX;
+
+/* A slot in the shared-memory table: 'seq' is odd while the slot is being written */
+typedef struct tagMGSHMSLOT {
+   unsigned long seq;
+   unsigned long hash;
+   unsigned long generation;
+   unsigned long expires;
+   int         key_len;
+   int         data_len;
+   char        buffer[MG_SHM_SLOT - (4 * sizeof(unsigned long)) - (2 * sizeof(int))];
+} MGSHMSLOT;
+
+/* The head of the shared-memory segment, followed by the slots */
+typedef struct tagMGSHMHEAD {
+   unsigned int magic;
+   unsigned int nslots;  /* set by the process that created the segment, before the magic number */
+   unsigned long generation[MG_SHM_GENERATIONS];
+} MGSHMHEAD;
+
+typedef struct tagMGCACHE {
+   MGCENTRY *  entries;
+   int *       buckets;
+   int         size;
+   int         nbuckets;
+   int         count;
+   int         free;
+   int         newest;
+   int         oldest;
+   int         nprefix;
+   MGCPREFIX   prefix[MG_CACHE_MAX_PREFIX];
+   size_t      bytes;
+   unsigned long epoch;
+   unsigned long write_seq;
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+   unsigned long invalidations;
+   int         max;
+   MGSHMHEAD * shm;
+   MGSHMSLOT * slots;
+   int         nslots;
+   size_t      shm_size;
+   char        shm_name[128];
+   unsigned char shm_written[MG_SHM_GENERATIONS]; /* the globals written since the last commit or rollback */
+} MGCACHE;
+
 typedef struct tagMGPAGE {
    MGSRV       srv;
    MGSRV *     p_srv;
+   int         futures;   /* v2.4.46: futures still referring to this object */
+   short       destroyed; /* v2.4.46: freed by the GC while futures remain */
+   MGPREFETCH  prefetch;  /* v2.4.46 */
+   MGCACHE *   cache;     /* v2.4.46 */
+   short       nobatch;   /* v2.4.46: the DB Superserver does not support the batched commands */
+   struct tagMGFUTURE * p_pending;      /* v2.4.46: futures holding a connection, oldest first */
+   struct tagMGFUTURE * p_pending_last;
 } MGPAGE;
 
 typedef struct tagMGMCLASS {
-   int         phndle;
+   VALUE       owner; /* v2.4.45: the MG_RUBY object that created this instance */
    int         oref;
 } MGMCLASS;
 
+/* v2.4.46 */
+typedef struct tagMGPIPELINE {
+   VALUE       owner;
+   int         count;
+   int         max;
+   short       writes;
+   VALUE       written;  /* the globals written (a Hash), for the cache */
+   unsigned long * offset;
+   MGBUF       buf;
+} MGPIPELINE;
+
+/* v2.4.46 */
+typedef struct tagMGFUTURE {
+   VALUE       owner;
+   MGPAGE *    p_page;    /* the owner's page: the owner may already have been swept when the future is freed */
+   VALUE       value;
+   VALUE       error;
+   int         chndle;
+   short       pending;
+   short       deferred;  /* the pool was exhausted: the request is made when the value is collected */
+   ID          method;
+   VALUE       args;
+   VALUE       thread;    /* the thread that sent the request */
+   struct tagMGFUTURE * prev;
+   struct tagMGFUTURE * next;
+} MGFUTURE;
+
+typedef struct tagMGFUTURECALL {
+   VALUE       self;
+   ID          method;
+   int         argc;
+   VALUE *     argv;
+} MGFUTURECALL;
+
+/* v2.4.46: a node of a LocalGlobal: the subscripts and data are held in the same block as the node */
+typedef struct tagMGLNODE {
+   int         levels;
+   int         nkeys;
+   MGSTR *     keys;
+   MGSTR       data;
+   size_t      size;
+   struct tagMGLNODE * next[1];
+} MGLNODE;
+
+/*
+   v2.4.46: a record being sorted by ma_local_sort, with its subscripts decoded in place.  The collating class
+   of the first subscript, and its value (for a number) or first 8 bytes (for a string), are held in the
+   entry itself so that most comparisons are settled without reference to the record.
+*/
+typedef struct tagMGLSORT {
+   VALUE       record;
+   MGSTR *     keys;
+   union {
+      double               number;
+      unsigned long long   prefix;
+   } first;
+   int         index;
+   short       nkeys;
+   short       kclass;
+} MGLSORT;
+
+/* v2.4.46: a LocalGlobal: a skiplist of nodes in subscript order */
+typedef struct tagMGLOCAL {
+   MGLNODE *   head;
+   int         levels;
+   long        count;
+   size_t      size;
+   unsigned int seed;
+} MGLOCAL;
+
+/* One partition of a parallel scan: the keys after 'lower' up to (and including) 'upper' */
+typedef struct tagMGSCAN {
+   VALUE       self;
+   VALUE       queue;
+   VALUE       lower;
+   VALUE       upper;
+   VALUE       results;
+   VALUE       error;
+   VALUE       args[MG_MAX_VARGS];
+   int         nargs;
+   int         index;
+   long        batch;
+   short *     stop;
+} MGSCAN;
+
+/* The state for queuing the nodes of a nested Hash (m_set_tree) */
+typedef struct tagMGTREE {
+   VALUE       pipeline;
+   VALUE *     args;
+   int         nargs;
+   long        nodes;
+} MGTREE;
+
+/* The state of an each_node walk while a batch of nodes is yielded (with the request for the next batch in flight) */
+typedef struct tagMGWALK {
+   VALUE       nodes;
+   int         chndle;
+   short       pending;
+   short       done;
+   MGPAGE *    p_page;
+} MGWALK;
+
+typedef struct tagMGSCANSET {
+   MGSCAN *    scans;
+   int         count;
+   VALUE       queue;
+   VALUE       threads;
+   short       stop;
+} MGSCANSET;
+
+/* v2.4.45 */
+typedef struct tagMGNOGVL {
+   MGSRV *     p_srv;
+   int         chndle;
+   int *       p_chndle;
+   short       context;
+   volatile short cancel;
+   MGBUF *     p_buf;
+   unsigned char * p_data;
+   int         size;
+   int         mode;
+   int         result;
+   short       done;
+   short       interrupted;
+   short       wake;
+   int         state;
+} MGNOGVL;
+
+/* v2.4.46 */
+typedef struct tagMGFIBER {
+   MGSRV *     p_srv;
+   int         chndle;
+   VALUE       scheduler;
+   VALUE       io;
+   int         fd;
+   int         events;
+   int         timeout;
+   int         state;
+} MGFIBER;
 
-static MGPAGE gpage;
-static MGPAGE *tp_page[MG_MAX_PAGE] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
 
 static long request_no = 0;
 
@@ -137,9 +456,15 @@ static char minit[256] = {'\0'};
 VALUE mg_r_nil    = Qnil;
 VALUE mg_ruby     = Qnil;
 VALUE mg_mclass   = Qnil; /* v2.3.43 */
+VALUE mg_pipeline = Qnil; /* v2.4.46 */
+VALUE mg_future   = Qnil; /* v2.4.46 */
+VALUE mg_local    = Qnil; /* v2.4.46 */
 
 
 int            mg_type                    (VALUE item);
+int            mg_is_canonic_number       (char *p, long len);
+int            mg_collate                 (char *p1, long len1, char *p2, long len2);
+int            mg_collate_number          (char *p1, long len1, char *p2, long len2);
 int            mg_get_array_size          (VALUE rb_array);
 int            mg_get_integer             (VALUE item);
 double         mg_get_float               (VALUE item);
@@ -150,25 +475,248 @@ int            mg_set_list_item           (VALUE list, int index, VALUE item);
 int            mg_kill_list               (VALUE list);
 int            mg_kill_list_item          (VALUE list, int index);
 
-MGPAGE *       mg_ppage                   (int phndle);
+MGPAGE *       mg_ppage                   (VALUE self);
 int            mg_ppage_init              (MGPAGE * p_page);
 
+/* v2.4.45 */
+void           mg_ruby_mark               (void * data);
+void           mg_ruby_free               (void * data);
+size_t         mg_ruby_size               (const void* data);
+VALUE          mg_ruby_alloc              (VALUE self);
+
+/* v2.4.46 */
+int            mg_prefetch_match          (MGPREFETCH *p_prefetch, MGVARGS *pvargs, int argc, char command);
+VALUE          mg_prefetch_order          (MGPAGE *p_page, VALUE self, int argc, VALUE *argv, MGVARGS *pvargs, char *command);
+int            mg_prefetch_note           (MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, VALUE key);
+VALUE          mg_prefetch_get            (MGPAGE *p_page, MGVARGS *pvargs, int argc);
+static VALUE   ex_m_set_cache             (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_clear_cache           (VALUE self);
+static VALUE   ex_m_invalidate_cache      (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_get_cache_stats       (VALUE self);
+MGCACHE *      mg_cache_alloc             (int size);
+int            mg_cache_free              (MGPAGE *p_page);
+int            mg_cache_clear             (MGCACHE *p_cache);
+int            mg_cache_key               (MGSTR *cvars, int nkeys, char command, char *key);
+int            mg_cache_prefix            (MGCACHE *p_cache, char *key, int key_len);
+unsigned long  mg_cache_hash              (char *key, int key_len);
+int            mg_cache_find              (MGCACHE *p_cache, char *key, int key_len, unsigned long hash);
+int            mg_cache_touch             (MGCACHE *p_cache, int n, short link);
+int            mg_cache_remove            (MGCACHE *p_cache, int n);
+VALUE          mg_cache_get               (MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, unsigned long *p_epoch);
+int            mg_cache_put               (MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, VALUE r_data, unsigned long epoch);
+int            mg_cache_note              (MGPAGE *p_page, MGSTR *cvars, int nkeys, unsigned long write_seq);
+int            mg_shm_open                (MGCACHE *p_cache, char *name, int size, char *error);
+int            mg_shm_close               (MGCACHE *p_cache);
+int            mg_shm_index               (MGSTR *global);
+int            mg_shm_invalidate          (MGCACHE *p_cache, MGSTR *global);
+int            mg_shm_commit              (MGCACHE *p_cache);
+int            mg_shm_get                 (MGCACHE *p_cache, char *key, int key_len, unsigned long hash, unsigned long generation, char *data, int *p_data_len);
+int            mg_shm_put                 (MGCACHE *p_cache, char *key, int key_len, unsigned long hash, char *data, int data_len, unsigned long generation, unsigned long expires);
+
+/* v2.4.45 */
+int            mg_db_connect_nogvl        (MGSRV *p_srv, int *p_chndle, short context);
+int            mg_db_send_nogvl           (MGSRV *p_srv, int chndle, MGBUF *p_buf, int mode);
+int            mg_db_receive_nogvl        (MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode);
+void *         mg_db_connect_nogvl_ex     (void *arg);
+void           mg_db_connect_nogvl_ubf    (void *arg);
+void *         mg_db_send_nogvl_ex        (void *arg);
+void *         mg_db_receive_nogvl_ex     (void *arg);
+int            mg_db_receive_string_nogvl (MGSRV *p_srv, int chndle, MGBUF *p_buf, VALUE *p_data);
+void *         mg_db_receive_body_nogvl_ex(void *arg);
+int            mg_db_receive_batch_nogvl  (MGSRV *p_srv, int chndle, MGBUF *p_buf, int count);
+void *         mg_db_receive_batch_nogvl_ex(void *arg);
+VALUE          mg_response_string         (MGBUF *p_buf, VALUE r_data);
+VALUE          mg_db_response             (MGPAGE *p_page, int chndle, MGBUF *p_buf, VALUE r_data);
+VALUE          mg_db_response_copy        (MGPAGE *p_page, int chndle, MGBUF *p_buf, MGBUF *p_copy);
+void           mg_db_nogvl_ubf            (void *arg);
+int            mg_db_nogvl_done           (MGNOGVL *p_nogvl);
+int            mg_db_nogvl_interrupts     (MGNOGVL *p_nogvl);
+VALUE          mg_db_nogvl_check_ints     (VALUE arg);
+int            mg_db_nogvl_begin          (MGNOGVL *p_nogvl);
+int            mg_db_nogvl_wait           (DBXCON *pcon, int events, int timeout);
+void *         mg_db_nogvl_wait_ints      (void *arg);
+
+/* v2.4.46 */
+int            mg_db_connect_fiber        (MGSRV *p_srv, int *p_chndle, short context, VALUE scheduler);
+int            mg_fiber_begin             (MGFIBER *p_fiber, MGSRV *p_srv, int chndle);
+int            mg_fiber_end               (MGFIBER *p_fiber, int result);
+int            mg_fiber_wait              (DBXCON *pcon, int events, int timeout);
+VALUE          mg_fiber_wait_ex           (VALUE arg);
+
 /* v2.3.43 */
+void           mclass_mark                (void * data);
 void           mclass_free                (void * data);
 size_t         mclass_size                (const void* data);
 VALUE          mclass_alloc               (VALUE self);
-VALUE          mclass_m_initialize        (VALUE self, VALUE rb_oref, VALUE rb_phndle);
+VALUE          mclass_m_initialize        (VALUE self, VALUE rb_oref, VALUE rb_owner);
 static VALUE   ex_m_mclass                ();
 static VALUE   ex_mclass_method           (int argc, VALUE *argv, VALUE self);
 static VALUE   ex_mclass_getproperty      (VALUE self, VALUE r_pname);
 static VALUE   ex_mclass_setproperty      (VALUE self, VALUE r_pname, VALUE p_pvalue);
 static VALUE   ex_mclass_close            (VALUE self);
 
+/* v2.4.46 */
+void           pipeline_mark              (void * data);
+void           pipeline_free              (void * data);
+size_t         pipeline_size              (const void* data);
+VALUE          pipeline_alloc             (VALUE self);
+VALUE          pipeline_m_initialize      (VALUE self, VALUE rb_owner);
+VALUE          mg_pipeline_add            (int argc, VALUE *argv, VALUE self, char *command);
+int            mg_pipeline_note           (MGPAGE *p_page, MGPIPELINE *ppipeline);
+int            mg_pipeline_results        (MGBUF *p_buf, int count, VALUE results, char *error, short status);
+VALUE          mg_pipeline_execute        (VALUE self, short status);
+static VALUE   ex_m_pipeline_class        (void);
+static VALUE   ex_m_pipeline              (VALUE self);
+static VALUE   ex_pipeline_m_set          (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_get          (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_kill         (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_data         (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_order        (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_previous     (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_increment    (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_function     (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_pipeline_m_size         (VALUE self);
+static VALUE   ex_pipeline_m_execute      (VALUE self);
+VALUE          mg_multi                   (VALUE self, VALUE items, char *command, char *method, short status);
+static VALUE   ex_m_get_multi             (VALUE self, VALUE items);
+static VALUE   ex_m_set_multi             (VALUE self, VALUE items);
+static VALUE   ex_m_kill_multi            (VALUE self, VALUE items);
+VALUE          mg_batch_request           (VALUE self, char *command, int nargs, VALUE *args, char *options);
+int            mg_batch_send              (VALUE self, char *command, int nargs, VALUE *args, char *options, int *p_chndle, short context);
+VALUE          mg_batch_receive           (VALUE self, int chndle, int sent, short raise);
+int            mg_pool_spare              (MGSRV *p_srv);
+int            mg_query_node              (VALUE items, long *p_offset, int *p_dvalue, VALUE *p_subs, VALUE *p_value);
+VALUE          mg_order_batch             (VALUE self, int nargs, VALUE *args, long count, short with_data, char *command, VALUE limit);
+VALUE          mg_order_step              (VALUE self, int nargs, VALUE *args, long count, short with_data, char *command, VALUE limit);
+static VALUE   ex_m_order_batch           (int argc, VALUE *argv, VALUE self);
+VALUE          mg_order_data              (int argc, VALUE *argv, VALUE self, char *command, char *method);
+static VALUE   ex_m_order_data            (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_previous_data         (int argc, VALUE *argv, VALUE self);
+int            mg_each_node               (VALUE self, int nargs, VALUE *args, int depth, long window);
+int            mg_each_node_batch         (VALUE self, int nargs, VALUE *args, int depth, long window);
+VALUE          mg_each_node_yield         (VALUE arg);
+VALUE          mg_each_node_ensure        (VALUE arg);
+static VALUE   ex_each_node               (int argc, VALUE *argv, VALUE self);
+int            mg_get_tree                (VALUE self, int nargs, VALUE *args, VALUE tree, long *p_nodes, long max_nodes);
+int            mg_get_tree_batch          (VALUE self, int nargs, VALUE *args, VALUE tree, long max_nodes);
+static VALUE   ex_m_get_tree              (int argc, VALUE *argv, VALUE self);
+int            mg_set_tree                (VALUE key, VALUE value, VALUE arg);
+static VALUE   ex_m_set_tree              (int argc, VALUE *argv, VALUE self);
+VALUE          mg_scan_bounds             (VALUE self, int nargs, VALUE *args, int partitions);
+VALUE          mg_scan_merge              (VALUE keys, VALUE probed);
+int            mg_scan_compare            (const void *p1, const void *p2);
+VALUE          mg_scan_points             (VALUE a, VALUE b, long count);
+int            mg_scan_push               (MGSCAN *p_scan, VALUE item);
+VALUE          mg_scan_partition          (VALUE arg);
+VALUE          mg_scan_worker             (void *arg);
+VALUE          mg_scan_done               (VALUE arg);
+VALUE          mg_scan_collect            (VALUE arg);
+VALUE          mg_scan_finish             (VALUE arg);
+static VALUE   ex_parallel_scan           (int argc, VALUE *argv, VALUE self);
+
+/* v2.4.46 */
+void           local_free                 (void * data);
+size_t         local_size                 (const void* data);
+VALUE          local_alloc                (VALUE self);
+VALUE          local_m_initialize         (int argc, VALUE *argv, VALUE self);
+MGLNODE *      mg_local_node              (int levels, int nkeys, MGSTR *keys, MGSTR *data);
+int            mg_local_keys              (int argc, VALUE *argv, MGSTR *keys, VALUE *keys_tmp);
+int            mg_local_compare           (MGLNODE *p_node, MGSTR *keys, int nkeys, short tail);
+int            mg_local_prefix            (MGLNODE *p_node, MGSTR *keys, int nkeys);
+MGLNODE *      mg_local_find              (MGLOCAL *p_local, MGSTR *keys, int nkeys, short tail, MGLNODE **update);
+int            mg_local_set               (MGLOCAL *p_local, MGSTR *keys, int nkeys, MGSTR *data);
+long           mg_local_kill              (MGLOCAL *p_local, MGSTR *keys, int nkeys);
+static VALUE   ex_m_local_class           (VALUE outer);
+static VALUE   ex_local_m_set             (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_get             (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_data            (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_kill            (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_order           (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_previous        (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_local_m_size            (VALUE self);
+static VALUE   ex_local_to_records        (VALUE self);
+int            mg_local_sort_compare      (const void *a, const void *b);
+char *         mg_local_record            (VALUE record, char *buffer, char **heap, int *len);
+
+/* v2.4.46 */
+void           future_mark                (void * data);
+void           future_free                (void * data);
+size_t         future_size                (const void* data);
+VALUE          future_alloc               (VALUE self);
+VALUE          mg_future_request          (int argc, VALUE *argv, VALUE self, char *command, char *method);
+VALUE          mg_future_invoke           (VALUE arg);
+VALUE          mg_future_receive          (VALUE arg);
+void           mg_future_link             (MGPAGE *p_page, MGFUTURE *pfuture);
+void           mg_future_unlink           (MGPAGE *p_page, MGFUTURE *pfuture);
+void           mg_future_resolve          (MGFUTURE *pfuture);
+static VALUE   ex_m_future_class          (void);
+static VALUE   ex_m_set_async             (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_get_async             (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_kill_async            (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_data_async            (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_order_async           (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_previous_async        (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_increment_async       (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_m_function_async        (int argc, VALUE *argv, VALUE self);
+static VALUE   ex_future_value            (VALUE self);
+static VALUE   ex_future_ready            (VALUE self);
+static VALUE   ex_future_wait_all         (VALUE self, VALUE futures);
+
+
+/* v2.4.45 */
+static const rb_data_type_t mg_ruby_type = {
+	.wrap_struct_name = "mg_ruby",
+	.function = {
+		.dmark = mg_ruby_mark,
+		.dfree = mg_ruby_free,
+		.dsize = mg_ruby_size,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/* v2.4.46 */
+static const rb_data_type_t pipeline_type = {
+	.wrap_struct_name = "mg_pipeline",
+	.function = {
+		.dmark = pipeline_mark,
+		.dfree = pipeline_free,
+		.dsize = pipeline_size,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/* v2.4.46 */
+static const rb_data_type_t future_type = {
+	.wrap_struct_name = "mg_future",
+	.function = {
+		.dmark = future_mark,
+		.dfree = future_free,
+		.dsize = future_size,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/* v2.4.46 */
+static const rb_data_type_t local_type = {
+	.wrap_struct_name = "mg_local",
+	.function = {
+		.dmark = NULL,
+		.dfree = local_free,
+		.dsize = local_size,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
 
 static const rb_data_type_t mclass_type = {
 	.wrap_struct_name = "mclass",
 	.function = {
-		.dmark = NULL,
+		.dmark = mclass_mark,
 		.dfree = mclass_free,
 		.dsize = mclass_size,
 	},
@@ -239,11 +787,10 @@ static VALUE ex_m_ext_version(VALUE self)
 
 static VALUE ex_m_set_storage_mode(VALUE self, VALUE r_mode)
 {
-   int mode, phndle;
+   int mode;
    MGPAGE *p_page;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
    mode = mg_get_integer(r_mode);
 
@@ -256,19 +803,24 @@ static VALUE ex_m_set_storage_mode(VALUE self, VALUE r_mode)
 
 static VALUE ex_m_set_host(VALUE self, VALUE r_netname, VALUE r_port, VALUE r_username, VALUE r_password)
 {
-   int len, phndle;
+   int len;
    char *netname, *port, *username, *password;
    MGPAGE *p_page;
    VALUE r[32];
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
    netname = mg_get_string(r_netname, &r[0], &len);
    port = mg_get_string(r_port, &r[1], &len);
    username = mg_get_string(r_username, &r[2], &len);
    password = mg_get_string(r_password, &r[3], &len);
 
+   /* v2.4.46 */
+   if (strlen(netname) >= sizeof(p_page->p_srv->ip_address)) {
+      MG_ERROR("mg_ruby: Host name or socket path is too long");
+      return mg_r_nil;
+   }
+
    strcpy(p_page->p_srv->ip_address, netname);
    p_page->p_srv->port = (int) strtol(port, NULL, 10);
    strcpy(p_page->p_srv->username, username);
@@ -280,13 +832,12 @@ static VALUE ex_m_set_host(VALUE self, VALUE r_netname, VALUE r_port, VALUE r_us
 
 static VALUE ex_m_set_uci(VALUE self, VALUE r_uci)
 {
-   int len, phndle;
+   int len;
    char * uci;
    MGPAGE *p_page;
    VALUE r;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
    uci = mg_get_string(r_uci, &r, &len);
 
@@ -298,13 +849,12 @@ static VALUE ex_m_set_uci(VALUE self, VALUE r_uci)
 
 static VALUE ex_m_set_server(VALUE self, VALUE r_server)
 {
-   int len, phndle;
+   int len;
    char * server;
    MGPAGE *p_page;
    VALUE r;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
    server = mg_get_string(r_server, &r, &len);
 
@@ -317,11 +867,10 @@ static VALUE ex_m_set_server(VALUE self, VALUE r_server)
 /* v2.2.41 */
 static VALUE ex_m_set_timeout(VALUE self, VALUE r_timeout)
 {
-   int phndle, timeout;
+   int timeout;
    MGPAGE *p_page;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
    timeout = mg_get_integer(r_timeout);
 
@@ -334,598 +883,1247 @@ static VALUE ex_m_set_timeout(VALUE self, VALUE r_timeout)
 }
 
 
-static VALUE ex_m_bind_server_api(VALUE self, VALUE r_dbtype_name, VALUE r_path, VALUE r_username, VALUE r_password, VALUE r_env, VALUE r_params)
+/* v2.4.45 */
+static VALUE ex_m_set_pool_wait(VALUE self, VALUE r_msecs)
 {
-   int result, phndle, len;
-   char buffer[32];
-   char *dbtype_name, *path, *username, *password, *env, *params;
+   int msecs;
    MGPAGE *p_page;
-   VALUE r[32];
-
-   result = 0;
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   dbtype_name = mg_get_string(r_dbtype_name, &r[0], &len);
-   path = mg_get_string(r_path, &r[1], &len);
-   username = mg_get_string(r_username, &r[2], &len);
-   password = mg_get_string(r_password, &r[3], &len);
-   env = mg_get_string(r_env, &r[4], &len);
-   params = mg_get_string(r_params, &r[5], &len);
-
-   strcpy(p_page->p_srv->dbtype_name, dbtype_name);
-   strcpy(p_page->p_srv->shdir, path);
-   strcpy(p_page->p_srv->username, password);
-   strcpy(p_page->p_srv->password, password);
 
-   p_page->p_srv->p_env = (MGBUF *) mg_malloc(sizeof(MGBUF), 0);
-   mg_buf_init(p_page->p_srv->p_env, MG_BUFSIZE, MG_BUFSIZE);
-   mg_buf_cpy(p_page->p_srv->p_env, env, (int) strlen(env));
+   p_page = mg_ppage(self);
 
-   result = mg_bind_server_api(p_page->p_srv, 0);
+   msecs = mg_get_integer(r_msecs);
 
-   if (!result) {
-      if (!strlen(p_page->p_srv->error_mess)) {
-         strcpy(p_page->p_srv->error_mess, "The server API is not available on this host");
-      }
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
-   }
+   p_page->p_srv->pool.wait_timeout = msecs;
 
-   sprintf(buffer, "%d", result);
-   return rb_str_new2(buffer);
+   return rb_str_new2("");
 }
 
 
-static VALUE ex_m_release_server_api(VALUE self, VALUE args)
+static VALUE ex_m_set_pool_affinity(VALUE self, VALUE r_affinity)
 {
-   int result, phndle;
-   char buffer[32];
    MGPAGE *p_page;
 
-   result = 0;
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   result = mg_release_server_api(p_page->p_srv, 0);
+   p_page->p_srv->pool.affinity = (short) (mg_get_integer(r_affinity) ? 1 : 0);
 
-   sprintf(buffer, "%d", result);
-   return rb_str_new2(buffer);
+   return rb_str_new2("");
 }
 
 
-
-static VALUE ex_m_get_last_error(VALUE self)
+static VALUE ex_m_set_pool_size(VALUE self, VALUE r_min, VALUE r_max)
 {
+   int min, max;
+   MGPAGE *p_page;
 
-   return rb_str_new2("");
+   p_page = mg_ppage(self);
+
+   min = mg_get_integer(r_min);
+   max = mg_get_integer(r_max);
 
+   if (min < 0 || max < 1 || min > max) {
+      MG_ERROR("mg_ruby: m_set_pool_size: the pool size must satisfy 0 <= min <= max and max >= 1");
+      return mg_r_nil;
+   }
+
+   mg_enter_critical_section((void *) &(p_page->p_srv->pool.mutex));
+   p_page->p_srv->pool.min = min;
+   p_page->p_srv->pool.max = max;
+   mg_pool_wakeup(p_page->p_srv);
+   mg_leave_critical_section((void *) &(p_page->p_srv->pool.mutex));
+
+   return rb_str_new2("");
 }
 
 
-static VALUE ex_m_set(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_set_pool_idle_timeout(VALUE self, VALUE r_secs)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
-   char ifc[4];
-   int chndle, phndle;
+   int secs;
    MGPAGE *p_page;
-   MGVARGS vargs;
-
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
-      return mg_r_nil;
-
-   phndle = 0;
-   p_page = mg_ppage(phndle);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("m_set");
+   secs = mg_get_integer(r_secs);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   p_page->p_srv->pool.idle_timeout = (secs > 0) ? secs : 0;
+   mg_pool_reap(p_page->p_srv, 1);
 
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
-   }
+   return rb_str_new2("");
+}
 
-   mg_request_header(p_page->p_srv, p_buf, "S", MG_PRODUCT);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+/* v2.4.46 */
+static VALUE ex_m_set_prefetch(VALUE self, VALUE r_max)
+{
+   int max;
+   MGPAGE *p_page;
 
-   for (n = 1; n < max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
-   }
+   p_page = mg_ppage(self);
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   max = mg_get_integer(r_max);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   p_page->prefetch.max = (max > 0) ? max : 0;
+   p_page->prefetch.prefix = Qnil;
+   p_page->prefetch.records = Qnil;
+   p_page->prefetch.last = Qnil;
+   p_page->prefetch.owner = Qnil;
+   p_page->prefetch.seq ++;
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   return rb_str_new2("");
+}
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+/*
+   Is the request from the fiber walking, do the global name and subscripts (all but the last) match the level
+   being walked, and is the last subscript the key it last returned?
+*/
+int mg_prefetch_match(MGPREFETCH *p_prefetch, MGVARGS *pvargs, int argc, char command)
+{
+   int n;
+   VALUE item;
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   if (NIL_P(p_prefetch->prefix) || RARRAY_LEN(p_prefetch->prefix) != (argc - 1) || (command && command != p_prefetch->command)) {
+      return 0;
+   }
+   if (p_prefetch->owner != rb_fiber_current()) {
+      return 0;
+   }
+   for (n = 0; n < (argc - 1); n ++) {
+      item = rb_ary_entry(p_prefetch->prefix, n);
+      if (RSTRING_LEN(item) != pvargs->cvars[n].size || memcmp((void *) RSTRING_PTR(item), (void *) pvargs->cvars[n].ps, (size_t) pvargs->cvars[n].size)) {
+         return 0;
+      }
+   }
+   item = p_prefetch->last;
+   if (NIL_P(item) || RSTRING_LEN(item) != pvargs->cvars[argc - 1].size || memcmp((void *) RSTRING_PTR(item), (void *) pvargs->cvars[argc - 1].ps, (size_t) pvargs->cvars[argc - 1].size)) {
+      return 0;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return 1;
 }
 
 
-static VALUE ex_ma_set(VALUE self, VALUE r_global, VALUE key, VALUE r_data)
+/*
+   Answer an m_order() (or m_previous()) that continues a walk from the records fetched ahead of it.  The next
+   window of records is fetched once the walk has been seen to read the data for the keys it visits.  Returns
+   Qundef if the request must be sent to the database.
+   The fetch is a single request (OB or PB) which waits on the network without the GVL.  If another walk has been
+   started in the meantime (by another thread or fiber), the request is answered from the records fetched, which
+   are then discarded.
+*/
+VALUE mg_prefetch_order(MGPAGE *p_page, VALUE self, int argc, VALUE *argv, MGVARGS *pvargs, char *command)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, data_len, len;
-   char ifc[4];
-   char *global, *data;
-   MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   VALUE p;
-   VALUE r_nkey[MG_MAX_KEY];
+   int n;
+   unsigned long seq, write_seq;
+   VALUE args[MG_MAX_VARGS], record, records;
+   MGPREFETCH *p_prefetch;
 
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_set' must be an array");
-      return mg_r_nil;
-   }
+   p_prefetch = &(p_page->prefetch);
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   if (!p_prefetch->max || argc < 2 || argc > MG_MAX_VARGS || !mg_prefetch_match(p_prefetch, pvargs, argc, command[0])) {
+      return Qundef;
+   }
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   /* discard the records if the database may have been changed through this object */
+   if (!NIL_P(p_prefetch->records) && p_prefetch->write_seq != p_page->p_srv->write_seq) {
+      p_prefetch->records = Qnil;
+   }
 
-   MG_FTRACE("ma_set");
+   if (NIL_P(p_prefetch->records) || (p_prefetch->next >= RARRAY_LEN(p_prefetch->records) && !p_prefetch->end)) {
+      if (p_prefetch->streak < MG_PREFETCH_STREAK || p_prefetch->gets < MG_PREFETCH_STREAK) {
+         return Qundef;
+      }
+      for (n = 0; n < argc; n ++) {
+         args[n] = argv[n];
+      }
+      seq = p_prefetch->seq;
+      write_seq = p_page->p_srv->write_seq;
+      records = mg_order_batch(self, argc, args, p_prefetch->window, 1, command, Qnil);
+      if (p_prefetch->seq != seq) {
+         return (RARRAY_LEN(records) > 0) ? rb_ary_entry(rb_ary_entry(records, 0), 0) : rb_str_new2("");
+      }
+      p_prefetch->records = records;
+      p_prefetch->write_seq = write_seq;
+      p_prefetch->end = (RARRAY_LEN(p_prefetch->records) < p_prefetch->window) ? 1 : 0;
+      p_prefetch->next = 0;
+      p_prefetch->window = (p_prefetch->window * 2) < p_prefetch->max ? (p_prefetch->window * 2) : p_prefetch->max;
+   }
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+   if (p_prefetch->next >= RARRAY_LEN(p_prefetch->records)) {
+      p_prefetch->prefix = Qnil;
+      p_prefetch->records = Qnil;
+      return rb_str_new2("");
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "S", MG_PRODUCT);
+   record = rb_ary_entry(p_prefetch->records, p_prefetch->next ++);
+   p_prefetch->last = rb_ary_entry(record, 0);
+   p_prefetch->streak ++;
 
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
-   global = mg_get_string(r_global, &p, &len);
-   data = mg_get_string(r_data, &p, &data_len);
+   return rb_str_dup(p_prefetch->last);
+}
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
 
-   for (n = 1; n <= max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+/* Record the key returned by m_order() (or m_previous()): a request that does not continue the walk starts a new one */
+int mg_prefetch_note(MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, VALUE key)
+{
+   int n;
+   MGPREFETCH *p_prefetch;
+
+   p_prefetch = &(p_page->prefetch);
+
+   if (!p_prefetch->max || argc < 2 || argc > MG_MAX_VARGS) {
+      return 0;
    }
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) data, data_len, (short) ifc[0], (short) ifc[1]);
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   if (mg_prefetch_match(p_prefetch, pvargs, argc, command[0])) {
+      p_prefetch->streak ++;
+   }
+   else {
+      p_prefetch->prefix = rb_ary_new_capa(argc - 1);
+      for (n = 0; n < (argc - 1); n ++) {
+         rb_ary_push(p_prefetch->prefix, rb_str_new((char *) pvargs->cvars[n].ps, (long) pvargs->cvars[n].size));
+      }
+      p_prefetch->owner = rb_fiber_current();
+      p_prefetch->seq ++;
+      p_prefetch->command = command[0];
+      p_prefetch->streak = 1;
+      p_prefetch->gets = 0;
+      p_prefetch->window = MG_PREFETCH_MIN < p_prefetch->max ? MG_PREFETCH_MIN : p_prefetch->max;
+   }
+   p_prefetch->records = Qnil;
+   p_prefetch->last = rb_str_new_frozen(key);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   return 1;
+}
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+/* Answer an m_get() for the key last returned by the walk from the records fetched ahead: returns Qundef otherwise */
+VALUE mg_prefetch_get(MGPAGE *p_page, MGVARGS *pvargs, int argc)
+{
+   VALUE record;
+   MGPREFETCH *p_prefetch;
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   p_prefetch = &(p_page->prefetch);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   if (!p_prefetch->max || argc < 2 || argc > MG_MAX_VARGS || !mg_prefetch_match(p_prefetch, pvargs, argc, 0)) {
+      return Qundef;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   p_prefetch->gets ++;
 
+   if (NIL_P(p_prefetch->records) || p_prefetch->next < 1 || p_prefetch->write_seq != p_page->p_srv->write_seq) {
+      return Qundef;
+   }
+
+   record = rb_ary_entry(p_prefetch->records, p_prefetch->next - 1);
+
+   return rb_str_dup(rb_ary_entry(record, 1));
 }
 
 
-static VALUE ex_m_get(int argc, VALUE *argv, VALUE self)
+/*
+   v2.4.46: client-side cache for m_get() and m_data()
+
+   Nodes at or below the key paths registered with m_set_cache() are cached in a hash table (keyed by the
+   command and the encoded key path) with an LRU list, for up to 'ttl' milliseconds.  An m_set(), m_kill() or
+   m_increment() (or a merge into the database) through this object invalidates the prefixes it touches by giving
+   them a new generation.  Any other request that changes the database (MGSRV.write_seq: the end of a
+   transaction) invalidates all of them.  Functions and class methods are not seen: m_invalidate_cache() is
+   provided for their callers.
+
+   With 'shared:', the results are held in a named POSIX shared-memory segment instead, so that all the
+   processes on the host (for example, the workers of a prefork server) share them.  The segment is an open-
+   addressing table of fixed-size slots, each guarded by a sequence lock, behind a table of generations
+   indexed by the hash of the global name.  A write through any of the processes invalidates the results
+   cached for that global by all of them, and again when its transaction ends; reads never do.  The number of
+   slots is fixed by the process that creates the segment and recorded in its head.
+*/
+static VALUE ex_m_set_cache(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
-   char ifc[4];
-   int chndle, phndle;
+   int n, max, nargs, key_len, size;
+   long ttl;
+   char key[MG_CACHE_MAX_KEY], error[256];
+   char *shared;
+   ID kwargs_id[3];
    MGPAGE *p_page;
+   MGCACHE *p_cache, *p_old;
    MGVARGS vargs;
+   VALUE global, rest, kwargs, kwargs_val[3], args[MG_MAX_VARGS];
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
-      return mg_r_nil;
-
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   rb_scan_args(argc, argv, "1*:", &global, &rest, &kwargs);
 
-   MG_FTRACE("m_get");
-
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   kwargs_id[0] = rb_intern("ttl");
+   kwargs_id[1] = rb_intern("max");
+   kwargs_id[2] = rb_intern("shared");
+   rb_get_kwargs(kwargs, kwargs_id, 0, 3, kwargs_val);
 
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
+   ttl = (kwargs_val[0] != Qundef) ? (long) (NUM2DBL(kwargs_val[0]) * 1000) : MG_CACHE_TTL;
+   size = (kwargs_val[1] != Qundef) ? (int) NUM2INT(kwargs_val[1]) : MG_CACHE_SIZE;
+   if (size < 1) {
+      MG_ERROR("mg_ruby: The size of the cache must be at least 1");
       return mg_r_nil;
    }
-
-   mg_request_header(p_page->p_srv, p_buf, "G", MG_PRODUCT);
-
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
-
-   for (n = 1; n < max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   shared = NULL;
+   if (kwargs_val[2] != Qundef && RTEST(kwargs_val[2])) {
+      shared = StringValueCStr(kwargs_val[2]);
+      if (strlen(shared) >= sizeof(p_cache->shm_name)) {
+         MG_ERROR("mg_ruby: The name of the shared cache is too long");
+         return mg_r_nil;
+      }
    }
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
-
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
-
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   nargs = (int) RARRAY_LEN(rest) + 1;
+   if (nargs > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to 'm_set_cache'");
+      return mg_r_nil;
+   }
+   args[0] = global;
+   for (n = 1; n < nargs; n ++) {
+      args[n] = rb_ary_entry(rest, n - 1);
+   }
+   if ((max = mg_get_vargs(nargs, args, &vargs, 0)) == -1)
+      return mg_r_nil;
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   key_len = mg_cache_key(vargs.cvars, max, 0, key);
+   if (key_len < 0) {
+      MG_ERROR("mg_ruby: The key path passed to 'm_set_cache' is too long");
+      return mg_r_nil;
+   }
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   p_page = mg_ppage(self);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   /* a new size, or a move to (or from) a shared cache, replaces the cache but keeps the key paths registered */
+   p_old = p_page->cache;
+   if (p_old) {
+      if (kwargs_val[1] == Qundef) {
+         size = p_old->max;
+      }
+      if (kwargs_val[2] == Qundef) {
+         shared = p_old->shm ? p_old->shm_name : NULL;
+      }
+      if (size == p_old->max && (shared ? (p_old->shm && !strcmp(shared, p_old->shm_name)) : !p_old->shm)) {
+         p_old = NULL;
+      }
+   }
+   p_cache = p_page->cache;
+   if (!p_cache || p_old) {
+      if (!p_cache && ttl <= 0) {
+         return rb_str_new2("");
+      }
+      p_cache = mg_cache_alloc(shared ? 1 : size);
+      if (!p_cache) {
+         rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the cache");
+      }
+      p_cache->max = size;
+      if (shared && !mg_shm_open(p_cache, shared, size, error)) {
+         mg_free((void *) p_cache->entries, 0);
+         mg_free((void *) p_cache->buckets, 0);
+         mg_free((void *) p_cache, 0);
+         MG_ERROR(error);
+         return mg_r_nil;
+      }
+      if (p_old) {
+         p_cache->nprefix = p_old->nprefix;
+         for (n = 0; n < p_old->nprefix; n ++) {
+            p_cache->prefix[n] = p_old->prefix[n];
+            p_cache->prefix[n].generation = ++ p_cache->epoch;
+         }
+         mg_cache_free(p_page);
+      }
+      p_cache->write_seq = p_page->p_srv->write_seq;
+      p_page->cache = p_cache;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   for (n = 0; n < p_cache->nprefix; n ++) {
+      if (p_cache->prefix[n].key_len == key_len && !memcmp((void *) p_cache->prefix[n].key, (void *) key, (size_t) key_len)) {
+         break;
+      }
+   }
+   if (ttl <= 0) {
+      /* stop caching this key path: entries filed under it are left to expire or be evicted */
+      if (n < p_cache->nprefix) {
+         p_cache->nprefix --;
+         for (; n < p_cache->nprefix; n ++) {
+            p_cache->prefix[n] = p_cache->prefix[n + 1];
+         }
+         p_cache->epoch ++;
+      }
+      return rb_str_new2("");
+   }
+   if (n == p_cache->nprefix) {
+      if (n == MG_CACHE_MAX_PREFIX) {
+         MG_ERROR("mg_ruby: Too many key paths are cached");
+         return mg_r_nil;
+      }
+      memcpy((void *) p_cache->prefix[n].key, (void *) key, (size_t) key_len);
+      p_cache->prefix[n].key_len = key_len;
+      p_cache->prefix[n].generation = ++ p_cache->epoch;
+      p_cache->nprefix ++;
+   }
+   else if (p_cache->prefix[n].ttl != ttl) {
+      /* results cached under the old ttl could outlive the new one */
+      p_cache->prefix[n].generation = ++ p_cache->epoch;
+      mg_shm_invalidate(p_cache, &(vargs.cvars[0]));
+   }
+   p_cache->prefix[n].ttl = ttl;
+
+   return rb_str_new2("");
 }
 
 
-static VALUE ex_ma_get(VALUE self, VALUE r_global, VALUE key)
+static VALUE ex_m_clear_cache(VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, len;
-   char *global;
-   char ifc[4];
-   MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle;
    MGPAGE *p_page;
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
 
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_get' must be an array");
-      return mg_r_nil;
+   p_page = mg_ppage(self);
+
+   if (p_page->cache) {
+      mg_cache_clear(p_page->cache);
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   return rb_str_new2("");
+}
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
 
-   MG_FTRACE("ma_get");
+/*
+   Invalidate the cached results at, above or below a key path (in this process and, for a shared cache, in all
+   of them) or, with no arguments, all the cached results.  For changes the cache cannot see: those made by
+   m_function() or a class method.  Any records fetched ahead of an m_order() loop are discarded too.
+*/
+static VALUE ex_m_invalidate_cache(int argc, VALUE *argv, VALUE self)
+{
+   int n, max;
+   MGPAGE *p_page;
+   MGCACHE *p_cache;
+   MGVARGS vargs;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-   }
+   p_page = mg_ppage(self);
+   p_cache = p_page->cache;
 
-   mg_request_header(p_page->p_srv, p_buf, "G", MG_PRODUCT);
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
-   global = mg_get_string(r_global, &p, &len);
+   p_page->prefetch.records = Qnil;
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+   if (!p_cache) {
+      return rb_str_new2("");
+   }
 
-   for (n = 1; n <= max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+   if (argc == 0) {
+      for (n = 0; n < p_cache->nprefix; n ++) {
+         p_cache->prefix[n].generation = ++ p_cache->epoch;
+      }
+      p_cache->invalidations ++;
+      mg_shm_invalidate(p_cache, NULL);
+      return rb_str_new2("");
    }
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_cache_note(p_page, vargs.cvars, max, p_page->p_srv->write_seq);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   return rb_str_new2("");
+}
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+static VALUE ex_m_get_cache_stats(VALUE self)
+{
+   int n;
+   MGPAGE *p_page;
+   MGCACHE cache;
+   VALUE stats;
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   p_page = mg_ppage(self);
+
+   memset((void *) &cache, 0, sizeof(MGCACHE));
+   if (p_page->cache) {
+      cache = *(p_page->cache);
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   stats = rb_hash_new();
+   rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(cache.hits));
+   rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(cache.misses));
+   if (cache.shm) {
+      for (n = 0; n < cache.nslots; n ++) {
+         if (cache.slots[n].key_len > 0) {
+            cache.count ++;
+         }
+      }
+      cache.max = cache.nslots;
+   }
+   rb_hash_aset(stats, ID2SYM(rb_intern("entries")), INT2NUM(cache.count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("max")), INT2NUM(cache.max));
+   rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), ULONG2NUM(cache.evictions));
+   rb_hash_aset(stats, ID2SYM(rb_intern("invalidations")), ULONG2NUM(cache.invalidations));
+   rb_hash_aset(stats, ID2SYM(rb_intern("prefixes")), INT2NUM(cache.nprefix));
+   rb_hash_aset(stats, ID2SYM(rb_intern("shared")), cache.shm ? rb_str_new2(cache.shm_name) : Qnil);
+
+   return stats;
 }
 
 
-static VALUE ex_m_kill(int argc, VALUE *argv, VALUE self)
+MGCACHE * mg_cache_alloc(int size)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
-   char ifc[4];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   MGVARGS vargs;
+   int n;
+   MGCACHE *p_cache;
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
-      return mg_r_nil;
+   p_cache = (MGCACHE *) mg_malloc(sizeof(MGCACHE), 0);
+   if (!p_cache) {
+      return NULL;
+   }
+   memset((void *) p_cache, 0, sizeof(MGCACHE));
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   for (p_cache->nbuckets = 16; p_cache->nbuckets < size; p_cache->nbuckets *= 2)
+      ;
+   p_cache->entries = (MGCENTRY *) mg_malloc((int) (sizeof(MGCENTRY) * size), 0);
+   p_cache->buckets = (int *) mg_malloc((int) (sizeof(int) * p_cache->nbuckets), 0);
+   if (!p_cache->entries || !p_cache->buckets) {
+      if (p_cache->entries)
+         mg_free((void *) p_cache->entries, 0);
+      if (p_cache->buckets)
+         mg_free((void *) p_cache->buckets, 0);
+      mg_free((void *) p_cache, 0);
+      return NULL;
+   }
+   memset((void *) p_cache->entries, 0, sizeof(MGCENTRY) * size);
+   p_cache->size = size;
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   for (n = 0; n < p_cache->nbuckets; n ++) {
+      p_cache->buckets[n] = -1;
+   }
+   for (n = 0; n < size; n ++) {
+      p_cache->entries[n].chain = (n + 1) < size ? (n + 1) : -1;
+   }
+   p_cache->free = 0;
+   p_cache->newest = -1;
+   p_cache->oldest = -1;
 
-   MG_FTRACE("m_kill");
+   return p_cache;
+}
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
 
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
-   }
+int mg_cache_free(MGPAGE *p_page)
+{
+   MGCACHE *p_cache;
 
-   mg_request_header(p_page->p_srv, p_buf, "K", MG_PRODUCT);
+   p_cache = p_page->cache;
+   if (!p_cache) {
+      return 0;
+   }
+   p_page->cache = NULL;
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+   mg_cache_clear(p_cache);
+   mg_shm_close(p_cache);
+   mg_free((void *) p_cache->entries, 0);
+   mg_free((void *) p_cache->buckets, 0);
+   mg_free((void *) p_cache, 0);
 
-   for (n = 1; n < max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
-   }
+   return 1;
+}
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+int mg_cache_clear(MGCACHE *p_cache)
+{
+   while (p_cache->oldest != -1) {
+      mg_cache_remove(p_cache, p_cache->oldest);
+   }
+   p_cache->epoch ++;
+   mg_shm_invalidate(p_cache, NULL);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   return 1;
+}
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+/* Encode a key path (optionally preceded by the command) as a run of item headers and subscripts: returns -1 if it is too long to cache */
+int mg_cache_key(MGSTR *cvars, int nkeys, char command, char *key)
+{
+   int n, len, hlen;
+   unsigned char head[16];
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   len = 0;
+   if (command) {
+      key[len ++] = command;
+   }
+   for (n = 0; n < nkeys; n ++) {
+      hlen = mg_encode_item_header(head, (int) cvars[n].size, 0, MG_TX_AKEY);
+      if ((len + hlen + (int) cvars[n].size) > MG_CACHE_MAX_KEY) {
+         return -1;
+      }
+      memcpy((void *) (key + len), (void *) head, (size_t) hlen);
+      len += hlen;
+      memcpy((void *) (key + len), (void *) cvars[n].ps, (size_t) cvars[n].size);
+      len += (int) cvars[n].size;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return len;
 }
 
 
-static VALUE ex_ma_kill(VALUE self, VALUE r_global, VALUE key)
+/* The longest cached key path that the (encoded) key path is at or below: returns -1 if there is none */
+int mg_cache_prefix(MGCACHE *p_cache, char *key, int key_len)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, len;
-   char *global;
-   char ifc[4];
-   MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
+   int n, result;
 
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_kill' must be an array");
-      return mg_r_nil;
+   result = -1;
+   for (n = 0; n < p_cache->nprefix; n ++) {
+      if (p_cache->prefix[n].key_len <= key_len && !memcmp((void *) p_cache->prefix[n].key, (void *) key, (size_t) p_cache->prefix[n].key_len)) {
+         if (result == -1 || p_cache->prefix[n].key_len > p_cache->prefix[result].key_len) {
+            result = n;
+         }
+      }
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   return result;
+}
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
 
-   MG_FTRACE("ma_kill");
+/* FNV-1a */
+unsigned long mg_cache_hash(char *key, int key_len)
+{
+   int n;
+   unsigned long hash;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+   hash = 2166136261UL;
+   for (n = 0; n < key_len; n ++) {
+      hash ^= (unsigned char) key[n];
+      hash *= 16777619UL;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "K", MG_PRODUCT);
+   return hash;
+}
 
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
-   global = mg_get_string(r_global, &p, &len);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+int mg_cache_find(MGCACHE *p_cache, char *key, int key_len, unsigned long hash)
+{
+   int n;
+   MGCENTRY *p_entry;
 
-   for (n = 1; n <= max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+   for (n = p_cache->buckets[hash & (p_cache->nbuckets - 1)]; n != -1; n = p_entry->chain) {
+      p_entry = &(p_cache->entries[n]);
+      if (p_entry->hash == hash && p_entry->key_len == key_len && !memcmp((void *) p_entry->key, (void *) key, (size_t) key_len)) {
+         return n;
+      }
    }
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
-
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   return -1;
+}
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+/* Move an entry to the most recently used end of the LRU list (or add it there) */
+int mg_cache_touch(MGCACHE *p_cache, int n, short link)
+{
+   MGCENTRY *p_entry;
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   p_entry = &(p_cache->entries[n]);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   if (!link) {
+      if (p_cache->newest == n) {
+         return 0;
+      }
+      if (p_entry->older != -1)
+         p_cache->entries[p_entry->older].newer = p_entry->newer;
+      else
+         p_cache->oldest = p_entry->newer;
+      p_cache->entries[p_entry->newer].older = p_entry->older;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   p_entry->newer = -1;
+   p_entry->older = p_cache->newest;
+   if (p_cache->newest != -1)
+      p_cache->entries[p_cache->newest].newer = n;
+   else
+      p_cache->oldest = n;
+   p_cache->newest = n;
+
+   return 1;
 }
 
 
-static VALUE ex_m_data(int argc, VALUE *argv, VALUE self)
+int mg_cache_remove(MGCACHE *p_cache, int n)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
-   char ifc[4];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   MGVARGS vargs;
+   int *p_next;
+   MGCENTRY *p_entry;
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
-      return mg_r_nil;
+   p_entry = &(p_cache->entries[n]);
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   for (p_next = &(p_cache->buckets[p_entry->hash & (p_cache->nbuckets - 1)]); *p_next != n; p_next = &(p_cache->entries[*p_next].chain))
+      ;
+   *p_next = p_entry->chain;
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   if (p_entry->older != -1)
+      p_cache->entries[p_entry->older].newer = p_entry->newer;
+   else
+      p_cache->oldest = p_entry->newer;
+   if (p_entry->newer != -1)
+      p_cache->entries[p_entry->newer].older = p_entry->older;
+   else
+      p_cache->newest = p_entry->older;
 
-   MG_FTRACE("m_data");
+   p_cache->bytes -= (p_entry->key_len + p_entry->data_len);
+   mg_free((void *) p_entry->key, 0);
+   p_entry->key = NULL;
+   p_entry->chain = p_cache->free;
+   p_cache->free = n;
+   p_cache->count --;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   return 1;
+}
 
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+
+/* Answer an m_get() or m_data() from the cache: returns Qundef (with the cache epoch for mg_cache_put()) on a miss */
+VALUE mg_cache_get(MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, unsigned long *p_epoch)
+{
+   int n, key_len, prefix, data_len;
+   unsigned long hash;
+   char key[MG_CACHE_MAX_KEY], data[MG_SHM_SLOT];
+   MGCENTRY *p_entry;
+   MGCACHE *p_cache;
+
+   p_cache = p_page->cache;
+   if (!p_cache || !p_cache->nprefix) {
+      return Qundef;
+   }
+
+   /*
+      something other than m_set/m_kill/m_increment may have changed the database through this object: the shared
+      generations are left alone, as each write gives the global it changes a new generation when it is made
+   */
+   if (p_cache->write_seq != p_page->p_srv->write_seq) {
+      for (n = 0; n < p_cache->nprefix; n ++) {
+         p_cache->prefix[n].generation = ++ p_cache->epoch;
+      }
+      p_cache->write_seq = p_page->p_srv->write_seq;
+      p_cache->invalidations ++;
    }
+   *p_epoch = p_cache->epoch;
 
-   mg_request_header(p_page->p_srv, p_buf, "D", MG_PRODUCT);
+   key_len = mg_cache_key(pvargs->cvars, argc, command[0], key);
+   if (key_len < 0 || (prefix = mg_cache_prefix(p_cache, key + 1, key_len - 1)) < 0) {
+      return Qundef;
+   }
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+   hash = mg_cache_hash(key, key_len);
 
-   for (n = 1; n < max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   if (p_cache->shm) {
+      /* the generation of the global, as it stands before the request is sent, is the 'epoch' of any result cached */
+      *p_epoch = __atomic_load_n(&(p_cache->shm->generation[mg_shm_index(&(pvargs->cvars[0]))]), __ATOMIC_ACQUIRE);
+      if (mg_shm_get(p_cache, key, key_len, hash, *p_epoch, data, &data_len)) {
+         p_cache->hits ++;
+         return rb_str_new(data, data_len);
+      }
+      p_cache->misses ++;
+      return Qundef;
+   }
+   if ((n = mg_cache_find(p_cache, key, key_len, hash)) != -1) {
+      p_entry = &(p_cache->entries[n]);
+      if (p_entry->generation == p_cache->prefix[prefix].generation && ((long) (p_entry->expires - mg_current_time_ms())) > 0) {
+         mg_cache_touch(p_cache, n, 0);
+         p_cache->hits ++;
+         return rb_str_new(p_entry->key + p_entry->key_len, p_entry->data_len);
+      }
+      mg_cache_remove(p_cache, n);
    }
+   p_cache->misses ++;
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   return Qundef;
+}
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+/* Cache the result of an m_get() or m_data(), unless the cache was invalidated while the request was in progress */
+int mg_cache_put(MGPAGE *p_page, MGVARGS *pvargs, int argc, char *command, VALUE r_data, unsigned long epoch)
+{
+   int n, key_len, data_len, prefix;
+   unsigned long hash;
+   char key[MG_CACHE_MAX_KEY];
+   MGCENTRY *p_entry;
+   MGCACHE *p_cache;
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   p_cache = p_page->cache;
+   if (!p_cache || !p_cache->nprefix || (!p_cache->shm && epoch != p_cache->epoch) || p_cache->write_seq != p_page->p_srv->write_seq || !RB_TYPE_P(r_data, T_STRING)) {
+      return 0;
+   }
+   data_len = (int) RSTRING_LEN(r_data);
+   if (data_len > MG_CACHE_MAX_DATA) {
+      return 0;
+   }
+   key_len = mg_cache_key(pvargs->cvars, argc, command[0], key);
+   if (key_len < 0 || (prefix = mg_cache_prefix(p_cache, key + 1, key_len - 1)) < 0) {
+      return 0;
+   }
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   hash = mg_cache_hash(key, key_len);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   if (p_cache->shm) {
+      n = mg_shm_put(p_cache, key, key_len, hash, RSTRING_PTR(r_data), data_len, epoch, mg_current_time_ms() + (unsigned long) p_cache->prefix[prefix].ttl);
+      if (n == 2) {
+         p_cache->evictions ++;
+      }
+      return n ? 1 : 0;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   if ((n = mg_cache_find(p_cache, key, key_len, hash)) != -1) {
+      mg_cache_remove(p_cache, n);
+   }
+   if (p_cache->free == -1) {
+      mg_cache_remove(p_cache, p_cache->oldest);
+      p_cache->evictions ++;
+   }
+
+   n = p_cache->free;
+   p_entry = &(p_cache->entries[n]);
+   p_entry->key = (char *) mg_malloc(key_len + data_len + 1, 0);
+   if (!p_entry->key) {
+      return 0;
+   }
+   p_cache->free = p_entry->chain;
+
+   memcpy((void *) p_entry->key, (void *) key, (size_t) key_len);
+   memcpy((void *) (p_entry->key + key_len), (void *) RSTRING_PTR(r_data), (size_t) data_len);
+   p_entry->key_len = key_len;
+   p_entry->data_len = data_len;
+   p_entry->hash = hash;
+   p_entry->generation = p_cache->prefix[prefix].generation;
+   p_entry->expires = mg_current_time_ms() + (unsigned long) p_cache->prefix[prefix].ttl;
+
+   p_entry->chain = p_cache->buckets[hash & (p_cache->nbuckets - 1)];
+   p_cache->buckets[hash & (p_cache->nbuckets - 1)] = n;
+   mg_cache_touch(p_cache, n, 1);
+   p_cache->bytes += (key_len + data_len);
+   p_cache->count ++;
+
+   return 1;
 }
 
 
-static VALUE ex_ma_data(VALUE self, VALUE r_global, VALUE key)
+/*
+   Invalidate the cached key paths above or below a node written by m_set(), m_kill() or m_increment().  If that
+   request was the only write since 'write_seq' (MGSRV.write_seq before it was sent), the rest of the cache stands.
+*/
+int mg_cache_note(MGPAGE *p_page, MGSTR *cvars, int nkeys, unsigned long write_seq)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, len;
-   char *global;
-   char ifc[4];
-   MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
+   int n, key_len, len, result;
+   char key[MG_CACHE_MAX_KEY];
+   MGCACHE *p_cache;
 
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_data' must be an array");
-      return mg_r_nil;
+   p_cache = p_page->cache;
+   if (!p_cache) {
+      return 0;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   result = 0;
+   key_len = mg_cache_key(cvars, nkeys, 0, key);
+   for (n = 0; n < p_cache->nprefix; n ++) {
+      len = (key_len < p_cache->prefix[n].key_len) ? key_len : p_cache->prefix[n].key_len;
+      if (key_len < 0 || !memcmp((void *) p_cache->prefix[n].key, (void *) key, (size_t) len)) {
+         p_cache->prefix[n].generation = ++ p_cache->epoch;
+         result ++;
+      }
+   }
+   if (result) {
+      p_cache->invalidations ++;
+   }
+   /* other processes may cache this global under key paths not registered here */
+   mg_shm_invalidate(p_cache, (nkeys < 1) ? NULL : &(cvars[0]));
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   if (p_cache->write_seq == write_seq && p_page->p_srv->write_seq == (write_seq + 1)) {
+      p_cache->write_seq = p_page->p_srv->write_seq;
+   }
 
-   MG_FTRACE("ma_data");
+   return result;
+}
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+
+/*
+   v2.4.46: attach the cache to a named shared-memory segment, creating it (with room for 'size' results) if need be.
+   The process that creates the segment sizes it, then records the number of slots in its head and marks it with
+   the magic number.  Any other process waits for the mark and takes the number of slots from the head (whatever
+   'size' it asked for), refusing a segment whose size does not match.
+*/
+int mg_shm_open(MGCACHE *p_cache, char *name, int size, char *error)
+{
+#if defined(_WIN32)
+   strcpy(error, "mg_ruby: A shared cache is not available on this platform");
+   return 0;
+#else
+   int fd, n, created;
+   unsigned int nslots;
+   size_t len;
+   struct stat st;
+   void *p;
+
+   created = 1;
+   fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   if (fd == -1 && errno == EEXIST) {
+      created = 0;
+      fd = shm_open(name, O_RDWR, 0600);
+   }
+   if (fd == -1) {
+      sprintf(error, "mg_ruby: Unable to open the shared cache '%s' (%s)", name, strerror(errno));
+      return 0;
+   }
+
+   /* a new segment is zero-filled, which is an empty table */
+   len = sizeof(MGSHMHEAD) + (sizeof(MGSHMSLOT) * size);
+   if (created) {
+      if (ftruncate(fd, (off_t) len) == -1) {
+         sprintf(error, "mg_ruby: Unable to size the shared cache '%s' (%s)", name, strerror(errno));
+         close(fd);
+         shm_unlink(name);
+         return 0;
+      }
+   }
+   else {
+      /* the creator may not have sized it yet */
+      for (n = 0; ; n ++) {
+         if (fstat(fd, &st) == -1) {
+            sprintf(error, "mg_ruby: Unable to size the shared cache '%s' (%s)", name, strerror(errno));
+            close(fd);
+            return 0;
+         }
+         if (st.st_size >= (off_t) (sizeof(MGSHMHEAD) + sizeof(MGSHMSLOT)) || n >= MG_SHM_WAIT) {
+            break;
+         }
+         mg_sleep(1);
+      }
+      len = (size_t) st.st_size;
+      if (len < (sizeof(MGSHMHEAD) + sizeof(MGSHMSLOT))) {
+         sprintf(error, "mg_ruby: '%s' is not an mg_ruby shared cache", name);
+         close(fd);
+         return 0;
+      }
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "D", MG_PRODUCT);
+   p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      sprintf(error, "mg_ruby: Unable to map the shared cache '%s' (%s)", name, strerror(errno));
+      return 0;
+   }
 
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
-   global = mg_get_string(r_global, &p, &len);
+   if (created) {
+      ((MGSHMHEAD *) p)->nslots = (unsigned int) size;
+      __atomic_store_n(&(((MGSHMHEAD *) p)->magic), MG_SHM_MAGIC, __ATOMIC_RELEASE);
+   }
+   else {
+      for (n = 0; __atomic_load_n(&(((MGSHMHEAD *) p)->magic), __ATOMIC_ACQUIRE) != MG_SHM_MAGIC && n < MG_SHM_WAIT; n ++) {
+         mg_sleep(1);
+      }
+      nslots = ((MGSHMHEAD *) p)->nslots;
+      if (__atomic_load_n(&(((MGSHMHEAD *) p)->magic), __ATOMIC_ACQUIRE) != MG_SHM_MAGIC || nslots < 1) {
+         sprintf(error, "mg_ruby: '%s' is not an mg_ruby shared cache", name);
+         munmap(p, len);
+         return 0;
+      }
+      if (len != (sizeof(MGSHMHEAD) + (sizeof(MGSHMSLOT) * nslots))) {
+         sprintf(error, "mg_ruby: The shared cache '%s' is %lu bytes, not the %lu recorded in its head", name, (unsigned long) len, (unsigned long) (sizeof(MGSHMHEAD) + (sizeof(MGSHMSLOT) * nslots)));
+         munmap(p, len);
+         return 0;
+      }
+   }
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+   p_cache->shm = (MGSHMHEAD *) p;
+   p_cache->slots = (MGSHMSLOT *) (p_cache->shm + 1);
+   p_cache->nslots = (int) ((MGSHMHEAD *) p)->nslots;
+   p_cache->shm_size = len;
+   strcpy(p_cache->shm_name, name);
 
-   for (n = 1; n <= max; n ++) {
-      ifc[0] = 0;
-      ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+   return 1;
+#endif
+}
+
+
+/* Detach from the shared segment: it persists for the other processes (and later ones) until it is unlinked */
+int mg_shm_close(MGCACHE *p_cache)
+{
+   if (!p_cache->shm) {
+      return 0;
    }
+#if !defined(_WIN32)
+   munmap((void *) p_cache->shm, p_cache->shm_size);
+#endif
+   p_cache->shm = NULL;
+   p_cache->slots = NULL;
+   p_cache->nslots = 0;
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   return 1;
+}
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+/* The slot in the table of generations for a global name */
+int mg_shm_index(MGSTR *global)
+{
+   return (int) (mg_cache_hash((char *) global->ps, (int) global->size) % MG_SHM_GENERATIONS);
+}
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+/* Give a global (or, for NULL, every global) a new generation, so that the results cached for it by all processes are discarded */
+int mg_shm_invalidate(MGCACHE *p_cache, MGSTR *global)
+{
+   int n;
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+   if (!p_cache->shm) {
+      return 0;
+   }
+   if (global) {
+      n = mg_shm_index(global);
+      __atomic_add_fetch(&(p_cache->shm->generation[n]), 1, __ATOMIC_ACQ_REL);
+      p_cache->shm_written[n] = 1;
+      return 1;
+   }
+   for (n = 0; n < MG_SHM_GENERATIONS; n ++) {
+      __atomic_add_fetch(&(p_cache->shm->generation[n]), 1, __ATOMIC_ACQ_REL);
+   }
+
+   return MG_SHM_GENERATIONS;
+}
+
+
+/*
+   A transaction has been committed (or rolled back): give the globals written since the last one a new generation
+   again, as other processes may have cached the data they held while the transaction was open.
+*/
+int mg_shm_commit(MGCACHE *p_cache)
+{
+   int n, result;
+
+   if (!p_cache || !p_cache->shm) {
+      return 0;
+   }
+
+   result = 0;
+   for (n = 0; n < MG_SHM_GENERATIONS; n ++) {
+      if (p_cache->shm_written[n]) {
+         __atomic_add_fetch(&(p_cache->shm->generation[n]), 1, __ATOMIC_ACQ_REL);
+         p_cache->shm_written[n] = 0;
+         result ++;
+      }
+   }
+
+   return result;
+}
+
+
+/*
+   Look up a result in the shared table.  The slot is read without a lock: the copy is only used if the slot's
+   sequence number was even (no write in progress) and unchanged across the read.  Returns 1 for a current result.
+*/
+int mg_shm_get(MGCACHE *p_cache, char *key, int key_len, unsigned long hash, unsigned long generation, char *data, int *p_data_len)
+{
+   int n, data_len;
+   unsigned long seq, slot_generation, expires;
+   MGSHMSLOT *p_slot;
+
+   for (n = 0; n < MG_SHM_PROBE; n ++) {
+      p_slot = &(p_cache->slots[(hash + n) % p_cache->nslots]);
+      seq = __atomic_load_n(&(p_slot->seq), __ATOMIC_ACQUIRE);
+      if ((seq & 1) || p_slot->hash != hash || p_slot->key_len != key_len || memcmp((void *) p_slot->buffer, (void *) key, (size_t) key_len)) {
+         continue;
+      }
+      data_len = p_slot->data_len;
+      if (data_len < 0 || (key_len + data_len) > (int) sizeof(p_slot->buffer)) {
+         return 0;
+      }
+      memcpy((void *) data, (void *) (p_slot->buffer + key_len), (size_t) data_len);
+      slot_generation = p_slot->generation;
+      expires = p_slot->expires;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&(p_slot->seq), __ATOMIC_RELAXED) != seq) {
+         return 0;
+      }
+      if (slot_generation != generation || ((long) (expires - mg_current_time_ms())) <= 0) {
+         return 0;
+      }
+      *p_data_len = data_len;
+      return 1;
+   }
+
+   return 0;
+}
+
+
+/*
+   Store a result in the shared table: in the slot already holding the key, else an empty slot, else the slot
+   (of those probed) that expires first.  A slot being written by another process is left alone.  Returns 0 if
+   the result was not stored, 1 if it was and 2 if it replaced another result.
+*/
+int mg_shm_put(MGCACHE *p_cache, char *key, int key_len, unsigned long hash, char *data, int data_len, unsigned long generation, unsigned long expires)
+{
+   int n, slot, evict;
+   unsigned long seq;
+   MGSHMSLOT *p_slot;
+
+   if ((key_len + data_len) > (int) sizeof(p_cache->slots[0].buffer)) {
+      return 0;
+   }
+
+   slot = -1;
+   evict = 0;
+   for (n = 0; n < MG_SHM_PROBE; n ++) {
+      p_slot = &(p_cache->slots[(hash + n) % p_cache->nslots]);
+      if (p_slot->key_len == 0 || (p_slot->hash == hash && p_slot->key_len == key_len && !memcmp((void *) p_slot->buffer, (void *) key, (size_t) key_len))) {
+         slot = (int) ((hash + n) % p_cache->nslots);
+         evict = 0;
+         break;
+      }
+      if (slot == -1 || ((long) (p_slot->expires - p_cache->slots[slot].expires)) < 0) {
+         slot = (int) ((hash + n) % p_cache->nslots);
+         evict = 1;
+      }
+   }
+
+   p_slot = &(p_cache->slots[slot]);
+   seq = __atomic_load_n(&(p_slot->seq), __ATOMIC_RELAXED);
+   if ((seq & 1) || !__atomic_compare_exchange_n(&(p_slot->seq), &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return 0;
+   }
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   p_slot->hash = hash;
+   p_slot->generation = generation;
+   p_slot->expires = expires;
+   p_slot->key_len = key_len;
+   p_slot->data_len = data_len;
+   memcpy((void *) p_slot->buffer, (void *) key, (size_t) key_len);
+   memcpy((void *) (p_slot->buffer + key_len), (void *) data, (size_t) data_len);
+
+   __atomic_store_n(&(p_slot->seq), seq + 2, __ATOMIC_RELEASE);
+
+   return evict ? 2 : 1;
+}
+
+
+static VALUE ex_m_get_pool_stats(VALUE self)
+{
+   MGPAGE *p_page;
+   MGPOOL pool;
+   VALUE stats;
+
+   p_page = mg_ppage(self);
+
+   mg_pool_reap(p_page->p_srv, 0);
+
+   mg_enter_critical_section((void *) &(p_page->p_srv->pool.mutex));
+   pool = p_page->p_srv->pool;
+   mg_leave_critical_section((void *) &(p_page->p_srv->pool.mutex));
+
+   stats = rb_hash_new();
+   rb_hash_aset(stats, ID2SYM(rb_intern("size")), INT2NUM(pool.size));
+   rb_hash_aset(stats, ID2SYM(rb_intern("peak")), INT2NUM(pool.peak));
+   rb_hash_aset(stats, ID2SYM(rb_intern("in_use")), INT2NUM(pool.size - pool.free_count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("idle")), INT2NUM(pool.free_count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("min")), INT2NUM(pool.min));
+   rb_hash_aset(stats, ID2SYM(rb_intern("max")), INT2NUM(pool.max));
+   rb_hash_aset(stats, ID2SYM(rb_intern("idle_timeout")), INT2NUM(pool.idle_timeout));
+   rb_hash_aset(stats, ID2SYM(rb_intern("opened")), ULONG2NUM(pool.created_count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("closed")), ULONG2NUM(pool.closed_count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("waits")), ULONG2NUM(pool.wait_count));
+   rb_hash_aset(stats, ID2SYM(rb_intern("timeouts")), ULONG2NUM(pool.timeout_count));
+
+   return stats;
+}
+
+
+static VALUE ex_m_bind_server_api(VALUE self, VALUE r_dbtype_name, VALUE r_path, VALUE r_username, VALUE r_password, VALUE r_env, VALUE r_params)
+{
+   int result, len;
+   char buffer[32];
+   char *dbtype_name, *path, *username, *password, *env, *params;
+   MGPAGE *p_page;
+   VALUE r[32];
+
+   result = 0;
+   p_page = mg_ppage(self);
+
+   dbtype_name = mg_get_string(r_dbtype_name, &r[0], &len);
+   path = mg_get_string(r_path, &r[1], &len);
+   username = mg_get_string(r_username, &r[2], &len);
+   password = mg_get_string(r_password, &r[3], &len);
+   env = mg_get_string(r_env, &r[4], &len);
+   params = mg_get_string(r_params, &r[5], &len);
+
+   strcpy(p_page->p_srv->dbtype_name, dbtype_name);
+   strcpy(p_page->p_srv->shdir, path);
+   strcpy(p_page->p_srv->username, password);
+   strcpy(p_page->p_srv->password, password);
+
+   p_page->p_srv->p_env = (MGBUF *) mg_malloc(sizeof(MGBUF), 0);
+   mg_buf_init(p_page->p_srv->p_env, MG_BUFSIZE, MG_BUFSIZE);
+   mg_buf_cpy(p_page->p_srv->p_env, env, (int) strlen(env));
+
+   result = mg_bind_server_api(p_page->p_srv, 0);
+
+   if (!result) {
+      if (!strlen(p_page->p_srv->error_mess)) {
+         strcpy(p_page->p_srv->error_mess, "The server API is not available on this host");
+      }
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   sprintf(buffer, "%d", result);
+   return rb_str_new2(buffer);
 }
 
 
-static VALUE ex_m_order(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_release_server_api(VALUE self, VALUE args)
 {
-   MGBUF mgbuf, *p_buf;
+   int result;
+   char buffer[32];
+   MGPAGE *p_page;
+
+   result = 0;
+   p_page = mg_ppage(self);
+
+   result = mg_release_server_api(p_page->p_srv, 0);
+
+   sprintf(buffer, "%d", result);
+   return rb_str_new2(buffer);
+}
+
+
+
+static VALUE ex_m_get_last_error(VALUE self)
+{
+
+   return rb_str_new2("");
+
+}
+
+
+static VALUE ex_m_set(int argc, VALUE *argv, VALUE self)
+{
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
+   unsigned long write_seq;
    MGPAGE *p_page;
+   VALUE r_data;
    MGVARGS vargs;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_set");
 
-   MG_FTRACE("m_order");
+   write_seq = p_page->p_srv->write_seq; /* v2.4.46 */
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "O", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "S", vargs.cvars, max)) { /* v2.4.46 */
+      r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_cache_note(p_page, vargs.cvars, max - 1, write_seq);
+      return r_data;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "S", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -939,59 +2137,53 @@ static VALUE ex_m_order(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_cache_note(p_page, vargs.cvars, max - 1, write_seq); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return r_data;
 }
 
 
-static VALUE ex_ma_order(VALUE self, VALUE r_global, VALUE key)
+static VALUE ex_ma_set(VALUE self, VALUE r_global, VALUE key, VALUE r_data)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
-   char *global = NULL;
+   MGBUF *p_buf;
+   int n, max, data_len, len;
    char ifc[4];
+   char *global, *data;
    MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle, len;
+   int chndle;
    MGPAGE *p_page;
    VALUE p;
    VALUE r_nkey[MG_MAX_KEY];
 
-
    if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_order' must be an array");
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_set' must be an array");
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("ma_order");
+   MG_FTRACE("ma_set");
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "O", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "S", MG_PRODUCT);
 
    max = mg_get_keys(key, nkey, r_nkey, NULL);
    global = mg_get_string(r_global, &p, &len);
+   data = mg_get_string(r_data, &p, &data_len);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -1002,57 +2194,65 @@ static VALUE ex_ma_order(VALUE self, VALUE r_global, VALUE key)
       ifc[1] = MG_TX_DATA;
       mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) data, data_len, (short) ifc[0], (short) ifc[1]);
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   p = rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-   mg_set_list_item(key, max, p);
+   return mg_db_response(p_page, chndle, p_buf, Qnil);
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
 }
 
 
-static VALUE ex_m_previous(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_get(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
+   unsigned long epoch;
    MGPAGE *p_page;
+   VALUE r_data;
    MGVARGS vargs;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_get");
 
-   MG_FTRACE("m_previous");
+   if ((r_data = mg_prefetch_get(p_page, &vargs, max)) != Qundef) { /* v2.4.46 */
+      return r_data;
+   }
+   epoch = 0;
+   if ((r_data = mg_cache_get(p_page, &vargs, max, "G", &epoch)) != Qundef) {
+      return r_data;
+   }
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "P", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "G", vargs.cvars, max)) { /* v2.4.46 */
+      r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_cache_put(p_page, &vargs, max, "G", r_data, epoch);
+      return r_data;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "G", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -1066,57 +2266,49 @@ static VALUE ex_m_previous(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   r_data = mg_db_response(p_page, chndle, p_buf, r_data);
+   mg_cache_put(p_page, &vargs, max, "G", r_data, epoch); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return r_data;
 }
 
 
-static VALUE ex_ma_previous(VALUE self, VALUE r_global, VALUE key)
+static VALUE ex_ma_get(VALUE self, VALUE r_global, VALUE key)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max, len;
-   char *global = NULL;
+   char *global;
    char ifc[4];
    MGSTR nkey[MG_MAX_KEY];
-   int chndle, phndle;
+   int chndle;
    MGPAGE *p_page;
-   VALUE p;
+   VALUE r_data;
    VALUE r_nkey[MG_MAX_KEY];
-
+   VALUE p;
 
    if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_order' must be an array");
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_get' must be an array");
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("ma_order");
+   MG_FTRACE("ma_get");
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "P", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
+   mg_request_header(p_page->p_srv, p_buf, "G", MG_PRODUCT);
    max = mg_get_keys(key, nkey, r_nkey, NULL);
    global = mg_get_string(r_global, &p, &len);
 
@@ -1132,55 +2324,52 @@ static VALUE ex_ma_previous(VALUE self, VALUE r_global, VALUE key)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   p = rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-   mg_set_list_item(key, max, p);
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return mg_db_response(p_page, chndle, p_buf, r_data);
 }
 
 
-/* v2.2.41 */
-static VALUE ex_m_increment(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_kill(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
+   unsigned long write_seq;
    MGPAGE *p_page;
+   VALUE r_data;
    MGVARGS vargs;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_kill");
 
-   MG_FTRACE("m_increment");
+   write_seq = p_page->p_srv->write_seq; /* v2.4.46 */
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "I", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "K", vargs.cvars, max)) { /* v2.4.46 */
+      r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_cache_note(p_page, vargs.cvars, max, write_seq);
+      return r_data;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "K", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -1194,108 +2383,120 @@ static VALUE ex_m_increment(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_cache_note(p_page, vargs.cvars, max, write_seq); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return r_data;
 }
 
 
-/* v2.2.41 */
-static VALUE ex_m_tstart(int argc, VALUE *argv, VALUE self)
+static VALUE ex_ma_kill(VALUE self, VALUE r_global, VALUE key)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
+   MGBUF *p_buf;
+   int n, max, len;
+   char *global;
    char ifc[4];
-   int chndle, phndle;
+   MGSTR nkey[MG_MAX_KEY];
+   int chndle;
    MGPAGE *p_page;
-   MGVARGS vargs;
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_kill' must be an array");
       return mg_r_nil;
+   }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
-
-   MG_FTRACE("m_tstart");
+   p_page = mg_ppage(self);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   MG_FTRACE("ma_kill");
 
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "a", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   for (n = 0; n < max; n ++) {
+   mg_request_header(p_page->p_srv, p_buf, "K", MG_PRODUCT);
+
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   global = mg_get_string(r_global, &p, &len);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n <= max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return mg_db_response(p_page, chndle, p_buf, Qnil);
 }
 
 
-static VALUE ex_m_tlevel(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_data(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
+   unsigned long epoch;
    MGPAGE *p_page;
+   VALUE r_data;
    MGVARGS vargs;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_data");
 
-   MG_FTRACE("m_tlevel");
+   epoch = 0;
+   if ((r_data = mg_cache_get(p_page, &vargs, max, "D", &epoch)) != Qundef) { /* v2.4.46 */
+      return r_data;
+   }
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "b", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   for (n = 0; n < max; n ++) {
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "D", vargs.cvars, max)) { /* v2.4.46 */
+      r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_cache_put(p_page, &vargs, max, "D", r_data, epoch);
+      return r_data;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "D", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n < max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
       mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
@@ -1303,107 +2504,118 @@ static VALUE ex_m_tlevel(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_cache_put(p_page, &vargs, max, "D", r_data, epoch); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return r_data;
 }
 
 
-static VALUE ex_m_tcommit(int argc, VALUE *argv, VALUE self)
+static VALUE ex_ma_data(VALUE self, VALUE r_global, VALUE key)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
+   MGBUF *p_buf;
+   int n, max, len;
+   char *global;
    char ifc[4];
-   int chndle, phndle;
+   MGSTR nkey[MG_MAX_KEY];
+   int chndle;
    MGPAGE *p_page;
-   MGVARGS vargs;
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_data' must be an array");
       return mg_r_nil;
+   }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
-
-   MG_FTRACE("m_tcommit");
+   p_page = mg_ppage(self);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   MG_FTRACE("ma_data");
 
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "c", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   for (n = 0; n < max; n ++) {
+   mg_request_header(p_page->p_srv, p_buf, "D", MG_PRODUCT);
+
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   global = mg_get_string(r_global, &p, &len);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n <= max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return mg_db_response(p_page, chndle, p_buf, Qnil);
 }
 
 
-static VALUE ex_m_trollback(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_order(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
    MGPAGE *p_page;
    MGVARGS vargs;
+   VALUE key;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_order");
 
-   MG_FTRACE("m_trollback");
+   if ((key = mg_prefetch_order(p_page, self, max, argv, &vargs, "O")) != Qundef) { /* v2.4.46 */
+      return key;
+   }
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "d", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   for (n = 0; n < max; n ++) {
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "O", vargs.cvars, max)) { /* v2.4.46 */
+      key = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_prefetch_note(p_page, &vargs, max, "O", key);
+      return key;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "O", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n < max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
       mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
@@ -1411,80 +2623,53 @@ static VALUE ex_m_trollback(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-}
-
-
-/* v2.2.41 */
-static VALUE ex_m_sleep(VALUE self, VALUE r_msecs)
-{
-   int msecs;
-
-   msecs = mg_get_integer(r_msecs);
-   mg_sleep((unsigned long) msecs);
-   msecs = 0;
+   key = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_prefetch_note(p_page, &vargs, max, "O", key); /* v2.4.46 */
 
-   return rb_str_new2("");
+   return key;
 }
 
 
-static VALUE ex_ma_merge_to_db(VALUE self, VALUE r_global, VALUE key, VALUE records, VALUE r_options)
+static VALUE ex_ma_order(VALUE self, VALUE r_global, VALUE key)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, mrec, rn, len;
+   MGBUF *p_buf;
+   int n, max;
+   char *global = NULL;
    char ifc[4];
-   char *global, *options, *ps;
    MGSTR nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   int chndle, phndle;
+   int chndle, len;
    MGPAGE *p_page;
+   VALUE p;
+   VALUE r_nkey[MG_MAX_KEY];
 
 
    if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_merge_to_db' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_merge_to_db' must be an array");
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_order' must be an array");
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
-
-   MG_FTRACE("ma_merge_to_db");
-
-   global = mg_get_string(r_global, &p, &len);
-   options = mg_get_string(r_options, &p, &len);
+   p_page = mg_ppage(self);
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   MG_FTRACE("ma_order");
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "M", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "O", MG_PRODUCT);
+
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   global = mg_get_string(r_global, &p, &len);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -1496,262 +2681,181 @@ static VALUE ex_ma_merge_to_db(VALUE self, VALUE r_global, VALUE key, VALUE reco
       mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_AREC;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
-
-   n = 0;
-   for (rn = 0; rn < mrec; rn ++) {
-      p = rb_ary_entry(records, rn);
-      ps = mg_get_string(p, &temp, &len);
-
-      if (rn == 0) {
-         ifc[0] = 0;
-         ifc[1] = MG_TX_AREC_FORMATTED;
-      }
-      mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) ps, len, (short) ifc[0], (short) ifc[1]);
-   }
-   ifc[0] = 0;
-   ifc[1] = MG_TX_EOD;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
-
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) options, (int) strlen((char *) options), (short) ifc[0], (short) ifc[1]);
-
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   p = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_set_list_item(key, max, p);
 
+   return rb_str_dup(p);
 }
 
 
-
-static VALUE ex_ma_merge_from_db(VALUE self, VALUE r_global, VALUE key, VALUE records, VALUE r_options)
+static VALUE ex_m_previous(int argc, VALUE *argv, VALUE self)
 {
-
-   MGBUF mgbuf, *p_buf;
-   int n, max, mrec, len, anybyref;
+   MGBUF *p_buf;
+   int n, max;
    char ifc[4];
-   char *global, *options;
-   MGSTR nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   int chndle, phndle;
+   int chndle;
    MGPAGE *p_page;
+   MGVARGS vargs;
+   VALUE key;
 
-
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_merge_from_db' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_merge_from_db' must be an array");
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
-   }
-
-   phndle = 0;
-   p_page = mg_ppage(phndle);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("ma_merge_from_db");
+   MG_FTRACE("m_previous");
 
-   global = mg_get_string(r_global, &p, &len);
-   options = mg_get_string(r_options, &p, &len);
+   if ((key = mg_prefetch_order(p_page, self, max, argv, &vargs, "P")) != Qundef) { /* v2.4.46 */
+      return key;
+   }
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "m", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "P", vargs.cvars, max)) { /* v2.4.46 */
+      key = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_prefetch_note(p_page, &vargs, max, "P", key);
+      return key;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "P", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
 
-   for (n = 1; n <= max; n ++) {
+   for (n = 1; n < max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
-   anybyref = 1;
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   ifc[0] = 1;
-   ifc[1] = MG_TX_AREC;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
-   ifc[0] = 0;
-   ifc[1] = MG_TX_EOD;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) options, (int) strlen((char *) options), (short) ifc[0], (short) ifc[1]);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   key = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_prefetch_note(p_page, &vargs, max, "P", key); /* v2.4.46 */
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   return key;
+}
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+static VALUE ex_ma_previous(VALUE self, VALUE r_global, VALUE key)
+{
+   MGBUF *p_buf;
+   int n, max, len;
+   char *global = NULL;
+   char ifc[4];
+   MGSTR nkey[MG_MAX_KEY];
+   int chndle;
+   MGPAGE *p_page;
+   VALUE p;
+   VALUE r_nkey[MG_MAX_KEY];
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_order' must be an array");
       return mg_r_nil;
    }
 
-   if (anybyref) {
-      short byref, type, stop;
-      int n, n1, rn, hlen, size, clen, rlen, argc, rec_len;
-      unsigned char *parg, *par;
+   p_page = mg_ppage(self);
 
-      stop = 0;
-      parg = (p_buf->p_buffer + MG_RECV_HEAD);
+   MG_FTRACE("ma_order");
 
-      clen = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
 
-      rlen = 0;
-      argc = 0;
-      for (n = 0;; n ++) {
-         hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-         if ((hlen + size + rlen) > clen) {
-            stop = 1;
-            break;
-         }
-         parg += hlen;
-         rlen += hlen;
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
-}
-*/
-         parg += size;
-         rlen += size;
-         if (type == MG_TX_AREC) {
-            par = parg;
-            rn = 0;
-            rec_len = 0;
-            for (n1 = 0;; n1 ++) {
-               hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-               if ((hlen + size + rlen) > clen) {
-                  stop = 1;
-                  break;
-               }
-               if (type == MG_TX_EOD) {
-                  parg += (hlen + size);
-                  rlen += (hlen + size);
-                  break;
-               }
-               parg += hlen;
-               rlen += hlen;
-               rec_len += hlen;
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n1, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
-}
-*/
-               parg += size;
-               rlen += size;
-               rec_len += size;
-               if (type == MG_TX_DATA) {
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY RECORD %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d; rec_len=%d", n1, argc, hlen, size, byref, type, rlen, clen, rec_len);
-   mg_log_event(par, buffer);
-   *(parg + size) = c;
-}
-*/
-                  p = rb_str_new(par, rec_len);
-                  mg_set_list_item(records, rn ++, p);
+   MG_DB_BUFFER(p_buf);
 
-                  par = parg;
-                  rec_len = 0;
-               }
-            }
-         }
-         if (rlen >= clen || stop)
-            break;
-         argc ++;
-      }
-      if (stop) {
-         MG_ERROR("ma_merge_from_db: Bad return data");
-         return mg_r_nil;
-      }
-      return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   mg_request_header(p_page->p_srv, p_buf, "P", MG_PRODUCT);
+
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
+   global = mg_get_string(r_global, &p, &len);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n <= max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+
+   MG_MEMCHECK("Insufficient memory to process response", 0);
+
+   p = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_set_list_item(key, max, p);
+
+   return rb_str_dup(p);
 }
 
 
-static VALUE ex_m_function(int argc, VALUE *argv, VALUE self)
+/* v2.2.41 */
+static VALUE ex_m_increment(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
+   unsigned long write_seq;
    MGPAGE *p_page;
+   VALUE r_data;
    MGVARGS vargs;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("m_increment");
 
-   MG_FTRACE("m_function");
+   write_seq = p_page->p_srv->write_seq; /* v2.4.46 */
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "X", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, "I", vargs.cvars, max)) { /* v2.4.46 */
+      r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+      mg_cache_note(p_page, vargs.cvars, max - 1, write_seq);
+      return r_data;
+   }
+
+   mg_request_header(p_page->p_srv, p_buf, "I", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
@@ -1765,323 +2869,189 @@ static VALUE ex_m_function(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
-
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   r_data = mg_db_response(p_page, chndle, p_buf, Qnil);
+   mg_cache_note(p_page, vargs.cvars, max - 1, write_seq); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return r_data;
 }
 
 
-static VALUE ex_ma_function(VALUE self, VALUE r_fun, VALUE a_list, VALUE r_argn)
+/* v2.2.41 */
+static VALUE ex_m_tstart(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, an, t, argn, chndle, phndle, len, anybyref, ret_size;
-   int types[32];
-   int byrefs[32];
+   MGBUF *p_buf;
+   int n, max;
    char ifc[4];
-   char bstr[256], bstr1[256];
-   MGSTR properties[MG_MAX_KEY];
-   char *str;
-   char *fun;
-   char *ret;
-   VALUE a;
-   VALUE pstr;
-   VALUE p;
+   int chndle;
    MGPAGE *p_page;
+   MGVARGS vargs;
+
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
 
+   p_page = mg_ppage(self);
 
-   if (mg_type(a_list) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_function' must be an array");
+   MG_FTRACE("m_tstart");
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   MG_DB_BUFFER(p_buf);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   mg_request_header(p_page->p_srv, p_buf, "a", MG_PRODUCT);
 
-   MG_FTRACE("ma_function");
+   for (n = 0; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   }
 
-   fun = mg_get_string(r_fun, &p, &len);
-   argn = mg_get_integer(r_argn);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   pstr = rb_ary_entry(a_list, 0);
-   str = NULL;
-   strcpy(bstr, "");
-   strcpy(bstr1, "");
-   if (pstr)
-      str = mg_get_string(pstr, &p, &len);
-   if (str) {
-      strcpy(bstr, str);
-   }
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-   anybyref = 0;
-   for (an = 1; an < 32; an ++) {
-      if (an < max) {
-         if (properties[an].ps[0] == '1')
-            types[an] = 1;
-         else
-            types[an] = 0;
-         if (properties[an].ps[1] == '1') {
-            byrefs[an] = 1;
-            anybyref = 1;
-         }
-         else
-            byrefs[an] = 0;
-      }
-      else {
-         types[an] = 0;
-         byrefs[an] = 0;
-      }
-   }
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   chndle = 0;
+   return mg_db_response(p_page, chndle, p_buf, Qnil);
+}
 
-   max = 0;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
+static VALUE ex_m_tlevel(int argc, VALUE *argv, VALUE self)
+{
+   MGBUF *p_buf;
+   int n, max;
+   char ifc[4];
+   int chndle;
+   MGPAGE *p_page;
+   MGVARGS vargs;
+
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
-   }
 
-   mg_request_header(p_page->p_srv, p_buf, "X", MG_PRODUCT);
+   p_page = mg_ppage(self);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) fun, (int) strlen((char *) fun), (short) ifc[0], (short) ifc[1]);
+   MG_FTRACE("m_tlevel");
 
-   for (an = 1; an <= argn; an ++) {
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-      str = NULL;
-      pstr = rb_ary_entry(a_list, an);
-      if (pstr) {
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
 
-         if (byrefs[an])
-            ifc[0] = 1;
-         else
-            ifc[0] = 0;
+   MG_DB_BUFFER(p_buf);
 
-         t = mg_type(pstr);
-         if (t == MG_T_LIST) {
+   mg_request_header(p_page->p_srv, p_buf, "b", MG_PRODUCT);
 
-            int max, n;
+   for (n = 0; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   }
 
-            ifc[1] = MG_TX_AREC;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-            ifc[1] = MG_TX_AREC_FORMATTED;
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-            max = mg_get_array_size(pstr);
-            for (n = 0; n < max; n ++) {
-               a = rb_ary_entry(pstr, n);
-               str = mg_get_string(a, &p, &len);
-               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
-            }
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-            ifc[1] = MG_TX_EOD;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-         }
-         else {
-            str = mg_get_string(pstr, &p, &n);
+   return mg_db_response(p_page, chndle, p_buf, Qnil);
+}
 
-            ifc[1] = MG_TX_DATA;
 
-            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
-         }
-      }
-   }
+static VALUE ex_m_tcommit(int argc, VALUE *argv, VALUE self)
+{
+   MGBUF *p_buf;
+   int n, max;
+   char ifc[4];
+   int chndle;
+   MGPAGE *p_page;
+   MGVARGS vargs;
+   VALUE response;
 
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   p_page = mg_ppage(self);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   MG_FTRACE("m_tcommit");
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   if (anybyref) {
-      short byref, type, stop;
-      int n, n1, rn, hlen, size, clen, rlen, argc, rec_len, argoffs;
-      unsigned char *parg, *par;
-
-      ret = p_buf->p_buffer + MG_RECV_HEAD;
-      ret_size = p_buf->data_size - MG_RECV_HEAD;
-
-      argoffs = 2;
-      stop = 0;
-      parg = (p_buf->p_buffer + MG_RECV_HEAD);
+   MG_DB_BUFFER(p_buf);
 
-      clen = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
+   mg_request_header(p_page->p_srv, p_buf, "c", MG_PRODUCT);
 
-      rlen = 0;
-      argc = 0;
-      for (n = 0;; n ++) {
-         hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-         if ((hlen + size + rlen) > clen) {
-            stop = 1;
-            break;
-         }
-         parg += hlen;
-         rlen += hlen;
-         an = argc - argoffs;
+   for (n = 0; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   }
 
-         if (an > 0) {
-            pstr = rb_ary_entry(a_list, an);
-            if (pstr)
-               t = mg_type(pstr);
-         }
-         else
-            pstr = mg_r_nil;
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
-}
-*/
-         if (argc == 0) {
-               ret = parg;
-               ret_size = size;
-         }
-         else if (pstr && type == MG_TX_DATA) {
-            p = rb_str_new(parg, size);
-            mg_set_list_item(a_list, an, p);
-         }
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-         parg += size;
-         rlen += size;
-         if (type == MG_TX_AREC) {
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-            if (pstr && t == MG_T_LIST)
-               mg_kill_list(pstr);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-            par = parg;
-            rn = 0;
-            rec_len = 0;
-            for (n1 = 0;; n1 ++) {
-               hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-               if ((hlen + size + rlen) > clen) {
-                  stop = 1;
-                  break;
-               }
-               if (type == MG_TX_EOD) {
-                  parg += (hlen + size);
-                  rlen += (hlen + size);
-                  break;
-               }
-               parg += hlen;
-               rlen += hlen;
-               rec_len += hlen;
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n1, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
-}
-*/
-               parg += size;
-               rlen += size;
-               rec_len += size;
-               if (type == MG_TX_DATA) {
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY RECORD %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d; rec_len=%d", n1, argc, hlen, size, byref, type, rlen, clen, rec_len);
-   mg_log_event(par, buffer);
-   *(parg + size) = c;
-}
-*/
-                  if (pstr && t == MG_T_LIST) {
-                     p = rb_str_new(par, rec_len);
-                     mg_set_list_item(pstr, rn ++, p);
-                  }
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-                  par = parg;
-                  rec_len = 0;
-               }
-            }
-         }
-         if (rlen >= clen || stop)
-            break;
-         argc ++;
-      }
-      if (stop) {
-         MG_ERROR("ma_function: Bad return data");
-         return mg_r_nil;
-      }
-      return rb_str_new(ret, ret_size);
-   }
+   response = mg_db_response(p_page, chndle, p_buf, Qnil);
 
+   mg_shm_commit(p_page->cache); /* v2.4.46 */
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return response;
 }
 
 
-static VALUE ex_m_classmethod(int argc, VALUE *argv, VALUE self)
+static VALUE ex_m_trollback(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
+   MGBUF *p_buf;
    int n, max;
    char ifc[4];
-   int chndle, phndle;
+   int chndle;
    MGPAGE *p_page;
    MGVARGS vargs;
+   VALUE response;
 
    if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("m_classmethod");
+   MG_FTRACE("m_trollback");
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "x", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
+   mg_request_header(p_page->p_srv, p_buf, "d", MG_PRODUCT);
 
-   for (n = 1; n < max; n ++) {
+   for (n = 0; n < max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
       mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
@@ -2089,369 +3059,400 @@ static VALUE ex_m_classmethod(int argc, VALUE *argv, VALUE self)
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   response = mg_db_response(p_page, chndle, p_buf, Qnil);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   mg_shm_commit(p_page->cache); /* v2.4.46 */
 
-   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
-      int oref;
-      VALUE mclass;
-
-      p_buf->p_buffer[p_buf->data_size] = '\0';
-      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
-
-      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), rb_int_new(phndle));
-
-      return mclass;
-   }
-
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-}
-
-
-/* v2.3.43 */
-void mclass_free(void *data)
-{
-   mg_free(data, 0);
-}
-
-
-size_t mclass_size(const void *data)
-{
-   return sizeof(MGMCLASS);
-}
-
-
-VALUE mclass_alloc(VALUE self)
-{
-   MGMCLASS *pmclass;
-
-   /* allocate */
-   pmclass = (MGMCLASS *) mg_malloc(sizeof(MGMCLASS), 0);
-
-   /* wrap */
-   return TypedData_Wrap_Struct(self, &mclass_type, pmclass);
-}
-
-
-VALUE mclass_m_initialize(VALUE self, VALUE rb_oref, VALUE rb_phndle)
-{
-   MGMCLASS *pmclass;
-   /* unwrap */
-
-   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
-
-   pmclass->oref = NUM2INT(rb_oref);
-   pmclass->phndle = NUM2INT(rb_phndle);
-
-   return self;
+   return response;
 }
 
 
-static VALUE ex_m_mclass()
+/* v2.2.41 */
+static VALUE ex_m_sleep(VALUE self, VALUE r_msecs)
 {
-   VALUE cmclass;
-
-   cmclass = rb_define_class("MCLASS", rb_cObject);
-/*
-   rb_define_method(mg_ruby, "initialize", t_init, 0);
-   rb_define_method(mg_ruby, "add", t_add, 1);
-*/
-   rb_define_alloc_func(cmclass, mclass_alloc);
-
-   rb_define_method(cmclass, "initialize", mclass_m_initialize, 2);
-   rb_define_method(cmclass, "method", ex_mclass_method, -1);
-   rb_define_method(cmclass, "getproperty", ex_mclass_getproperty, 1);
-   rb_define_method(cmclass, "setproperty", ex_mclass_setproperty, 2);
+   int msecs;
 
-   rb_define_method(cmclass, "close", ex_mclass_close, 0);
-/*
-   rb_define_attr(cmclass, "myvar", 1, 1);
-*/
+   msecs = mg_get_integer(r_msecs);
+   mg_sleep((unsigned long) msecs);
+   msecs = 0;
 
-   return cmclass;
+   return rb_str_new2("");
 }
 
 
-/* v2.3.43 */
-static VALUE ex_mclass_method(int argc, VALUE *argv, VALUE self)
+static VALUE ex_ma_merge_to_db(VALUE self, VALUE r_global, VALUE key, VALUE records, VALUE r_options)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max;
+   MGBUF *p_buf;
+   int n, max, mrec, rn, len;
    char ifc[4];
-   char buffer[32];
-   int chndle, phndle;
+   char *global, *options, *ps;
+   MGSTR nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   VALUE temp;
+   VALUE response;
+   int chndle;
+   unsigned long write_seq;
    MGPAGE *p_page;
-   MGVARGS vargs;
-   MGMCLASS *pmclass;
-   /* unwrap */
 
-   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
 
-   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_merge_to_db' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_merge_to_db' must be an array");
       return mg_r_nil;
+   }
 
-   phndle = pmclass->phndle;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("ma_merge_to_db");
 
-   MG_FTRACE("mclass_method");
+   global = mg_get_string(r_global, &p, &len);
+   options = mg_get_string(r_options, &p, &len);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
 
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "j", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   write_seq = p_page->p_srv->write_seq; /* v2.4.46 */
+   mg_request_header(p_page->p_srv, p_buf, "M", MG_PRODUCT);
 
-   sprintf(buffer, "%d", pmclass->oref);
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
 
-   for (n = 0; n < max; n ++) {
+   for (n = 1; n <= max; n ++) {
       ifc[0] = 0;
       ifc[1] = MG_TX_DATA;
-      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_AREC;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   n = 0;
+   for (rn = 0; rn < mrec; rn ++) {
+      p = rb_ary_entry(records, rn);
+      ps = mg_get_string(p, &temp, &len);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+      if (rn == 0) {
+         ifc[0] = 0;
+         ifc[1] = MG_TX_AREC_FORMATTED;
+      }
+      mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) ps, len, (short) ifc[0], (short) ifc[1]);
+   }
+   ifc[0] = 0;
+   ifc[1] = MG_TX_EOD;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) options, (int) strlen((char *) options), (short) ifc[0], (short) ifc[1]);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
-   }
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
-      int oref;
-      VALUE mclass;
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-      p_buf->p_buffer[p_buf->data_size] = '\0';
-      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), rb_int_new(phndle));
+   response = mg_db_response(p_page, chndle, p_buf, Qnil);
 
-      return mclass;
+   /* v2.4.46: the cached results for the key path merged into */
+   if (p_page->cache) {
+      nkey[0].ps = (unsigned char *) global;
+      nkey[0].size = (unsigned int) strlen(global);
+      mg_cache_note(p_page, nkey, max + 1, write_seq);
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   return response;
+
 }
 
 
-static VALUE ex_mclass_getproperty(VALUE self, VALUE r_pname)
+
+static VALUE ex_ma_merge_from_db(VALUE self, VALUE r_global, VALUE key, VALUE records, VALUE r_options)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, len;
+
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, max, mrec, len, anybyref;
    char ifc[4];
-   char buffer[32];
-   int chndle, phndle;
+   char *global, *options;
+   MGSTR nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   int chndle;
    MGPAGE *p_page;
-   MGMCLASS *pmclass;
-   char *cpname;
-   VALUE rpname;
 
-   /* unwrap */
 
-   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_merge_from_db' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_merge_from_db' must be an array");
+      return mg_r_nil;
+   }
 
-   phndle = pmclass->phndle;
-   p_page = mg_ppage(phndle);
+   p_page = mg_ppage(self);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   MG_FTRACE("ma_merge_from_db");
 
-   MG_FTRACE("mclass_getproperty");
+   global = mg_get_string(r_global, &p, &len);
+   options = mg_get_string(r_options, &p, &len);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
 
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "h", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "m", MG_PRODUCT);
 
-   sprintf(buffer, "%d", pmclass->oref);
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) global, (int) strlen((char *) global), (short) ifc[0], (short) ifc[1]);
+
+   for (n = 1; n <= max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, nkey[n].ps, nkey[n].size, (short) ifc[0], (short) ifc[1]);
+   }
+
+   anybyref = 1;
+
+   ifc[0] = 1;
+   ifc[1] = MG_TX_AREC;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_EOD;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
 
-   cpname = mg_get_string(r_pname, &rpname, &len);
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpname, (int) len, (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) options, (int) strlen((char *) options), (short) ifc[0], (short) ifc[1]);
 
    MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
 
    if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
       MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
       return mg_r_nil;
    }
 
-   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
-      int oref;
-      VALUE mclass;
-
-      p_buf->p_buffer[p_buf->data_size] = '\0';
-      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
-
-      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), rb_int_new(phndle));
-
-      return mclass;
-   }
+   if (anybyref) {
+      short byref, type, stop;
+      int n, n1, rn, hlen, size, clen, rlen, argc, rec_len;
+      unsigned char *parg, *par;
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-}
+      stop = 0;
+      parg = (p_buf->p_buffer + MG_RECV_HEAD);
 
+      clen = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
 
-static VALUE ex_mclass_setproperty(VALUE self, VALUE r_pname, VALUE r_pvalue)
+      rlen = 0;
+      argc = 0;
+      for (n = 0;; n ++) {
+         hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
+         if ((hlen + size + rlen) > clen) {
+            stop = 1;
+            break;
+         }
+         parg += hlen;
+         rlen += hlen;
+/*
 {
-   MGBUF mgbuf, *p_buf;
-   int n, len;
-   char ifc[4];
-   char buffer[32];
-   int chndle, phndle;
-   MGPAGE *p_page;
-   MGMCLASS *pmclass;
-   char *cpname, *cpvalue;
-   VALUE rpname, rpvalue;
-
-   /* unwrap */
-
-   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
-
-   phndle = pmclass->phndle;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
-
-   MG_FTRACE("mclass_getproperty");
-
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n, argc, hlen, size, byref, type, rlen, clen);
+   mg_log_event(parg, buffer);
+   *(parg + size) = c;
+}
+*/
+         parg += size;
+         rlen += size;
+         if (type == MG_TX_AREC) {
+            par = parg;
+            rn = 0;
+            rec_len = 0;
+            for (n1 = 0;; n1 ++) {
+               hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
+               if ((hlen + size + rlen) > clen) {
+                  stop = 1;
+                  break;
+               }
+               if (type == MG_TX_EOD) {
+                  parg += (hlen + size);
+                  rlen += (hlen + size);
+                  break;
+               }
+               parg += hlen;
+               rlen += hlen;
+               rec_len += hlen;
+/*
+{
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT ARRAY %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n1, argc, hlen, size, byref, type, rlen, clen);
+   mg_log_event(parg, buffer);
+   *(parg + size) = c;
+}
+*/
+               parg += size;
+               rlen += size;
+               rec_len += size;
+               if (type == MG_TX_DATA) {
+/*
+{
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT ARRAY RECORD %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d; rec_len=%d", n1, argc, hlen, size, byref, type, rlen, clen, rec_len);
+   mg_log_event(par, buffer);
+   *(parg + size) = c;
+}
+*/
+                  p = rb_str_new(par, rec_len);
+                  mg_set_list_item(records, rn ++, p);
 
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+                  par = parg;
+                  rec_len = 0;
+               }
+            }
+         }
+         if (rlen >= clen || stop)
+            break;
+         argc ++;
+      }
+      if (stop) {
+         MG_ERROR("ma_merge_from_db: Bad return data");
+         return mg_r_nil;
+      }
+      return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "i", MG_PRODUCT);
-
-   sprintf(buffer, "%d", pmclass->oref);
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
+   RB_GC_GUARD(response);
+   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
 
-   cpname = mg_get_string(r_pname, &rpname, &len);
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpname, (int) len, (short) ifc[0], (short) ifc[1]);
+}
 
-   cpvalue = mg_get_string(r_pvalue, &rpvalue, &len);
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpvalue, (int) len, (short) ifc[0], (short) ifc[1]);
 
-   MG_MEMCHECK("Insufficient memory to process request", 1);
+static VALUE ex_m_function(int argc, VALUE *argv, VALUE self)
+{
+   MGBUF *p_buf;
+   int n, max;
+   char ifc[4];
+   int chndle;
+   MGPAGE *p_page;
+   VALUE r_data;
+   MGVARGS vargs;
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
 
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   p_page = mg_ppage(self);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   MG_FTRACE("m_function");
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
-      int oref;
-      VALUE mclass;
+   MG_DB_BUFFER(p_buf);
 
-      p_buf->p_buffer[p_buf->data_size] = '\0';
-      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
+   mg_request_header(p_page->p_srv, p_buf, "X", MG_PRODUCT);
 
-      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), rb_int_new(phndle));
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
 
-      return mclass;
+   for (n = 1; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
    }
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
-}
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-static VALUE ex_mclass_close(VALUE self)
-{
-   return rb_str_new("", 0);
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
+
+   MG_MEMCHECK("Insufficient memory to process response", 0);
+
+   return mg_db_response(p_page, chndle, p_buf, r_data);
 }
 
 
-static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALUE a_list, VALUE r_argn)
+static VALUE ex_ma_function(VALUE self, VALUE r_fun, VALUE a_list, VALUE r_argn)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, an, t, argn, chndle, phndle, len, anybyref, ret_size;
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, max, an, t, argn, chndle, len, anybyref, ret_size;
    int types[32];
    int byrefs[32];
    char ifc[4];
    char bstr[256], bstr1[256];
    MGSTR properties[MG_MAX_KEY];
    char *str;
-   char *cclass;
-   char *cmethod;
+   char *fun;
    char *ret;
    VALUE a;
    VALUE pstr;
    VALUE p;
+   VALUE pins;
    MGPAGE *p_page;
 
 
    if (mg_type(a_list) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_classmethod' must be an array");
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_function' must be an array");
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   p_page = mg_ppage(self);
 
-   MG_FTRACE("ma_classmethod");
+   MG_FTRACE("ma_function");
 
-   cclass = mg_get_string(r_cclass, &p, &len);
-   cmethod = mg_get_string(r_cmethod, &p, &len);
+   fun = mg_get_string(r_fun, &p, &len);
    argn = mg_get_integer(r_argn);
 
    pstr = rb_ary_entry(a_list, 0);
@@ -2490,21 +3491,21 @@ static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALU
 
    max = 0;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "x", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cclass, (int) strlen((char *) cclass), (short) ifc[0], (short) ifc[1]);
+   mg_request_header(p_page->p_srv, p_buf, "X", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cmethod, (int) strlen((char *) cmethod), (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) fun, (int) strlen((char *) fun), (short) ifc[0], (short) ifc[1]);
+
+   pins = rb_ary_new(); /* v2.4.46 */
 
    for (an = 1; an <= argn; an ++) {
 
@@ -2540,6 +3541,9 @@ static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALU
          }
          else {
             str = mg_get_string(pstr, &p, &n);
+            if (n >= MG_IOV_MIN) {
+               rb_ary_push(pins, p); /* v2.4.46 */
+            }
 
             ifc[1] = MG_TX_DATA;
 
@@ -2548,19 +3552,21 @@ static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALU
       }
    }
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+   RB_GC_GUARD(pins);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
    MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
 
    if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
       MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
       return mg_r_nil;
    }
 
-
    if (anybyref) {
       short byref, type, stop;
       int n, n1, rn, hlen, size, clen, rlen, argc, rec_len, argoffs;
@@ -2569,7 +3575,7 @@ static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALU
       ret = p_buf->p_buffer + MG_RECV_HEAD;
       ret_size = p_buf->data_size - MG_RECV_HEAD;
 
-      argoffs = 3;
+      argoffs = 2;
       stop = 0;
       parg = (p_buf->p_buffer + MG_RECV_HEAD);
 
@@ -2679,1433 +3685,5835 @@ static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALU
          argc ++;
       }
       if (stop) {
-         MG_ERROR("ma_classmethod: Bad return data");
+         MG_ERROR("ma_function: Bad return data");
          return mg_r_nil;
       }
       return rb_str_new(ret, ret_size);
    }
 
+
+   RB_GC_GUARD(response);
    return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
 }
 
 
-static VALUE ex_ma_html_ex(VALUE self, VALUE r_fun, VALUE a_list, VALUE r_argn)
+static VALUE ex_m_classmethod(int argc, VALUE *argv, VALUE self)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, an, t, argn, chndle, phndle, len;
-   int types[32];
-   int byrefs[32];
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, max;
    char ifc[4];
-   char bstr[256], bstr1[256];
-   MGSTR properties[MG_MAX_KEY];
-   char *str;
-   char *fun;
-   VALUE a;
-   VALUE pstr;
-   VALUE p;
+   int chndle;
    MGPAGE *p_page;
+   VALUE r_data;
+   MGVARGS vargs;
 
-
-   if (mg_type(a_list) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 2 to 'ma_html_ex' must be an array");
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
       return mg_r_nil;
-   }
-
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
-
-   MG_FTRACE("ma_html_ex");
-
-   fun = mg_get_string(r_fun, &p, &len);
-   argn = mg_get_integer(r_argn);
-
-   pstr = rb_ary_entry(a_list, 0);
-   str = NULL;
-   strcpy(bstr, "");
-   strcpy(bstr1, "");
-   if (pstr)
-      str = mg_get_string(pstr, &p, &len);
-   if (str) {
-      strcpy(bstr, str);
-   }
 
-   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
-
-   for (an = 1; an < 32; an ++) {
-      if (an < max) {
-         if (properties[an].ps[0] == '1')
-            types[an] = 1;
-         else
-            types[an] = 0;
-         if (properties[an].ps[1] == '1')
-            byrefs[an] = 1;
-         else
-            byrefs[an] = 0;
-      }
-      else {
-         types[an] = 0;
-         byrefs[an] = 0;
-      }
-   }
+   p_page = mg_ppage(self);
 
-   chndle = 0;
+   MG_FTRACE("m_classmethod");
 
-   max = 0;
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "H", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "x", MG_PRODUCT);
 
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) fun, (int) strlen((char *) fun), (short) ifc[0], (short) ifc[1]);
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, (short) ifc[0], (short) ifc[1]);
 
-   for (an = 1; an <= argn; an ++) {
+   for (n = 1; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   }
 
-      str = NULL;
-      pstr = rb_ary_entry(a_list, an);
-      if (pstr) {
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-         if (byrefs[an])
-            ifc[0] = 1;
-         else
-            ifc[0] = 0;
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-         t = mg_type(pstr);
-         if (t == MG_T_LIST) {
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
 
-            int max, n;
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-            ifc[1] = MG_TX_AREC;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
 
-            ifc[1] = MG_TX_AREC_FORMATTED;
-
-            max = mg_get_array_size(pstr);
-            for (n = 0; n < max; n ++) {
-               a = rb_ary_entry(pstr, n);
-               str = mg_get_string(a, &p, &len);
-               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
-            }
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
+   }
 
-            ifc[1] = MG_TX_EOD;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
+      int oref;
+      VALUE mclass;
 
-         }
-         else {
-            str = mg_get_string(pstr, &p, &n);
+      p_buf->p_buffer[p_buf->data_size] = '\0';
+      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
 
-            ifc[1] = MG_TX_DATA;
+      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), self);
 
-            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
-         }
-      }
+      return mclass;
    }
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   RB_GC_GUARD(response);
+   return mg_response_string(p_buf, r_data);
+}
 
-   return rb_int2inum((long) chndle);
+
+/* v2.4.45 */
+void mclass_mark(void *data)
+{
+   rb_gc_mark(((MGMCLASS *) data)->owner);
 }
 
 
-static VALUE ex_ma_html_classmethod_ex(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALUE a_list, VALUE r_argn)
+/* v2.3.43 */
+void mclass_free(void *data)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, an, t, argn, chndle, phndle, len;
-   int types[32];
-   int byrefs[32];
-   char ifc[4];
-   char bstr[256], bstr1[256];
-   MGSTR properties[MG_MAX_KEY];
-   char *str;
-   char *cclass;
-   char *cmethod;
-   VALUE a;
-   VALUE pstr;
-   VALUE p;
-   MGPAGE *p_page;
+   mg_free(data, 0);
+}
 
 
-   if (mg_type(a_list) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_html_classmethod_ex' must be an array");
+size_t mclass_size(const void *data)
+{
+   return sizeof(MGMCLASS);
+}
+
+
+VALUE mclass_alloc(VALUE self)
+{
+   MGMCLASS *pmclass;
+
+   /* allocate */
+   pmclass = (MGMCLASS *) mg_malloc(sizeof(MGMCLASS), 0);
+   pmclass->owner = Qnil;
+   pmclass->oref = 0;
+
+   /* wrap */
+   return TypedData_Wrap_Struct(self, &mclass_type, pmclass);
+}
+
+
+VALUE mclass_m_initialize(VALUE self, VALUE rb_oref, VALUE rb_owner)
+{
+   MGMCLASS *pmclass;
+   /* unwrap */
+
+   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
+
+   if (!rb_typeddata_is_kind_of(rb_owner, &mg_ruby_type)) { /* v2.4.45 */
+      MG_ERROR("mg_ruby: Argument 2 to 'MCLASS.new' must be an MG_RUBY object");
       return mg_r_nil;
    }
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
+   pmclass->oref = NUM2INT(rb_oref);
+   pmclass->owner = rb_owner;
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   return self;
+}
 
-   MG_FTRACE("ma_html_classmethod_ex");
 
-   cclass = mg_get_string(r_cclass, &p, &len);
-   cmethod = mg_get_string(r_cmethod, &p, &len);
-   argn = mg_get_integer(r_argn);
+static VALUE ex_m_mclass()
+{
+   VALUE cmclass;
 
-   pstr = rb_ary_entry(a_list, 0);
-   str = NULL;
-   strcpy(bstr, "");
-   strcpy(bstr1, "");
-   if (pstr)
-      str = mg_get_string(pstr, &p, &len);
-   if (str) {
-      strcpy(bstr, str);
-   }
+   cmclass = rb_define_class("MCLASS", rb_cObject);
+/*
+   rb_define_method(mg_ruby, "initialize", t_init, 0);
+   rb_define_method(mg_ruby, "add", t_add, 1);
+*/
+   rb_define_alloc_func(cmclass, mclass_alloc);
 
-   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+   rb_define_method(cmclass, "initialize", mclass_m_initialize, 2);
+   rb_define_method(cmclass, "method", ex_mclass_method, -1);
+   rb_define_method(cmclass, "getproperty", ex_mclass_getproperty, 1);
+   rb_define_method(cmclass, "setproperty", ex_mclass_setproperty, 2);
 
-   for (an = 1; an < 32; an ++) {
-      if (an < max) {
-         if (properties[an].ps[0] == '1')
-            types[an] = 1;
-         else
-            types[an] = 0;
-         if (properties[an].ps[1] == '1')
-            byrefs[an] = 1;
-         else
-            byrefs[an] = 0;
-      }
-      else {
-         types[an] = 0;
-         byrefs[an] = 0;
-      }
-   }
+   rb_define_method(cmclass, "close", ex_mclass_close, 0);
+/*
+   rb_define_attr(cmclass, "myvar", 1, 1);
+*/
 
-   chndle = 0;
+   return cmclass;
+}
 
-   max = 0;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
+/* v2.3.43 */
+static VALUE ex_mclass_method(int argc, VALUE *argv, VALUE self)
+{
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, max;
+   char ifc[4];
+   char buffer[32];
+   int chndle;
+   MGPAGE *p_page;
+   VALUE r_data;
+   MGVARGS vargs;
+   MGMCLASS *pmclass;
+   /* unwrap */
+
+   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
+
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
+
+   p_page = mg_ppage(pmclass->owner);
+
+   MG_FTRACE("mclass_method");
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "y", MG_PRODUCT);
+   MG_DB_BUFFER(p_buf);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cclass, (int) strlen((char *) cclass), (short) ifc[0], (short) ifc[1]);
+   mg_request_header(p_page->p_srv, p_buf, "j", MG_PRODUCT);
 
+   sprintf(buffer, "%d", pmclass->oref);
    ifc[0] = 0;
    ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cmethod, (int) strlen((char *) cmethod), (short) ifc[0], (short) ifc[1]);
-
-   for (an = 1; an <= argn; an ++) {
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
 
-      str = NULL;
-      pstr = rb_ary_entry(a_list, an);
-      if (pstr) {
+   for (n = 0; n < max; n ++) {
+      ifc[0] = 0;
+      ifc[1] = MG_TX_DATA;
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, (short) ifc[0], (short) ifc[1]);
+   }
 
-         if (byrefs[an])
-            ifc[0] = 1;
-         else
-            ifc[0] = 0;
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-         t = mg_type(pstr);
-         if (t == MG_T_LIST) {
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-            int max, n;
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
 
-            ifc[1] = MG_TX_AREC;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-            ifc[1] = MG_TX_AREC_FORMATTED;
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
 
-            max = (int) (pstr);
-            for (n = 0; n < max; n ++) {
-               a = rb_ary_entry(pstr, n);
-               str = mg_get_string(a, &p, &len);
-               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
-            }
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
+   }
 
-            ifc[1] = MG_TX_EOD;
-            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
+      int oref;
+      VALUE mclass;
 
-         }
-         else {
-            str = mg_get_string(pstr, &p, &n);
+      p_buf->p_buffer[p_buf->data_size] = '\0';
+      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
 
-            ifc[1] = MG_TX_DATA;
+      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), pmclass->owner);
 
-            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
-         }
-      }
+      return mclass;
    }
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
-
-   return rb_int2inum((long) chndle);
+   RB_GC_GUARD(response);
+   return mg_response_string(p_buf, r_data);
 }
 
 
-static VALUE ex_ma_http_ex(VALUE self, VALUE r_cgi, VALUE r_content)
+static VALUE ex_mclass_getproperty(VALUE self, VALUE r_pname)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, chndle, phndle, len;
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, len;
    char ifc[4];
-   char *str;
-   VALUE a;
-   VALUE p;
+   char buffer[32];
+   int chndle;
    MGPAGE *p_page;
+   VALUE r_data;
+   MGMCLASS *pmclass;
+   char *cpname;
+   VALUE rpname;
 
+   /* unwrap */
 
-   if (mg_type(r_cgi) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_http_ex' must be an array");
-      return mg_r_nil;
-   }
-
-   phndle = 0;
-   p_page = mg_ppage(phndle);
-
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
 
-   MG_FTRACE("ma_http_ex");
+   p_page = mg_ppage(pmclass->owner);
 
-   chndle = 0;
+   MG_FTRACE("mclass_getproperty");
 
-   max = 0;
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
    if (!n) {
       MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
+   MG_DB_BUFFER(p_buf);
+
    mg_request_header(p_page->p_srv, p_buf, "h", MG_PRODUCT);
 
+   sprintf(buffer, "%d", pmclass->oref);
    ifc[0] = 0;
-   ifc[1] = MG_TX_AREC;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
 
-   ifc[1] = MG_TX_AREC_FORMATTED;
+   cpname = mg_get_string(r_pname, &rpname, &len);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpname, (int) len, (short) ifc[0], (short) ifc[1]);
 
-   max = mg_get_array_size(r_cgi);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-   for (n = 0; n < max; n ++) {
-      a = rb_ary_entry(r_cgi, n);
-      str = mg_get_string(a, &p, &len);
-      mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
-   }
-   ifc[1] = MG_TX_EOD;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   str = mg_get_string(r_content, &p, &n);
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data); /* v2.4.45 */
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
+
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
+   }
 
+   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
+      int oref;
+      VALUE mclass;
 
-   return rb_int2inum((long) chndle);
+      p_buf->p_buffer[p_buf->data_size] = '\0';
+      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
 
+      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), pmclass->owner);
+
+      return mclass;
+   }
+
+   RB_GC_GUARD(response);
+   return mg_response_string(p_buf, r_data);
 }
 
 
-static VALUE ex_ma_arg_set(VALUE self, VALUE a_list, VALUE r_argn, VALUE a, VALUE r_by_ref)
+static VALUE ex_mclass_setproperty(VALUE self, VALUE r_pname, VALUE r_pvalue)
 {
-   int n, max, t, argn, by_ref, typ, phndle, len;
-   char buffer[MG_BUFSIZE], error[256], props[256], bstr[256], bstr1[256];
-   MGSTR properties[MG_MAX_KEY];
-   char *str;
-   VALUE p;
-   VALUE pstr;
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, len;
+   char ifc[4];
+   char buffer[32];
+   int chndle;
+   MGPAGE *p_page;
+   MGMCLASS *pmclass;
+   char *cpname, *cpvalue;
+   VALUE rpname, rpvalue;
 
-   *props = '\0';
+   /* unwrap */
 
+   TypedData_Get_Struct(self, MGMCLASS, &mclass_type, pmclass);
 
-   phndle = 0;
+   p_page = mg_ppage(pmclass->owner);
 
-   if (mg_type(a_list) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_arg_set' must be an array");
+   MG_FTRACE("mclass_getproperty");
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   argn = mg_get_integer(r_argn);
-   by_ref = mg_get_integer(r_by_ref);
+   MG_DB_BUFFER(p_buf);
 
-   t = mg_type(a);
+   mg_request_header(p_page->p_srv, p_buf, "i", MG_PRODUCT);
 
-   if (t == MG_T_LIST) {
-      typ = 1;
-   }
-   else {
-      typ = 0;
-   }
+   sprintf(buffer, "%d", pmclass->oref);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
 
-   pstr = 0;
-   if (mg_get_array_size(a_list) > 0)
-      pstr = rb_ary_entry(a_list, 0);
+   cpname = mg_get_string(r_pname, &rpname, &len);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpname, (int) len, (short) ifc[0], (short) ifc[1]);
 
-   str = NULL;
-   strcpy(bstr, "");
-   strcpy(bstr1, "");
+   cpvalue = mg_get_string(r_pvalue, &rpvalue, &len);
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cpvalue, (int) len, (short) ifc[0], (short) ifc[1]);
 
-   if (pstr) {
-      t = mg_type(pstr);
-      if (t == MG_T_STRING) {
-         str = mg_get_string(pstr, &p, &len);
+   MG_MEMCHECK("Insufficient memory to process request", 1);
 
-      }
-   }
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
 
-   if (str) {
-      strcpy(bstr, str);
-   }
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
 
-   strcpy(error, "");
+   MG_MEMCHECK("Insufficient memory to process response", 0);
 
-   n = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
-/*
-{
-   int i;
-   char buffer[256], buf1[256], tmp[256];
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
 
-   sprintf(buffer, "*************************** MA SET max=%d *******************", n);
-   strcpy(buf1, "");
-   for (i = 0; i <= n; i ++) {
-      sprintf(tmp, "i=%d; ps=%s; size=%d;", i, properties[i].ps ? properties[i].ps : "null", properties[i].size);
-      strcat(buf1, tmp);
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
    }
-   mg_log_event(buf1, buffer);
-}
-*/
-   if (n > argn)
-      max = n - 1;
-   else
-      max = argn;
 
-   for (n = 1; n <= max; n ++) {
-      strcat(bstr1, "#");
-      if (n == argn) {
-         sprintf(buffer, "%d%d", typ, by_ref);
-         strcat(bstr1, buffer);
-      }
-      else {
-         if (properties[n].ps)
-            strcat(bstr1, properties[n].ps);
-         else
-            strcat(bstr1, "00");
-      }
+   if (!strncmp((char *) p_buf->p_buffer + 5, "co", 2)) { /* v2.3.43 */
+      int oref;
+      VALUE mclass;
+
+      p_buf->p_buffer[p_buf->data_size] = '\0';
+      oref = (int) strtol(p_buf->p_buffer + MG_RECV_HEAD, NULL, 10);
+
+      mclass = rb_funcall(mg_mclass, rb_intern("new"), 2, rb_int_new(oref), pmclass->owner);
+
+      return mclass;
    }
 
-   pstr = rb_str_new2(bstr1);
-   mg_set_list_item(a_list, 0, pstr);
-   mg_set_list_item(a_list, argn, a);
+   RB_GC_GUARD(response);
+   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+}
 
-   strcpy(buffer, "");
 
-   return rb_str_new2(buffer);
+static VALUE ex_mclass_close(VALUE self)
+{
+   return rb_str_new("", 0);
+}
+
 
+/* v2.4.46 */
+void pipeline_mark(void *data)
+{
+   rb_gc_mark(((MGPIPELINE *) data)->owner);
+   rb_gc_mark(((MGPIPELINE *) data)->written);
 }
 
 
-static VALUE ex_ma_get_stream_data(VALUE self, VALUE r_chndle)
+void pipeline_free(void *data)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, phndle, chndle;
-   MGPAGE *p_page;
+   MGPIPELINE *ppipeline;
 
-   chndle = mg_get_integer(r_chndle);
+   ppipeline = (MGPIPELINE *) data;
 
-   if (chndle < 0) {
-      MG_ERROR("Bad connection handle");
-      return mg_r_nil;
+   mg_buf_free(&(ppipeline->buf));
+   if (ppipeline->offset) {
+      mg_free((void *) ppipeline->offset, 0);
    }
+   mg_free(data, 0);
+}
 
-   phndle = 0;
-   p_page = tp_page[phndle]; /* mg_ppage(phndle); */
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+size_t pipeline_size(const void *data)
+{
+   const MGPIPELINE *ppipeline;
 
-   MG_FTRACE("ma_get_stream_data");
+   ppipeline = (const MGPIPELINE *) data;
 
-   phndle = 0;
-   n = mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   return sizeof(MGPIPELINE) + ppipeline->buf.size + (sizeof(unsigned long) * ppipeline->max);
+}
 
-   if (n < 1) {
-      strcpy(p_buf->p_buffer, "");
-      mg_db_disconnect(p_page->p_srv, chndle, 1);
-      return rb_str_new2(p_buf->p_buffer);
-   }
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+VALUE pipeline_alloc(VALUE self)
+{
+   MGPIPELINE *ppipeline;
+
+   /* allocate */
+   ppipeline = (MGPIPELINE *) mg_malloc(sizeof(MGPIPELINE), 0);
+   if (!ppipeline) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the pipeline");
    }
+   memset((void *) ppipeline, 0, sizeof(MGPIPELINE));
+   ppipeline->owner = Qnil;
+   ppipeline->written = Qnil;
 
-   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+   /* wrap */
+   return TypedData_Wrap_Struct(self, &pipeline_type, ppipeline);
 }
 
 
-
-static VALUE ex_ma_return_to_client(VALUE self, VALUE r_data)
+VALUE pipeline_m_initialize(VALUE self, VALUE rb_owner)
 {
-   char record[MG_BUFSIZE];
-   int phndle, len;
-   VALUE p;
-   char *ps;
-
-   phndle = 0;
+   MGPIPELINE *ppipeline;
+   /* unwrap */
 
-   ps = mg_get_string(r_data, &p, &len);
+   TypedData_Get_Struct(self, MGPIPELINE, &pipeline_type, ppipeline);
 
-   strcpy(record, "\x07");
-   if (ps) {
-      memcpy((void *) record, (void *) ps, len);
-      len ++;
+   if (!rb_typeddata_is_kind_of(rb_owner, &mg_ruby_type)) {
+      MG_ERROR("mg_ruby: Argument 1 to 'MG_PIPELINE.new' must be an MG_RUBY object");
+      return mg_r_nil;
    }
-   else
-      len = 1;
 
-   return rb_str_new2(record);
+   ppipeline->owner = rb_owner;
 
+   return self;
 }
 
 
-static VALUE ex_ma_local_set(VALUE self, VALUE records, VALUE r_index, VALUE key, VALUE data)
+static VALUE ex_m_pipeline_class(void)
 {
-   int result, index, max, mrec, rmax, start, found, rn, n, len;
-   char buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE r_record;
-   VALUE p;
-   VALUE temp;
-   char * ps;
-   MGBUF mgbuf, *p_buf;
+   VALUE cpipeline;
 
-   rmax = 0;
+   cpipeline = rb_define_class("MG_PIPELINE", rb_cObject);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+   rb_define_alloc_func(cpipeline, pipeline_alloc);
 
-   index = mg_get_integer(r_index);
+   rb_define_method(cpipeline, "initialize", pipeline_m_initialize, 1);
+   rb_define_method(cpipeline, "m_set", ex_pipeline_m_set, -1);
+   rb_define_method(cpipeline, "m_get", ex_pipeline_m_get, -1);
+   rb_define_method(cpipeline, "m_kill", ex_pipeline_m_kill, -1);
+   rb_define_method(cpipeline, "m_data", ex_pipeline_m_data, -1);
+   rb_define_method(cpipeline, "m_order", ex_pipeline_m_order, -1);
+   rb_define_method(cpipeline, "m_previous", ex_pipeline_m_previous, -1);
+   rb_define_method(cpipeline, "m_increment", ex_pipeline_m_increment, -1);
+   rb_define_method(cpipeline, "m_function", ex_pipeline_m_function, -1);
+   rb_define_method(cpipeline, "m_size", ex_pipeline_m_size, 0);
+   rb_define_method(cpipeline, "m_execute", ex_pipeline_m_execute, 0);
 
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_set' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_set' must be an array");
-      return mg_r_nil;
-   }
+   return cpipeline;
+}
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, NULL);
 
-   ps = mg_get_string(data, &p, &len);
+/* Queue a request: it is encoded now and sent by m_execute() */
+VALUE mg_pipeline_add(int argc, VALUE *argv, VALUE self, char *command)
+{
+   int n, max;
+   unsigned long offset, *p_offset;
+   MGPAGE *p_page;
+   MGVARGS vargs;
+   MGPIPELINE *ppipeline;
 
-   for (n = 1; n <= max; n ++) {
-      mg_request_add(NULL, -1, p_buf, nkey[n].ps, nkey[n].size, 0, MG_TX_AKEY);
+   TypedData_Get_Struct(self, MGPIPELINE, &pipeline_type, ppipeline);
+
+   if (argc < 1 || argc > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Bad number of arguments");
+      return mg_r_nil;
    }
-   mg_request_add(NULL, -1, p_buf, (unsigned char *) ps, len, 0, MG_TX_DATA);
 
-   r_record = rb_str_new((char *) p_buf->p_buffer, p_buf->data_size);
+   p_page = mg_ppage(ppipeline->owner);
 
-   if (index == -2) {
-      mg_set_list_item(records, mrec, r_record);
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
+
+   if (ppipeline->count == ppipeline->max) {
+      n = ppipeline->max ? (ppipeline->max * 2) : 64;
+      p_offset = (unsigned long *) mg_malloc(sizeof(unsigned long) * n, 0);
+      if (!p_offset) {
+         MG_ERROR("Insufficient memory to process request");
+         return mg_r_nil;
+      }
+      if (ppipeline->offset) {
+         memcpy((void *) p_offset, (void *) ppipeline->offset, sizeof(unsigned long) * ppipeline->count);
+         mg_free((void *) ppipeline->offset, 0);
+      }
+      ppipeline->offset = p_offset;
+      ppipeline->max = n;
    }
-   else if (index > -1) {
-      mg_set_list_item(records, index, r_record);
+   if (!ppipeline->buf.p_buffer) {
+      mg_buf_init(&(ppipeline->buf), MG_BUFSIZE, MG_BUFSIZE);
    }
-   else {
-      found = 0;
-      start = 0;
-
-      for (rn = start; rn < mrec; rn ++) {
-         p = rb_ary_entry(records, rn);
-         ps = mg_get_string(p, &temp, &len);
-         memcpy((void *) buffer, (void *) ps, len);
-         rmax = mg_extract_substrings(rkey, buffer, len, '#', 1, 0, MG_ES_BLOCK);
-         rmax --;
-         if (rmax == max) {
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
 
-               mg_set_list_item(records, rn, r_record);
-               found = 1;
-               break;
-            }
+   if (mg_request_writes(command)) {
+      ppipeline->writes = 1;
+      if (p_page->cache) {
+         if (NIL_P(ppipeline->written)) {
+            ppipeline->written = rb_hash_new();
          }
-      }
-      if (!found) {
-         mg_set_list_item(records, mrec, r_record);
+         rb_hash_aset(ppipeline->written, rb_str_new((char *) vargs.global, (long) vargs.global_len), Qtrue);
       }
    }
-   result = rmax;
+   offset = mg_request_batch_header(p_page->p_srv, &(ppipeline->buf), command, MG_PRODUCT);
+
+   mg_request_add(p_page->p_srv, -1, &(ppipeline->buf), (unsigned char *) vargs.global, (int) vargs.global_len, 0, MG_TX_DATA);
+   for (n = 1; n < max; n ++) {
+      mg_request_add(p_page->p_srv, -1, &(ppipeline->buf), vargs.cvars[n].ps, vargs.cvars[n].size, 0, MG_TX_DATA);
+   }
+
+   mg_request_batch_end(p_page->p_srv, &(ppipeline->buf), offset);
 
-   return rb_str_new(p_buf->p_buffer, p_buf->data_size);
+   ppipeline->offset[ppipeline->count ++] = offset;
 
+   return self;
 }
 
 
-static VALUE  ex_ma_local_get(VALUE self, VALUE records, VALUE r_index, VALUE key)
+/*
+   Append the responses held in the buffer to the results: the text of the first error is returned in 'error'.
+   With 'status' set, the result for each request is 0 if it succeeded or the text of its error instead.
+*/
+int mg_pipeline_results(MGBUF *p_buf, int count, VALUE results, char *error, short status)
 {
-   int index, max, mrec, rmax, start, rn, len;
-   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   char * ps;
-   char * result;
+   int n, len;
+   unsigned long offset, size;
+   char *p;
+   VALUE text;
+
+   offset = 0;
+   for (n = 0; n < count; n ++) {
+      p = (char *) p_buf->p_buffer + offset;
+      if (count == 1) {
+         if (p_buf->data_size < MG_RECV_HEAD) {
+            if (!error[0]) {
+               strcpy(error, "mg_ruby: No response from the database");
+            }
+            rb_ary_push(results, mg_r_nil);
+            break;
+         }
+         size = p_buf->data_size - MG_RECV_HEAD; /* the API does not encode the size of its response */
+      }
+      else {
+         size = (unsigned long) mg_decode_size((unsigned char *) p, 5, MG_CHUNK_SIZE_BASE);
+      }
 
-   rmax = 0;
+      if (!strncmp(p + 5, "ce", 2)) {
+         if (status) {
+            text = rb_str_new(p + MG_RECV_HEAD, (long) size);
+            for (p = RSTRING_PTR(text), len = 0; len < (int) size; len ++) {
+               if (p[len] == '%')
+                  p[len] = '^';
+            }
+            rb_ary_push(results, text);
+         }
+         else {
+            if (!error[0]) {
+               len = (size < 255) ? (int) size : 255;
+               strncpy(error, p + MG_RECV_HEAD, len);
+               error[len] = '\0';
+               for (p = error; *p; p ++) {
+                  if (*p == '%')
+                     *p = '^';
+               }
+            }
+            rb_ary_push(results, mg_r_nil);
+         }
+      }
+      else if (status) {
+         rb_ary_push(results, INT2FIX(0));
+      }
+      else {
+         rb_ary_push(results, rb_str_new(p + MG_RECV_HEAD, (long) size));
+      }
+      offset += (MG_RECV_HEAD + size);
+   }
 
-   result = record;
-   strcpy(record, "");
+   return count;
+}
 
-   index = mg_get_integer(r_index);
 
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_get' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_get' must be an array");
-      return mg_r_nil;
-   }
+static VALUE ex_m_pipeline(VALUE self)
+{
+   VALUE pipeline;
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, record);
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
 
-   if (index > -1) {
-      if (index < mrec) {
-         p = rb_ary_entry(records, index);
-         ps = mg_get_string(p, &temp, &len);
-         memcpy((void *) buffer, (void *) ps, len);
-         rmax = mg_extract_substrings(rkey, buffer, (int) strlen(buffer), '#', 1, 0, MG_ES_BLOCK);
-         result = rkey[rmax].ps;
-         len = rkey[rmax].size;
-      }
-   }
-   else {
-      start = 0;
-      for (rn = start; rn < mrec; rn ++) {
-         p = rb_ary_entry(records, rn);
-         ps = mg_get_string(p, &temp, &len);
-         memcpy((void *) buffer, (void *) ps, len);
-         rmax = mg_extract_substrings(rkey, buffer, len, '#', 1, 0, MG_ES_BLOCK);
-         rmax --;
-         if (rmax == max) {
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
-               result = rkey[rmax + 1].ps;
-               len = rkey[rmax + 1].size;
-               break;
-            }
-         }
-      }
+   if (!rb_block_given_p()) {
+      return pipeline;
    }
 
+   rb_yield(pipeline);
 
-   return rb_str_new(result, len);
+   return ex_pipeline_m_execute(pipeline);
 }
 
 
-static VALUE  ex_ma_local_data(VALUE self, VALUE records, VALUE r_index, VALUE key)
+static VALUE ex_pipeline_m_set(int argc, VALUE *argv, VALUE self)
 {
-   int result, index, max, mrec, rmax, start, rn, data, subs, len;
-   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   char * ps;
+   return mg_pipeline_add(argc, argv, self, "S");
+}
 
-   result = 0;
-   rmax = 0;
 
-   ps = record;
-   strcpy(record, "");
+static VALUE ex_pipeline_m_get(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "G");
+}
 
 
-   index = mg_get_integer(r_index);
+static VALUE ex_pipeline_m_kill(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "K");
+}
 
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_data' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_data' must be an array");
-      return mg_r_nil;
-   }
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, record);
+static VALUE ex_pipeline_m_data(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "D");
+}
 
-   result = 0;
-   if (index > -1) {
-      if (index < mrec) {
-         result = 1;
-      }
-   }
-   else {
-      start = 0;
-      data = 0;
-      subs = 0;
-      for (rn = start; rn < mrec; rn ++) {
-         p = rb_ary_entry(records, rn);
-         ps = mg_get_string(p, &temp, &len);
-         memcpy((void *) buffer, (void *) ps, len);
-         rmax = mg_extract_substrings(rkey, buffer, (int) strlen(buffer), '#', 1, 0, MG_ES_BLOCK);
-         rmax --;
-         if (rmax >= max) {
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
-               if (rmax == max)
-                  data = 1;
-               else
-                  subs = 10;
-               if (data > 0 && subs > 0)
-               break;
-            }
-         }
-      }
-      result = data + subs;
-   }
 
-   return rb_int2inum((long) result);
+static VALUE ex_pipeline_m_order(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "O");
 }
 
 
+static VALUE ex_pipeline_m_previous(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "P");
+}
 
 
-static VALUE  ex_ma_local_kill(VALUE self, VALUE records, VALUE r_index, VALUE key)
+static VALUE ex_pipeline_m_increment(int argc, VALUE *argv, VALUE self)
 {
-   int result, index, max, mrec, rmax, start, rn, len;
-   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   char * ps;
-
-   rmax = 0;
-   result = 0;
+   return mg_pipeline_add(argc, argv, self, "I");
+}
 
-   ps = record;
-   strcpy(record, "");
 
-   index = mg_get_integer(r_index);
+static VALUE ex_pipeline_m_function(int argc, VALUE *argv, VALUE self)
+{
+   return mg_pipeline_add(argc, argv, self, "X");
+}
 
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_kill' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_kill' must be an array");
-      return mg_r_nil;
-   }
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, record);
+static VALUE ex_pipeline_m_size(VALUE self)
+{
+   MGPIPELINE *ppipeline;
 
-   if (index > -1) {
-      if (index < mrec) {
-         mg_kill_list_item(records, index);
-         result ++;
-      }
-   }
-   else {
-      start = 0;
-      for (rn = start; rn < mrec; rn ++) {
-         p = rb_ary_entry(records, rn);
-         ps = mg_get_string(p, &temp, &len);
-         memcpy((void *) buffer, (void *) ps, len);
-         rmax = mg_extract_substrings(rkey, buffer, len, '#', 1, 0, MG_ES_BLOCK);
-         rmax --;
-         if (rmax >= max) {
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
-               mg_kill_list_item(records, rn);
-               result ++;
-            }
-         }
-      }
-   }
+   TypedData_Get_Struct(self, MGPIPELINE, &pipeline_type, ppipeline);
 
-   return rb_int2inum((long) result);
+   return rb_int2inum((long) ppipeline->count);
 }
 
 
-static VALUE  ex_ma_local_order(VALUE self, VALUE records, VALUE r_index, VALUE key)
+static VALUE ex_pipeline_m_execute(VALUE self)
 {
-   int result, index, max, mrec, rmax, start, rn, found, next, len;
-   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   char *vkey, *vrkey, *vrkey1;
-   char * ps;
+   return mg_pipeline_execute(self, 0);
+}
 
-   rmax = 0;
-   result = -1;
-   ps = record;
-   strcpy(record, "");
 
-   index = mg_get_integer(r_index);
+/*
+   Send the queued requests and return their responses (in order) as an array.  The requests are written
+   in batches of about MG_PIPELINE_BATCH bytes so that neither end can block on a full socket buffer.
+   The pipeline is kept alive to the end: m_pipeline { } holds it only on the C stack, and another
+   thread may run the garbage collector while the lock is released for the network.
+*/
+VALUE mg_pipeline_execute(VALUE self, short status)
+{
+   int n, start, end, count, chndle;
+   unsigned long end_offset;
+   char error[256];
+   MGBUF mgbuf, *p_buf;
+   MGPAGE *p_page;
+   MGPIPELINE *ppipeline;
+   VALUE results;
 
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_order' must be an array");
-      return mg_r_nil;
+   TypedData_Get_Struct(self, MGPIPELINE, &pipeline_type, ppipeline);
+
+   results = rb_ary_new_capa((long) ppipeline->count);
+   if (!ppipeline->count) {
+      return results;
    }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_order' must be an array");
+
+   p_page = mg_ppage(ppipeline->owner);
+
+   MG_FTRACE("pipeline_m_execute");
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
       return mg_r_nil;
    }
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, record);
-   vkey = nkey[max].ps;
+   MG_DB_BUFFER(p_buf);
 
-   start = 0;
+   count = ppipeline->count;
+   ppipeline->count = 0;
+   error[0] = '\0';
 
-   if (index > -1) {
-      start = index;
+   /* the count was advanced as the requests were queued: advance it again now that they are processed */
+   if (ppipeline->writes) {
+      p_page->p_srv->write_seq ++;
+      ppipeline->writes = 0;
    }
 
-   found = 0;
-   next = -1;
+   for (start = 0; start < count; start = end) {
+      end = start + 1;
+      if (p_page->p_srv->mode != 2) {
+         while (end < count && ((end + 1 < count ? ppipeline->offset[end + 1] : ppipeline->buf.data_size) - ppipeline->offset[start]) <= MG_PIPELINE_BATCH) {
+            end ++;
+         }
+      }
+      end_offset = (end < count) ? ppipeline->offset[end] : ppipeline->buf.data_size;
+
+      if (p_page->p_srv->mode == 2) {
+         /* the database API processes one request at a time */
+         if (!mg_api_request(p_page->p_srv, chndle, p_buf, ppipeline->buf.p_buffer + ppipeline->offset[start], end_offset - ppipeline->offset[start])) {
+            mg_buf_cpy(p_buf, (char *) ppipeline->buf.p_buffer + ppipeline->offset[start], end_offset - ppipeline->offset[start]);
+            p_page->p_srv->header_len = (int) (strchr((char *) p_buf->p_buffer, '\n') - (char *) p_buf->p_buffer) + 1;
+            mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+         }
+         n = 1;
+      }
+      else {
+         mgbuf.p_buffer = ppipeline->buf.p_buffer + ppipeline->offset[start];
+         mgbuf.data_size = end_offset - ppipeline->offset[start];
+         mgbuf.size = mgbuf.data_size;
+         mgbuf.increment_size = 0;
 
-   for (rn = start; rn < mrec; rn ++) {
-      p = rb_ary_entry(records, rn);
-      ps = mg_get_string(p, &temp, &len);
-      memcpy((void *) buffer, (void *) ps, len);
-      rmax = mg_extract_substrings(rkey, buffer, len, '#', 1, 0, MG_ES_BLOCK);
-      rmax --;
-      if (rmax >= max) {
-         vrkey = rkey[max].ps;
-         if (mg_compare_keys(nkey, rkey, max - 1) == 0) {
+         mg_db_send_nogvl(p_page->p_srv, chndle, &mgbuf, 0);
+         n = mg_db_receive_batch_nogvl(p_page->p_srv, chndle, p_buf, end - start);
+      }
 
-            if (strlen(vkey) == 0 && strlen(vrkey) > 0) {
-               p = rb_str_new2(vrkey);
-               mg_set_list_item(key, max, p);
-               result = rn;
-               break;
-            }
-            if (found == 1 && strcmp(vrkey, vkey)) {
-               p = rb_str_new2(vrkey);
-               mg_set_list_item(key, max, p);
-               result = rn;
-               break;
-            }
-            if (strcmp(vrkey, vkey) > 0) {
-               if (next == -1) {
-                  next = rn;
-                  vrkey1 = vrkey;
-               }
-            }
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
-               found = 1;
-            }
-         }
+      MG_MEMCHECK("Insufficient memory to process response", 0);
+
+      if (n < (end - start)) {
+         strncpy(error, p_page->p_srv->pcon[chndle]->error, 255);
+         error[255] = '\0';
+         mg_db_disconnect(p_page->p_srv, chndle, 0);
+         ppipeline->buf.data_size = 0;
+         mg_pipeline_note(p_page, ppipeline);
+         RB_GC_GUARD(self);
+         MG_ERROR((error[0] ? error : "mg_ruby: Incomplete response to a pipelined request"));
+         return mg_r_nil;
       }
-   }
 
-   if (found == 0 && next != -1) {
-      result = rn;
-      p = rb_str_new2(vrkey1);
-      mg_set_list_item(key, max, p);
+      mg_pipeline_results(p_buf, n, results, error, status);
    }
 
-   if (result == -1) {
-      p = rb_str_new2("");
-      mg_set_list_item(key, max, p);
+   mg_db_disconnect(p_page->p_srv, chndle, 1);
+
+   ppipeline->buf.data_size = 0;
+   mg_pipeline_note(p_page, ppipeline);
+   RB_GC_GUARD(self);
+
+   if (error[0]) {
+      MG_ERROR(error);
+      return mg_r_nil;
    }
 
-   return rb_int2inum((long) result);
+   return results;
 }
 
 
-
-static VALUE  ex_ma_local_previous(VALUE self, VALUE records, VALUE r_index, VALUE key)
+/* The cached results for each global written by the pipeline are invalidated once the writes are made */
+int mg_pipeline_note(MGPAGE *p_page, MGPIPELINE *ppipeline)
 {
-   int result, index, max, mrec, rmax, start, rn, found, next, len;
-   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
-   VALUE r_nkey[MG_MAX_KEY];
-   VALUE p;
-   VALUE temp;
-   char *vkey, *vrkey, *vrkey1;
-   char * ps;
-
-   rmax = 0;
-   result = -1;
-   ps = record;
-   strcpy(record, "");
-
-   index = mg_get_integer(r_index);
-
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_previous' must be an array");
-      return mg_r_nil;
-   }
-   if (mg_type(key) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_previous' must be an array");
-      return mg_r_nil;
+   long n;
+   MGSTR global;
+   VALUE globals, name;
+
+   if (NIL_P(ppipeline->written)) {
+      return 0;
+   }
+   globals = rb_funcall(ppipeline->written, rb_intern("keys"), 0);
+   ppipeline->written = Qnil;
+
+   for (n = 0; n < RARRAY_LEN(globals); n ++) {
+      name = rb_ary_entry(globals, n);
+      global.ps = (unsigned char *) RSTRING_PTR(name);
+      global.size = (unsigned int) RSTRING_LEN(name);
+      if (p_page->cache) {
+         mg_cache_note(p_page, &global, 1, p_page->p_srv->write_seq);
+      }
    }
 
-   mrec = mg_get_array_size(records);
-   max = mg_get_keys(key, nkey, r_nkey, record);
-   vkey = nkey[max].ps;
+   RB_GC_GUARD(globals);
+   return (int) n;
+}
 
-   start = 0;
 
-   if (index == -1) {
-      index = mrec - 1;
+/* v2.4.46 */
+/* Apply a command to each key path in an array: the requests are pipelined so that they share a network round trip */
+VALUE mg_multi(VALUE self, VALUE items, char *command, char *method, short status)
+{
+   long n, max;
+   char error[128];
+   VALUE pipeline, item;
+
+   if (mg_type(items) != MG_T_LIST) {
+      sprintf(error, "mg_ruby: Argument 1 to '%s' must be an array", method);
+      MG_ERROR(error);
+      return mg_r_nil;
    }
 
-   found = 0;
-   next = -1;
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
 
-   for (rn = index; rn >= start; rn --) {
-      p = rb_ary_entry(records, rn);
-      ps = mg_get_string(p, &temp, &len);
-      memcpy((void *) buffer, (void *) ps, len);
-      rmax = mg_extract_substrings(rkey, buffer, len, '#', 1, 0, MG_ES_BLOCK);
-      rmax --;
-      if (rmax >= max) {
-         vrkey = rkey[max].ps;
-         if (mg_compare_keys(nkey, rkey, max - 1) == 0) {
-            if (strlen(vkey) == 0 && strlen(vrkey) > 0) {
-               p = rb_str_new2(vrkey);
-               mg_set_list_item(key, max, p);
-               result = rn;
-               break;
-            }
-            if (found == 1 && strcmp(vrkey, vkey)) {
-               p = rb_str_new2(vrkey);
-               mg_set_list_item(key, max, p);
-               result = rn;
-               break;
-            }
-            if (strcmp(vrkey, vkey) < 0) {
-               if (next == -1) {
-                  next = rn;
-                  vrkey1 = vrkey;
-               }
-            }
-            if (mg_compare_keys(nkey, rkey, max) == 0) {
-               found = 1;
-            }
-         }
+   max = RARRAY_LEN(items);
+   for (n = 0; n < max; n ++) {
+      item = rb_ary_entry(items, n);
+      if (mg_type(item) != MG_T_LIST || RARRAY_LEN(item) < (command[0] == 'S' ? 2 : 1)) {
+         if (command[0] == 'S')
+            sprintf(error, "mg_ruby: Each item passed to '%s' must be an array (global name, subscripts and value)", method);
+         else
+            sprintf(error, "mg_ruby: Each item passed to '%s' must be an array (global name and subscripts)", method);
+         MG_ERROR(error);
+         return mg_r_nil;
       }
+      mg_pipeline_add((int) RARRAY_LEN(item), (VALUE *) RARRAY_CONST_PTR(item), pipeline, command);
    }
 
-   if (found == 0 && next != -1) {
-      result = rn;
-      p = rb_str_new2(vrkey1);
-      mg_set_list_item(key, max, p);
-   }
+   RB_GC_GUARD(items);
+   return mg_pipeline_execute(pipeline, status);
+}
 
-   if (result == -1) {
-      p = rb_str_new2("");
-      mg_set_list_item(key, max, p);
-   }
 
-   return rb_int2inum((long) result);
+static VALUE ex_m_get_multi(VALUE self, VALUE items)
+{
+   return mg_multi(self, items, "G", "m_get_multi", 0);
 }
 
 
-static VALUE  ex_ma_local_sort(VALUE self, VALUE records)
+static VALUE ex_m_set_multi(VALUE self, VALUE items)
 {
-   MGBUF mgbuf, *p_buf;
-   int n, max, chndle, phndle, anybyref, len;
-   char ifc[4];
-   char ret[MG_BUFSIZE], buffer[MG_BUFSIZE];
-   char *str;
-   VALUE a;
-   VALUE p;
-   MGPAGE *p_page;
-
-   if (mg_type(records) != MG_T_LIST) {
-      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_sort' must be an array");
-      return mg_r_nil;
-   }
+   return mg_multi(self, items, "S", "m_set_multi", 1);
+}
 
-   phndle = 0;
-   p_page = mg_ppage(phndle);
 
-   p_buf = &mgbuf;
-   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+static VALUE ex_m_kill_multi(VALUE self, VALUE items)
+{
+   return mg_multi(self, items, "K", "m_kill_multi", 1);
+}
 
-   MG_FTRACE("ma_local_sort");
 
-   chndle = 0;
-   max = 0;
-   anybyref = 1;
+/* v2.4.46 */
+/*
+   Send one of the batched global commands (OB, PB or QB) with its options as the last argument, and return the
+   items in the response.  Returns Qundef if the DB Superserver does not support the command, or reported an error
+   (which the caller reproduces by making the request step by step).
+*/
+VALUE mg_batch_request(VALUE self, char *command, int nargs, VALUE *args, char *options)
+{
+   int chndle, sent;
 
-   n = mg_db_connect(p_page->p_srv, &chndle, 1);
-   if (!n) {
-      MG_ERROR(p_page->p_srv->error_mess);
-      return mg_r_nil;
+   if (mg_ppage(self)->nobatch || nargs < 1 || nargs >= MG_MAX_VARGS) {
+      return Qundef;
    }
 
-   mg_request_header(p_page->p_srv, p_buf, "X", MG_PRODUCT);
+   sent = mg_batch_send(self, command, nargs, args, options, &chndle, 1);
 
-   ifc[0] = 0;
-   ifc[1] = MG_TX_DATA;
-   strcpy(buffer, "sort^%ZMGS");
-   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) buffer, (int) strlen((char *) buffer), (short) ifc[0], (short) ifc[1]);
+   return mg_batch_receive(self, chndle, sent, 0);
+}
 
 
-   ifc[0] = 1;
-   ifc[1] = MG_TX_AREC;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+/*
+   Send a batched global command without waiting for the response.  Returns 1 if the request was sent, 2 if the
+   response is already in the connection's buffer (API mode), or 0 if 'context' includes MG_CONNECT_NOWAIT and no
+   connection is free.  The connection is held until the response is read by mg_batch_receive().
+*/
+int mg_batch_send(VALUE self, char *command, int nargs, VALUE *args, char *options, int *p_chndle, short context)
+{
+   int n, chndle;
+   MGBUF *p_buf;
+   MGPAGE *p_page;
+   MGVARGS vargs;
 
-   ifc[1] = MG_TX_AREC_FORMATTED;
+   p_page = mg_ppage(self);
+   *p_chndle = -1;
 
-   max = mg_get_array_size(records);
-   for (n = 0; n < max; n ++) {
-      a = rb_ary_entry(records, n);
-      str = mg_get_string(a, &p, &len);
-      mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
+   if (nargs < 1 || nargs >= MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts for a batched request");
+      return 0;
    }
-   ifc[1] = MG_TX_EOD;
-   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
 
-   mg_db_send(p_page->p_srv, chndle, p_buf, 1);
-   mg_db_receive(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   mg_get_vargs(nargs, args, &vargs, 0);
+   vargs.cvars[nargs].ps = (unsigned char *) options;
+   vargs.cvars[nargs].size = (int) strlen(options);
 
-   MG_MEMCHECK("Insufficient memory to process response", 0);
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, context);
 
-   mg_db_disconnect(p_page->p_srv, chndle, 1);
+   if (n == MG_POOL_BUSY) {
+      return 0;
+   }
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return 0;
+   }
 
-   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
-      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
-      return mg_r_nil;
+   p_buf = mg_db_buffer(p_page->p_srv, chndle);
+   if (!p_buf) {
+      mg_db_disconnect(p_page->p_srv, chndle, 0);
+      MG_ERROR("Insufficient memory to process request");
+      return 0;
    }
+   *p_chndle = chndle;
 
-   if (anybyref) {
-      short byref, type, stop;
-      int n, n1, rn, hlen, size, clen, rlen, argc, rec_len;
-      unsigned char *parg, *par;
+   if (mg_api_global(p_page->p_srv, chndle, p_buf, command, vargs.cvars, nargs + 1)) {
+      return 2;
+   }
 
-      stop = 0;
-      parg = (p_buf->p_buffer + MG_RECV_HEAD);
+   mg_request_header(p_page->p_srv, p_buf, command, MG_PRODUCT);
+   for (n = 0; n <= nargs; n ++) {
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, 0, MG_TX_DATA);
+   }
 
-      clen = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
+   if (p_page->p_srv->mem_error == 1) {
+      mg_db_disconnect(p_page->p_srv, chndle, 1);
+      MG_ERROR("Insufficient memory to process request");
+      return 0;
+   }
 
-      rlen = 0;
-      argc = 0;
-      for (n = 0;; n ++) {
-         hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-         if ((hlen + size + rlen) > clen) {
-            stop = 1;
-            break;
-         }
-         parg += hlen;
-         rlen += hlen;
-/*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+
+   return 1;
 }
-*/
-         parg += size;
-         rlen += size;
-         if (type == MG_TX_AREC) {
-            par = parg;
-            rn = 0;
-            rec_len = 0;
-            for (n1 = 0;; n1 ++) {
-               hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
-               if ((hlen + size + rlen) > clen) {
-                  stop = 1;
-                  break;
-               }
-               if (type == MG_TX_EOD) {
-                  parg += (hlen + size);
-                  rlen += (hlen + size);
-                  break;
-               }
-               parg += hlen;
-               rlen += hlen;
-               rec_len += hlen;
+
+
 /*
-{
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n1, argc, hlen, size, byref, type, rlen, clen);
-   mg_log_event(parg, buffer);
-   *(parg + size) = c;
-}
+   Read the response to a request sent by mg_batch_send() ('sent' is its return value), return the connection to
+   the pool and return the items in the response.  An error reported by the DB Superserver (or a malformed
+   response) returns Qundef, or is raised if 'raise' is set.
 */
-               parg += size;
-               rlen += size;
-               rec_len += size;
-               if (type == MG_TX_DATA) {
-/*
+VALUE mg_batch_receive(VALUE self, int chndle, int sent, short raise)
 {
-   unsigned char c;
-   char buffer[256];
-   c = *(parg + size);
-   *(parg + size) = '\0';
-   sprintf(buffer, "RESULT ARRAY RECORD %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d; rec_len=%d", n1, argc, hlen, size, byref, type, rlen, clen, rec_len);
-   mg_log_event(par, buffer);
-   *(parg + size) = c;
-}
-*/
+   int size;
+   short byref, type;
+   unsigned long offset, hlen;
+   MGBUF *p_buf, mgbuf;
+   MGPAGE *p_page;
+   VALUE response, items;
 
-                  p = rb_str_new(par, rec_len);
-                  mg_set_list_item(records, rn ++, p);
+   p_page = mg_ppage(self);
 
-                  par = parg;
-                  rec_len = 0;
-               }
-            }
+   if (sent < 1) {
+      return Qundef;
+   }
+
+   p_buf = mg_db_buffer(p_page->p_srv, chndle);
+
+   if (sent == 1) {
+      mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+
+      MG_MEMCHECK("Insufficient memory to process response", 0);
+   }
+
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf);
+   p_buf = &mgbuf;
+
+   if (p_buf->data_size <= MG_RECV_HEAD || strncmp((char *) p_buf->p_buffer + 5, "cv", 2)) {
+      if (raise) {
+         if (p_buf->data_size > MG_RECV_HEAD && !strncmp((char *) p_buf->p_buffer + 5, "ce", 2)) {
+            rb_raise(rb_eRuntimeError, "%.*s", (int) (p_buf->data_size - MG_RECV_HEAD), (char *) p_buf->p_buffer + MG_RECV_HEAD);
          }
-         if (rlen >= clen || stop)
-            break;
-         argc ++;
+         MG_ERROR("mg_ruby: No response to a batched request");
       }
-      if (stop) {
-         MG_ERROR("ma_local_sort: Bad return data");
-         return mg_r_nil;
+      return Qundef;
+   }
+
+   items = rb_ary_new();
+   for (offset = MG_RECV_HEAD; offset < p_buf->data_size; offset += (hlen + size)) {
+      if ((offset + 1 + (p_buf->p_buffer[offset] % 8)) > p_buf->data_size) {
+         items = Qundef;
+         break;
       }
+      hlen = (unsigned long) mg_decode_item_header(p_buf->p_buffer + offset, &size, &byref, &type);
+      if (type != MG_TX_DATA || size < 0 || (offset + hlen + size) > p_buf->data_size) {
+         items = Qundef;
+         break;
+      }
+      rb_ary_push(items, rb_str_new((char *) p_buf->p_buffer + offset + hlen, (long) size));
+   }
+
+   if (items == Qundef && raise) {
+      MG_ERROR("mg_ruby: Malformed response to a batched request");
    }
 
-   return rb_str_new2(ret);
+   RB_GC_GUARD(response);
+   return items;
 }
 
 
-#if defined(_WIN32)
-__declspec(dllexport) void __cdecl Init_mg_ruby() {
-#else
-void Init_mg_ruby() {
-#endif
+/* Whether a pooled connection can be had without waiting (so that one may be held by a request in flight) */
+int mg_pool_spare(MGSRV *p_srv)
+{
+   int spare;
+
+   if (p_srv->mode == 2 || !p_srv->pool.created) {
+      return 0;
+   }
+
+   mg_enter_critical_section((void *) &(p_srv->pool.mutex));
+   spare = ((p_srv->pool.max - p_srv->pool.size) + p_srv->pool.free_count) > 0;
+   mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+
+   return spare;
+}
 
-   mg_ruby = rb_define_class("MG_RUBY", rb_cObject);
 
-   mg_mclass = ex_m_mclass(); /* v2.3.43 */
 /*
-   rb_define_method(mg_ruby, "initialize", t_init, 0);
-   rb_define_method(mg_ruby, "add", t_add, 1);
+   Read the node at item 'offset' of the response to a QB request and advance 'offset' past it.  Returns the
+   number of its subscripts below the head of the subtree (-1 at the end of the response, -2 if it is malformed).
 */
-   rb_define_method(mg_ruby, "m_ext_version", ex_m_ext_version, 0);
+int mg_query_node(VALUE items, long *p_offset, int *p_dvalue, VALUE *p_subs, VALUE *p_value)
+{
+   int nsubs, has_value;
+   long offset, len;
+   VALUE item;
 
-   rb_define_method(mg_ruby, "m_set_host", ex_m_set_host, 4);
-   rb_define_method(mg_ruby, "m_set_uci", ex_m_set_uci, 1);
-   rb_define_method(mg_ruby, "m_set_server", ex_m_set_server, 1);
-   rb_define_method(mg_ruby, "m_set_timeout", ex_m_set_timeout, 1);
+   offset = *p_offset;
+   len = RARRAY_LEN(items);
 
-   rb_define_method(mg_ruby, "m_bind_server_api", ex_m_bind_server_api, 6);
-   rb_define_method(mg_ruby, "m_release_server_api", ex_m_release_server_api, 0);
+   if (offset >= len) {
+      return -1;
+   }
+
+   item = rb_ary_entry(items, offset);
+   if (sscanf(RSTRING_PTR(item), "%d#%d", &nsubs, p_dvalue) != 2 || nsubs < 0 || nsubs >= MG_MAX_VARGS || *p_dvalue < 0) {
+      return -2;
+   }
+   has_value = (*p_dvalue % 10) ? 1 : 0;
+   if ((offset + 1 + nsubs + has_value) > len) {
+      return -2;
+   }
+
+   *p_subs = rb_ary_subseq(items, offset + 1, nsubs);
+   *p_value = has_value ? rb_ary_entry(items, offset + 1 + nsubs) : Qnil;
+   *p_offset = offset + 1 + nsubs + has_value;
+
+   return nsubs;
+}
+
+
+/*
+   Return up to 'count' of the subscripts that follow the last key given (or precede it for command "P"), as
+   [key, value] pairs with 'with_data' (or [key, $data, value] with 'with_data' set to 2).  They are returned
+   by a single OB (or PB) request.  If 'limit' is not nil the walk stops at the first key that collates beyond it.
+*/
+VALUE mg_order_batch(VALUE self, int nargs, VALUE *args, long count, short with_data, char *command, VALUE limit)
+{
+   long n, max, size;
+   int cmp;
+   char options[64];
+   VALUE items, results, key;
+
+   if (count < 1) {
+      return rb_ary_new();
+   }
+
+   sprintf(options, "%ld#%d", count, (int) with_data);
+   items = mg_batch_request(self, command[0] == 'P' ? "PB" : "OB", nargs, args, options);
+
+   size = with_data ? (with_data + 1) : 1;
+   max = (items == Qundef) ? -1 : NUM2LONG(rb_str_to_inum(rb_ary_entry(items, 0), 10, 0));
+   if (max < 0 || max > count || RARRAY_LEN(items) != (1 + (max * size))) {
+      /* an older DB Superserver: make the request step by step */
+      results = mg_order_step(self, nargs, args, count, with_data, command, limit);
+      mg_ppage(self)->nobatch = 1;
+      return results;
+   }
+
+   results = rb_ary_new_capa(max);
+   for (n = 0; n < max; n ++) {
+      key = rb_ary_entry(items, 1 + (n * size));
+      if (!NIL_P(limit)) {
+         cmp = mg_collate(RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(limit), RSTRING_LEN(limit));
+         if (command[0] == 'P' ? (cmp < 0) : (cmp > 0)) {
+            break;
+         }
+      }
+      if (with_data == 2) {
+         rb_ary_push(results, rb_ary_new3(3, key, rb_ary_entry(items, 2 + (n * size)), rb_ary_entry(items, 3 + (n * size))));
+      }
+      else if (with_data) {
+         rb_ary_push(results, rb_assoc_new(key, rb_ary_entry(items, 2 + (n * size))));
+      }
+      else {
+         rb_ary_push(results, key);
+      }
+   }
+
+   RB_GC_GUARD(items);
+   return results;
+}
+
+
+/*
+   mg_order_batch() for a DB Superserver without the batched commands: each step is a request, but the steps share
+   one pipeline and the other requests for a key are sent in the same round trip as its $order.
+*/
+VALUE mg_order_step(VALUE self, int nargs, VALUE *args, long count, short with_data, char *command, VALUE limit)
+{
+   int n;
+   short next;
+   VALUE results, pipeline, flight, key;
+
+   results = rb_ary_new();
+   if (count < 1) {
+      return results;
+   }
+
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+
+   mg_pipeline_add(nargs, args, pipeline, command);
+   flight = mg_pipeline_execute(pipeline, 0);
+   key = rb_ary_entry(flight, 0);
+
+   while (mg_type(key) == MG_T_STRING && RSTRING_LEN(key) > 0) {
+      if (!NIL_P(limit)) {
+         n = mg_collate(RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(limit), RSTRING_LEN(limit));
+         if (command[0] == 'P' ? (n < 0) : (n > 0)) {
+            break;
+         }
+      }
+      args[nargs - 1] = key;
+      next = (RARRAY_LEN(results) + 1) < count ? 1 : 0;
+      if (with_data == 2) {
+         mg_pipeline_add(nargs, args, pipeline, "D");
+      }
+      if (with_data) {
+         mg_pipeline_add(nargs, args, pipeline, "G");
+      }
+      if (next) {
+         mg_pipeline_add(nargs, args, pipeline, command);
+      }
+      if (with_data || next) {
+         flight = mg_pipeline_execute(pipeline, 0);
+      }
+      if (with_data == 2) {
+         rb_ary_push(results, rb_ary_new3(3, key, rb_ary_entry(flight, 0), rb_ary_entry(flight, 1)));
+      }
+      else if (with_data) {
+         rb_ary_push(results, rb_assoc_new(key, rb_ary_entry(flight, 0)));
+      }
+      else {
+         rb_ary_push(results, key);
+      }
+      if (!next) {
+         break;
+      }
+      key = rb_ary_entry(flight, with_data);
+   }
+
+   RB_GC_GUARD(pipeline);
+   return results;
+}
+
+
+static VALUE ex_m_order_batch(int argc, VALUE *argv, VALUE self)
+{
+   int n, nargs;
+   ID kwargs_id[3];
+   VALUE global, subs, kwargs, kwargs_val[3], args[MG_MAX_VARGS], results;
+
+   rb_scan_args(argc, argv, "1*:", &global, &subs, &kwargs);
+
+   kwargs_id[0] = rb_intern("count");
+   kwargs_id[1] = rb_intern("with_data");
+   kwargs_id[2] = rb_intern("reverse");
+   rb_get_kwargs(kwargs, kwargs_id, 1, 2, kwargs_val);
+
+   nargs = (int) RARRAY_LEN(subs) + 1;
+   if (nargs < 2 || nargs > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: 'm_order_batch' requires a global name and at least one subscript");
+      return mg_r_nil;
+   }
+
+   MG_FTRACE("m_order_batch");
+
+   args[0] = global;
+   for (n = 1; n < nargs; n ++) {
+      args[n] = rb_ary_entry(subs, n - 1);
+   }
+
+   results = mg_order_batch(self, nargs, args, NUM2LONG(kwargs_val[0]), (kwargs_val[1] != Qundef && RTEST(kwargs_val[1])) ? 1 : 0, (kwargs_val[2] != Qundef && RTEST(kwargs_val[2])) ? "P" : "O", Qnil);
+
+   RB_GC_GUARD(subs);
+   return results;
+}
+
+
+/*
+   Return the next (or previous) subscript and its data as [key, data]: ["", ""] at the end of the set.  This is a
+   single request for both (OB or PB for one key); in API mode it is a single call to dbx_next_ex() with getdata.
+*/
+VALUE mg_order_data(int argc, VALUE *argv, VALUE self, char *command, char *method)
+{
+   int n;
+   char error[128];
+   VALUE args[MG_MAX_VARGS], results;
+
+   if (argc < 2 || argc > MG_MAX_VARGS) {
+      sprintf(error, "mg_ruby: '%s' requires a global name and at least one subscript", method);
+      MG_ERROR(error);
+      return mg_r_nil;
+   }
+
+   MG_FTRACE(method);
+
+   for (n = 0; n < argc; n ++) {
+      args[n] = argv[n];
+   }
+
+   results = mg_order_batch(self, argc, args, 1, 1, command, Qnil);
+   if (RARRAY_LEN(results) == 0) {
+      return rb_assoc_new(rb_str_new2(""), rb_str_new2(""));
+   }
+
+   return rb_ary_entry(results, 0);
+}
+
+
+static VALUE ex_m_order_data(int argc, VALUE *argv, VALUE self)
+{
+   return mg_order_data(argc, argv, self, "O", "m_order_data");
+}
+
+
+static VALUE ex_m_previous_data(int argc, VALUE *argv, VALUE self)
+{
+   return mg_order_data(argc, argv, self, "P", "m_previous_data");
+}
+
+
+/*
+   Yield the nodes of the subtree at the key path in args (the head included) in batches of up to 'window' nodes,
+   each fetched by a single QB request.  The request for the next batch is sent before the current one is yielded,
+   provided the pool has a connection to spare for the block, so that the DB Superserver is working on it while
+   the block runs.  Returns 0 (having yielded nothing) if the DB Superserver does not support QB.
+*/
+int mg_each_node_batch(VALUE self, int nargs, VALUE *args, int depth, long window)
+{
+   int n, nsubs, dvalue, more, sent, chndle, state;
+   long count, offset;
+   char options[64];
+   MGPAGE *p_page;
+   MGWALK walk;
+   VALUE items, head, subs, value, last, resume[MG_MAX_VARGS];
+
+   p_page = mg_ppage(self);
+
+   sprintf(options, "%ld#%d#%d", window, depth, nargs - 1);
+   items = mg_batch_request(self, "QB", nargs, args, options);
+   if (items == Qundef) {
+      return 0;
+   }
+
+   head = rb_ary_new_from_values(nargs - 1, args + 1);
+   for (n = 0; n < nargs; n ++) {
+      resume[n] = args[n];
+   }
+
+   memset((void *) &walk, 0, sizeof(MGWALK));
+   walk.p_page = p_page;
+   walk.chndle = -1;
+
+   for (state = 0; ; state = 1) {
+      more = 0;
+      last = Qnil;
+      walk.nodes = rb_ary_new();
+      if (RARRAY_LEN(items) < 1 || sscanf(RSTRING_PTR(rb_ary_entry(items, 0)), "%ld#%d", &count, &more) != 2 || count < 0 || count > window) {
+         count = -1;
+      }
+      for (offset = 1, n = 0; n < count; n ++) {
+         if ((nsubs = mg_query_node(items, &offset, &dvalue, &subs, &value)) < 0) {
+            break;
+         }
+         last = subs;
+         if (dvalue % 10) {
+            rb_ary_push(walk.nodes, rb_assoc_new(rb_ary_plus(head, subs), value));
+         }
+      }
+      if (count < 0 || n < count || offset != RARRAY_LEN(items) || (more && (NIL_P(last) || RARRAY_LEN(last) == 0 || (nargs + RARRAY_LEN(last)) >= MG_MAX_VARGS))) {
+         if (!state) {
+            return 0; /* nothing has been yielded: the caller walks the subtree step by step */
+         }
+         MG_ERROR("mg_ruby: Malformed response to a batched request");
+         return 0;
+      }
+
+      /* the next batch starts after the last node of this one */
+      if (more) {
+         for (n = 0; n < RARRAY_LEN(last); n ++) {
+            resume[nargs + n] = rb_ary_entry(last, n);
+         }
+         walk.pending = 0;
+         walk.done = 0;
+         if (mg_pool_spare(p_page->p_srv)) {
+            sent = mg_batch_send(self, "QB", nargs + (int) RARRAY_LEN(last), resume, options, &chndle, (short) (1 | MG_CONNECT_NOWAIT));
+            if (sent == 1) {
+               walk.chndle = chndle;
+               walk.pending = 1;
+            }
+         }
+      }
+
+      rb_ensure(mg_each_node_yield, (VALUE) &walk, mg_each_node_ensure, (VALUE) &walk);
+
+      if (!more) {
+         break;
+      }
+      if (walk.pending) {
+         walk.pending = 0;
+         items = mg_batch_receive(self, walk.chndle, 1, 1);
+      }
+      else {
+         sent = mg_batch_send(self, "QB", nargs + (int) RARRAY_LEN(last), resume, options, &chndle, 1);
+         items = mg_batch_receive(self, chndle, sent, 1);
+      }
+   }
+
+   RB_GC_GUARD(head);
+   RB_GC_GUARD(last);
+   RB_GC_GUARD(walk.nodes);
+   return 1;
+}
+
+
+VALUE mg_each_node_yield(VALUE arg)
+{
+   long n, max;
+   MGWALK *p_walk;
+
+   p_walk = (MGWALK *) arg;
+
+   max = RARRAY_LEN(p_walk->nodes);
+   for (n = 0; n < max; n ++) {
+      rb_yield(rb_ary_entry(p_walk->nodes, n));
+   }
+   p_walk->done = 1;
+
+   return Qnil;
+}
+
+
+/* The block broke out of the walk (or raised): the response to the request in flight will not be read */
+VALUE mg_each_node_ensure(VALUE arg)
+{
+   MGWALK *p_walk;
+
+   p_walk = (MGWALK *) arg;
+
+   if (p_walk->pending && !p_walk->done) {
+      p_walk->pending = 0;
+      if (p_walk->p_page->p_srv->pcon[p_walk->chndle]) {
+         p_walk->p_page->p_srv->pcon[p_walk->chndle]->keep_alive = 0;
+      }
+      mg_db_disconnect(p_walk->p_page->p_srv, p_walk->chndle, 0);
+   }
+
+   return Qnil;
+}
+
+
+/* Yield the nodes below the key path in args depth first, fetching up to 'window' nodes at each level at a time */
+int mg_each_node(VALUE self, int nargs, VALUE *args, int depth, long window)
+{
+   long n, max;
+   int dvalue;
+   VALUE batch, item;
+
+   if (nargs > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: 'each_node' has reached the maximum number of subscripts");
+      return 0;
+   }
+
+   args[nargs - 1] = rb_str_new2("");
+   for (;;) {
+      batch = mg_order_batch(self, nargs, args, window, 2, "O", Qnil);
+      max = RARRAY_LEN(batch);
+      for (n = 0; n < max; n ++) {
+         item = rb_ary_entry(batch, n);
+         args[nargs - 1] = rb_ary_entry(item, 0);
+         dvalue = NUM2INT(rb_str_to_inum(rb_ary_entry(item, 1), 10, 0));
+         if (dvalue % 10) {
+            rb_yield(rb_assoc_new(rb_ary_new_from_values(nargs - 1, args + 1), rb_ary_entry(item, 2)));
+         }
+         if (dvalue >= 10 && depth != 1) {
+            mg_each_node(self, nargs + 1, args, depth > 1 ? depth - 1 : depth, window);
+         }
+      }
+      if (max < window) {
+         break;
+      }
+      args[nargs - 1] = rb_ary_entry(rb_ary_entry(batch, max - 1), 0);
+   }
+
+   RB_GC_GUARD(batch);
+   return 1;
+}
+
+
+/*
+   Enumerate the nodes in a global subtree as [subscripts, value] (depth first, in collating sequence).  Without a
+   block a lazy enumerator is returned.  Memory is bounded by 'prefetch' nodes (or by 'prefetch' nodes for each
+   level being walked by a DB Superserver without the QB command).
+*/
+static VALUE ex_each_node(int argc, VALUE *argv, VALUE self)
+{
+   int n, nargs, depth;
+   long window;
+   ID kwargs_id[2];
+   VALUE global, subs, kwargs, kwargs_val[2], args[MG_MAX_VARGS], pipeline, flight;
+
+   if (!rb_block_given_p()) {
+      return rb_funcall(rb_enumeratorize_with_size_kw(self, ID2SYM(rb_intern("each_node")), argc, argv, 0, RB_PASS_CALLED_KEYWORDS), rb_intern("lazy"), 0);
+   }
+
+   rb_scan_args(argc, argv, "1*:", &global, &subs, &kwargs);
+
+   kwargs_id[0] = rb_intern("depth");
+   kwargs_id[1] = rb_intern("prefetch");
+   rb_get_kwargs(kwargs, kwargs_id, 0, 2, kwargs_val);
+
+   nargs = (int) RARRAY_LEN(subs) + 1;
+   if (nargs >= MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to 'each_node'");
+      return mg_r_nil;
+   }
+
+   depth = 0;
+   if (kwargs_val[0] != Qundef && kwargs_val[0] != ID2SYM(rb_intern("all"))) {
+      depth = NUM2INT(kwargs_val[0]);
+      if (depth < 1) {
+         MG_ERROR("mg_ruby: The depth passed to 'each_node' must be :all or a positive number of levels");
+         return mg_r_nil;
+      }
+   }
+   window = (kwargs_val[1] != Qundef) ? NUM2LONG(kwargs_val[1]) : MG_EACH_NODE_PREFETCH;
+   if (window < 1) {
+      MG_ERROR("mg_ruby: The prefetch window passed to 'each_node' must be at least 1");
+      return mg_r_nil;
+   }
+
+   MG_FTRACE("each_node");
+
+   args[0] = global;
+   for (n = 1; n < nargs; n ++) {
+      args[n] = rb_ary_entry(subs, n - 1);
+   }
+
+   if (mg_each_node_batch(self, nargs, args, depth, window)) {
+      RB_GC_GUARD(subs);
+      return self;
+   }
+
+   /* an older DB Superserver: the node at the head of the subtree, then each level a batch at a time */
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+   mg_pipeline_add(nargs, args, pipeline, "D");
+   mg_pipeline_add(nargs, args, pipeline, "G");
+   flight = mg_pipeline_execute(pipeline, 0);
+   mg_ppage(self)->nobatch = 1;
+   n = NUM2INT(rb_str_to_inum(rb_ary_entry(flight, 0), 10, 0));
+   if (n % 10) {
+      rb_yield(rb_assoc_new(rb_ary_new_from_values(nargs - 1, args + 1), rb_ary_entry(flight, 1)));
+   }
+   if (n >= 10) {
+      mg_each_node(self, nargs + 1, args, depth, window);
+   }
+
+   RB_GC_GUARD(subs);
+   RB_GC_GUARD(pipeline);
+   return self;
+}
+
+
+/*
+   Load the subtree at the key path in args into 'tree' from the nodes returned by QB requests, in $query order:
+   each node is a Hash in the Hash of its parent (the last one at the level above).  A subtree of up to
+   'max_nodes' nodes is read by a single request.  Returns 0 (with 'tree' left empty) if the DB Superserver does
+   not support QB.
+*/
+int mg_get_tree_batch(VALUE self, int nargs, VALUE *args, VALUE tree, long max_nodes)
+{
+   int n, nsubs, dvalue, more, sent, chndle, first;
+   long count, offset, nodes, window;
+   char options[64], error[128];
+   VALUE items, subs, value, node, last, levels[MG_MAX_VARGS], resume[MG_MAX_VARGS];
+
+   window = (max_nodes < MG_TREE_MAX_NODES) ? (max_nodes + 1) : MG_TREE_MAX_NODES;
+   sprintf(options, "%ld#0#%d", window, nargs - 1);
+   items = mg_batch_request(self, "QB", nargs, args, options);
+   if (items == Qundef) {
+      return 0;
+   }
+
+   for (n = 0; n < nargs; n ++) {
+      resume[n] = args[n];
+   }
+   for (n = 0; n < MG_MAX_VARGS; n ++) {
+      levels[n] = Qnil;
+   }
+   levels[0] = tree;
+   nodes = 0;
+
+   for (first = 1; ; first = 0) {
+      more = 0;
+      last = Qnil;
+      if (RARRAY_LEN(items) < 1 || sscanf(RSTRING_PTR(rb_ary_entry(items, 0)), "%ld#%d", &count, &more) != 2 || count < 0 || count > window) {
+         count = -1;
+      }
+      for (offset = 1, n = 0; n < count; n ++) {
+         if ((nsubs = mg_query_node(items, &offset, &dvalue, &subs, &value)) < 0 || (nargs + nsubs) >= MG_MAX_VARGS || (nsubs && NIL_P(levels[nsubs - 1]))) {
+            break;
+         }
+         last = subs;
+         if (nsubs) {
+            node = rb_hash_new();
+            rb_hash_aset(levels[nsubs - 1], rb_ary_entry(subs, nsubs - 1), node);
+            levels[nsubs] = node;
+         }
+         else {
+            node = tree;
+         }
+         if (dvalue % 10) {
+            if (++ nodes > max_nodes) {
+               sprintf(error, "mg_ruby: The subtree passed to 'm_get_tree' has more than %ld nodes", max_nodes);
+               MG_ERROR(error);
+               return 0;
+            }
+            rb_hash_aset(node, ID2SYM(rb_intern("_value")), value);
+         }
+      }
+      if (count < 0 || n < count || offset != RARRAY_LEN(items) || (more && (NIL_P(last) || RARRAY_LEN(last) == 0))) {
+         if (first) {
+            rb_hash_clear(tree);
+            return 0; /* the caller reads the subtree step by step */
+         }
+         MG_ERROR("mg_ruby: Malformed response to a batched request");
+         return 0;
+      }
+      if (!more) {
+         break;
+      }
+
+      /* the next batch starts after the last node of this one */
+      for (n = 0; n < RARRAY_LEN(last); n ++) {
+         resume[nargs + n] = rb_ary_entry(last, n);
+      }
+      sent = mg_batch_send(self, "QB", nargs + (int) RARRAY_LEN(last), resume, options, &chndle, 1);
+      items = mg_batch_receive(self, chndle, sent, 1);
+   }
+
+   RB_GC_GUARD(items);
+   RB_GC_GUARD(last);
+   return 1;
+}
+
+
+/* Load the nodes below the key path in args into 'tree': a Hash keyed by subscript with the data for each node under :_value */
+int mg_get_tree(VALUE self, int nargs, VALUE *args, VALUE tree, long *p_nodes, long max_nodes)
+{
+   long n, max;
+   int dvalue;
+   char error[128];
+   VALUE batch, item, node;
+
+   if (nargs > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: 'm_get_tree' has reached the maximum number of subscripts");
+      return 0;
+   }
+
+   args[nargs - 1] = rb_str_new2("");
+   for (;;) {
+      batch = mg_order_batch(self, nargs, args, MG_EACH_NODE_PREFETCH, 2, "O", Qnil);
+      max = RARRAY_LEN(batch);
+      for (n = 0; n < max; n ++) {
+         item = rb_ary_entry(batch, n);
+         args[nargs - 1] = rb_ary_entry(item, 0);
+         dvalue = NUM2INT(rb_str_to_inum(rb_ary_entry(item, 1), 10, 0));
+         node = rb_hash_new();
+         if (dvalue % 10) {
+            if (++ (*p_nodes) > max_nodes) {
+               sprintf(error, "mg_ruby: The subtree passed to 'm_get_tree' has more than %ld nodes", max_nodes);
+               MG_ERROR(error);
+               return 0;
+            }
+            rb_hash_aset(node, ID2SYM(rb_intern("_value")), rb_ary_entry(item, 2));
+         }
+         rb_hash_aset(tree, args[nargs - 1], node);
+         if (dvalue >= 10) {
+            mg_get_tree(self, nargs + 1, args, node, p_nodes, max_nodes);
+         }
+      }
+      if (max < MG_EACH_NODE_PREFETCH) {
+         break;
+      }
+      args[nargs - 1] = rb_ary_entry(rb_ary_entry(batch, max - 1), 0);
+   }
+
+   RB_GC_GUARD(batch);
+   return 1;
+}
+
+
+/*
+   Return the subtree below a key path as nested Hashes.  The nodes are read by a single QB request (or one for
+   each batch of nodes in a large subtree).  A DB Superserver without QB is walked a level at a time, with the
+   $data and data for a batch of keys fetched by one request.
+*/
+static VALUE ex_m_get_tree(int argc, VALUE *argv, VALUE self)
+{
+   int n, nargs;
+   long nodes, max_nodes;
+   char error[128];
+   ID kwargs_id[1];
+   VALUE global, subs, kwargs, kwargs_val[1], args[MG_MAX_VARGS], pipeline, flight, tree;
+
+   rb_scan_args(argc, argv, "1*:", &global, &subs, &kwargs);
+
+   kwargs_id[0] = rb_intern("max_nodes");
+   rb_get_kwargs(kwargs, kwargs_id, 0, 1, kwargs_val);
+
+   nargs = (int) RARRAY_LEN(subs) + 1;
+   if (nargs >= MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to 'm_get_tree'");
+      return mg_r_nil;
+   }
+   max_nodes = (kwargs_val[0] != Qundef) ? NUM2LONG(kwargs_val[0]) : MG_TREE_MAX_NODES;
+
+   MG_FTRACE("m_get_tree");
+
+   args[0] = global;
+   for (n = 1; n < nargs; n ++) {
+      args[n] = rb_ary_entry(subs, n - 1);
+   }
+
+   tree = rb_hash_new();
+   nodes = 0;
+
+   if (mg_get_tree_batch(self, nargs, args, tree, max_nodes)) {
+      RB_GC_GUARD(subs);
+      return tree;
+   }
+
+   /* an older DB Superserver */
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+   mg_pipeline_add(nargs, args, pipeline, "D");
+   mg_pipeline_add(nargs, args, pipeline, "G");
+   flight = mg_pipeline_execute(pipeline, 0);
+   mg_ppage(self)->nobatch = 1;
+   n = NUM2INT(rb_str_to_inum(rb_ary_entry(flight, 0), 10, 0));
+   if (n % 10) {
+      if (++ nodes > max_nodes) {
+         sprintf(error, "mg_ruby: The subtree passed to 'm_get_tree' has more than %ld nodes", max_nodes);
+         MG_ERROR(error);
+         return mg_r_nil;
+      }
+      rb_hash_aset(tree, ID2SYM(rb_intern("_value")), rb_ary_entry(flight, 1));
+   }
+   if (n >= 10) {
+      mg_get_tree(self, nargs + 1, args, tree, &nodes, max_nodes);
+   }
+
+   RB_GC_GUARD(subs);
+   RB_GC_GUARD(pipeline);
+   return tree;
+}
+
+
+/* rb_hash_foreach() callback: queue a set for the data under :_value and for each leaf, and descend into each Hash */
+int mg_set_tree(VALUE key, VALUE value, VALUE arg)
+{
+   MGTREE *p_tree, tree;
+
+   p_tree = (MGTREE *) arg;
+
+   if (key == ID2SYM(rb_intern("_value"))) {
+      p_tree->args[p_tree->nargs] = value;
+      mg_pipeline_add(p_tree->nargs + 1, p_tree->args, p_tree->pipeline, "S");
+      p_tree->nodes ++;
+      return ST_CONTINUE;
+   }
+
+   if ((p_tree->nargs + 2) > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: The Hash passed to 'm_set_tree' is nested too deeply");
+      return ST_STOP;
+   }
+
+   p_tree->args[p_tree->nargs] = SYMBOL_P(key) ? rb_sym2str(key) : key;
+   if (RB_TYPE_P(value, T_HASH)) {
+      tree = *p_tree;
+      tree.nargs ++;
+      tree.nodes = 0;
+      rb_hash_foreach(value, mg_set_tree, (VALUE) &tree);
+      p_tree->nodes += tree.nodes;
+   }
+   else {
+      p_tree->args[p_tree->nargs + 1] = value;
+      mg_pipeline_add(p_tree->nargs + 2, p_tree->args, p_tree->pipeline, "S");
+      p_tree->nodes ++;
+   }
+
+   return ST_CONTINUE;
+}
+
+
+/*
+   Store a nested Hash (in the form returned by m_get_tree) below a key path, optionally deleting the subtree
+   first.  The sets are pipelined so that a document is written in a single round trip for each MG_PIPELINE_BATCH
+   bytes.  Returns the number of nodes set.
+*/
+static VALUE ex_m_set_tree(int argc, VALUE *argv, VALUE self)
+{
+   int n, nargs;
+   ID kwargs_id[1];
+   MGTREE tree;
+   VALUE global, rest, kwargs, kwargs_val[1], args[MG_MAX_VARGS], hash;
+
+   rb_scan_args(argc, argv, "2*:", &global, &hash, &rest, &kwargs);
+
+   kwargs_id[0] = rb_intern("kill_first");
+   rb_get_kwargs(kwargs, kwargs_id, 0, 1, kwargs_val);
+
+   /* the Hash follows the subscripts */
+   if (RARRAY_LEN(rest) > 0) {
+      rb_ary_unshift(rest, hash);
+      hash = rb_ary_pop(rest);
+   }
+   if (!RB_TYPE_P(hash, T_HASH)) {
+      MG_ERROR("mg_ruby: The last argument to 'm_set_tree' must be a Hash");
+      return mg_r_nil;
+   }
+
+   nargs = (int) RARRAY_LEN(rest) + 1;
+   if (nargs >= MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to 'm_set_tree'");
+      return mg_r_nil;
+   }
+
+   MG_FTRACE("m_set_tree");
+
+   args[0] = global;
+   for (n = 1; n < nargs; n ++) {
+      args[n] = rb_ary_entry(rest, n - 1);
+   }
+
+   tree.pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+   tree.args = args;
+   tree.nargs = nargs;
+   tree.nodes = 0;
+
+   if (kwargs_val[0] != Qundef && RTEST(kwargs_val[0])) {
+      mg_pipeline_add(nargs, args, tree.pipeline, "K");
+   }
+   rb_hash_foreach(hash, mg_set_tree, (VALUE) &tree);
+
+   mg_pipeline_execute(tree.pipeline, 0);
+
+   RB_GC_GUARD(rest);
+   RB_GC_GUARD(hash);
+   RB_GC_GUARD(tree.pipeline);
+   return rb_int2inum(tree.nodes);
+}
+
+
+/*
+   Choose up to 'partitions - 1' boundaries that split the keys at the last level of args into ranges.  They are
+   chosen evenly by rank from a sample of real keys, read a round trip at a time: the first and last keys (and
+   either side of the boundary between the numeric and string parts of the collating sequence) and their
+   neighbours, then for each gap between the keys sampled so far, the keys that follow the points interpolated
+   across it.  Sampling stops when MG_SCAN_SAMPLES keys per partition are known, or a round adds none.
+*/
+VALUE mg_scan_bounds(VALUE self, int nargs, VALUE *args, int partitions)
+{
+   int n, round, samples;
+   long i, max, m, points;
+   VALUE bounds, pipeline, flight, keys, key, gap;
+
+   bounds = rb_ary_new();
+   if (partitions < 2) {
+      return bounds;
+   }
+   samples = partitions * MG_SCAN_SAMPLES;
+
+   pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+   args[nargs - 1] = rb_str_new2("");
+   mg_pipeline_add(nargs, args, pipeline, "O");
+   args[nargs - 1] = rb_str_new2("\001"); /* before all strings other than those starting $c(0) */
+   mg_pipeline_add(nargs, args, pipeline, "P");
+   mg_pipeline_add(nargs, args, pipeline, "O");
+   args[nargs - 1] = rb_str_new2("");
+   mg_pipeline_add(nargs, args, pipeline, "P");
+   flight = mg_pipeline_execute(pipeline, 0);
+
+   keys = mg_scan_merge(rb_ary_new(), flight);
+
+   for (round = 0; round < MG_SCAN_ROUNDS && RARRAY_LEN(keys) > 1 && RARRAY_LEN(keys) < samples; round ++) {
+      max = RARRAY_LEN(keys);
+      points = (samples / (max - 1)) + 1;
+      pipeline = rb_funcall(mg_pipeline, rb_intern("new"), 1, self);
+      for (i = 0; i < (max - 1); i ++) {
+         if (!round) {
+            args[nargs - 1] = rb_ary_entry(keys, i);
+            mg_pipeline_add(nargs, args, pipeline, "O");
+         }
+         gap = mg_scan_points(rb_ary_entry(keys, i), rb_ary_entry(keys, i + 1), points);
+         for (m = 0; m < RARRAY_LEN(gap); m ++) {
+            args[nargs - 1] = rb_ary_entry(gap, m);
+            mg_pipeline_add(nargs, args, pipeline, "O");
+         }
+         if (!round) {
+            args[nargs - 1] = rb_ary_entry(keys, i + 1);
+            mg_pipeline_add(nargs, args, pipeline, "P");
+         }
+      }
+      flight = mg_pipeline_execute(pipeline, 0);
+      flight = mg_scan_merge(keys, flight);
+      if (RARRAY_LEN(flight) == max) {
+         break;
+      }
+      keys = flight;
+   }
+
+   /* the keys that divide the sample into 'partitions' runs of equal length (none of which may be the last key) */
+   max = RARRAY_LEN(keys);
+   for (n = 1; n < partitions && max > 1; n ++) {
+      m = (max < partitions) ? (n - 1) : ((n * max) / partitions);
+      if (m >= (max - 1)) {
+         break;
+      }
+      key = rb_ary_entry(keys, m);
+      rb_ary_push(bounds, key);
+   }
+
+   RB_GC_GUARD(pipeline);
+   RB_GC_GUARD(keys);
+   return bounds;
+}
+
+
+/* Merge the keys probed with those sampled so far (in collating sequence) and discard repeats */
+VALUE mg_scan_merge(VALUE keys, VALUE probed)
+{
+   long n, max;
+   VALUE merged, key, prev, *p_keys;
+
+   merged = rb_ary_dup(keys);
+   for (n = 0; n < RARRAY_LEN(probed); n ++) {
+      key = rb_ary_entry(probed, n);
+      if (mg_type(key) == MG_T_STRING && RSTRING_LEN(key) > 0) {
+         rb_ary_push(merged, key);
+      }
+   }
+
+   max = RARRAY_LEN(merged);
+   p_keys = (VALUE *) mg_malloc(sizeof(VALUE) * (max + 1), 0);
+   if (!p_keys) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the sample of keys");
+   }
+   for (n = 0; n < max; n ++) {
+      p_keys[n] = rb_ary_entry(merged, n);
+   }
+   qsort((void *) p_keys, (size_t) max, sizeof(VALUE), mg_scan_compare);
+
+   keys = rb_ary_new_capa(max);
+   prev = Qnil;
+   for (n = 0; n < max; n ++) {
+      key = p_keys[n];
+      if (NIL_P(prev) || mg_collate(RSTRING_PTR(prev), RSTRING_LEN(prev), RSTRING_PTR(key), RSTRING_LEN(key)) < 0) {
+         rb_ary_push(keys, key);
+         prev = key;
+      }
+   }
+   mg_free((void *) p_keys, 0);
+
+   RB_GC_GUARD(merged);
+   return keys;
+}
+
+
+int mg_scan_compare(const void *p1, const void *p2)
+{
+   VALUE a, b;
+
+   a = *((VALUE *) p1);
+   b = *((VALUE *) p2);
+
+   return mg_collate(RSTRING_PTR(a), RSTRING_LEN(a), RSTRING_PTR(b), RSTRING_LEN(b));
+}
+
+
+/*
+   Up to 'count' points evenly spaced between keys 'a' and 'b' (in collating sequence): between two numbers by
+   value, and between two strings on the three bytes that follow the prefix they share.
+*/
+VALUE mg_scan_points(VALUE a, VALUE b, long count)
+{
+   int n, plen;
+   long len;
+   unsigned long x, y, v;
+   double d1, d2, d;
+   char buffer[MG_MAX_KEY + 8];
+   unsigned char *pa, *pb;
+   VALUE points;
+
+   points = rb_ary_new();
+
+   if (mg_is_canonic_number(RSTRING_PTR(a), RSTRING_LEN(a))) {
+      if (!mg_is_canonic_number(RSTRING_PTR(b), RSTRING_LEN(b))) {
+         return points;
+      }
+      d1 = strtod(RSTRING_PTR(a), NULL);
+      d2 = strtod(RSTRING_PTR(b), NULL);
+      for (n = 1; n <= count; n ++) {
+         d = floor(d1 + ((d2 - d1) * n) / (count + 1));
+         if (fabs(d) >= 1e15 || d <= d1 || d >= d2) {
+            continue;
+         }
+         sprintf(buffer, "%.0f", d);
+         if (!strcmp(buffer, "-0")) {
+            strcpy(buffer, "0");
+         }
+         rb_ary_push(points, rb_str_new2(buffer));
+      }
+      return points;
+   }
+   if (mg_is_canonic_number(RSTRING_PTR(b), RSTRING_LEN(b))) {
+      return points;
+   }
+
+   pa = (unsigned char *) RSTRING_PTR(a);
+   pb = (unsigned char *) RSTRING_PTR(b);
+   for (plen = 0; plen < RSTRING_LEN(a) && plen < RSTRING_LEN(b) && plen < MG_MAX_KEY && pa[plen] == pb[plen]; plen ++)
+      ;
+   memcpy((void *) buffer, (void *) pa, (size_t) plen);
+
+   /* interpolate on the three bytes after the prefix */
+   for (x = 0, y = 0, n = 0; n < 3; n ++) {
+      x = (x << 8) + ((plen + n) < RSTRING_LEN(a) ? pa[plen + n] : 0);
+      y = (y << 8) + ((plen + n) < RSTRING_LEN(b) ? pb[plen + n] : 0);
+   }
+   for (n = 1; n <= count && y > x; n ++) {
+      v = x + ((y - x) * n) / (count + 1);
+      if (v == x) {
+         continue;
+      }
+      buffer[plen] = (char) ((v >> 16) & 0xff);
+      buffer[plen + 1] = (char) ((v >> 8) & 0xff);
+      buffer[plen + 2] = (char) (v & 0xff);
+      for (len = plen + 3; len > plen && !buffer[len - 1]; len --)
+         ;
+      if (len == 0) {
+         continue;
+      }
+      if (mg_is_canonic_number(buffer, len)) {
+         buffer[len ++] = ' '; /* keep it in the string part of the collating sequence */
+      }
+      rb_ary_push(points, rb_str_new(buffer, len));
+   }
+
+   return points;
+}
+
+
+/* Pass a batch of records (or the final nil or exception) from a partition to the consumer */
+int mg_scan_push(MGSCAN *p_scan, VALUE item)
+{
+   if (!NIL_P(p_scan->queue)) {
+      rb_funcall(p_scan->queue, rb_intern("push"), 1, rb_assoc_new(INT2FIX(p_scan->index), item));
+   }
+   else if (mg_type(item) == MG_T_LIST) {
+      if (rb_block_given_p())
+         rb_yield_values(2, INT2FIX(p_scan->index), item);
+      else
+         rb_ary_concat(p_scan->results, item);
+   }
+
+   return 0;
+}
+
+
+VALUE mg_scan_partition(VALUE arg)
+{
+   long n;
+   MGSCAN *p_scan;
+   VALUE key, records;
+
+   p_scan = (MGSCAN *) arg;
+
+   key = p_scan->lower;
+   while (!(*(p_scan->stop))) {
+      p_scan->args[p_scan->nargs - 1] = key;
+      records = mg_order_batch(p_scan->self, p_scan->nargs, p_scan->args, p_scan->batch, 1, "O", p_scan->upper);
+      n = RARRAY_LEN(records);
+      if (n > 0) {
+         mg_scan_push(p_scan, records);
+      }
+      if (n < p_scan->batch) {
+         break;
+      }
+      key = rb_ary_entry(rb_ary_entry(records, n - 1), 0);
+   }
+
+   return Qnil;
+}
+
+
+/* The body of a worker thread: its requests release the GVL while they wait on the network */
+VALUE mg_scan_worker(void *arg)
+{
+   int state;
+   MGSCAN *p_scan;
+
+   p_scan = (MGSCAN *) arg;
+
+   rb_protect(mg_scan_partition, (VALUE) p_scan, &state);
+   p_scan->error = state ? rb_errinfo() : Qnil;
+   rb_set_errinfo(Qnil);
+
+   /* the queue is closed if the consumer has stopped */
+   rb_protect(mg_scan_done, (VALUE) p_scan, &state);
+   rb_set_errinfo(Qnil);
+
+   return Qnil;
+}
+
+
+/* Tell the consumer that the partition is complete: nil, or the exception that stopped it */
+VALUE mg_scan_done(VALUE arg)
+{
+   MGSCAN *p_scan;
+
+   p_scan = (MGSCAN *) arg;
+
+   mg_scan_push(p_scan, p_scan->error);
+
+   return Qnil;
+}
+
+
+VALUE mg_scan_collect(VALUE arg)
+{
+   int n, done;
+   MGSCANSET *p_set;
+   VALUE message, item, error, results;
+
+   p_set = (MGSCANSET *) arg;
+
+   error = Qnil;
+   for (done = 0; done < p_set->count; ) {
+      message = rb_funcall(p_set->queue, rb_intern("pop"), 0);
+      n = FIX2INT(rb_ary_entry(message, 0));
+      item = rb_ary_entry(message, 1);
+      if (NIL_P(item)) {
+         done ++;
+      }
+      else if (rb_obj_is_kind_of(item, rb_eException)) {
+         if (NIL_P(error)) {
+            error = item;
+         }
+         p_set->stop = 1;
+         done ++;
+      }
+      else if (rb_block_given_p()) {
+         rb_yield_values(2, INT2FIX(n), item);
+      }
+      else {
+         rb_ary_concat(p_set->scans[n].results, item);
+      }
+   }
+
+   if (!NIL_P(error)) {
+      rb_exc_raise(error);
+   }
+
+   results = rb_ary_new();
+   for (n = 0; n < p_set->count; n ++) {
+      rb_ary_concat(results, p_set->scans[n].results);
+   }
+
+   return results;
+}
+
+
+/* Stop the workers (if the consumer has not read to the end) and wait for their current requests to finish */
+VALUE mg_scan_finish(VALUE arg)
+{
+   long n;
+   MGSCANSET *p_set;
+
+   p_set = (MGSCANSET *) arg;
+
+   p_set->stop = 1;
+   rb_funcall(p_set->queue, rb_intern("close"), 0);
+   for (n = 0; n < RARRAY_LEN(p_set->threads); n ++) {
+      rb_funcall(rb_ary_entry(p_set->threads, n), rb_intern("join"), 0);
+   }
+
+   return Qnil;
+}
+
+
+/*
+   Scan the keys at one level of a global as [key, data] in several partitions at once, each on its own pooled
+   connection and worker thread.  With a block, each batch of records is yielded with the number of its partition
+   as it arrives.  Otherwise, the records are returned in collating sequence.
+*/
+static VALUE ex_parallel_scan(int argc, VALUE *argv, VALUE self)
+{
+   int n, nargs, partitions;
+   long batch;
+   ID kwargs_id[2];
+   MGPAGE *p_page;
+   MGSCAN scans[MG_SCAN_MAX_PARTITIONS];
+   MGSCANSET set;
+   VALUE global, subs, kwargs, kwargs_val[2], args[MG_MAX_VARGS], bounds, results;
+
+   rb_scan_args(argc, argv, "1*:", &global, &subs, &kwargs);
+
+   kwargs_id[0] = rb_intern("partitions");
+   kwargs_id[1] = rb_intern("batch");
+   rb_get_kwargs(kwargs, kwargs_id, 0, 2, kwargs_val);
+
+   nargs = (int) RARRAY_LEN(subs) + 2;
+   if (nargs > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to 'parallel_scan'");
+      return mg_r_nil;
+   }
+   partitions = (kwargs_val[0] != Qundef) ? NUM2INT(kwargs_val[0]) : MG_SCAN_PARTITIONS;
+   batch = (kwargs_val[1] != Qundef) ? NUM2LONG(kwargs_val[1]) : MG_EACH_NODE_PREFETCH;
+   if (partitions < 1 || partitions > MG_SCAN_MAX_PARTITIONS || batch < 1) {
+      MG_ERROR("mg_ruby: Bad number of partitions or batch size passed to 'parallel_scan'");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   MG_FTRACE("parallel_scan");
+
+   /* the database API serves one request at a time, so scan in this thread */
+   if (p_page->p_srv->mode == 2) {
+      partitions = 1;
+   }
+
+   args[0] = global;
+   for (n = 1; n < (nargs - 1); n ++) {
+      args[n] = rb_ary_entry(subs, n - 1);
+   }
+
+   bounds = mg_scan_bounds(self, nargs, args, partitions);
+
+   set.scans = scans;
+   set.count = (int) RARRAY_LEN(bounds) + 1;
+   set.queue = Qnil;
+   set.threads = rb_ary_new();
+   set.stop = 0;
+
+   for (n = 0; n < set.count; n ++) {
+      scans[n].self = self;
+      scans[n].queue = Qnil;
+      scans[n].lower = n ? rb_ary_entry(bounds, n - 1) : rb_str_new2("");
+      scans[n].upper = (n < (set.count - 1)) ? rb_ary_entry(bounds, n) : Qnil;
+      scans[n].results = rb_ary_new();
+      scans[n].error = Qnil;
+      memcpy((void *) scans[n].args, (void *) args, sizeof(VALUE) * nargs);
+      scans[n].nargs = nargs;
+      scans[n].index = n;
+      scans[n].batch = batch;
+      scans[n].stop = &(set.stop);
+   }
+
+   if (set.count == 1) {
+      mg_scan_partition((VALUE) &scans[0]);
+      results = scans[0].results;
+   }
+   else {
+      /* the queue is bounded so that the workers cannot run far ahead of the consumer */
+      set.queue = rb_funcall(rb_path2class("Thread::SizedQueue"), rb_intern("new"), 1, INT2FIX(set.count * 2));
+      for (n = 0; n < set.count; n ++) {
+         scans[n].queue = set.queue;
+         rb_ary_push(set.threads, rb_thread_create(mg_scan_worker, (void *) &scans[n]));
+      }
+      results = rb_ensure(mg_scan_collect, (VALUE) &set, mg_scan_finish, (VALUE) &set);
+   }
+
+   RB_GC_GUARD(subs);
+   RB_GC_GUARD(bounds);
+   return rb_block_given_p() ? self : results;
+}
+
+
+/* v2.4.46 */
+void future_mark(void *data)
+{
+   MGFUTURE *pfuture;
+
+   pfuture = (MGFUTURE *) data;
+
+   rb_gc_mark(pfuture->owner);
+   rb_gc_mark(pfuture->value);
+   rb_gc_mark(pfuture->error);
+   rb_gc_mark(pfuture->args);
+   rb_gc_mark(pfuture->thread);
+}
+
+
+void future_free(void *data)
+{
+   MGFUTURE *pfuture;
+   MGPAGE *p_page;
+
+   pfuture = (MGFUTURE *) data;
+
+   p_page = pfuture->p_page;
+   if (p_page) {
+      if (pfuture->pending && !p_page->destroyed) {
+         /* abandoned before its response was read: the connection cannot be reused */
+         if (p_page->p_srv->pcon[pfuture->chndle]) {
+            p_page->p_srv->pcon[pfuture->chndle]->keep_alive = 0;
+         }
+         mg_db_disconnect(p_page->p_srv, pfuture->chndle, 0);
+         mg_future_unlink(p_page, pfuture);
+      }
+      p_page->futures --;
+      if (p_page->destroyed && p_page->futures <= 0) {
+         mg_free((void *) p_page, 0);
+      }
+   }
+
+   mg_free(data, 0);
+}
+
+
+size_t future_size(const void *data)
+{
+   return sizeof(MGFUTURE);
+}
+
+
+VALUE future_alloc(VALUE self)
+{
+   MGFUTURE *pfuture;
+
+   /* allocate */
+   pfuture = (MGFUTURE *) mg_malloc(sizeof(MGFUTURE), 0);
+   if (!pfuture) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the future");
+   }
+   memset((void *) pfuture, 0, sizeof(MGFUTURE));
+   pfuture->owner = Qnil;
+   pfuture->value = Qnil;
+   pfuture->error = Qnil;
+   pfuture->args = Qnil;
+   pfuture->thread = Qnil;
+   pfuture->chndle = -1;
+
+   /* wrap */
+   return TypedData_Wrap_Struct(self, &future_type, pfuture);
+}
+
+
+static VALUE ex_m_future_class(void)
+{
+   VALUE cfuture;
+
+   cfuture = rb_define_class("MG_FUTURE", rb_cObject);
+
+   rb_define_alloc_func(cfuture, future_alloc);
+   rb_undef_method(CLASS_OF(cfuture), "new");
+
+   rb_define_method(cfuture, "value", ex_future_value, 0);
+   rb_define_method(cfuture, "ready?", ex_future_ready, 0);
+   rb_define_singleton_method(cfuture, "wait_all", ex_future_wait_all, 1);
+
+   return cfuture;
+}
+
+
+/*
+   Send a request and return an MG_FUTURE without waiting for the response.  The future holds the
+   pooled connection until its value is collected, so requests started together are processed in
+   parallel on separate connections.  In API mode the request is completed before returning.
+   If no connection is free, the request is deferred until its value is collected rather than
+   waiting for one: the connections in use may be held by this thread's own futures.
+*/
+VALUE mg_future_request(int argc, VALUE *argv, VALUE self, char *command, char *method)
+{
+   int n, max, chndle, state;
+   MGBUF *p_buf;
+   MGPAGE *p_page;
+   MGVARGS vargs;
+   MGFUTURE *pfuture;
+   MGFUTURECALL call;
+   VALUE future;
+
+   p_page = mg_ppage(self);
+
+   if (p_page->p_srv->mode == 2) {
+      future = future_alloc(mg_future);
+      TypedData_Get_Struct(future, MGFUTURE, &future_type, pfuture);
+      pfuture->owner = self;
+      pfuture->p_page = p_page;
+      p_page->futures ++;
+
+      call.self = self;
+      call.method = rb_intern(method);
+      call.argc = argc;
+      call.argv = argv;
+      state = 0;
+      pfuture->value = rb_protect(mg_future_invoke, (VALUE) &call, &state);
+      if (state) {
+         pfuture->value = Qnil;
+         pfuture->error = rb_errinfo();
+         rb_set_errinfo(Qnil);
+      }
+      return future;
+   }
+
+   if ((max = mg_get_vargs(argc, argv, &vargs, 0)) == -1)
+      return mg_r_nil;
+
+   MG_FTRACE(method);
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, (short) (1 | MG_CONNECT_NOWAIT));
+
+   if (n == MG_POOL_BUSY) {
+      future = future_alloc(mg_future);
+      TypedData_Get_Struct(future, MGFUTURE, &future_type, pfuture);
+      pfuture->owner = self;
+      pfuture->p_page = p_page;
+      pfuture->deferred = 1;
+      pfuture->method = rb_intern(method);
+      pfuture->args = rb_ary_new_from_values(argc, argv);
+      p_page->futures ++;
+      return future;
+   }
+
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
+
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, command, MG_PRODUCT);
+
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) vargs.global, (int) vargs.global_len, 0, MG_TX_DATA);
+   for (n = 1; n < max; n ++) {
+      mg_request_add(p_page->p_srv, chndle, p_buf, vargs.cvars[n].ps, vargs.cvars[n].size, 0, MG_TX_DATA);
+   }
+
+   MG_MEMCHECK("Insufficient memory to process request", 1);
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+
+   /* the connection now belongs to the future */
+   future = future_alloc(mg_future);
+   TypedData_Get_Struct(future, MGFUTURE, &future_type, pfuture);
+   pfuture->owner = self;
+   pfuture->p_page = p_page;
+   pfuture->chndle = chndle;
+   pfuture->pending = 1;
+   pfuture->thread = rb_thread_current();
+   p_page->futures ++;
+   mg_future_link(p_page, pfuture);
+
+   return future;
+}
+
+
+/* Futures holding a connection are listed with their object so that a deferred request can release them */
+void mg_future_link(MGPAGE *p_page, MGFUTURE *pfuture)
+{
+   pfuture->next = NULL;
+   pfuture->prev = p_page->p_pending_last;
+   if (p_page->p_pending_last) {
+      p_page->p_pending_last->next = pfuture;
+   }
+   else {
+      p_page->p_pending = pfuture;
+   }
+   p_page->p_pending_last = pfuture;
+
+   return;
+}
+
+
+void mg_future_unlink(MGPAGE *p_page, MGFUTURE *pfuture)
+{
+   if (p_page->destroyed) {
+      return; /* the futures are being swept with their object */
+   }
+
+   if (pfuture->prev) {
+      pfuture->prev->next = pfuture->next;
+   }
+   else {
+      p_page->p_pending = pfuture->next;
+   }
+   if (pfuture->next) {
+      pfuture->next->prev = pfuture->prev;
+   }
+   else {
+      p_page->p_pending_last = pfuture->prev;
+   }
+   pfuture->prev = NULL;
+   pfuture->next = NULL;
+
+   return;
+}
+
+
+/* Collect the result of a future (or the error it raised) */
+void mg_future_resolve(MGFUTURE *pfuture)
+{
+   int state;
+   MGFUTURE *pnext, *pother;
+   MGFUTURECALL call;
+   VALUE thread;
+
+   state = 0;
+   if (pfuture->pending) {
+      /* whatever happens, the connection is released by mg_future_receive() */
+      pfuture->pending = 0;
+      mg_future_unlink(pfuture->p_page, pfuture);
+      pfuture->value = rb_protect(mg_future_receive, (VALUE) pfuture, &state);
+      pfuture->chndle = -1;
+   }
+   else if (pfuture->deferred) {
+      pfuture->deferred = 0;
+      /* first collect the futures by which this thread holds connections, oldest first */
+      thread = rb_thread_current();
+      for (pother = pfuture->p_page->p_pending; pother; pother = pnext) {
+         pnext = pother->next;
+         if (pother->thread == thread) {
+            mg_future_resolve(pother);
+         }
+      }
+      call.self = pfuture->owner;
+      call.method = pfuture->method;
+      call.argc = (int) RARRAY_LEN(pfuture->args);
+      call.argv = (VALUE *) RARRAY_CONST_PTR(pfuture->args);
+      pfuture->value = rb_protect(mg_future_invoke, (VALUE) &call, &state);
+      RB_GC_GUARD(pfuture->args);
+      pfuture->args = Qnil;
+   }
+   else {
+      return;
+   }
+
+   if (state) {
+      pfuture->value = Qnil;
+      pfuture->error = rb_errinfo();
+      rb_set_errinfo(Qnil);
+   }
+
+   return;
+}
+
+
+VALUE mg_future_invoke(VALUE arg)
+{
+   MGFUTURECALL *p_call;
+
+   p_call = (MGFUTURECALL *) arg;
+
+   return rb_funcallv(p_call->self, p_call->method, p_call->argc, p_call->argv);
+}
+
+
+/* Read the response to a future's request and return the connection to the pool */
+VALUE mg_future_receive(VALUE arg)
+{
+   int n, chndle;
+   MGBUF *p_buf;
+   MGPAGE *p_page;
+   MGFUTURE *pfuture;
+   VALUE r_data;
+
+   pfuture = (MGFUTURE *) arg;
+   p_page = mg_ppage(pfuture->owner);
+   chndle = pfuture->chndle;
+
+   p_buf = p_page->p_srv->pcon[chndle]->p_buf;
+
+   mg_db_receive_string_nogvl(p_page->p_srv, chndle, p_buf, &r_data);
+
+   MG_MEMCHECK("Insufficient memory to process response", 0);
+
+   return mg_db_response(p_page, chndle, p_buf, r_data);
+}
+
+
+static VALUE ex_m_set_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "S", "m_set");
+}
+
+
+static VALUE ex_m_get_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "G", "m_get");
+}
+
+
+static VALUE ex_m_kill_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "K", "m_kill");
+}
+
+
+static VALUE ex_m_data_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "D", "m_data");
+}
+
+
+static VALUE ex_m_order_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "O", "m_order");
+}
+
+
+static VALUE ex_m_previous_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "P", "m_previous");
+}
+
+
+static VALUE ex_m_increment_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "I", "m_increment");
+}
+
+
+static VALUE ex_m_function_async(int argc, VALUE *argv, VALUE self)
+{
+   return mg_future_request(argc, argv, self, "X", "m_function");
+}
+
+
+/* Wait for (if necessary) and return the result: an error returned by the server is raised here */
+static VALUE ex_future_value(VALUE self)
+{
+   MGFUTURE *pfuture;
+
+   TypedData_Get_Struct(self, MGFUTURE, &future_type, pfuture);
+
+   mg_future_resolve(pfuture);
+
+   if (!NIL_P(pfuture->error)) {
+      rb_exc_raise(pfuture->error);
+   }
+
+   return pfuture->value;
+}
+
+
+/* True if the result can be collected without waiting for the server to respond */
+static VALUE ex_future_ready(VALUE self)
+{
+   MGFUTURE *pfuture;
+   MGPAGE *p_page;
+
+   TypedData_Get_Struct(self, MGFUTURE, &future_type, pfuture);
+
+   if (pfuture->deferred) {
+      return Qfalse;
+   }
+   if (!pfuture->pending) {
+      return Qtrue;
+   }
+
+   p_page = mg_ppage(pfuture->owner);
+
+   return mg_db_poll(p_page->p_srv, pfuture->chndle) ? Qtrue : Qfalse;
+}
+
+
+/* Collect the results of an array of futures: the first error (if any) is raised once all are complete */
+static VALUE ex_future_wait_all(VALUE self, VALUE futures)
+{
+   long n, max;
+   MGFUTURE *pfuture;
+   VALUE results, error, future;
+
+   if (mg_type(futures) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'MG_FUTURE.wait_all' must be an array");
+      return mg_r_nil;
+   }
+
+   max = RARRAY_LEN(futures);
+   results = rb_ary_new_capa(max);
+   error = Qnil;
+
+   for (n = 0; n < max; n ++) {
+      future = rb_ary_entry(futures, n);
+      if (!rb_typeddata_is_kind_of(future, &future_type)) {
+         MG_ERROR("mg_ruby: 'MG_FUTURE.wait_all' expects an array of MG_FUTURE objects");
+         return mg_r_nil;
+      }
+      TypedData_Get_Struct(future, MGFUTURE, &future_type, pfuture);
+      mg_future_resolve(pfuture);
+      if (NIL_P(error) && !NIL_P(pfuture->error)) {
+         error = pfuture->error;
+      }
+      rb_ary_push(results, pfuture->value);
+   }
+
+   if (!NIL_P(error)) {
+      rb_exc_raise(error);
+   }
+
+   return results;
+}
+
+
+static VALUE ex_ma_classmethod(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALUE a_list, VALUE r_argn)
+{
+   MGBUF *p_buf, mgbuf;
+   VALUE response;
+   int n, max, an, t, argn, chndle, len, anybyref, ret_size;
+   int types[32];
+   int byrefs[32];
+   char ifc[4];
+   char bstr[256], bstr1[256];
+   MGSTR properties[MG_MAX_KEY];
+   char *str;
+   char *cclass;
+   char *cmethod;
+   char *ret;
+   VALUE a;
+   VALUE pstr;
+   VALUE p;
+   VALUE pins;
+   MGPAGE *p_page;
+
+
+   if (mg_type(a_list) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_classmethod' must be an array");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   MG_FTRACE("ma_classmethod");
+
+   cclass = mg_get_string(r_cclass, &p, &len);
+   cmethod = mg_get_string(r_cmethod, &p, &len);
+   argn = mg_get_integer(r_argn);
+
+   pstr = rb_ary_entry(a_list, 0);
+   str = NULL;
+   strcpy(bstr, "");
+   strcpy(bstr1, "");
+   if (pstr)
+      str = mg_get_string(pstr, &p, &len);
+   if (str) {
+      strcpy(bstr, str);
+   }
+
+   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+
+   anybyref = 0;
+   for (an = 1; an < 32; an ++) {
+      if (an < max) {
+         if (properties[an].ps[0] == '1')
+            types[an] = 1;
+         else
+            types[an] = 0;
+         if (properties[an].ps[1] == '1') {
+            byrefs[an] = 1;
+            anybyref = 1;
+         }
+         else
+            byrefs[an] = 0;
+      }
+      else {
+         types[an] = 0;
+         byrefs[an] = 0;
+      }
+   }
+
+   chndle = 0;
+
+   max = 0;
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
+
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "x", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cclass, (int) strlen((char *) cclass), (short) ifc[0], (short) ifc[1]);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cmethod, (int) strlen((char *) cmethod), (short) ifc[0], (short) ifc[1]);
+
+   pins = rb_ary_new(); /* v2.4.46 */
+
+   for (an = 1; an <= argn; an ++) {
+
+      str = NULL;
+      pstr = rb_ary_entry(a_list, an);
+      if (pstr) {
+
+         if (byrefs[an])
+            ifc[0] = 1;
+         else
+            ifc[0] = 0;
+
+         t = mg_type(pstr);
+         if (t == MG_T_LIST) {
+
+            int max, n;
+
+            ifc[1] = MG_TX_AREC;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+            ifc[1] = MG_TX_AREC_FORMATTED;
+
+            max = mg_get_array_size(pstr);
+            for (n = 0; n < max; n ++) {
+               a = rb_ary_entry(pstr, n);
+               str = mg_get_string(a, &p, &len);
+               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
+            }
+
+            ifc[1] = MG_TX_EOD;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+         }
+         else {
+            str = mg_get_string(pstr, &p, &n);
+            if (n >= MG_IOV_MIN) {
+               rb_ary_push(pins, p); /* v2.4.46 */
+            }
+
+            ifc[1] = MG_TX_DATA;
+
+            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
+         }
+      }
+   }
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+   RB_GC_GUARD(pins);
+   mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+
+   MG_MEMCHECK("Insufficient memory to process response", 0);
+
+   response = mg_db_response_copy(p_page, chndle, p_buf, &mgbuf); /* v2.4.46 */
+   p_buf = &mgbuf;
+
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
+   }
+
+
+   if (anybyref) {
+      short byref, type, stop;
+      int n, n1, rn, hlen, size, clen, rlen, argc, rec_len, argoffs;
+      unsigned char *parg, *par;
+
+      ret = p_buf->p_buffer + MG_RECV_HEAD;
+      ret_size = p_buf->data_size - MG_RECV_HEAD;
+
+      argoffs = 3;
+      stop = 0;
+      parg = (p_buf->p_buffer + MG_RECV_HEAD);
+
+      clen = mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
+
+      rlen = 0;
+      argc = 0;
+      for (n = 0;; n ++) {
+         hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
+         if ((hlen + size + rlen) > clen) {
+            stop = 1;
+            break;
+         }
+         parg += hlen;
+         rlen += hlen;
+         an = argc - argoffs;
+
+         if (an > 0) {
+            pstr = rb_ary_entry(a_list, an);
+            if (pstr)
+               t = mg_type(pstr);
+         }
+         else
+            pstr = mg_r_nil;
+/*
+{
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n, argc, hlen, size, byref, type, rlen, clen);
+   mg_log_event(parg, buffer);
+   *(parg + size) = c;
+}
+*/
+         if (argc == 0) {
+               ret = parg;
+               ret_size = size;
+         }
+         else if (pstr && type == MG_TX_DATA) {
+            p = rb_str_new(parg, size);
+            mg_set_list_item(a_list, an, p);
+         }
+
+         parg += size;
+         rlen += size;
+         if (type == MG_TX_AREC) {
+
+            if (pstr && t == MG_T_LIST)
+               mg_kill_list(pstr);
+
+            par = parg;
+            rn = 0;
+            rec_len = 0;
+            for (n1 = 0;; n1 ++) {
+               hlen = mg_decode_item_header(parg, &size, (short *) &byref, (short *) &type);
+               if ((hlen + size + rlen) > clen) {
+                  stop = 1;
+                  break;
+               }
+               if (type == MG_TX_EOD) {
+                  parg += (hlen + size);
+                  rlen += (hlen + size);
+                  break;
+               }
+               parg += hlen;
+               rlen += hlen;
+               rec_len += hlen;
+/*
+{
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT ARRAY %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d", n1, argc, hlen, size, byref, type, rlen, clen);
+   mg_log_event(parg, buffer);
+   *(parg + size) = c;
+}
+*/
+               parg += size;
+               rlen += size;
+               rec_len += size;
+               if (type == MG_TX_DATA) {
+/*
+{
+   unsigned char c;
+   char buffer[256];
+   c = *(parg + size);
+   *(parg + size) = '\0';
+   sprintf(buffer, "RESULT ARRAY RECORD %d: argc=%d; hlen=%d; size=%d; byref=%d; type=%d; rlen=%d; clen=%d; rec_len=%d", n1, argc, hlen, size, byref, type, rlen, clen, rec_len);
+   mg_log_event(par, buffer);
+   *(parg + size) = c;
+}
+*/
+                  if (pstr && t == MG_T_LIST) {
+                     p = rb_str_new(par, rec_len);
+                     mg_set_list_item(pstr, rn ++, p);
+                  }
+
+                  par = parg;
+                  rec_len = 0;
+               }
+            }
+         }
+         if (rlen >= clen || stop)
+            break;
+         argc ++;
+      }
+      if (stop) {
+         MG_ERROR("ma_classmethod: Bad return data");
+         return mg_r_nil;
+      }
+      return rb_str_new(ret, ret_size);
+   }
+
+   RB_GC_GUARD(response);
+   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+}
+
+
+static VALUE ex_ma_html_ex(VALUE self, VALUE r_fun, VALUE a_list, VALUE r_argn)
+{
+   MGBUF *p_buf;
+   int n, max, an, t, argn, chndle, len;
+   int types[32];
+   int byrefs[32];
+   char ifc[4];
+   char bstr[256], bstr1[256];
+   MGSTR properties[MG_MAX_KEY];
+   char *str;
+   char *fun;
+   VALUE a;
+   VALUE pstr;
+   VALUE p;
+   VALUE pins;
+   MGPAGE *p_page;
+
+
+   if (mg_type(a_list) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 2 to 'ma_html_ex' must be an array");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   MG_FTRACE("ma_html_ex");
+
+   fun = mg_get_string(r_fun, &p, &len);
+   argn = mg_get_integer(r_argn);
+
+   pstr = rb_ary_entry(a_list, 0);
+   str = NULL;
+   strcpy(bstr, "");
+   strcpy(bstr1, "");
+   if (pstr)
+      str = mg_get_string(pstr, &p, &len);
+   if (str) {
+      strcpy(bstr, str);
+   }
+
+   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+
+   for (an = 1; an < 32; an ++) {
+      if (an < max) {
+         if (properties[an].ps[0] == '1')
+            types[an] = 1;
+         else
+            types[an] = 0;
+         if (properties[an].ps[1] == '1')
+            byrefs[an] = 1;
+         else
+            byrefs[an] = 0;
+      }
+      else {
+         types[an] = 0;
+         byrefs[an] = 0;
+      }
+   }
+
+   chndle = 0;
+
+   max = 0;
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
+
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "H", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) fun, (int) strlen((char *) fun), (short) ifc[0], (short) ifc[1]);
+
+   pins = rb_ary_new(); /* v2.4.46 */
+
+   for (an = 1; an <= argn; an ++) {
+
+      str = NULL;
+      pstr = rb_ary_entry(a_list, an);
+      if (pstr) {
+
+         if (byrefs[an])
+            ifc[0] = 1;
+         else
+            ifc[0] = 0;
+
+         t = mg_type(pstr);
+         if (t == MG_T_LIST) {
+
+            int max, n;
+
+            ifc[1] = MG_TX_AREC;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+            ifc[1] = MG_TX_AREC_FORMATTED;
+
+            max = mg_get_array_size(pstr);
+            for (n = 0; n < max; n ++) {
+               a = rb_ary_entry(pstr, n);
+               str = mg_get_string(a, &p, &len);
+               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
+            }
+
+            ifc[1] = MG_TX_EOD;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+         }
+         else {
+            str = mg_get_string(pstr, &p, &n);
+            if (n >= MG_IOV_MIN) {
+               rb_ary_push(pins, p); /* v2.4.46 */
+            }
+
+            ifc[1] = MG_TX_DATA;
+
+            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
+         }
+      }
+   }
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+   RB_GC_GUARD(pins);
+
+   return rb_int2inum((long) chndle);
+}
+
+
+static VALUE ex_ma_html_classmethod_ex(VALUE self, VALUE r_cclass, VALUE r_cmethod, VALUE a_list, VALUE r_argn)
+{
+   MGBUF *p_buf;
+   int n, max, an, t, argn, chndle, len;
+   int types[32];
+   int byrefs[32];
+   char ifc[4];
+   char bstr[256], bstr1[256];
+   MGSTR properties[MG_MAX_KEY];
+   char *str;
+   char *cclass;
+   char *cmethod;
+   VALUE a;
+   VALUE pstr;
+   VALUE p;
+   VALUE pins;
+   MGPAGE *p_page;
+
+
+   if (mg_type(a_list) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_html_classmethod_ex' must be an array");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   MG_FTRACE("ma_html_classmethod_ex");
+
+   cclass = mg_get_string(r_cclass, &p, &len);
+   cmethod = mg_get_string(r_cmethod, &p, &len);
+   argn = mg_get_integer(r_argn);
+
+   pstr = rb_ary_entry(a_list, 0);
+   str = NULL;
+   strcpy(bstr, "");
+   strcpy(bstr1, "");
+   if (pstr)
+      str = mg_get_string(pstr, &p, &len);
+   if (str) {
+      strcpy(bstr, str);
+   }
+
+   max = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+
+   for (an = 1; an < 32; an ++) {
+      if (an < max) {
+         if (properties[an].ps[0] == '1')
+            types[an] = 1;
+         else
+            types[an] = 0;
+         if (properties[an].ps[1] == '1')
+            byrefs[an] = 1;
+         else
+            byrefs[an] = 0;
+      }
+      else {
+         types[an] = 0;
+         byrefs[an] = 0;
+      }
+   }
+
+   chndle = 0;
+
+   max = 0;
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
+
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "y", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cclass, (int) strlen((char *) cclass), (short) ifc[0], (short) ifc[1]);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) cmethod, (int) strlen((char *) cmethod), (short) ifc[0], (short) ifc[1]);
+
+   pins = rb_ary_new(); /* v2.4.46 */
+
+   for (an = 1; an <= argn; an ++) {
+
+      str = NULL;
+      pstr = rb_ary_entry(a_list, an);
+      if (pstr) {
+
+         if (byrefs[an])
+            ifc[0] = 1;
+         else
+            ifc[0] = 0;
+
+         t = mg_type(pstr);
+         if (t == MG_T_LIST) {
+
+            int max, n;
+
+            ifc[1] = MG_TX_AREC;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+            ifc[1] = MG_TX_AREC_FORMATTED;
+
+            max = (int) (pstr);
+            for (n = 0; n < max; n ++) {
+               a = rb_ary_entry(pstr, n);
+               str = mg_get_string(a, &p, &len);
+               mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
+            }
+
+            ifc[1] = MG_TX_EOD;
+            mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+         }
+         else {
+            str = mg_get_string(pstr, &p, &n);
+            if (n >= MG_IOV_MIN) {
+               rb_ary_push(pins, p); /* v2.4.46 */
+            }
+
+            ifc[1] = MG_TX_DATA;
+
+            mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
+         }
+      }
+   }
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+   RB_GC_GUARD(pins);
+
+   return rb_int2inum((long) chndle);
+}
+
+
+static VALUE ex_ma_http_ex(VALUE self, VALUE r_cgi, VALUE r_content)
+{
+   MGBUF *p_buf;
+   int n, max, chndle, len;
+   char ifc[4];
+   char *str;
+   VALUE a;
+   VALUE p;
+   MGPAGE *p_page;
+
+
+   if (mg_type(r_cgi) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_http_ex' must be an array");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   MG_FTRACE("ma_http_ex");
+
+   chndle = 0;
+
+   max = 0;
+
+   n = mg_db_connect_nogvl(p_page->p_srv, &chndle, 1);
+   if (!n) {
+      MG_ERROR(p_page->p_srv->error_mess);
+      return mg_r_nil;
+   }
+
+   MG_DB_BUFFER(p_buf);
+
+   mg_request_header(p_page->p_srv, p_buf, "h", MG_PRODUCT);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_AREC;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+   ifc[1] = MG_TX_AREC_FORMATTED;
+
+   max = mg_get_array_size(r_cgi);
+
+   for (n = 0; n < max; n ++) {
+      a = rb_ary_entry(r_cgi, n);
+      str = mg_get_string(a, &p, &len);
+      mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, len, (short) ifc[0], (short) ifc[1]);
+   }
+   ifc[1] = MG_TX_EOD;
+   mg_request_add(p_page->p_srv, chndle, p_buf, NULL, 0, (short) ifc[0], (short) ifc[1]);
+
+   str = mg_get_string(r_content, &p, &n);
+
+   ifc[0] = 0;
+   ifc[1] = MG_TX_DATA;
+   mg_request_add(p_page->p_srv, chndle, p_buf, (unsigned char *) str, (int) strlen((char *) str), (short) ifc[0], (short) ifc[1]);
+
+   mg_db_send_nogvl(p_page->p_srv, chndle, p_buf, 1);
+
+
+   return rb_int2inum((long) chndle);
+
+}
+
+
+static VALUE ex_ma_arg_set(VALUE self, VALUE a_list, VALUE r_argn, VALUE a, VALUE r_by_ref)
+{
+   int n, max, t, argn, by_ref, typ, phndle, len;
+   char buffer[MG_BUFSIZE], error[256], props[256], bstr[256], bstr1[256];
+   MGSTR properties[MG_MAX_KEY];
+   char *str;
+   VALUE p;
+   VALUE pstr;
+
+   *props = '\0';
+
+
+   phndle = 0;
+
+   if (mg_type(a_list) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_arg_set' must be an array");
+      return mg_r_nil;
+   }
+
+   argn = mg_get_integer(r_argn);
+   by_ref = mg_get_integer(r_by_ref);
+
+   t = mg_type(a);
+
+   if (t == MG_T_LIST) {
+      typ = 1;
+   }
+   else {
+      typ = 0;
+   }
+
+   pstr = 0;
+   if (mg_get_array_size(a_list) > 0)
+      pstr = rb_ary_entry(a_list, 0);
+
+   str = NULL;
+   strcpy(bstr, "");
+   strcpy(bstr1, "");
+
+   if (pstr) {
+      t = mg_type(pstr);
+      if (t == MG_T_STRING) {
+         str = mg_get_string(pstr, &p, &len);
+
+      }
+   }
+
+   if (str) {
+      strcpy(bstr, str);
+   }
+
+   strcpy(error, "");
+
+   n = mg_extract_substrings(properties, bstr, (int) strlen(bstr), '#', 0, 0, MG_ES_DELIM);
+/*
+{
+   int i;
+   char buffer[256], buf1[256], tmp[256];
+
+   sprintf(buffer, "*************************** MA SET max=%d *******************", n);
+   strcpy(buf1, "");
+   for (i = 0; i <= n; i ++) {
+      sprintf(tmp, "i=%d; ps=%s; size=%d;", i, properties[i].ps ? properties[i].ps : "null", properties[i].size);
+      strcat(buf1, tmp);
+   }
+   mg_log_event(buf1, buffer);
+}
+*/
+   if (n > argn)
+      max = n - 1;
+   else
+      max = argn;
+
+   for (n = 1; n <= max; n ++) {
+      strcat(bstr1, "#");
+      if (n == argn) {
+         sprintf(buffer, "%d%d", typ, by_ref);
+         strcat(bstr1, buffer);
+      }
+      else {
+         if (properties[n].ps)
+            strcat(bstr1, properties[n].ps);
+         else
+            strcat(bstr1, "00");
+      }
+   }
+
+   pstr = rb_str_new2(bstr1);
+   mg_set_list_item(a_list, 0, pstr);
+   mg_set_list_item(a_list, argn, a);
+
+   strcpy(buffer, "");
+
+   return rb_str_new2(buffer);
+
+}
+
+
+static VALUE ex_ma_get_stream_data(VALUE self, VALUE r_chndle)
+{
+   MGBUF *p_buf;
+   int n, chndle;
+   MGPAGE *p_page;
+
+   chndle = mg_get_integer(r_chndle);
+
+   if (chndle < 0) {
+      MG_ERROR("Bad connection handle");
+      return mg_r_nil;
+   }
+
+   p_page = mg_ppage(self);
+
+   p_buf = mg_db_buffer(p_page->p_srv, chndle); /* v2.4.45 */
+   if (!p_buf) {
+      MG_ERROR("Bad connection handle");
+      return mg_r_nil;
+   }
+
+   MG_FTRACE("ma_get_stream_data");
+
+   n = mg_db_receive_nogvl(p_page->p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+
+   if (n < 1) {
+      mg_db_disconnect(p_page->p_srv, chndle, 1);
+      return rb_str_new2("");
+   }
+
+   if ((n = mg_get_error(p_page->p_srv, p_buf->p_buffer))) {
+      MG_ERROR(p_buf->p_buffer + MG_RECV_HEAD);
+      return mg_r_nil;
+   }
+
+   return rb_str_new(p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+}
+
+
+
+static VALUE ex_ma_return_to_client(VALUE self, VALUE r_data)
+{
+   char record[MG_BUFSIZE];
+   int phndle, len;
+   VALUE p;
+   char *ps;
+
+   phndle = 0;
+
+   ps = mg_get_string(r_data, &p, &len);
+
+   strcpy(record, "\x07");
+   if (ps) {
+      memcpy((void *) record, (void *) ps, len);
+      len ++;
+   }
+   else
+      len = 1;
+
+   return rb_str_new2(record);
+
+}
+
+
+/*
+   v2.4.46: copy a record so that mg_extract_substrings() can split it: into 'buffer' (MG_BUFSIZE bytes) if it fits,
+   otherwise into a block held in '*heap', which replaces the last one and is freed by the caller.  The records
+   returned by LocalGlobal#to_records (or set by ma_local_set) may hold data of any size.
+*/
+char * mg_local_record(VALUE record, char *buffer, char **heap, int *len)
+{
+   char *ps;
+   VALUE temp;
+
+   ps = mg_get_string(record, &temp, len);
+   if (*len >= MG_BUFSIZE) {
+      if (*heap) {
+         mg_free((void *) *heap, 0);
+      }
+      *heap = (char *) mg_malloc(*len + 1, 0);
+      if (!(*heap)) {
+         rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for a record");
+      }
+      buffer = *heap;
+   }
+   memcpy((void *) buffer, (void *) ps, *len);
+   buffer[*len] = '\0';
+
+   RB_GC_GUARD(temp);
+   return buffer;
+}
+
+
+static VALUE ex_ma_local_set(VALUE self, VALUE records, VALUE r_index, VALUE key, VALUE data)
+{
+   int result, index, max, mrec, rmax, start, found, rn, n, len;
+   char buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE r_record;
+   VALUE p;
+   char * ps;
+   char *pbuf, *heap; /* v2.4.46 */
+   MGBUF mgbuf, *p_buf;
+
+   rmax = 0;
+   heap = NULL;
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_set' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_set' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, NULL);
+
+   ps = mg_get_string(data, &p, &len);
+
+   p_buf = &mgbuf;
+   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+
+   for (n = 1; n <= max; n ++) {
+      mg_request_add(NULL, -1, p_buf, nkey[n].ps, nkey[n].size, 0, MG_TX_AKEY);
+   }
+   mg_request_add(NULL, -1, p_buf, (unsigned char *) ps, len, 0, MG_TX_DATA);
+
+   r_record = rb_str_new((char *) p_buf->p_buffer, p_buf->data_size);
+   mg_buf_free(p_buf); /* v2.4.45 */
+
+   if (index == -2) {
+      mg_set_list_item(records, mrec, r_record);
+   }
+   else if (index > -1) {
+      mg_set_list_item(records, index, r_record);
+   }
+   else {
+      found = 0;
+      start = 0;
+
+      for (rn = start; rn < mrec; rn ++) {
+         p = rb_ary_entry(records, rn);
+         pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+         rmax = mg_extract_substrings(rkey, pbuf, len, '#', 1, 0, MG_ES_BLOCK);
+         rmax --;
+         if (rmax == max) {
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+
+               mg_set_list_item(records, rn, r_record);
+               found = 1;
+               break;
+            }
+         }
+      }
+      if (!found) {
+         mg_set_list_item(records, mrec, r_record);
+      }
+   }
+   result = rmax;
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return rb_str_dup(r_record);
+
+}
+
+
+static VALUE  ex_ma_local_get(VALUE self, VALUE records, VALUE r_index, VALUE key)
+{
+   int index, max, mrec, rmax, start, rn, len;
+   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   char *pbuf, *heap; /* v2.4.46 */
+   char * result;
+
+   rmax = 0;
+   heap = NULL;
+
+   result = record;
+   strcpy(record, "");
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_get' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_get' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, record);
+
+   if (index > -1) {
+      if (index < mrec) {
+         p = rb_ary_entry(records, index);
+         pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+         rmax = mg_extract_substrings(rkey, pbuf, (int) strlen(pbuf), '#', 1, 0, MG_ES_BLOCK);
+         result = rkey[rmax].ps;
+         len = rkey[rmax].size;
+      }
+   }
+   else {
+      start = 0;
+      for (rn = start; rn < mrec; rn ++) {
+         p = rb_ary_entry(records, rn);
+         pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+         rmax = mg_extract_substrings(rkey, pbuf, len, '#', 1, 0, MG_ES_BLOCK);
+         rmax --;
+         if (rmax == max) {
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+               result = rkey[rmax + 1].ps;
+               len = rkey[rmax + 1].size;
+               break;
+            }
+         }
+      }
+   }
+
+   if (result == record) {
+      len = 0; /* v2.4.46: not found (len is that of the last record read) */
+   }
+   p = rb_str_new(result, len);
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return p;
+}
+
+
+static VALUE  ex_ma_local_data(VALUE self, VALUE records, VALUE r_index, VALUE key)
+{
+   int result, index, max, mrec, rmax, start, rn, data, subs, len;
+   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   char *pbuf, *heap; /* v2.4.46 */
+
+   result = 0;
+   rmax = 0;
+   heap = NULL;
+
+   strcpy(record, "");
+
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_data' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_data' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, record);
+
+   result = 0;
+   if (index > -1) {
+      if (index < mrec) {
+         result = 1;
+      }
+   }
+   else {
+      start = 0;
+      data = 0;
+      subs = 0;
+      for (rn = start; rn < mrec; rn ++) {
+         p = rb_ary_entry(records, rn);
+         pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+         rmax = mg_extract_substrings(rkey, pbuf, (int) strlen(pbuf), '#', 1, 0, MG_ES_BLOCK);
+         rmax --;
+         if (rmax >= max) {
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+               if (rmax == max)
+                  data = 1;
+               else
+                  subs = 10;
+               if (data > 0 && subs > 0)
+               break;
+            }
+         }
+      }
+      result = data + subs;
+   }
+
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return rb_int2inum((long) result);
+}
+
+
+
+
+static VALUE  ex_ma_local_kill(VALUE self, VALUE records, VALUE r_index, VALUE key)
+{
+   int result, index, max, mrec, rmax, start, rn, len;
+   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   char *pbuf, *heap; /* v2.4.46 */
+
+   rmax = 0;
+   heap = NULL;
+   result = 0;
+
+   strcpy(record, "");
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_kill' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_kill' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, record);
+
+   if (index > -1) {
+      if (index < mrec) {
+         mg_kill_list_item(records, index);
+         result ++;
+      }
+   }
+   else {
+      start = 0;
+      for (rn = start; rn < mrec; rn ++) {
+         p = rb_ary_entry(records, rn);
+         pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+         rmax = mg_extract_substrings(rkey, pbuf, len, '#', 1, 0, MG_ES_BLOCK);
+         rmax --;
+         if (rmax >= max) {
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+               mg_kill_list_item(records, rn);
+               result ++;
+               rn --; /* v2.4.46: the records that follow have moved down */
+               mrec --;
+            }
+         }
+      }
+   }
+
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return rb_int2inum((long) result);
+}
+
+
+static VALUE  ex_ma_local_order(VALUE self, VALUE records, VALUE r_index, VALUE key)
+{
+   int result, index, max, mrec, rmax, start, rn, found, next, len;
+   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   VALUE r_next; /* v2.4.46 */
+   char *vkey, *vrkey;
+   char *pbuf, *heap; /* v2.4.46 */
+
+   rmax = 0;
+   heap = NULL;
+   r_next = Qnil;
+   result = -1;
+   strcpy(record, "");
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_order' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_order' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, record);
+   vkey = nkey[max].ps;
+
+   start = 0;
+
+   if (index > -1) {
+      start = index;
+   }
+
+   found = 0;
+   next = -1;
+
+   for (rn = start; rn < mrec; rn ++) {
+      p = rb_ary_entry(records, rn);
+      pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+      rmax = mg_extract_substrings(rkey, pbuf, len, '#', 1, 0, MG_ES_BLOCK);
+      rmax --;
+      if (rmax >= max) {
+         vrkey = rkey[max].ps;
+         if (mg_compare_keys(nkey, rkey, max - 1) == 0) {
+
+            if (strlen(vkey) == 0 && strlen(vrkey) > 0) {
+               p = rb_str_new2(vrkey);
+               mg_set_list_item(key, max, p);
+               result = rn;
+               break;
+            }
+            if (found == 1 && strcmp(vrkey, vkey)) {
+               p = rb_str_new2(vrkey);
+               mg_set_list_item(key, max, p);
+               result = rn;
+               break;
+            }
+            if (mg_collate(vrkey, (long) rkey[max].size, vkey, (long) nkey[max].size) > 0) { /* v2.4.46 */
+               if (next == -1) {
+                  next = rn;
+                  r_next = rb_str_new2(vrkey); /* v2.4.46: the buffer is reused for the records that follow */
+               }
+            }
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+               found = 1;
+            }
+         }
+      }
+   }
+
+   if (found == 0 && next != -1) {
+      result = next;
+      p = r_next;
+      mg_set_list_item(key, max, p);
+   }
+
+   if (result == -1) {
+      p = rb_str_new2("");
+      mg_set_list_item(key, max, p);
+   }
+
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return rb_int2inum((long) result);
+}
+
+
+
+static VALUE  ex_ma_local_previous(VALUE self, VALUE records, VALUE r_index, VALUE key)
+{
+   int result, index, max, mrec, rmax, start, rn, found, next, len;
+   char record[MG_BUFSIZE], buffer[MG_BUFSIZE];
+   MGSTR rkey[MG_MAX_KEY], nkey[MG_MAX_KEY];
+   VALUE r_nkey[MG_MAX_KEY];
+   VALUE p;
+   VALUE r_next; /* v2.4.46 */
+   char *vkey, *vrkey;
+   char *pbuf, *heap; /* v2.4.46 */
+
+   rmax = 0;
+   heap = NULL;
+   r_next = Qnil;
+   result = -1;
+   strcpy(record, "");
+
+   index = mg_get_integer(r_index);
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_previous' must be an array");
+      return mg_r_nil;
+   }
+   if (mg_type(key) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 3 to 'ma_local_previous' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = mg_get_array_size(records);
+   max = mg_get_keys(key, nkey, r_nkey, record);
+   vkey = nkey[max].ps;
+
+   start = 0;
+
+   if (index == -1) {
+      index = mrec - 1;
+   }
+
+   found = 0;
+   next = -1;
+
+   for (rn = index; rn >= start; rn --) {
+      p = rb_ary_entry(records, rn);
+      pbuf = mg_local_record(p, buffer, &heap, &len); /* v2.4.46 */
+      rmax = mg_extract_substrings(rkey, pbuf, len, '#', 1, 0, MG_ES_BLOCK);
+      rmax --;
+      if (rmax >= max) {
+         vrkey = rkey[max].ps;
+         if (mg_compare_keys(nkey, rkey, max - 1) == 0) {
+            if (strlen(vkey) == 0 && strlen(vrkey) > 0) {
+               p = rb_str_new2(vrkey);
+               mg_set_list_item(key, max, p);
+               result = rn;
+               break;
+            }
+            if (found == 1 && strcmp(vrkey, vkey)) {
+               p = rb_str_new2(vrkey);
+               mg_set_list_item(key, max, p);
+               result = rn;
+               break;
+            }
+            if (mg_collate(vrkey, (long) rkey[max].size, vkey, (long) nkey[max].size) < 0) { /* v2.4.46 */
+               if (next == -1) {
+                  next = rn;
+                  r_next = rb_str_new2(vrkey); /* v2.4.46: the buffer is reused for the records that follow */
+               }
+            }
+            if (mg_compare_keys(nkey, rkey, max) == 0) {
+               found = 1;
+            }
+         }
+      }
+   }
+
+   if (found == 0 && next != -1) {
+      result = next;
+      p = r_next;
+      mg_set_list_item(key, max, p);
+   }
+
+   if (result == -1) {
+      p = rb_str_new2("");
+      mg_set_list_item(key, max, p);
+   }
+
+   if (heap) {
+      mg_free((void *) heap, 0);
+   }
+
+   return rb_int2inum((long) result);
+}
+
+
+/* v2.4.46: sort the records in-process into M collating sequence of their subscripts (previously done by sort^%ZMGS on the DB Server) */
+static VALUE  ex_ma_local_sort(VALUE self, VALUE records)
+{
+   int n, len, hlen, size;
+   short byref, type;
+   long rn, mrec, total;
+   char *ps;
+   MGSTR *keys;
+   MGLSORT *sort;
+   VALUE temp;
+
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'ma_local_sort' must be an array");
+      return mg_r_nil;
+   }
+
+   MG_FTRACE("ma_local_sort");
+
+   mrec = RARRAY_LEN(records);
+   if (mrec < 2) {
+      return rb_str_new2("");
+   }
+
+   /* make sure each record is a String, and count the items, so that the subscripts can be decoded in place */
+   total = 0;
+   for (rn = 0; rn < mrec; rn ++) {
+      temp = rb_ary_entry(records, rn);
+      if (!RB_TYPE_P(temp, T_STRING)) {
+         ps = mg_get_string(temp, &temp, &len);
+         rb_ary_store(records, rn, rb_str_new(ps, len));
+         temp = rb_ary_entry(records, rn);
+      }
+      ps = RSTRING_PTR(temp);
+      len = (int) RSTRING_LEN(temp);
+      for (n = 0; n < len; n += (hlen + size)) {
+         hlen = mg_decode_item_header((unsigned char *) ps + n, &size, &byref, &type);
+         total ++;
+      }
+   }
+
+   sort = (MGLSORT *) mg_malloc((int) ((sizeof(MGLSORT) * mrec) + (sizeof(MGSTR) * total)), 0);
+   if (!sort) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for 'ma_local_sort'");
+   }
+   keys = (MGSTR *) (sort + mrec);
+
+   for (rn = 0; rn < mrec; rn ++) {
+      temp = rb_ary_entry(records, rn);
+      ps = RSTRING_PTR(temp);
+      len = (int) RSTRING_LEN(temp);
+      sort[rn].record = temp;
+      sort[rn].index = (int) rn;
+      sort[rn].keys = keys;
+      sort[rn].nkeys = 0;
+      for (n = 0; n < len; n += (hlen + size)) {
+         hlen = mg_decode_item_header((unsigned char *) ps + n, &size, &byref, &type);
+         if ((n + hlen + size) > len) {
+            break;
+         }
+         keys->ps = (unsigned char *) ps + n + hlen;
+         keys->size = size;
+         keys ++;
+         sort[rn].nkeys ++;
+      }
+      /* the last item is the data */
+      if (sort[rn].nkeys > 0) {
+         sort[rn].nkeys --;
+      }
+      sort[rn].kclass = 0;
+      sort[rn].first.prefix = 0;
+      if (sort[rn].nkeys > 0 && sort[rn].keys[0].size > 0) {
+         ps = (char *) sort[rn].keys[0].ps;
+         size = (int) sort[rn].keys[0].size;
+         if (mg_is_canonic_number(ps, size)) {
+            char buffer[32];
+
+            sort[rn].kclass = 1;
+            memcpy((void *) buffer, (void *) ps, size);
+            buffer[size] = '\0';
+            sort[rn].first.number = strtod(buffer, NULL);
+         }
+         else {
+            sort[rn].kclass = 2;
+            for (n = 0; n < 8; n ++) {
+               sort[rn].first.prefix = (sort[rn].first.prefix << 8) | (n < size ? (unsigned char) ps[n] : 0);
+            }
+         }
+      }
+   }
+
+   qsort((void *) sort, (size_t) mrec, sizeof(MGLSORT), mg_local_sort_compare);
+
+   for (rn = 0; rn < mrec; rn ++) {
+      rb_ary_store(records, rn, sort[rn].record);
+   }
+   mg_free((void *) sort, 0);
+
+   RB_GC_GUARD(records);
+   return rb_str_new2("");
+}
+
+
+/* qsort() comparator for ma_local_sort: M collation of the subscripts, a node before the nodes below it, and otherwise the original order */
+int mg_local_sort_compare(const void *a, const void *b)
+{
+   int n, result;
+   const MGLSORT *p1, *p2;
+
+   p1 = (const MGLSORT *) a;
+   p2 = (const MGLSORT *) b;
+
+   /* the class of the first subscript, then its value or prefix, decide most comparisons (equal values are compared in full) */
+   if (p1->nkeys > 0 && p2->nkeys > 0) {
+      if (p1->kclass != p2->kclass) {
+         return (p1->kclass < p2->kclass) ? -1 : 1;
+      }
+      if (p1->kclass == 1 && p1->first.number != p2->first.number) {
+         return (p1->first.number < p2->first.number) ? -1 : 1;
+      }
+      if (p1->kclass == 2 && p1->first.prefix != p2->first.prefix) {
+         return (p1->first.prefix < p2->first.prefix) ? -1 : 1;
+      }
+   }
+
+   for (n = 0; n < p1->nkeys && n < p2->nkeys; n ++) {
+      result = mg_collate((char *) p1->keys[n].ps, (long) p1->keys[n].size, (char *) p2->keys[n].ps, (long) p2->keys[n].size);
+      if (result) {
+         return result;
+      }
+   }
+   if (p1->nkeys != p2->nkeys) {
+      return (p1->nkeys < p2->nkeys) ? -1 : 1;
+   }
+
+   return (p1->index < p2->index) ? -1 : ((p1->index > p2->index) ? 1 : 0);
+}
+
+
+/*
+   v2.4.46: MG_RUBY::LocalGlobal
+
+   A local (in-process) global held as a skiplist of nodes ordered by the M collation of their subscripts.
+   Each node holds its subscripts already decoded, so that lookups, $data, $order and $previous take
+   O(log n) comparisons rather than a decode of every record in the array used by the ma_local_* methods.
+   A LocalGlobal can be created from, and converted back to, the array of records used by those methods.
+*/
+
+void local_free(void *data)
+{
+   MGLOCAL *p_local;
+   MGLNODE *p_node, *p_next;
+
+   p_local = (MGLOCAL *) data;
+
+   for (p_node = p_local->head; p_node; p_node = p_next) {
+      p_next = p_node->next[0];
+      mg_free((void *) p_node, 0);
+   }
+   mg_free(data, 0);
+}
+
+
+size_t local_size(const void *data)
+{
+   const MGLOCAL *p_local;
+
+   p_local = (const MGLOCAL *) data;
+
+   return sizeof(MGLOCAL) + p_local->size;
+}
+
+
+VALUE local_alloc(VALUE self)
+{
+   MGLOCAL *p_local;
+
+   /* allocate */
+   p_local = (MGLOCAL *) mg_malloc(sizeof(MGLOCAL), 0);
+   if (!p_local) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the LocalGlobal");
+   }
+   memset((void *) p_local, 0, sizeof(MGLOCAL));
+   p_local->head = mg_local_node(MG_LOCAL_MAX_LEVEL, 0, NULL, NULL);
+   if (!p_local->head) {
+      mg_free((void *) p_local, 0);
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the LocalGlobal");
+   }
+   p_local->size = p_local->head->size;
+   p_local->levels = 1;
+   p_local->seed = 2463534242;
+
+   /* wrap */
+   return TypedData_Wrap_Struct(self, &local_type, p_local);
+}
+
+
+/* LocalGlobal.new(records = nil): optionally load an array of records in the form used by the ma_local_* methods */
+VALUE local_m_initialize(int argc, VALUE *argv, VALUE self)
+{
+   int n, rmax, size, hlen, len;
+   long rn, mrec;
+   short byref, type;
+   char *ps;
+   MGSTR rkey[MG_MAX_KEY + 1];
+   MGLOCAL *p_local;
+   VALUE records, record, temp;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   rb_scan_args(argc, argv, "01", &records);
+
+   if (NIL_P(records)) {
+      return self;
+   }
+   if (mg_type(records) != MG_T_LIST) {
+      MG_ERROR("mg_ruby: Argument 1 to 'LocalGlobal.new' must be an array");
+      return mg_r_nil;
+   }
+
+   mrec = RARRAY_LEN(records);
+   for (rn = 0; rn < mrec; rn ++) {
+      record = rb_ary_entry(records, rn);
+      if (NIL_P(record)) {
+         continue;
+      }
+      ps = mg_get_string(record, &temp, &len);
+
+      /* the subscripts followed by the data, each with an item header */
+      rmax = 0;
+      for (n = 0; n < len && rmax <= MG_MAX_KEY; n += (hlen + size)) {
+         hlen = mg_decode_item_header((unsigned char *) ps + n, &size, &byref, &type);
+         if ((n + hlen + size) > len) {
+            break;
+         }
+         rkey[rmax].ps = (unsigned char *) ps + n + hlen;
+         rkey[rmax].size = size;
+         rmax ++;
+      }
+      if (rmax < 1 || rmax > MG_MAX_KEY) {
+         MG_ERROR("mg_ruby: Bad record passed to 'LocalGlobal.new'");
+         return mg_r_nil;
+      }
+      if (mg_local_set(p_local, rkey, rmax - 1, &rkey[rmax - 1]) < 0) {
+         rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the LocalGlobal");
+      }
+      RB_GC_GUARD(record);
+   }
+
+   return self;
+}
+
+
+/* Allocate a node with its subscripts and data copied (null-terminated) into the same block */
+MGLNODE * mg_local_node(int levels, int nkeys, MGSTR *keys, MGSTR *data)
+{
+   int n;
+   size_t size;
+   unsigned char *p;
+   MGLNODE *p_node;
+
+   size = sizeof(MGLNODE) + (sizeof(MGLNODE *) * (levels - 1)) + (sizeof(MGSTR) * nkeys);
+   for (n = 0; n < nkeys; n ++) {
+      size += keys[n].size + 1;
+   }
+   size += (data ? data->size : 0) + 1;
+
+   p_node = (MGLNODE *) mg_malloc((int) size, 0);
+   if (!p_node) {
+      return NULL;
+   }
+   memset((void *) p_node, 0, sizeof(MGLNODE) + (sizeof(MGLNODE *) * (levels - 1)));
+   p_node->levels = levels;
+   p_node->nkeys = nkeys;
+   p_node->size = size;
+   p_node->keys = (MGSTR *) (((char *) p_node) + sizeof(MGLNODE) + (sizeof(MGLNODE *) * (levels - 1)));
+
+   p = (unsigned char *) (p_node->keys + nkeys);
+   for (n = 0; n < nkeys; n ++) {
+      p_node->keys[n].ps = p;
+      p_node->keys[n].size = keys[n].size;
+      memcpy((void *) p, (void *) keys[n].ps, keys[n].size);
+      p += keys[n].size;
+      *(p ++) = '\0';
+   }
+   p_node->data.ps = p;
+   p_node->data.size = 0;
+   if (data) {
+      p_node->data.size = data->size;
+      memcpy((void *) p, (void *) data->ps, data->size);
+      p += data->size;
+   }
+   *p = '\0';
+
+   return p_node;
+}
+
+
+int mg_local_keys(int argc, VALUE *argv, MGSTR *keys, VALUE *keys_tmp)
+{
+   int n, len;
+
+   if (argc > MG_MAX_VARGS) {
+      MG_ERROR("mg_ruby: Too many subscripts passed to a LocalGlobal method");
+      return -1;
+   }
+   for (n = 0; n < argc; n ++) {
+      keys_tmp[n] = argv[n];
+      keys[n].ps = (unsigned char *) mg_get_string(argv[n], &keys_tmp[n], &len);
+      keys[n].size = len;
+   }
+
+   return argc;
+}
+
+
+/*
+   Compare a node with a key.  A node below the key collates after it unless 'tail' is set, in which case the
+   key stands for the end of its subtree and everything in the subtree collates before it.
+*/
+int mg_local_compare(MGLNODE *p_node, MGSTR *keys, int nkeys, short tail)
+{
+   int n, result;
+
+   for (n = 0; n < nkeys && n < p_node->nkeys; n ++) {
+      result = mg_collate((char *) p_node->keys[n].ps, (long) p_node->keys[n].size, (char *) keys[n].ps, (long) keys[n].size);
+      if (result) {
+         return result;
+      }
+   }
+   if (p_node->nkeys == nkeys) {
+      return 0;
+   }
+   if (p_node->nkeys < nkeys) {
+      return -1;
+   }
+
+   return tail ? -1 : 1;
+}
+
+
+/* Is the node the key itself or below it? */
+int mg_local_prefix(MGLNODE *p_node, MGSTR *keys, int nkeys)
+{
+   int n;
+
+   if (!p_node || p_node->nkeys < nkeys) {
+      return 0;
+   }
+   for (n = 0; n < nkeys; n ++) {
+      if (p_node->keys[n].size != keys[n].size || memcmp((void *) p_node->keys[n].ps, (void *) keys[n].ps, keys[n].size)) {
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+
+/* Record the last node at each level that collates before the key (or its subtree, for 'tail'), returning the last one at level 0 */
+MGLNODE * mg_local_find(MGLOCAL *p_local, MGSTR *keys, int nkeys, short tail, MGLNODE **update)
+{
+   int level, result;
+   MGLNODE *p_node;
+
+   p_node = p_local->head;
+   for (level = MG_LOCAL_MAX_LEVEL - 1; level >= 0; level --) {
+      while (p_node->next[level]) {
+         result = mg_local_compare(p_node->next[level], keys, nkeys, tail);
+         if (result > 0 || (result == 0 && !tail)) {
+            break;
+         }
+         p_node = p_node->next[level];
+      }
+      update[level] = p_node;
+   }
+
+   return p_node;
+}
+
+
+/* Set (or replace) the data for a node: returns 1 for a new node, 0 for a replacement and -1 if out of memory */
+int mg_local_set(MGLOCAL *p_local, MGSTR *keys, int nkeys, MGSTR *data)
+{
+   int level, levels;
+   MGLNODE *p_node, *p_old, *update[MG_LOCAL_MAX_LEVEL];
+
+   mg_local_find(p_local, keys, nkeys, 0, update);
+
+   p_old = update[0]->next[0];
+   if (p_old && mg_local_compare(p_old, keys, nkeys, 0) == 0) {
+      p_node = mg_local_node(p_old->levels, nkeys, keys, data);
+      if (!p_node) {
+         return -1;
+      }
+      for (level = 0; level < p_old->levels; level ++) {
+         p_node->next[level] = p_old->next[level];
+         update[level]->next[level] = p_node;
+      }
+      p_local->size += p_node->size;
+      p_local->size -= p_old->size;
+      mg_free((void *) p_old, 0);
+      return 0;
+   }
+
+   /* xorshift: each level is kept by one node in four */
+   for (levels = 1; levels < MG_LOCAL_MAX_LEVEL; levels ++) {
+      p_local->seed ^= p_local->seed << 13;
+      p_local->seed ^= p_local->seed >> 17;
+      p_local->seed ^= p_local->seed << 5;
+      if (p_local->seed & 3) {
+         break;
+      }
+   }
+
+   p_node = mg_local_node(levels, nkeys, keys, data);
+   if (!p_node) {
+      return -1;
+   }
+   for (level = 0; level < levels; level ++) {
+      p_node->next[level] = update[level]->next[level];
+      update[level]->next[level] = p_node;
+   }
+   if (levels > p_local->levels) {
+      p_local->levels = levels;
+   }
+   p_local->size += p_node->size;
+   p_local->count ++;
+
+   return 1;
+}
+
+
+/* Delete a node and everything below it, returning the number of nodes deleted */
+long mg_local_kill(MGLOCAL *p_local, MGSTR *keys, int nkeys)
+{
+   int level;
+   long result;
+   MGLNODE *p_node, *update[MG_LOCAL_MAX_LEVEL];
+
+   mg_local_find(p_local, keys, nkeys, 0, update);
+
+   result = 0;
+   for (p_node = update[0]->next[0]; mg_local_prefix(p_node, keys, nkeys); p_node = update[0]->next[0]) {
+      for (level = 0; level < p_node->levels; level ++) {
+         update[level]->next[level] = p_node->next[level];
+      }
+      p_local->size -= p_node->size;
+      p_local->count --;
+      mg_free((void *) p_node, 0);
+      result ++;
+   }
+   while (p_local->levels > 1 && !p_local->head->next[p_local->levels - 1]) {
+      p_local->levels --;
+   }
+
+   return result;
+}
+
+
+static VALUE ex_m_local_class(VALUE outer)
+{
+   VALUE clocal;
+
+   clocal = rb_define_class_under(outer, "LocalGlobal", rb_cObject);
+
+   rb_define_alloc_func(clocal, local_alloc);
+
+   rb_define_method(clocal, "initialize", local_m_initialize, -1);
+   rb_define_method(clocal, "m_set", ex_local_m_set, -1);
+   rb_define_method(clocal, "m_get", ex_local_m_get, -1);
+   rb_define_method(clocal, "m_data", ex_local_m_data, -1);
+   rb_define_method(clocal, "m_kill", ex_local_m_kill, -1);
+   rb_define_method(clocal, "m_order", ex_local_m_order, -1);
+   rb_define_method(clocal, "m_previous", ex_local_m_previous, -1);
+   rb_define_method(clocal, "m_size", ex_local_m_size, 0);
+   rb_define_method(clocal, "to_records", ex_local_to_records, 0);
+
+   return clocal;
+}
+
+
+static VALUE ex_local_m_set(int argc, VALUE *argv, VALUE self)
+{
+   int n, nkeys, len;
+   MGSTR keys[MG_MAX_VARGS], data;
+   VALUE keys_tmp[MG_MAX_VARGS], data_tmp;
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   if (argc < 1) {
+      MG_ERROR("mg_ruby: Missing data for 'LocalGlobal#m_set'");
+      return mg_r_nil;
+   }
+   nkeys = mg_local_keys(argc - 1, argv, keys, keys_tmp);
+   for (n = 0; n < nkeys; n ++) {
+      if (keys[n].size == 0) {
+         MG_ERROR("mg_ruby: A null subscript cannot be set in a LocalGlobal");
+         return mg_r_nil;
+      }
+   }
+   data_tmp = argv[argc - 1];
+   data.ps = (unsigned char *) mg_get_string(argv[argc - 1], &data_tmp, &len);
+   data.size = len;
+
+   if (mg_local_set(p_local, keys, nkeys, &data) < 0) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the LocalGlobal");
+   }
+
+   RB_GC_GUARD(data_tmp);
+   return argv[argc - 1];
+}
+
+
+static VALUE ex_local_m_get(int argc, VALUE *argv, VALUE self)
+{
+   int nkeys;
+   MGSTR keys[MG_MAX_VARGS];
+   VALUE keys_tmp[MG_MAX_VARGS];
+   MGLNODE *p_node, *update[MG_LOCAL_MAX_LEVEL];
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   nkeys = mg_local_keys(argc, argv, keys, keys_tmp);
+   mg_local_find(p_local, keys, nkeys, 0, update);
+
+   p_node = update[0]->next[0];
+   if (p_node && mg_local_compare(p_node, keys, nkeys, 0) == 0) {
+      return rb_str_new((char *) p_node->data.ps, p_node->data.size);
+   }
+
+   return rb_str_new2("");
+}
+
+
+static VALUE ex_local_m_data(int argc, VALUE *argv, VALUE self)
+{
+   int nkeys;
+   long result;
+   MGSTR keys[MG_MAX_VARGS];
+   VALUE keys_tmp[MG_MAX_VARGS];
+   MGLNODE *p_node, *update[MG_LOCAL_MAX_LEVEL];
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   nkeys = mg_local_keys(argc, argv, keys, keys_tmp);
+   mg_local_find(p_local, keys, nkeys, 0, update);
+
+   result = 0;
+   p_node = update[0]->next[0];
+   if (p_node && mg_local_compare(p_node, keys, nkeys, 0) == 0) {
+      result = 1;
+      p_node = p_node->next[0];
+   }
+   if (mg_local_prefix(p_node, keys, nkeys)) {
+      result += 10;
+   }
+
+   return rb_int2inum(result);
+}
+
+
+static VALUE ex_local_m_kill(int argc, VALUE *argv, VALUE self)
+{
+   int nkeys;
+   MGSTR keys[MG_MAX_VARGS];
+   VALUE keys_tmp[MG_MAX_VARGS];
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   nkeys = mg_local_keys(argc, argv, keys, keys_tmp);
+
+   return rb_int2inum(mg_local_kill(p_local, keys, nkeys));
+}
+
+
+/* The next subscript at the level of the last subscript given ("" to start, and at the end) */
+static VALUE ex_local_m_order(int argc, VALUE *argv, VALUE self)
+{
+   int nkeys;
+   MGSTR keys[MG_MAX_VARGS];
+   VALUE keys_tmp[MG_MAX_VARGS];
+   MGLNODE *p_node, *update[MG_LOCAL_MAX_LEVEL];
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   if (argc < 1) {
+      MG_ERROR("mg_ruby: Missing subscript for 'LocalGlobal#m_order'");
+      return mg_r_nil;
+   }
+   nkeys = mg_local_keys(argc, argv, keys, keys_tmp);
+   mg_local_find(p_local, keys, nkeys, 1, update);
+
+   p_node = update[0]->next[0];
+   if (mg_local_prefix(p_node, keys, nkeys - 1) && p_node->nkeys >= nkeys) {
+      return rb_str_new((char *) p_node->keys[nkeys - 1].ps, p_node->keys[nkeys - 1].size);
+   }
+
+   return rb_str_new2("");
+}
+
+
+/* The previous subscript at the level of the last subscript given ("" to start from the end, and at the end) */
+static VALUE ex_local_m_previous(int argc, VALUE *argv, VALUE self)
+{
+   int nkeys;
+   MGSTR keys[MG_MAX_VARGS];
+   VALUE keys_tmp[MG_MAX_VARGS];
+   MGLNODE *p_node, *update[MG_LOCAL_MAX_LEVEL];
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   if (argc < 1) {
+      MG_ERROR("mg_ruby: Missing subscript for 'LocalGlobal#m_previous'");
+      return mg_r_nil;
+   }
+   nkeys = mg_local_keys(argc, argv, keys, keys_tmp);
+   if (keys[nkeys - 1].size == 0) {
+      p_node = mg_local_find(p_local, keys, nkeys - 1, 1, update);
+   }
+   else {
+      p_node = mg_local_find(p_local, keys, nkeys, 0, update);
+   }
+
+   if (p_node != p_local->head && mg_local_prefix(p_node, keys, nkeys - 1) && p_node->nkeys >= nkeys) {
+      return rb_str_new((char *) p_node->keys[nkeys - 1].ps, p_node->keys[nkeys - 1].size);
+   }
+
+   return rb_str_new2("");
+}
+
+
+static VALUE ex_local_m_size(VALUE self)
+{
+   MGLOCAL *p_local;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   return rb_int2inum(p_local->count);
+}
+
+
+/* Return the nodes, in order, as an array of records in the form used by the ma_local_* methods */
+static VALUE ex_local_to_records(VALUE self)
+{
+   int n;
+   MGBUF mgbuf, *p_buf;
+   MGLNODE *p_node;
+   MGLOCAL *p_local;
+   VALUE records;
+
+   TypedData_Get_Struct(self, MGLOCAL, &local_type, p_local);
+
+   records = rb_ary_new_capa(p_local->count);
+
+   p_buf = &mgbuf;
+   mg_buf_init(p_buf, MG_BUFSIZE, MG_BUFSIZE);
+
+   for (p_node = p_local->head->next[0]; p_node; p_node = p_node->next[0]) {
+      p_buf->data_size = 0;
+      for (n = 0; n < p_node->nkeys; n ++) {
+         mg_request_add(NULL, -1, p_buf, p_node->keys[n].ps, p_node->keys[n].size, 0, MG_TX_AKEY);
+      }
+      mg_request_add(NULL, -1, p_buf, p_node->data.ps, p_node->data.size, 0, MG_TX_DATA);
+      rb_ary_push(records, rb_str_new((char *) p_buf->p_buffer, p_buf->data_size));
+   }
+   mg_buf_free(p_buf);
+
+   return records;
+}
+
+
+#if defined(_WIN32)
+__declspec(dllexport) void __cdecl Init_mg_ruby() {
+#else
+void Init_mg_ruby() {
+#endif
+
+   mg_ruby = rb_define_class("MG_RUBY", rb_cObject);
+   rb_define_alloc_func(mg_ruby, mg_ruby_alloc); /* v2.4.45 */
+
+   mg_mclass = ex_m_mclass(); /* v2.3.43 */
+   mg_pipeline = ex_m_pipeline_class(); /* v2.4.46 */
+   mg_future = ex_m_future_class(); /* v2.4.46 */
+   mg_local = ex_m_local_class(mg_ruby); /* v2.4.46 */
+/*
+   rb_define_method(mg_ruby, "initialize", t_init, 0);
+   rb_define_method(mg_ruby, "add", t_add, 1);
+*/
+   rb_define_method(mg_ruby, "m_ext_version", ex_m_ext_version, 0);
+
+   rb_define_method(mg_ruby, "m_set_host", ex_m_set_host, 4);
+   rb_define_method(mg_ruby, "m_set_uci", ex_m_set_uci, 1);
+   rb_define_method(mg_ruby, "m_set_server", ex_m_set_server, 1);
+   rb_define_method(mg_ruby, "m_set_timeout", ex_m_set_timeout, 1);
+   rb_define_method(mg_ruby, "m_set_pool_wait", ex_m_set_pool_wait, 1); /* v2.4.45 */
+   rb_define_method(mg_ruby, "m_set_pool_affinity", ex_m_set_pool_affinity, 1);
+   rb_define_method(mg_ruby, "m_set_pool_size", ex_m_set_pool_size, 2);
+   rb_define_method(mg_ruby, "m_set_pool_idle_timeout", ex_m_set_pool_idle_timeout, 1);
+   rb_define_method(mg_ruby, "m_set_prefetch", ex_m_set_prefetch, 1); /* v2.4.46 */
+   rb_define_method(mg_ruby, "m_set_cache", ex_m_set_cache, -1); /* v2.4.46 */
+   rb_define_method(mg_ruby, "m_clear_cache", ex_m_clear_cache, 0);
+   rb_define_method(mg_ruby, "m_invalidate_cache", ex_m_invalidate_cache, -1);
+   rb_define_method(mg_ruby, "m_get_cache_stats", ex_m_get_cache_stats, 0);
+   rb_define_method(mg_ruby, "m_get_pool_stats", ex_m_get_pool_stats, 0);
+
+   rb_define_method(mg_ruby, "m_bind_server_api", ex_m_bind_server_api, 6);
+   rb_define_method(mg_ruby, "m_release_server_api", ex_m_release_server_api, 0);
+
+   rb_define_method(mg_ruby, "m_set_storage_mode", ex_m_set_storage_mode, 1);
+   rb_define_method(mg_ruby, "m_get_last_error", ex_m_get_last_error, 0);
+
+   rb_define_method(mg_ruby, "m_set", ex_m_set, -1);
+   rb_define_method(mg_ruby, "ma_set", ex_ma_set, 3);
+   rb_define_method(mg_ruby, "m_get", ex_m_get, -1);
+   rb_define_method(mg_ruby, "ma_get", ex_ma_get, 2);
+   rb_define_method(mg_ruby, "m_kill", ex_m_kill, -1);
+   rb_define_method(mg_ruby, "ma_kill", ex_ma_kill, 2);
+   rb_define_method(mg_ruby, "m_delete", ex_m_kill, -1);
+   rb_define_method(mg_ruby, "ma_delete", ex_ma_kill, 2);
+   rb_define_method(mg_ruby, "m_data", ex_m_data, -1);
+   rb_define_method(mg_ruby, "ma_data", ex_ma_data, 2);
+   rb_define_method(mg_ruby, "m_defined", ex_m_data, -1);
+   rb_define_method(mg_ruby, "ma_defined", ex_ma_data, 2);
+   rb_define_method(mg_ruby, "m_order", ex_m_order, -1);
+   rb_define_method(mg_ruby, "ma_order", ex_ma_order, 2);
+   rb_define_method(mg_ruby, "m_previous", ex_m_previous, -1);
+   rb_define_method(mg_ruby, "ma_previous", ex_ma_previous, 2);
+
+   /* v2.2.41 */
+   rb_define_method(mg_ruby, "m_increment", ex_m_increment, -1);
+   rb_define_method(mg_ruby, "m_tstart", ex_m_tstart, -1);
+   rb_define_method(mg_ruby, "m_tlevel", ex_m_tlevel, -1);
+   rb_define_method(mg_ruby, "m_tcommit", ex_m_tcommit, -1);
+   rb_define_method(mg_ruby, "m_trollback", ex_m_trollback, -1);
+   rb_define_method(mg_ruby, "m_sleep", ex_m_sleep, 1);
+
+   rb_define_method(mg_ruby, "ma_merge_to_db", ex_ma_merge_to_db, 4);
+   rb_define_method(mg_ruby, "ma_merge_from_db", ex_ma_merge_from_db, 4);
+
+   rb_define_method(mg_ruby, "m_pipeline", ex_m_pipeline, 0); /* v2.4.46 */
+   rb_define_alias(mg_ruby, "pipeline", "m_pipeline");
+   rb_define_method(mg_ruby, "m_get_multi", ex_m_get_multi, 1); /* v2.4.46 */
+   rb_define_method(mg_ruby, "m_set_multi", ex_m_set_multi, 1);
+   rb_define_method(mg_ruby, "m_kill_multi", ex_m_kill_multi, 1);
+   rb_define_method(mg_ruby, "m_order_batch", ex_m_order_batch, -1); /* v2.4.46 */
+   rb_define_method(mg_ruby, "m_order_data", ex_m_order_data, -1);
+   rb_define_method(mg_ruby, "m_previous_data", ex_m_previous_data, -1);
+   rb_define_method(mg_ruby, "each_node", ex_each_node, -1);
+   rb_define_method(mg_ruby, "parallel_scan", ex_parallel_scan, -1);
+   rb_define_method(mg_ruby, "m_get_tree", ex_m_get_tree, -1);
+   rb_define_method(mg_ruby, "m_set_tree", ex_m_set_tree, -1);
+   rb_define_method(mg_ruby, "m_set_async", ex_m_set_async, -1); /* v2.4.46 */
+   rb_define_method(mg_ruby, "m_get_async", ex_m_get_async, -1);
+   rb_define_method(mg_ruby, "m_kill_async", ex_m_kill_async, -1);
+   rb_define_method(mg_ruby, "m_data_async", ex_m_data_async, -1);
+   rb_define_method(mg_ruby, "m_order_async", ex_m_order_async, -1);
+   rb_define_method(mg_ruby, "m_previous_async", ex_m_previous_async, -1);
+   rb_define_method(mg_ruby, "m_increment_async", ex_m_increment_async, -1);
+   rb_define_method(mg_ruby, "m_function_async", ex_m_function_async, -1);
+
+   rb_define_method(mg_ruby, "m_function", ex_m_function, -1);
+   rb_define_method(mg_ruby, "ma_function", ex_ma_function, 3);
+   rb_define_method(mg_ruby, "m_classmethod", ex_m_classmethod, -1);
+   rb_define_method(mg_ruby, "ma_classmethod", ex_ma_classmethod, 4);
+
+   rb_define_method(mg_ruby, "ma_html_ex", ex_ma_html_ex, 3);
+   rb_define_method(mg_ruby, "ma_html_classmethod_ex", ex_ma_html_classmethod_ex, 4);
+   rb_define_method(mg_ruby, "ma_http_ex", ex_ma_http_ex, 2);
+   rb_define_method(mg_ruby, "ma_arg_set", ex_ma_arg_set, 4);
+
+   rb_define_method(mg_ruby, "ma_get_stream_data", ex_ma_get_stream_data, 1);
+   rb_define_method(mg_ruby, "ma_return_to_client", ex_ma_return_to_client, 1);
+
+   rb_define_method(mg_ruby, "ma_local_set", ex_ma_local_set, 4);
+   rb_define_method(mg_ruby, "ma_local_get", ex_ma_local_get, 3);
+   rb_define_method(mg_ruby, "ma_local_data", ex_ma_local_data, 3);
+   rb_define_method(mg_ruby, "ma_local_kill", ex_ma_local_kill, 3);
+   rb_define_method(mg_ruby, "ma_local_order", ex_ma_local_order, 3);
+   rb_define_method(mg_ruby, "ma_local_previous", ex_ma_local_previous, 3);
+   rb_define_method(mg_ruby, "ma_local_sort", ex_ma_local_sort, 1);
+
+   dbx_init();
+
+}
+
+
+
+int mg_type(VALUE item)
+{
+   int type, result;
+
+   if (!item)
+      return -1;
+
+   type = TYPE(item);
+
+   if (type == T_STRING)
+      result = MG_T_STRING;
+   else if (type == T_FIXNUM)
+      result = MG_T_INTEGER;
+   else if (type == T_BIGNUM)
+      result = MG_T_INTEGER;
+   else if (type == T_FLOAT)
+      result = MG_T_FLOAT;
+   else if (type == T_ARRAY)
+      result = MG_T_LIST;
+   else
+      result = MG_T_VAR;
+
+   return result;
+}
+
+
+/* v2.4.46 */
+/* Is this a number in the canonic form that M collates ahead of strings? */
+int mg_is_canonic_number(char *p, long len)
+{
+   long n, dot;
+
+   if (len > 0 && p[0] == '-') {
+      p ++;
+      len --;
+      if (len == 1 && p[0] == '0') {
+         return 0;
+      }
+   }
+   if (len < 1 || len > 24) {
+      return 0;
+   }
+   if (len == 1 && p[0] == '0') {
+      return 1;
+   }
+   if (p[0] == '0') {
+      return 0;
+   }
+   for (n = 0, dot = -1; n < len; n ++) {
+      if (p[n] == '.') {
+         if (dot != -1)
+            return 0;
+         dot = n;
+      }
+      else if (p[n] < '0' || p[n] > '9') {
+         return 0;
+      }
+   }
+   if (dot != -1 && (dot == (len - 1) || p[len - 1] == '0')) {
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* Compare two subscripts in M collating sequence: the empty string, then canonic numbers, then strings */
+int mg_collate(char *p1, long len1, char *p2, long len2)
+{
+   int num1, num2, result;
+
+   if (len1 == 0 || len2 == 0) {
+      return (len1 == len2) ? 0 : (len1 == 0 ? -1 : 1);
+   }
+
+   num1 = mg_is_canonic_number(p1, len1);
+   num2 = mg_is_canonic_number(p2, len2);
+   if (num1 && num2) {
+      return mg_collate_number(p1, len1, p2, len2);
+   }
+   if (num1 || num2) {
+      return num1 ? -1 : 1;
+   }
+
+   result = memcmp((void *) p1, (void *) p2, (size_t) (len1 < len2 ? len1 : len2));
+   if (result == 0) {
+      result = (len1 < len2) ? -1 : ((len1 > len2) ? 1 : 0);
+   }
+
+   return (result < 0) ? -1 : ((result > 0) ? 1 : 0);
+}
+
+
+/*
+   Compare two canonic numbers without converting them: the longer integer part is the larger magnitude, and
+   otherwise the digits compare in byte order (canonic numbers have no leading or trailing zeros)
+*/
+int mg_collate_number(char *p1, long len1, char *p2, long len2)
+{
+   int neg, result;
+   long int1, int2;
+
+   neg = (p1[0] == '-');
+   if (neg != (p2[0] == '-')) {
+      return neg ? -1 : 1;
+   }
+   if (neg) {
+      p1 ++;
+      len1 --;
+      p2 ++;
+      len2 --;
+   }
+
+   /* zero has an empty integer part, so that it collates before .5 */
+   for (int1 = 0; int1 < len1 && p1[int1] != '.'; int1 ++)
+      ;
+   for (int2 = 0; int2 < len2 && p2[int2] != '.'; int2 ++)
+      ;
+   if (len1 == 1 && p1[0] == '0') {
+      int1 = 0;
+      len1 = 0;
+   }
+   if (len2 == 1 && p2[0] == '0') {
+      int2 = 0;
+      len2 = 0;
+   }
+
+   if (int1 != int2) {
+      result = (int1 < int2) ? -1 : 1;
+   }
+   else if (len1 <= 0 || len2 <= 0) {
+      result = (len1 < len2) ? -1 : ((len1 > len2) ? 1 : 0);
+   }
+   else {
+      result = memcmp((void *) p1, (void *) p2, (size_t) (len1 < len2 ? len1 : len2));
+      if (result == 0) {
+         result = (len1 < len2) ? -1 : ((len1 > len2) ? 1 : 0);
+      }
+      result = (result < 0) ? -1 : ((result > 0) ? 1 : 0);
+   }
+
+   return neg ? -result : result;
+}
+
+
+int mg_get_array_size(VALUE rb_array)
+{
+   int result;
+
+   result = 0;
+   result = RARRAY_LEN(rb_array);
+   return result;
+}
+
+
+int mg_get_integer(VALUE item)
+{
+   int t, result;
+   char *ps;
+
+   result = 0;
+   t = mg_type(item);
+
+   if (t == MG_T_INTEGER)
+      result = (int) rb_num2long(item);
+   else if (t == MG_T_FLOAT) {
+      result = (int) rb_num2dbl(item);
+   }
+   else {
+      ps = rb_string_value_cstr(&item);
+      if (ps)
+         result = (int) strtol(ps, NULL, 10);
+      else
+         result = 0;
+   }
+
+   return result;
+}
+
+
+double mg_get_float(VALUE item)
+{
+   int t;
+   double result;
+   char *ps;
+
+   result = 0;
+   t = mg_type(item);
+
+   if (t == MG_T_INTEGER)
+      result = (double) rb_num2long(item);
+   else if (t == MG_T_FLOAT) {
+      result = (double) rb_num2dbl(item);
+   }
+   else {
+      ps = rb_string_value_cstr(&item);
+      if (ps)
+         result = (double) strtod(ps, NULL);
+      else
+         result = 0;
+   }
+
+   return result;
+}
+
+
+
+char * mg_get_string(VALUE item, VALUE * item_tmp, int * size)
+{
+   int t, x;
+   double y;
+   char * result;
+   char buffer[64];
+
+   *size = 0;
+   result = NULL;
+   t = mg_type(item);
+   
+   if (t == MG_T_INTEGER) {
+      x = (int) rb_num2long(item);
+      sprintf(buffer, "%d", x);
+      *size = (int) strlen(buffer);
+      *item_tmp = rb_str_new2(buffer);
+      result = rb_string_value_cstr(item_tmp);
+
+   }
+   else if (t == MG_T_FLOAT) {
+      y = (double) rb_num2dbl(item);
+      sprintf(buffer, "%f", y);
+      *size = (int) strlen(buffer);
+      *item_tmp = rb_str_new2(buffer);
+      result = rb_string_value_cstr(item_tmp);
+   }
+   else {
+      result = rb_string_value_ptr(&item);
+      *size = RSTRING_LEN(item);
+      if (*size >= MG_IOV_MIN) {
+         /* v2.4.46: a value this large is sent from the string itself with the GVL released (see mg_request_defer()), so send it from a frozen copy */
+         /* that shares the string's buffer: if another thread changes the string in the meantime, the string gets a buffer of its own */
+         *item_tmp = rb_str_new_frozen(item);
+         result = RSTRING_PTR(*item_tmp);
+      }
+   }
 
-   rb_define_method(mg_ruby, "m_set_storage_mode", ex_m_set_storage_mode, 1);
-   rb_define_method(mg_ruby, "m_get_last_error", ex_m_get_last_error, 0);
+   return result;
+}
 
-   rb_define_method(mg_ruby, "m_set", ex_m_set, -1);
-   rb_define_method(mg_ruby, "ma_set", ex_ma_set, 3);
-   rb_define_method(mg_ruby, "m_get", ex_m_get, -1);
-   rb_define_method(mg_ruby, "ma_get", ex_ma_get, 2);
-   rb_define_method(mg_ruby, "m_kill", ex_m_kill, -1);
-   rb_define_method(mg_ruby, "ma_kill", ex_ma_kill, 2);
-   rb_define_method(mg_ruby, "m_delete", ex_m_kill, -1);
-   rb_define_method(mg_ruby, "ma_delete", ex_ma_kill, 2);
-   rb_define_method(mg_ruby, "m_data", ex_m_data, -1);
-   rb_define_method(mg_ruby, "ma_data", ex_ma_data, 2);
-   rb_define_method(mg_ruby, "m_defined", ex_m_data, -1);
-   rb_define_method(mg_ruby, "ma_defined", ex_ma_data, 2);
-   rb_define_method(mg_ruby, "m_order", ex_m_order, -1);
-   rb_define_method(mg_ruby, "ma_order", ex_ma_order, 2);
-   rb_define_method(mg_ruby, "m_previous", ex_m_previous, -1);
-   rb_define_method(mg_ruby, "ma_previous", ex_ma_previous, 2);
 
-   /* v2.2.41 */
-   rb_define_method(mg_ruby, "m_increment", ex_m_increment, -1);
-   rb_define_method(mg_ruby, "m_tstart", ex_m_tstart, -1);
-   rb_define_method(mg_ruby, "m_tlevel", ex_m_tlevel, -1);
-   rb_define_method(mg_ruby, "m_tcommit", ex_m_tcommit, -1);
-   rb_define_method(mg_ruby, "m_trollback", ex_m_trollback, -1);
-   rb_define_method(mg_ruby, "m_sleep", ex_m_sleep, 1);
+int mg_get_vargs(int argc, VALUE *argv, MGVARGS *pvargs, int context)
+{
+   int n;
+
+   if (context) {
+      for (n = 0; n < argc; n ++) {
+         pvargs->cvars[n].ps = (unsigned char *) mg_get_string(argv[n], &(pvargs->rvars[n]), &(pvargs->cvars[n].size));
+      }
+   }
+   else {
+      for (n = 0; n < argc; n ++) {
+         pvargs->cvars[n].ps = (unsigned char *) mg_get_string(argv[n], &(pvargs->rvars[n]), &(pvargs->cvars[n].size));
+         if (n == 0) {
+            pvargs->global = (char *) pvargs->cvars[n].ps;
+            pvargs->global_len = pvargs->cvars[n].size;
+         }
+      }
+   }
+
+   return n;
+}
+
+
+
+int mg_get_keys(VALUE keys, MGSTR * ckeys, VALUE *keys_tmp, char *krec)
+{
+   int kmax, max, n, len;
+   VALUE p;
+
+   kmax = 32;
+
+   p = rb_ary_entry(keys, 0);
+   max = mg_get_integer(p);
+
+
+   for (n = 1; n <= max; n ++) {
+      p = rb_ary_entry(keys, n);
+
+      ckeys[n].ps = mg_get_string(p, &keys_tmp[n], &len);
+      ckeys[n].size = len;
+   }
+
+   return max;
+}
+
+
+
+int mg_set_list_item(VALUE list, int index, VALUE item)
+{
+
+   rb_ary_store(list, index, item);
+
+   return index;
+}
+
+
+int mg_kill_list(VALUE list)
+{
+   int result;
+
+   result = (int) rb_ary_clear(list);
+
+   return result;
+}
+
+
+int mg_kill_list_item(VALUE list, int index)
+{
+   int result;
+
+   result = (int) rb_ary_delete_at(list, index);
+
+   return result;
+}
+
+
+/* v2.4.45: each MG_RUBY object carries its own server definition and connection pool */
+MGPAGE * mg_ppage(VALUE self)
+{
+   MGPAGE *p_page;
+
+   TypedData_Get_Struct(self, MGPAGE, &mg_ruby_type, p_page);
+
+   return p_page;
+}
+
+
+int mg_ppage_init(MGPAGE * p_page)
+{
+   p_page->p_srv->mem_error = 0;
+   p_page->p_srv->storage_mode = 0;
+   p_page->p_srv->timeout = 0;
+   p_page->p_srv->no_retry = 0;
+
+   strcpy(p_page->p_srv->server, "");
+   strcpy(p_page->p_srv->username, "");
+   strcpy(p_page->p_srv->password, "");
+
+   strcpy(p_page->p_srv->ip_address, MG_HOST);
+   p_page->p_srv->port = MG_PORT;
+   strcpy(p_page->p_srv->uci, MG_UCI);
+
+   /* v2.4.45 */
+   p_page->p_srv->pcon = NULL;
+   p_page->p_srv->pool.affinity = 1;
+   p_page->p_srv->pool.wait_timeout = MG_POOL_WAIT;
+   p_page->p_srv->pool.min = 0;
+   p_page->p_srv->pool.max = MG_MAXCON;
+   p_page->p_srv->pool.idle_timeout = 0;
+   mg_pool_init(p_page->p_srv);
+
+   /* v2.4.46 */
+   p_page->prefetch.prefix = Qnil;
+   p_page->prefetch.records = Qnil;
+   p_page->prefetch.last = Qnil;
+   p_page->prefetch.owner = Qnil;
+   p_page->prefetch.max = MG_PREFETCH_MAX;
+
+   return 1;
+}
+
+
+/* v2.4.45 */
+VALUE mg_ruby_alloc(VALUE self)
+{
+   MGPAGE *p_page;
+
+   /* allocate */
+   p_page = (MGPAGE *) mg_malloc(sizeof(MGPAGE), 0);
+   if (!p_page) {
+      rb_raise(rb_eNoMemError, "mg_ruby: Unable to allocate memory for the server definition");
+   }
+   memset((void *) p_page, 0, sizeof(MGPAGE));
+   p_page->p_srv = &(p_page->srv);
+   mg_ppage_init(p_page);
+
+   /* wrap */
+   return TypedData_Wrap_Struct(self, &mg_ruby_type, p_page);
+}
+
+
+/* v2.4.46 */
+void mg_ruby_mark(void *data)
+{
+   MGPAGE *p_page;
+
+   p_page = (MGPAGE *) data;
+
+   rb_gc_mark(p_page->prefetch.prefix);
+   rb_gc_mark(p_page->prefetch.records);
+   rb_gc_mark(p_page->prefetch.last);
+   rb_gc_mark(p_page->prefetch.owner);
+}
+
+
+/* v2.4.45 */
+void mg_ruby_free(void *data)
+{
+   MGPAGE *p_page;
+
+   p_page = (MGPAGE *) data;
+
+   mg_cache_free(p_page); /* v2.4.46 */
+   mg_pool_destroy(p_page->p_srv);
+
+   if (p_page->p_srv->p_env) {
+      mg_buf_free(p_page->p_srv->p_env);
+      mg_free((void *) p_page->p_srv->p_env, 0);
+      p_page->p_srv->p_env = NULL;
+   }
+
+   /* v2.4.46: at exit, objects are freed in no particular order so the last future frees the page */
+   if (p_page->futures > 0) {
+      p_page->destroyed = 1;
+      return;
+   }
+
+   mg_free(data, 0);
+}
+
+
+/* v2.4.45 */
+size_t mg_ruby_size(const void *data)
+{
+   size_t size;
+   const MGPAGE *p_page;
+
+   p_page = (const MGPAGE *) data;
+
+   size = sizeof(MGPAGE);
+   if (p_page->srv.pool.created) {
+      size += (sizeof(PDBXCON) + sizeof(int)) * p_page->srv.pool.capacity;
+      size += sizeof(DBXCON) * p_page->srv.pool.size;
+   }
+   if (p_page->cache) { /* v2.4.46 */
+      size += sizeof(MGCACHE) + (sizeof(MGCENTRY) * p_page->cache->size) + (sizeof(int) * p_page->cache->nbuckets) + p_page->cache->bytes;
+   }
+
+   return size;
+}
+
+
+/* v2.4.45 */
+int mg_db_connect_nogvl(MGSRV *p_srv, int *p_chndle, short context)
+{
+   MGNOGVL nogvl;
+
+   if (p_srv->mode == 2) {
+      return mg_db_connect(p_srv, p_chndle, context);
+   }
+
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+   /* v2.4.46 */
+   if (!NIL_P(rb_fiber_scheduler_current())) {
+      return mg_db_connect_fiber(p_srv, p_chndle, context, rb_fiber_scheduler_current());
+   }
+#endif
+
+   memset((void *) &nogvl, 0, sizeof(MGNOGVL));
+   nogvl.p_srv = p_srv;
+   nogvl.chndle = -1;
+   nogvl.p_chndle = p_chndle;
+   nogvl.context = context;
+   *p_chndle = -1;
+
+   for (;;) {
+      rb_thread_call_without_gvl2(mg_db_connect_nogvl_ex, (void *) &nogvl, mg_db_connect_nogvl_ubf, (void *) &nogvl);
+      if (nogvl.done && !nogvl.interrupted) {
+         return nogvl.result;
+      }
+      if (nogvl.done && nogvl.result && *p_chndle >= 0) {
+         mg_db_disconnect(p_srv, *p_chndle, 1);
+      }
+      /* not started, or the wait was cut short: service the interrupts (which raise if they must) and try again */
+      mg_db_nogvl_interrupts(&nogvl);
+      nogvl.done = 0;
+      nogvl.interrupted = 0;
+      nogvl.cancel = 0;
+      nogvl.result = 0;
+      *p_chndle = -1;
+   }
+
+   return 0;
+}
+
+
+int mg_db_send_nogvl(MGSRV *p_srv, int chndle, MGBUF *p_buf, int mode)
+{
+   MGNOGVL nogvl;
+   MGFIBER fiber;
+
+   if (p_srv->mode == 2) {
+      return mg_db_send(p_srv, chndle, p_buf, mode);
+   }
+
+   if (mg_fiber_begin(&fiber, p_srv, chndle)) { /* v2.4.46 */
+      return mg_fiber_end(&fiber, mg_db_send(p_srv, chndle, p_buf, mode));
+   }
+
+   memset((void *) &nogvl, 0, sizeof(MGNOGVL));
+   nogvl.p_srv = p_srv;
+   nogvl.chndle = chndle;
+   nogvl.p_buf = p_buf;
+   nogvl.mode = mode;
+   mg_db_nogvl_begin(&nogvl);
+
+   for (;;) {
+      rb_thread_call_without_gvl2(mg_db_send_nogvl_ex, (void *) &nogvl, mg_db_nogvl_ubf, (void *) &nogvl);
+      if (nogvl.done) {
+         break;
+      }
+      mg_db_nogvl_interrupts(&nogvl);
+   }
+
+   return mg_db_nogvl_done(&nogvl);
+}
+
+
+int mg_db_receive_nogvl(MGSRV *p_srv, int chndle, MGBUF *p_buf, int size, int mode)
+{
+   MGNOGVL nogvl;
+   MGFIBER fiber;
+
+   /* API mode calls into the DB engine which relies on the GVL for serialization */
+   if (p_srv->mode == 2) {
+      return mg_db_receive(p_srv, chndle, p_buf, size, mode);
+   }
+
+   if (mg_fiber_begin(&fiber, p_srv, chndle)) { /* v2.4.46 */
+      return mg_fiber_end(&fiber, mg_db_receive(p_srv, chndle, p_buf, size, mode));
+   }
+
+   memset((void *) &nogvl, 0, sizeof(MGNOGVL));
+   nogvl.p_srv = p_srv;
+   nogvl.chndle = chndle;
+   nogvl.p_buf = p_buf;
+   nogvl.size = size;
+   nogvl.mode = mode;
+   mg_db_nogvl_begin(&nogvl);
+
+   for (;;) {
+      rb_thread_call_without_gvl2(mg_db_receive_nogvl_ex, (void *) &nogvl, mg_db_nogvl_ubf, (void *) &nogvl);
+      if (nogvl.done) {
+         break;
+      }
+      mg_db_nogvl_interrupts(&nogvl);
+   }
+
+   return mg_db_nogvl_done(&nogvl);
+}
+
+
+/* v2.4.45 */
+/*
+   Receive a response.  A payload too large for the connection's buffer is read straight into a
+   Ruby string (returned in *p_data) instead of being buffered and then copied.
+*/
+int mg_db_receive_string_nogvl(MGSRV *p_srv, int chndle, MGBUF *p_buf, VALUE *p_data)
+{
+   int n;
+   unsigned long size, got;
+   char error[DBX_ERROR_SIZE];
+   VALUE data;
+   MGNOGVL nogvl;
+   MGFIBER fiber;
+
+   *p_data = Qnil;
+
+   if (p_srv->mode == 2) {
+      return mg_db_receive(p_srv, chndle, p_buf, MG_BUFSIZE, 0);
+   }
+
+   n = mg_db_receive_nogvl(p_srv, chndle, p_buf, MG_BUFSIZE, MG_RECV_PARTIAL);
+   if (p_buf->data_size < MG_RECV_HEAD) {
+      return n;
+   }
+
+   size = (unsigned long) mg_decode_size(p_buf->p_buffer, 5, MG_CHUNK_SIZE_BASE);
+   got = p_buf->data_size - MG_RECV_HEAD;
+   if (got >= size) {
+      return n;
+   }
+
+   data = rb_str_buf_new((long) size);
+   memcpy((void *) RSTRING_PTR(data), (void *) (p_buf->p_buffer + MG_RECV_HEAD), (size_t) got);
+
+   memset((void *) &nogvl, 0, sizeof(MGNOGVL));
+   nogvl.p_srv = p_srv;
+   nogvl.chndle = chndle;
+   nogvl.p_data = (unsigned char *) RSTRING_PTR(data) + got;
+   nogvl.size = (int) (size - got);
+
+   if (mg_fiber_begin(&fiber, p_srv, chndle)) { /* v2.4.46 */
+      n = mg_fiber_end(&fiber, mg_db_receive_body(p_srv, chndle, nogvl.p_data, (unsigned long) nogvl.size));
+   }
+   else {
+      mg_db_nogvl_begin(&nogvl);
+      for (;;) {
+         rb_thread_call_without_gvl2(mg_db_receive_body_nogvl_ex, (void *) &nogvl, mg_db_nogvl_ubf, (void *) &nogvl);
+         if (nogvl.done) {
+            break;
+         }
+         mg_db_nogvl_interrupts(&nogvl);
+      }
+
+      n = mg_db_nogvl_done(&nogvl);
+   }
+   if (n < nogvl.size) {
+      strcpy(error, p_srv->pcon[chndle]->error);
+      mg_db_disconnect(p_srv, chndle, 0);
+      MG_ERROR(error);
+      return 0;
+   }
+
+   rb_str_set_len(data, (long) size);
+   *p_data = data;
+
+   RB_GC_GUARD(data);
+   return (int) (p_buf->data_size + n);
+}
+
+
+/* v2.4.45 */
+/* v2.4.46 */
+/*
+   Read the response to a request and then release the connection.  The buffer belongs to the connection and is
+   reused by the next request made on it (possibly by another thread) so the text of an error is copied out first.
+*/
+VALUE mg_db_response(MGPAGE *p_page, int chndle, MGBUF *p_buf, VALUE r_data)
+{
+   VALUE error;
+
+   if (mg_get_error(p_page->p_srv, (char *) p_buf->p_buffer)) {
+      error = rb_str_new2((char *) p_buf->p_buffer + MG_RECV_HEAD);
+      mg_db_disconnect(p_page->p_srv, chndle, 1);
+      rb_exc_raise(rb_exc_new_str(rb_eRuntimeError, error));
+      return mg_r_nil;
+   }
+
+   r_data = mg_response_string(p_buf, r_data);
+   mg_db_disconnect(p_page->p_srv, chndle, 1);
 
-   rb_define_method(mg_ruby, "ma_merge_to_db", ex_ma_merge_to_db, 4);
-   rb_define_method(mg_ruby, "ma_merge_from_db", ex_ma_merge_from_db, 4);
+   return r_data;
+}
 
-   rb_define_method(mg_ruby, "m_function", ex_m_function, -1);
-   rb_define_method(mg_ruby, "ma_function", ex_ma_function, 3);
-   rb_define_method(mg_ruby, "m_classmethod", ex_m_classmethod, -1);
-   rb_define_method(mg_ruby, "ma_classmethod", ex_ma_classmethod, 4);
 
-   rb_define_method(mg_ruby, "ma_html_ex", ex_ma_html_ex, 3);
-   rb_define_method(mg_ruby, "ma_html_classmethod_ex", ex_ma_html_classmethod_ex, 4);
-   rb_define_method(mg_ruby, "ma_http_ex", ex_ma_http_ex, 2);
-   rb_define_method(mg_ruby, "ma_arg_set", ex_ma_arg_set, 4);
+/* For responses that are parsed in place: copy the response into a String, release the connection and point 'p_copy' at the copy */
+VALUE mg_db_response_copy(MGPAGE *p_page, int chndle, MGBUF *p_buf, MGBUF *p_copy)
+{
+   VALUE response;
 
-   rb_define_method(mg_ruby, "ma_get_stream_data", ex_ma_get_stream_data, 1);
-   rb_define_method(mg_ruby, "ma_return_to_client", ex_ma_return_to_client, 1);
+   response = rb_str_buf_new((long) p_buf->data_size + 1);
+   memcpy((void *) RSTRING_PTR(response), (void *) p_buf->p_buffer, (size_t) p_buf->data_size);
+   rb_str_set_len(response, (long) p_buf->data_size);
 
-   rb_define_method(mg_ruby, "ma_local_set", ex_ma_local_set, 4);
-   rb_define_method(mg_ruby, "ma_local_get", ex_ma_local_get, 3);
-   rb_define_method(mg_ruby, "ma_local_data", ex_ma_local_data, 3);
-   rb_define_method(mg_ruby, "ma_local_kill", ex_ma_local_kill, 3);
-   rb_define_method(mg_ruby, "ma_local_order", ex_ma_local_order, 3);
-   rb_define_method(mg_ruby, "ma_local_previous", ex_ma_local_previous, 3);
-   rb_define_method(mg_ruby, "ma_local_sort", ex_ma_local_sort, 1);
+   mg_db_disconnect(p_page->p_srv, chndle, 1);
 
-   dbx_init();
+   p_copy->p_buffer = (unsigned char *) RSTRING_PTR(response);
+   p_copy->size = p_buf->data_size;
+   p_copy->data_size = p_buf->data_size;
+   p_copy->increment_size = 0;
 
+   return response;
 }
 
 
+VALUE mg_response_string(MGBUF *p_buf, VALUE r_data)
+{
+   if (!NIL_P(r_data)) {
+      return r_data;
+   }
+
+   return rb_str_new((char *) p_buf->p_buffer + MG_RECV_HEAD, p_buf->data_size - MG_RECV_HEAD);
+}
 
-int mg_type(VALUE item)
+
+void * mg_db_connect_nogvl_ex(void *arg)
 {
-   int type, result;
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
 
-   if (!item)
-      return -1;
+   p_nogvl->result = mg_db_connect_ex(p_nogvl->p_srv, p_nogvl->p_chndle, p_nogvl->context, &(p_nogvl->cancel));
+   p_nogvl->done = 1;
 
-   type = TYPE(item);
+   return NULL;
+}
 
-   if (type == T_STRING)
-      result = MG_T_STRING;
-   else if (type == T_FIXNUM)
-      result = MG_T_INTEGER;
-   else if (type == T_BIGNUM)
-      result = MG_T_INTEGER;
-   else if (type == T_FLOAT)
-      result = MG_T_FLOAT;
-   else if (type == T_ARRAY)
-      result = MG_T_LIST;
-   else
-      result = MG_T_VAR;
 
-   return result;
+/* Called by Ruby (without the GVL) to wake a thread waiting for a pooled connection */
+void mg_db_connect_nogvl_ubf(void *arg)
+{
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
+
+   p_nogvl->interrupted = 1;
+   p_nogvl->cancel = 1;
+
+   mg_enter_critical_section((void *) &(p_nogvl->p_srv->pool.mutex));
+   mg_pool_wakeup(p_nogvl->p_srv);
+   mg_leave_critical_section((void *) &(p_nogvl->p_srv->pool.mutex));
+
+   return;
 }
 
 
-int mg_get_array_size(VALUE rb_array)
+void * mg_db_send_nogvl_ex(void *arg)
 {
-   int result;
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
 
-   result = 0;
-   result = RARRAY_LEN(rb_array);
-   return result;
+   p_nogvl->result = mg_db_send(p_nogvl->p_srv, p_nogvl->chndle, p_nogvl->p_buf, p_nogvl->mode);
+   p_nogvl->done = 1;
+
+   return NULL;
 }
 
 
-int mg_get_integer(VALUE item)
+void * mg_db_receive_nogvl_ex(void *arg)
 {
-   int t, result;
-   char *ps;
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
 
-   result = 0;
-   t = mg_type(item);
+   p_nogvl->result = mg_db_receive(p_nogvl->p_srv, p_nogvl->chndle, p_nogvl->p_buf, p_nogvl->size, p_nogvl->mode);
+   p_nogvl->done = 1;
 
-   if (t == MG_T_INTEGER)
-      result = (int) rb_num2long(item);
-   else if (t == MG_T_FLOAT) {
-      result = (int) rb_num2dbl(item);
+   return NULL;
+}
+
+
+/* v2.4.46 */
+int mg_db_receive_batch_nogvl(MGSRV *p_srv, int chndle, MGBUF *p_buf, int count)
+{
+   MGNOGVL nogvl;
+   MGFIBER fiber;
+
+   if (mg_fiber_begin(&fiber, p_srv, chndle)) {
+      return mg_fiber_end(&fiber, mg_db_receive_batch(p_srv, chndle, p_buf, count));
    }
-   else {
-      ps = rb_string_value_cstr(&item);
-      if (ps)
-         result = (int) strtol(ps, NULL, 10);
-      else
-         result = 0;
+
+   memset((void *) &nogvl, 0, sizeof(MGNOGVL));
+   nogvl.p_srv = p_srv;
+   nogvl.chndle = chndle;
+   nogvl.p_buf = p_buf;
+   nogvl.size = count;
+   mg_db_nogvl_begin(&nogvl);
+
+   for (;;) {
+      rb_thread_call_without_gvl2(mg_db_receive_batch_nogvl_ex, (void *) &nogvl, mg_db_nogvl_ubf, (void *) &nogvl);
+      if (nogvl.done) {
+         break;
+      }
+      mg_db_nogvl_interrupts(&nogvl);
    }
 
-   return result;
+   return mg_db_nogvl_done(&nogvl);
 }
 
 
-double mg_get_float(VALUE item)
+void * mg_db_receive_batch_nogvl_ex(void *arg)
 {
-   int t;
-   double result;
-   char *ps;
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
 
-   result = 0;
-   t = mg_type(item);
+   p_nogvl->result = mg_db_receive_batch(p_nogvl->p_srv, p_nogvl->chndle, p_nogvl->p_buf, p_nogvl->size);
+   p_nogvl->done = 1;
 
-   if (t == MG_T_INTEGER)
-      result = (double) rb_num2long(item);
-   else if (t == MG_T_FLOAT) {
-      result = (double) rb_num2dbl(item);
+   return NULL;
+}
+
+
+void * mg_db_receive_body_nogvl_ex(void *arg)
+{
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
+
+   p_nogvl->result = mg_db_receive_body(p_nogvl->p_srv, p_nogvl->chndle, p_nogvl->p_data, (unsigned long) p_nogvl->size);
+   p_nogvl->done = 1;
+
+   return NULL;
+}
+
+
+/*
+   Called by Ruby (without the GVL) to wake a thread blocked in send/recv.  A thread waiting through
+   mg_db_nogvl_wait() is woken with the connection intact; otherwise the socket is shut down.
+*/
+void mg_db_nogvl_ubf(void *arg)
+{
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
+   DBXCON *pcon;
+
+   pcon = p_nogvl->p_srv->pcon[p_nogvl->chndle];
+   if (pcon && p_nogvl->wake && mg_db_wake(pcon)) {
+      return;
    }
-   else {
-      ps = rb_string_value_cstr(&item);
-      if (ps)
-         result = (double) strtod(ps, NULL);
-      else
-         result = 0;
+
+   p_nogvl->interrupted = 1;
+   if (!pcon) {
+      return;
    }
 
-   return result;
-}
+#if defined(_WIN32)
+   shutdown(pcon->cli_socket, SD_BOTH);
+#else
+   shutdown(pcon->cli_socket, SHUT_RDWR);
+#endif
 
+   return;
+}
 
 
-char * mg_get_string(VALUE item, VALUE * item_tmp, int * size)
+int mg_db_nogvl_done(MGNOGVL *p_nogvl)
 {
-   int t, x;
-   double y;
-   char * result;
-   char buffer[64];
+   DBXCON *pcon;
 
-   *size = 0;
-   result = NULL;
-   t = mg_type(item);
-   
-   if (t == MG_T_INTEGER) {
-      x = (int) rb_num2long(item);
-      sprintf(buffer, "%d", x);
-      *size = (int) strlen(buffer);
-      *item_tmp = rb_str_new2(buffer);
-      result = rb_string_value_cstr(item_tmp);
+   pcon = p_nogvl->p_srv->pcon[p_nogvl->chndle];
+   if (p_nogvl->wake && pcon) {
+      pcon->p_wait = NULL;
+      pcon->p_wait_arg = NULL;
+   }
 
+   if (p_nogvl->state) {
+      /* an interrupt raised while the request was waiting: the response may never be read */
+      if (pcon) {
+         pcon->keep_alive = 0;
+         mg_db_disconnect(p_nogvl->p_srv, p_nogvl->chndle, 0);
+      }
+      rb_jump_tag(p_nogvl->state);
    }
-   else if (t == MG_T_FLOAT) {
-      y = (double) rb_num2dbl(item);
-      sprintf(buffer, "%f", y);
-      *size = (int) strlen(buffer);
-      *item_tmp = rb_str_new2(buffer);
-      result = rb_string_value_cstr(item_tmp);
+
+   if (!p_nogvl->interrupted) {
+      return p_nogvl->result;
    }
-   else {
-      result = rb_string_value_ptr(&item);
-      *size = RSTRING_LEN(item);
+
+   /* the connection is now in an unknown state so it must not be returned to the pool */
+   if (p_nogvl->p_srv->pcon[p_nogvl->chndle]) {
+      p_nogvl->p_srv->pcon[p_nogvl->chndle]->keep_alive = 0;
+      mg_db_disconnect(p_nogvl->p_srv, p_nogvl->chndle, 0);
    }
 
-   return result;
+   rb_thread_check_ints();
+
+   rb_raise(rb_eRuntimeError, "%s", "mg_ruby: Database request interrupted");
+
+   return 0;
 }
 
 
-int mg_get_vargs(int argc, VALUE *argv, MGVARGS *pvargs, int context)
+/* Service pending interrupts (with the GVL): if one raises, drop the connection before propagating it */
+int mg_db_nogvl_interrupts(MGNOGVL *p_nogvl)
 {
-   int n;
+   int state;
 
-   if (context) {
-      for (n = 0; n < argc; n ++) {
-         pvargs->cvars[n].ps = (unsigned char *) mg_get_string(argv[n], &(pvargs->rvars[n]), &(pvargs->cvars[n].size));
-      }
-   }
-   else {
-      for (n = 0; n < argc; n ++) {
-         pvargs->cvars[n].ps = (unsigned char *) mg_get_string(argv[n], &(pvargs->rvars[n]), &(pvargs->cvars[n].size));
-         if (n == 0) {
-            pvargs->global = (char *) pvargs->cvars[n].ps;
-            pvargs->global_len = pvargs->cvars[n].size;
-         }
+   state = 0;
+   rb_protect(mg_db_nogvl_check_ints, Qnil, &state);
+
+   if (state) {
+      if (p_nogvl->chndle >= 0 && p_nogvl->p_srv->pcon[p_nogvl->chndle]) {
+         p_nogvl->p_srv->pcon[p_nogvl->chndle]->keep_alive = 0;
+         mg_db_disconnect(p_nogvl->p_srv, p_nogvl->chndle, 0);
       }
+      rb_jump_tag(state);
    }
 
-   return n;
+   return 0;
 }
 
 
-
-int mg_get_keys(VALUE keys, MGSTR * ckeys, VALUE *keys_tmp, char *krec)
+VALUE mg_db_nogvl_check_ints(VALUE arg)
 {
-   int kmax, max, n, len;
-   VALUE p;
+   rb_thread_check_ints();
 
-   kmax = 32;
-
-   p = rb_ary_entry(keys, 0);
-   max = mg_get_integer(p);
+   return Qnil;
+}
 
 
-   for (n = 1; n <= max; n ++) {
-      p = rb_ary_entry(keys, n);
+/* v2.4.46 */
+/* Wait on the connection through mg_db_nogvl_wait() (non-blocking) so that an interrupt does not have to close it */
+int mg_db_nogvl_begin(MGNOGVL *p_nogvl)
+{
+   DBXCON *pcon;
 
-      ckeys[n].ps = mg_get_string(p, &keys_tmp[n], &len);
-      ckeys[n].size = len;
+   pcon = p_nogvl->p_srv->pcon[p_nogvl->chndle];
+   if (!pcon || !mg_db_wake_open(pcon) || !mg_db_set_nonblocking(pcon, 1)) {
+      return 0;
    }
+   pcon->p_wait = mg_db_nogvl_wait;
+   pcon->p_wait_arg = (void *) p_nogvl;
+   p_nogvl->wake = 1;
 
-   return max;
+   return 1;
 }
 
 
-
-int mg_set_list_item(VALUE list, int index, VALUE item)
+/*
+   The DBXCON wait function for a thread waiting without the GVL.  When woken by mg_db_nogvl_ubf() the pending
+   interrupts are serviced with the GVL: the wait is resumed unless one of them raised (a trapped signal whose
+   handler returns, or Thread#wakeup, must not cost the request its connection).
+*/
+int mg_db_nogvl_wait(DBXCON *pcon, int events, int timeout)
 {
+   int n;
+   long msecs;
+   unsigned long start;
+   MGNOGVL *p_nogvl;
 
-   rb_ary_store(list, index, item);
+   p_nogvl = (MGNOGVL *) pcon->p_wait_arg;
+   start = mg_current_time_ms();
 
-   return index;
+   for (;;) {
+      if (p_nogvl->state) {
+         return -1;
+      }
+      msecs = -1;
+      if (timeout) {
+         msecs = ((long) timeout * 1000) - (long) (mg_current_time_ms() - start);
+         if (msecs < 0) {
+            msecs = 0;
+         }
+      }
+      n = mg_db_wait_wake(pcon, events, msecs);
+      if (n != MG_WAIT_WOKEN) {
+         return n;
+      }
+      rb_thread_call_with_gvl(mg_db_nogvl_wait_ints, (void *) p_nogvl);
+   }
 }
 
 
-int mg_kill_list(VALUE list)
+void * mg_db_nogvl_wait_ints(void *arg)
 {
-   int result;
+   MGNOGVL *p_nogvl = (MGNOGVL *) arg;
 
-   result = (int) rb_ary_clear(list);
+   rb_protect(mg_db_nogvl_check_ints, Qnil, &(p_nogvl->state));
 
-   return result;
+   return NULL;
 }
 
 
-int mg_kill_list_item(VALUE list, int index)
+/* v2.4.46 */
+/*
+   Get a pooled connection from a fiber running under a Fiber::Scheduler.  Rather than blocking the
+   thread (and with it every other fiber) on the pool's condition variable, yield to the scheduler
+   until one of the fibers holding a connection releases it.
+*/
+int mg_db_connect_fiber(MGSRV *p_srv, int *p_chndle, short context, VALUE scheduler)
 {
-   int result;
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+   int n, waited;
+   unsigned long start;
+   MGFIBER fiber;
+   DBXCON *pcon;
+
+   start = mg_current_time_ms();
+   waited = 0;
+
+   for (;;) {
+      n = mg_db_connect_ex(p_srv, p_chndle, (short) (context | MG_CONNECT_NOWAIT | MG_CONNECT_NOOPEN), NULL);
+      if (n == MG_POOL_NEW) {
+         /* open the new connection without blocking the thread: the TCP connect yields to the scheduler */
+         memset((void *) &fiber, 0, sizeof(MGFIBER));
+         fiber.p_srv = p_srv;
+         fiber.chndle = *p_chndle;
+         fiber.scheduler = scheduler;
+         fiber.io = Qnil;
+         fiber.fd = -1;
+         pcon = p_srv->pcon[*p_chndle];
+         pcon->p_wait = mg_fiber_wait;
+         pcon->p_wait_arg = (void *) &fiber;
+         n = mg_db_connect_open(p_srv, *p_chndle);
+         if (n) {
+            /* on failure the connection has been released with its wait function */
+            pcon->p_wait = NULL;
+            pcon->p_wait_arg = NULL;
+         }
+         else {
+            *p_chndle = -1;
+         }
+         RB_GC_GUARD(fiber.io);
+         if (fiber.state) {
+            if (n) {
+               pcon->keep_alive = 0;
+               mg_db_disconnect(p_srv, fiber.chndle, 0);
+            }
+            rb_jump_tag(fiber.state);
+         }
+         return n;
+      }
+      if (n != MG_POOL_BUSY || (context & MG_CONNECT_NOWAIT)) {
+         return n;
+      }
 
-   result = (int) rb_ary_delete_at(list, index);
+      mg_enter_critical_section((void *) &(p_srv->pool.mutex));
+      if (p_srv->pool.wait_timeout > 0 && (mg_current_time_ms() - start) >= (unsigned long) p_srv->pool.wait_timeout) {
+         p_srv->pool.timeout_count ++;
+         mg_leave_critical_section((void *) &(p_srv->pool.mutex));
+         sprintf(p_srv->error_mess, "Connection pool exhausted: no connection became free within %d ms (maximum %d connections)", p_srv->pool.wait_timeout, p_srv->pool.max);
+         return 0;
+      }
+      if (!waited) {
+         p_srv->pool.wait_count ++;
+         waited = 1;
+      }
+      mg_leave_critical_section((void *) &(p_srv->pool.mutex));
 
-   return result;
+      rb_fiber_scheduler_kernel_sleep(scheduler, rb_float_new(MG_FIBER_POOL_POLL));
+   }
+#else
+   return mg_db_connect(p_srv, p_chndle, context);
+#endif
 }
 
 
-MGPAGE * mg_ppage(int phndle)
+/*
+   Prepare a connection for use by the current fiber.  Under a Fiber::Scheduler the socket is made
+   non-blocking and mg_fiber_wait() is installed so that the thread is not blocked in send/recv: the
+   fiber yields to the scheduler until the socket is ready.  Otherwise the GVL-free path is taken
+   (which installs its own wait function: mg_db_nogvl_begin()).
+*/
+int mg_fiber_begin(MGFIBER *p_fiber, MGSRV *p_srv, int chndle)
 {
-   MGPAGE *p_page;
+   DBXCON *pcon;
 
-   if (phndle >= 0 && phndle < MG_MAX_PAGE && tp_page[phndle]) {
-      return tp_page[phndle];
-   }
+   pcon = p_srv->pcon[chndle];
 
-   p_page = &gpage;
-   p_page->p_srv = &(p_page->srv);
-   mg_ppage_init(p_page);
-   tp_page[0] = p_page;
+   p_fiber->p_srv = p_srv;
+   p_fiber->chndle = chndle;
+   p_fiber->scheduler = Qnil;
+   p_fiber->io = Qnil;
+   p_fiber->fd = -1;
+   p_fiber->state = 0;
 
-   return p_page;
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+   p_fiber->scheduler = rb_fiber_scheduler_current();
+   if (!NIL_P(p_fiber->scheduler) && mg_db_set_nonblocking(pcon, 1)) {
+      pcon->p_wait = mg_fiber_wait;
+      pcon->p_wait_arg = (void *) p_fiber;
+      return 1;
+   }
+#endif
+
+   return 0;
 }
 
 
-int mg_ppage_init(MGPAGE * p_page)
+/* If the scheduler raised while the fiber was waiting, drop the connection before propagating it */
+int mg_fiber_end(MGFIBER *p_fiber, int result)
 {
-   int n;
+   DBXCON *pcon;
 
-   p_page->p_srv->mem_error = 0;
-   p_page->p_srv->storage_mode = 0;
-   p_page->p_srv->timeout = 0;
-   p_page->p_srv->no_retry = 0;
+   pcon = p_fiber->p_srv->pcon[p_fiber->chndle];
+   if (pcon) {
+      pcon->p_wait = NULL;
+      pcon->p_wait_arg = NULL;
+   }
 
-   strcpy(p_page->p_srv->server, "");
-   strcpy(p_page->p_srv->username, "");
-   strcpy(p_page->p_srv->password, "");
+   if (p_fiber->state) {
+      if (pcon) {
+         pcon->keep_alive = 0;
+         mg_db_disconnect(p_fiber->p_srv, p_fiber->chndle, 0);
+      }
+      rb_jump_tag(p_fiber->state);
+   }
 
-   strcpy(p_page->p_srv->ip_address, MG_HOST);
-   p_page->p_srv->port = MG_PORT;
-   strcpy(p_page->p_srv->uci, MG_UCI);
+   RB_GC_GUARD(p_fiber->io);
+   return result;
+}
+
+
+/* The DBXCON wait function: 1 = ready; 0 = timed out; -1 = error (or exception pending) */
+int mg_fiber_wait(DBXCON *pcon, int events, int timeout)
+{
+   VALUE result;
+   MGFIBER *p_fiber;
 
-   for (n = 0; n < MG_MAXCON; n ++) {
-      p_page->p_srv->pcon[n] = NULL;
+   p_fiber = (MGFIBER *) pcon->p_wait_arg;
+   if (p_fiber->state) {
+      return -1; /* an exception is waiting to be raised: do not re-enter the scheduler */
    }
+   p_fiber->events = events;
+   p_fiber->timeout = timeout;
 
-   return 1;
+   result = rb_protect(mg_fiber_wait_ex, (VALUE) p_fiber, &(p_fiber->state));
+   if (p_fiber->state) {
+      return -1;
+   }
+
+   return (RTEST(result) ? 1 : 0);
 }
 
 
+VALUE mg_fiber_wait_ex(VALUE arg)
+{
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+   MGFIBER *p_fiber;
+
+   p_fiber = (MGFIBER *) arg;
+
+   /* the scheduler waits on IO objects: wrap the socket, leaving it owned by the pool (a connect may try more than one socket) */
+   if (NIL_P(p_fiber->io) || p_fiber->fd != (int) p_fiber->p_srv->pcon[p_fiber->chndle]->cli_socket) {
+      p_fiber->fd = (int) p_fiber->p_srv->pcon[p_fiber->chndle]->cli_socket;
+      p_fiber->io = rb_io_fdopen(p_fiber->fd, O_RDWR, NULL);
+      rb_funcall(p_fiber->io, rb_intern("autoclose="), 1, Qfalse);
+   }
+
+   return rb_fiber_scheduler_io_wait(p_fiber->scheduler, p_fiber->io, INT2NUM(p_fiber->events), p_fiber->timeout ? INT2NUM(p_fiber->timeout) : Qnil);
+#else
+   return Qfalse;
+#endif
+}
@@ -0,0 +1,263 @@
+#
+# A minimal DB Superserver (%zmgsi) for the mg_ruby tests.
+#
+# It speaks the request/response protocol used by mg_ruby over TCP and holds a single database of globals in
+# memory, in M collating sequence.  It runs in a thread of the test process (mg_ruby releases the GVL while it
+# waits on the network).  Options:
+#    rtt:     simulated network latency, in seconds, charged once for each flight of requests.
+#    nobatch: reject the batched global commands (OB, PB and QB), as an older Superserver does.
+# Setting a node of ^MockError fails.  The function counts^mock returns the number of requests received for each command since it was last called.
+#
+
+require 'socket'
+
+class MockServer
+
+   B62   = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+   NUMRE = /\A(0|-?[1-9][0-9]*(\.[0-9]*[1-9])?|-?\.[0-9]*[1-9])\z/
+
+   attr_reader :port, :db
+
+   def initialize(rtt: 0, nobatch: false)
+      @rtt = rtt
+      @nobatch = nobatch
+      @db = {}
+      @counts = Hash.new(0)
+      @subscripts = {}
+      @lock = Mutex.new
+      @server = TCPServer.new("127.0.0.1", 0)
+      @port = @server.addr[1]
+      @thread = Thread.new { accept }
+   end
+
+   def close
+      @thread.kill
+      @server.close
+   end
+
+   # canonic numbers of up to 24 characters (after the sign) collate ahead of strings, and compare exactly
+   def self.collate(s)
+      if s.delete_prefix("-").size <= 24 && NUMRE.match?(s)
+         [0, s.to_r, ""]
+      else
+         [1, 0, s]
+      end
+   end
+
+   private
+
+   def accept
+      loop do
+         conn = @server.accept
+         conn.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+         Thread.new(conn) { |c| serve(c) }
+      end
+   end
+
+   def serve(conn)
+      loop do
+         header = conn.gets("\n")
+         break if header.nil?
+         size = header[-6, 5].each_char.inject(0) { |n, ch| (n * 62) + B62.index(ch) }
+         body = size > 0 ? conn.read(size) : ""
+         command = header.split("^")[3]
+         data, status = @lock.synchronize { execute(command, items(body)) }
+         reply(conn, data, status)
+      end
+   rescue IOError, SystemCallError
+   ensure
+      conn.close
+   end
+
+   def items(body)
+      body = body.b
+      result = []
+      i = 0
+      while i < body.size
+         code = body.getbyte(i)
+         slen = code % 8
+         size = slen > 0 ? body[i + 1, slen].to_i : 0
+         i += 1 + slen
+         result << body[i, size]
+         i += size
+      end
+      result
+   end
+
+   def reply(conn, data, status)
+      data = data.to_s.b
+      # a response that another request is already waiting behind does not pay the latency again
+      sleep(@rtt) if @rtt > 0 && !IO.select([conn], nil, nil, 0)
+      conn.write(enc62(data.bytesize) + status + "0" + data)
+   end
+
+   def enc62(n)
+      s = ""
+      loop do
+         s = B62[n % 62] + s
+         n /= 62
+         break if n == 0
+      end
+      s.rjust(5, "0")
+   end
+
+   def execute(command, items)
+      @counts[command] += 1
+      if "SKI".include?(command)
+         @children = nil
+         @subscripts.clear
+      end
+      case command
+      when "OB", "PB", "QB"
+         return ["unsupported command #{command}", "ce"] if @nobatch
+         return [query_batch(items), "cv"] if command == "QB"
+         [order_batch(items, command == "PB" ? -1 : 1), "cv"]
+      when "S"
+         return ["mock error", "ce"] if items[0] == "^MockError"
+         @db[items[0..-2]] = items[-1]
+         ["0", "cv"]
+      when "G"
+         [@db.fetch(items, ""), "cv"]
+      when "K"
+         @db.delete_if { |k, _| k[0, items.size] == items }
+         ["0", "cv"]
+      when "D"
+         [data_of(items).to_s, "cv"]
+      when "O"
+         [order(items, 1), "cv"]
+      when "P"
+         [order(items, -1), "cv"]
+      when "I"
+         v = @db.fetch(items[0..-2], "0").to_f + items[-1].to_f
+         v = (v == v.to_i) ? v.to_i.to_s : v.to_s
+         @db[items[0..-2]] = v
+         [v, "cv"]
+      when "M"
+         # ma_merge_to_db: the records are accepted but not applied
+         ["0", "cv"]
+      when "a", "b", "c", "d"
+         ["0", "cv"]
+      when "X"
+         function(items)
+      else
+         ["unsupported command #{command}", "ce"]
+      end
+   end
+
+   def function(items)
+      case items[0]
+      when "big^mock"
+         ["x" * items[1].to_i, "cv"]
+      when "error^mock"
+         ["mock error", "ce"]
+      when "counts^mock"
+         @counts["X"] -= 1
+         result = @counts.select { |_, n| n > 0 }.sort.map { |c, n| "#{c}:#{n}" }.join(",")
+         @counts.clear
+         [result, "cv"]
+      else
+         ["#{items[0]}(#{items[1..].join(',')})", "cv"]
+      end
+   end
+
+   # the subscripts found below each node, indexed by its key path (rebuilt after a write)
+   def children
+      @children ||= begin
+         index = Hash.new { |h, k| h[k] = {} }
+         @db.each_key { |k| k.size.times { |n| index[k[0, n]][k[n]] = true } }
+         index
+      end
+   end
+
+   def data_of(key)
+      v = @db.key?(key) ? 1 : 0
+      v += 10 if children.key?(key)
+      v
+   end
+
+   # the subscripts below a node, in collating sequence
+   def subscripts(parent)
+      return [] unless children.key?(parent)
+      @subscripts[parent] ||= children[parent].keys.map { |s| [MockServer.collate(s), s] }.sort
+   end
+
+   def order(key, direction)
+      subs = subscripts(key[0..-2])
+      return "" if subs.empty?
+      if key[-1] == ""
+         return direction > 0 ? subs.first[1] : subs.last[1]
+      end
+      cur = MockServer.collate(key[-1])
+      if direction > 0
+         i = subs.bsearch_index { |c, _| (c <=> cur) > 0 }
+         i ? subs[i][1] : ""
+      else
+         i = subs.bsearch_index { |c, _| (c <=> cur) >= 0 } || subs.size
+         i > 0 ? subs[i - 1][1] : ""
+      end
+   end
+
+   def encode(values)
+      values.map { |v| v = v.to_s.b; sz = v.bytesize.to_s; sz.size.chr + sz + v }.join
+   end
+
+   # OB/PB: the next 'count' subscripts after the key, with their data (1) or $data and data (2)
+   def order_batch(items, direction)
+      count, data = items[-1].split("#").first(2).map(&:to_i)
+      key = items[0..-2]
+      out = []
+      n = 0
+      while n < count
+         nxt = order(key, direction)
+         break if nxt == ""
+         key = key[0..-2] + [nxt]
+         out << nxt
+         out << @db.fetch(key, "") if data == 1
+         out.push(data_of(key).to_s, (data_of(key) % 10) > 0 ? @db[key] : "") if data == 2
+         n += 1
+      end
+      encode([n.to_s] + out)
+   end
+
+   # QB: up to 'count' nodes of the subtree below the first 1+nhead items, in $query order from the key given
+   def query_batch(items)
+      count, depth, nhead = items[-1].split("#").map(&:to_i)
+      path = items[0..-2]
+      base = 1 + nhead
+      out = []
+      n = 0
+      more = 0
+      emit = lambda do |p, dv|
+         out << "#{p.size - base}##{dv}"
+         out.concat(p[base..])
+         out << @db[p] if (dv % 10) > 0
+      end
+      dv = data_of(path)
+      if path.size == base
+         if dv > 0
+            emit.call(path, dv)
+            n += 1
+         end
+         return encode(["#{n}#0"] + out) if dv < 10
+      end
+      path = path + [""] if dv >= 10 && (depth == 0 || path.size - base < depth)
+      while path.size > base
+         nxt = order(path, 1)
+         if nxt == ""
+            path = path[0..-2]
+            next
+         end
+         if n >= count
+            more = 1
+            break
+         end
+         path = path[0..-2] + [nxt]
+         dv = data_of(path)
+         emit.call(path, dv)
+         n += 1
+         path = path + [""] if dv >= 10 && (depth == 0 || path.size - base < depth)
+      end
+      encode(["#{n}##{more}"] + out)
+   end
+
+end
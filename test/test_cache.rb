@@ -0,0 +1,174 @@
+require_relative 'test_helper'
+
+class TestCache < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TCache")
+      @m.m_kill("^TOther")
+      @m.m_set("^TCache", "a", "1")
+      @m.m_set("^TCache", "b", "2")
+      @m.m_set("^TOther", "x", "9")
+      @m.m_set_cache("^TCache", ttl: 60)
+      @m.m_set_cache("^TOther", ttl: 60)
+      warm
+   end
+
+   def warm
+      @m.m_get("^TCache", "a")
+      @m.m_get("^TCache", "b")
+      @m.m_get("^TOther", "x")
+      counts(@m)
+   end
+
+   # the number of G requests made by reading the three cached nodes again
+   def refetched
+      counts(@m)
+      @m.m_get("^TCache", "a")
+      @m.m_get("^TCache", "b")
+      @m.m_get("^TOther", "x")
+      counts(@m)[/G:(\d+)/, 1].to_i
+   end
+
+   def test_hits_and_misses
+      @m.m_clear_cache
+      stats = @m.m_get_cache_stats
+      assert_equal "1", @m.m_get("^TCache", "a")
+      assert_equal "1", @m.m_get("^TCache", "a")
+      assert_equal "10", @m.m_data("^TCache")
+      assert_equal "10", @m.m_data("^TCache")
+      after = @m.m_get_cache_stats
+      assert_equal 2, after[:hits] - stats[:hits]
+      assert_equal 2, after[:misses] - stats[:misses]
+      assert_equal 2, after[:entries]
+      assert_equal "D:1,G:1", counts(@m)
+   end
+
+   def test_reads_do_not_invalidate
+      @m.m_data("^TCache", "b")
+      @m.m_order("^TCache", "")
+      @m.m_function("echo^mock", 1)
+      @m.m_tstart
+      @m.m_tlevel
+      assert_equal 0, refetched
+   end
+
+   def test_unregistered_globals_are_not_cached
+      @m.m_get("^TUncached", 1)
+      @m.m_get("^TUncached", 1)
+      assert_equal "G:2", counts(@m)
+   end
+
+   # a write discards what is cached for the registered key path it falls within, and nothing else
+   def test_writes_invalidate_their_key_path
+      @m.m_set("^TCache", "a", "new")
+      assert_equal "new", @m.m_get("^TCache", "a")
+      assert_equal 1, refetched
+      @m.m_kill("^TCache", "b")
+      assert_equal "", @m.m_get("^TCache", "b")
+      assert_equal 1, refetched
+      @m.m_increment("^TCache", "a", 1)
+      assert_equal "1", @m.m_get("^TCache", "a")
+      assert_equal 1, refetched
+      @m.ma_merge_to_db("^TOther", [0], [], "")
+      assert_equal 1, refetched
+   end
+
+   def test_registered_key_paths_are_invalidated_separately
+      @m.m_set_cache("^TCache", ttl: 0)
+      @m.m_set_cache("^TCache", "a", ttl: 60)
+      @m.m_set_cache("^TCache", "b", ttl: 60)
+      warm
+      @m.m_set("^TCache", "a", "x")
+      assert_equal 1, refetched
+      @m.m_set("^TCache", "c", "x")
+      assert_equal 0, refetched
+      @m.m_kill("^TCache")
+      assert_equal 2, refetched
+   end
+
+   def test_other_writes_invalidate_everything
+      @m.m_set_multi([["^TUncached", 1, 1]])
+      assert_equal 3, refetched
+      @m.m_pipeline { |p| p.m_set("^TUncached", 1, 2) }
+      assert_equal 3, refetched
+      @m.m_tstart
+      @m.m_tcommit
+      assert_equal 3, refetched
+      @m.m_trollback
+      assert_equal 3, refetched
+   end
+
+   def test_explicit_invalidation
+      invalidations = @m.m_get_cache_stats[:invalidations]
+      @m.m_invalidate_cache("^TOther", "x")
+      assert_equal 1, refetched
+      @m.m_invalidate_cache("^TCache", "a")
+      assert_equal 2, refetched
+      @m.m_invalidate_cache
+      assert_equal 3, refetched
+      assert_equal invalidations + 3, @m.m_get_cache_stats[:invalidations]
+   end
+
+   def test_clear
+      @m.m_clear_cache
+      assert_equal 0, @m.m_get_cache_stats[:entries]
+      assert_equal 3, refetched
+   end
+
+   def test_ttl
+      @m.m_set_cache("^TCache", ttl: 0.2)
+      assert_equal 2, refetched
+      other = connect
+      other.m_set("^TCache", "a", "changed")
+      assert_equal "1", @m.m_get("^TCache", "a")
+      sleep 0.3
+      assert_equal "changed", @m.m_get("^TCache", "a")
+      @m.m_set_cache("^TCache", ttl: 0)
+      counts(@m)
+      @m.m_get("^TCache", "a")
+      @m.m_get("^TCache", "a")
+      assert_equal "G:2", counts(@m)
+   end
+
+   def test_lru_eviction
+      @m.m_set_cache("^TCache", ttl: 60, max: 3)
+      %w[c d e].each { |k| @m.m_get("^TCache", k) }
+      @m.m_get("^TCache", "c")
+      @m.m_get("^TCache", "f")
+      stats = @m.m_get_cache_stats
+      assert_equal 3, stats[:entries]
+      assert_operator stats[:evictions], :>=, 1
+      counts(@m)
+      @m.m_get("^TCache", "c")
+      @m.m_get("^TCache", "d")
+      assert_equal "G:1", counts(@m)
+   end
+
+   def test_large_values_are_not_cached
+      big = "c" * 9000
+      @m.m_set("^TCache", "big", big)
+      counts(@m)
+      assert_equal big, @m.m_get("^TCache", "big")
+      assert_equal big, @m.m_get("^TCache", "big")
+      assert_equal "G:2", counts(@m)
+      small = "c" * 8000
+      @m.m_set("^TCache", "big", small)
+      counts(@m)
+      assert_equal small, @m.m_get("^TCache", "big")
+      assert_equal small, @m.m_get("^TCache", "big")
+      assert_equal "G:1", counts(@m)
+   end
+
+   def test_key_path_scoping
+      @m.m_set_cache("^TCache", ttl: 0)
+      @m.m_set_cache("^TCache", "a", ttl: 60)
+      @m.m_get("^TCache", "a")
+      @m.m_get("^TCache", "b")
+      counts(@m)
+      @m.m_get("^TCache", "a")
+      @m.m_get("^TCache", "b")
+      assert_equal "G:1", counts(@m)
+   end
+
+end
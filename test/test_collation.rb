@@ -0,0 +1,91 @@
+require_relative 'test_helper'
+
+class TestCollation < MGTest
+
+   # canonic numbers (negative, decimal, up to 24 digits) and the strings that only look like numbers
+   NUMBERS = ["-10", "-1.5", "-1", "-.5", "0", ".5", "1", "1.5", "2", "10", "99",
+              "123456789012345678901234", "123456789012345678901235", "-123456789012345678901234"]
+   STRINGS = [" 1", "-0", "0.5", "03", "1.", "1.50", "1e3", "1234567890123456789012345", "B", "a", "a b", "b", "x"]
+
+   def collate(a, b)
+      MockServer.collate(a) <=> MockServer.collate(b)
+   end
+
+   def key_collate(a, b)
+      a.zip(b).each do |x, y|
+         return 1 if y.nil?
+         r = collate(x, y)
+         return r if r != 0
+      end
+      a.size <=> b.size
+   end
+
+   # records appended in the order given, each holding its own key as data
+   def records_for(keys)
+      m = MG_RUBY.new
+      records = []
+      keys.each { |k| m.ma_local_set(records, -2, [k.size, *k], k.join(",")) }
+      records
+   end
+
+   def test_reference_order
+      subscripts = NUMBERS + STRINGS
+      expected = NUMBERS.sort { |a, b| a.to_r <=> b.to_r } + STRINGS.sort
+      assert_equal expected, subscripts.shuffle(random: Random.new(1)).sort { |a, b| collate(a, b) }
+   end
+
+   def test_sort_single_subscripts
+      keys = (NUMBERS + STRINGS).map { |s| [s] }
+      records = records_for(keys.shuffle(random: Random.new(2)))
+      MG_RUBY.new.ma_local_sort(records)
+      assert_equal records_for(keys.sort { |a, b| key_collate(a, b) }), records
+   end
+
+   def test_sort_several_levels
+      rng = Random.new(3)
+      subscripts = NUMBERS + STRINGS
+      keys = Array.new(2000) { Array.new(rng.rand(1..3)) { subscripts.sample(random: rng) } }.uniq
+      records = records_for(keys)
+      MG_RUBY.new.ma_local_sort(records)
+      assert_equal records_for(keys.sort { |a, b| key_collate(a, b) }), records
+   end
+
+   def test_order_and_previous_walk_in_collating_order
+      m = MG_RUBY.new
+      subscripts = (NUMBERS + STRINGS).shuffle(random: Random.new(4))
+      expected = subscripts.sort { |a, b| collate(a, b) }
+      records = records_for(subscripts.map { |s| [s] })
+      m.ma_local_sort(records)
+      [[:ma_local_order, expected], [:ma_local_previous, expected.reverse]].each do |method, order|
+         walked = []
+         key = [1, ""]
+         loop do
+            m.send(method, records, -1, key)
+            break if key[1] == ""
+            walked << key[1]
+         end
+         assert_equal order, walked
+      end
+   end
+
+   def test_local_global_order
+      local = MG_RUBY::LocalGlobal.new
+      (NUMBERS + STRINGS).each { |s| local.m_set(s, s) }
+      walked = []
+      s = ""
+      walked << s while (s = local.m_order(s)) != ""
+      assert_equal (NUMBERS + STRINGS).sort { |a, b| collate(a, b) }, walked
+   end
+
+   def test_same_order_as_the_server
+      m = connect
+      m.m_kill("^TColl")
+      m.m_pipeline { |p| (NUMBERS + STRINGS).each { |s| p.m_set("^TColl", s, 1) } }
+      walked = []
+      s = ""
+      walked << s while (s = m.m_order("^TColl", s)) != ""
+      assert_equal (NUMBERS + STRINGS).sort { |a, b| collate(a, b) }, walked
+      assert_equal walked, m.m_order_batch("^TColl", "", count: 100)
+   end
+
+end
@@ -0,0 +1,80 @@
+require_relative 'test_helper'
+
+class TestEachNode < MGTest
+
+   def fill(m, n = 40)
+      m.m_kill("^TEach")
+      m.m_pipeline { |p| n.times { |i| p.m_set("^TEach", i, "v#{i}") } }
+   end
+
+   def test_query_order
+      m = connect
+      m.m_kill("^TEach")
+      m.m_set("^TEach", "1", "h")
+      m.m_set("^TEach", "1", "a", "x")
+      m.m_set("^TEach", "1", "a", "b", "y")
+      m.m_set("^TEach", "1", 10, "t")
+      m.m_set("^TEach", "1", 9, "n")
+      m.m_set("^TEach", "2", "z")
+      expected = [[["1"], "h"], [["1", "9"], "n"], [["1", "10"], "t"], [["1", "a"], "x"], [["1", "a", "b"], "y"], [["2"], "z"]]
+      assert_equal expected, m.each_node("^TEach", prefetch: 2).to_a
+      assert_equal expected[0, 5], m.each_node("^TEach", "1", prefetch: 2).to_a
+      assert_equal [[["1"], "h"], [["2"], "z"]], m.each_node("^TEach", depth: 1).to_a
+      assert_equal [], m.each_node("^TEach", "none").to_a
+   end
+
+   def test_one_request_per_batch
+      m = connect
+      fill(m, 39)
+      counts(m)
+      # the head node (with no data of its own) fills the first slot of the first batch
+      assert_equal 39, m.each_node("^TEach", prefetch: 10).count
+      assert_equal "QB:4", counts(m)
+   end
+
+   def test_next_batch_overlaps_the_block
+      m = connect(rtt: 0.1)
+      fill(m, 29)
+      seen = []
+      elapsed = timed { m.each_node("^TEach", prefetch: 10) { |s, v| seen << s[0]; sleep 0.1 if s[0].to_i % 10 == 8 } }
+      assert_equal (0...29).map(&:to_s), seen
+      # three fetches and three pauses in the block: 0.6s serially, 0.4s with the fetches overlapped
+      assert_operator elapsed, :<, 0.5
+   end
+
+   def test_break_and_raise_release_the_connection
+      m = connect
+      fill(m)
+      m.each_node("^TEach", prefetch: 10) { break }
+      assert_equal 0, m.m_get_pool_stats[:in_use]
+      assert_raises(RuntimeError) { m.each_node("^TEach", prefetch: 10) { |s, v| raise "stop" if s[0] == "12" } }
+      assert_equal 0, m.m_get_pool_stats[:in_use]
+      assert_equal "v7", m.m_get("^TEach", 7)
+   end
+
+   def test_lazy
+      m = connect
+      fill(m)
+      counts(m)
+      assert_equal [["0"], ["1"], ["2"]], m.each_node("^TEach", prefetch: 10).map { |s, v| s }.first(3)
+      # the first batch, and perhaps the next one requested ahead of the block
+      assert_includes ["QB:1", "QB:2"], counts(m)
+   end
+
+   def test_large_values
+      m = connect
+      m.m_kill("^TEach")
+      big = "e" * 70_000
+      3.times { |i| m.m_set("^TEach", i, big) }
+      assert_equal [big] * 3, m.each_node("^TEach", prefetch: 2).map { |s, v| v }.to_a
+   end
+
+   def test_fallback_without_batched_commands
+      m = connect(nobatch: true)
+      m.m_kill("^TEach")
+      m.m_set("^TEach", "1", "a", "x")
+      m.m_set("^TEach", "2", "z")
+      assert_equal [[["1", "a"], "x"], [["2"], "z"]], m.each_node("^TEach", prefetch: 1).to_a
+   end
+
+end
@@ -0,0 +1,61 @@
+require_relative 'test_helper'
+
+class TestFuture < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TFut")
+      @m.m_set("^TFut", 1, "one")
+   end
+
+   def test_values
+      assert_equal "one", @m.m_get_async("^TFut", 1).value
+      assert_equal "0", @m.m_set_async("^TFut", 2, "two").value
+      assert_equal "1", @m.m_data_async("^TFut", 1).value
+      assert_equal "1", @m.m_order_async("^TFut", "").value
+      assert_equal "2", @m.m_previous_async("^TFut", "").value
+      assert_equal "3", @m.m_increment_async("^TFut", "n", 3).value
+      assert_equal "0", @m.m_kill_async("^TFut", 2).value
+      assert_equal "f^mock(x)", @m.m_function_async("f^mock", "x").value
+   end
+
+   def test_value_is_kept
+      f = @m.m_get_async("^TFut", 1)
+      assert_equal "one", f.value
+      assert f.ready?
+      assert_equal "one", f.value
+   end
+
+   def test_wait_all_in_order
+      futures = 20.times.map { |i| @m.m_function_async("f^mock", i) }
+      assert_equal 20.times.map { |i| "f^mock(#{i})" }, MG_FUTURE.wait_all(futures)
+   end
+
+   def test_requests_overlap
+      m = connect(rtt: 0.05)
+      elapsed = timed { MG_FUTURE.wait_all(8.times.map { m.m_get_async("^TFut", 1) }) }
+      assert_operator elapsed, :<, 0.05 * 4
+   end
+
+   def test_large_value
+      big = "z" * 150_000
+      assert_equal "0", @m.m_set_async("^TFut", "big", big).value
+      assert_equal big, @m.m_get_async("^TFut", "big").value
+   end
+
+   def test_errors
+      e = @m.m_function_async("error^mock")
+      g = @m.m_get_async("^TFut", 1)
+      assert_raises(StandardError) { MG_FUTURE.wait_all([e, g]) }
+      assert_equal "one", g.value
+      assert_raises(StandardError) { e.value }
+      assert_raises(StandardError) { MG_FUTURE.wait_all([1]) }
+   end
+
+   def test_abandoned_futures
+      20.times { @m.m_function_async("f^mock") }
+      GC.start
+      assert_equal "one", @m.m_get("^TFut", 1)
+   end
+
+end
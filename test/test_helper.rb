@@ -0,0 +1,43 @@
+#
+# Common set-up for the mg_ruby tests.
+#
+# Build the extension first (cd src; ruby extconf.rb; make), then run a test from the top of the tree with:
+#    ruby -Isrc test/test_pipeline.rb
+# or all of them with:
+#    ruby -Isrc -e 'Dir["./test/test_*.rb"].each { |f| require f }'
+#
+
+require 'minitest/autorun'
+require 'mg_ruby'
+require_relative 'mock_server'
+
+class MGTest < Minitest::Test
+
+   # one mock server for each set of options, shared by all the tests
+   def self.server(**options)
+      @@servers ||= {}
+      @@servers[options] ||= MockServer.new(**options)
+   end
+
+   def server(**options)
+      MGTest.server(**options)
+   end
+
+   def connect(**options)
+      m = MG_RUBY.new
+      m.m_set_host("localhost", server(**options).port, "", "")
+      m
+   end
+
+   # the requests received by the server for each command since this was last called, as "G:2,S:1"
+   def counts(m)
+      m.m_function("counts^mock")
+   end
+
+   def timed
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      yield
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+   end
+
+end
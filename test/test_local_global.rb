@@ -0,0 +1,108 @@
+require_relative 'test_helper'
+
+class TestLocalGlobal < MGTest
+
+   SUBSCRIPTS = %w[a b B 1 2 10 -1 1.5 .5 03 x]
+
+   def collate(a, b)
+      MockServer.collate(a) <=> MockServer.collate(b)
+   end
+
+   def test_collating_order
+      local = MG_RUBY::LocalGlobal.new
+      SUBSCRIPTS.each { |s| local.m_set(s, "v#{s}") }
+      keys = []
+      k = ""
+      keys << k while (k = local.m_order(k)) != ""
+      assert_equal ["-1", ".5", "1", "1.5", "2", "10", "03", "B", "a", "b", "x"], keys
+      assert_equal "x", local.m_previous("")
+      assert_equal "10", local.m_previous("03")
+   end
+
+   def test_against_a_hash
+      local = MG_RUBY::LocalGlobal.new
+      ref = {}
+      rng = Random.new(7)
+      3000.times do |i|
+         key = Array.new(rng.rand(1..3)) { SUBSCRIPTS.sample(random: rng) }
+         case rng.rand(5)
+         when 0, 1
+            local.m_set(*key, "v#{i}")
+            ref[key] = "v#{i}"
+         when 2
+            assert_equal ref.fetch(key, ""), local.m_get(*key)
+         when 3
+            below = ref.each_key.any? { |r| r.size > key.size && r[0, key.size] == key }
+            assert_equal (ref.key?(key) ? 1 : 0) + (below ? 10 : 0), local.m_data(*key)
+         when 4
+            parent = key[0..-2]
+            subs = ref.each_key.select { |r| r.size >= key.size && r[0, parent.size] == parent }.map { |r| r[parent.size] }.uniq.sort { |a, b| collate(a, b) }
+            assert_equal subs.find { |s| collate(s, key[-1]) > 0 } || "", local.m_order(*key)
+            assert_equal subs.reverse.find { |s| collate(s, key[-1]) < 0 } || "", local.m_previous(*key)
+            if rng.rand(10) == 0
+               n = ref.each_key.count { |r| r[0, key.size] == key }
+               ref.delete_if { |r, _| r[0, key.size] == key }
+               assert_equal n, local.m_kill(*key)
+            end
+         end
+      end
+      assert_equal ref.size, local.m_size
+   end
+
+   def test_records_round_trip
+      m = MG_RUBY.new
+      records = []
+      SUBSCRIPTS.each_with_index { |s, i| m.ma_local_set(records, -2, [2, s, i], "d#{i}") }
+      m.ma_local_sort(records)
+      local = MG_RUBY::LocalGlobal.new(records)
+      assert_equal records, local.to_records
+      assert_equal "d0", local.m_get("a", 0)
+      assert_equal SUBSCRIPTS.size, local.m_size
+   end
+
+   def test_to_records_larger_than_the_buffer
+      big = "L" * 100_000
+      local = MG_RUBY::LocalGlobal.new
+      local.m_set("a", big)
+      local.m_set(big[0, 40_000], 1, "small")
+      local.m_set("b", "c", big * 2)
+      records = local.to_records
+      assert_equal 3, records.size
+      copy = MG_RUBY::LocalGlobal.new(records)
+      assert_equal big, copy.m_get("a")
+      assert_equal big * 2, copy.m_get("b", "c")
+      assert_equal "small", copy.m_get(big[0, 40_000], 1)
+      assert_equal records, copy.to_records
+   end
+
+   def test_ma_local_methods_read_large_records
+      m = MG_RUBY.new
+      big = "L" * 100_000
+      local = MG_RUBY::LocalGlobal.new
+      local.m_set("a", big)
+      local.m_set("a", 1, big)
+      local.m_set("c", "x")
+      local.m_set("e", big * 2)
+      records = local.to_records
+      assert_equal big, m.ma_local_get(records, -1, [1, "a"])
+      assert_equal big * 2, m.ma_local_get(records, -1, [1, "e"])
+      assert_equal "", m.ma_local_get(records, -1, [1, "none"])
+      assert_equal 11, m.ma_local_data(records, -1, [1, "a"])
+      key = [1, "b"]
+      assert_equal 2, m.ma_local_order(records, -1, key)
+      assert_equal "c", key[1]
+      key = [1, "d"]
+      assert_equal 2, m.ma_local_previous(records, -1, key)
+      assert_equal "c", key[1]
+      m.ma_local_set(records, -1, [1, "c"], big)
+      assert_equal big, m.ma_local_get(records, -1, [1, "c"])
+      assert_equal 2, m.ma_local_kill(records, -1, [1, "a"])
+      assert_equal 2, records.size
+   end
+
+   def test_bad_records
+      assert_raises(StandardError) { MG_RUBY::LocalGlobal.new("records") }
+      assert_raises(StandardError) { MG_RUBY::LocalGlobal.new([""]) }
+   end
+
+end
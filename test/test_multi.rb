@@ -0,0 +1,55 @@
+require_relative 'test_helper'
+
+class TestMulti < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TMulti")
+   end
+
+   def test_get_multi
+      50.times { |i| @m.m_set("^TMulti", i, i * 2) }
+      keys = 50.times.map { |i| ["^TMulti", i] } + [["^TMulti", "none"]]
+      counts(@m)
+      assert_equal 50.times.map { |i| (i * 2).to_s } + [""], @m.m_get_multi(keys)
+      assert_equal "G:51", counts(@m)
+      assert_equal [], @m.m_get_multi([])
+   end
+
+   def test_get_multi_large_values
+      big = "b" * 100_000
+      @m.m_set("^TMulti", 1, big)
+      @m.m_set("^TMulti", 2, "small")
+      assert_equal [big, "small", big], @m.m_get_multi([["^TMulti", 1], ["^TMulti", 2], ["^TMulti", 1]])
+   end
+
+   def test_get_multi_bad_arguments
+      assert_raises(StandardError) { @m.m_get_multi(1) }
+      assert_raises(StandardError) { @m.m_get_multi([1]) }
+   end
+
+   def test_set_and_kill_multi
+      counts(@m)
+      assert_equal [0] * 100, @m.m_set_multi(100.times.map { |i| ["^TMulti", i, "v#{i}"] })
+      assert_equal "S:100", counts(@m)
+      assert_equal ["v0", "v99"], @m.m_get_multi([["^TMulti", 0], ["^TMulti", 99]])
+      assert_equal [0, 0], @m.m_kill_multi([["^TMulti", 0], ["^TMulti", 1]])
+      assert_equal ["", "", "v2"], @m.m_get_multi([["^TMulti", 0], ["^TMulti", 1], ["^TMulti", 2]])
+   end
+
+   def test_set_multi_reports_each_error
+      statuses = @m.m_set_multi([["^TMulti", 1, "x"], ["^MockError", 1, "e"], ["^TMulti", 2, "y"]])
+      assert_equal 0, statuses[0]
+      assert_match(/mock error/, statuses[1])
+      assert_equal 0, statuses[2]
+      assert_equal ["x", "y"], @m.m_get_multi([["^TMulti", 1], ["^TMulti", 2]])
+      assert_raises(StandardError) { @m.m_set_multi([["^TMulti", 1, "x"], "^TMulti"]) }
+   end
+
+   def test_set_multi_large_values
+      big = "s" * 120_000
+      @m.m_set_multi([["^TMulti", "a", big], ["^TMulti", "b", "small"]])
+      assert_equal [big, "small"], @m.m_get_multi([["^TMulti", "a"], ["^TMulti", "b"]])
+   end
+
+end
@@ -0,0 +1,62 @@
+require_relative 'test_helper'
+
+class TestOrderBatch < MGTest
+
+   def fill(m)
+      m.m_kill("^TOB")
+      [1, 2, 10, -1, "1.5", "a", "B", "b"].each { |k| m.m_set("^TOB", k, "v#{k}") }
+      m.m_set("^TOB", "a", "x", "below")
+   end
+
+   def test_collating_order
+      m = connect
+      fill(m)
+      assert_equal ["-1", "1", "1.5", "2", "10", "B", "a", "b"], m.m_order_batch("^TOB", "", count: 20)
+      assert_equal ["b", "a", "B"], m.m_order_batch("^TOB", "", count: 3, reverse: true)
+      assert_equal ["10", "B"], m.m_order_batch("^TOB", 2, count: 2)
+      assert_equal [], m.m_order_batch("^TOB", "b", count: 5)
+      assert_equal [], m.m_order_batch("^TOB", "", count: 0)
+   end
+
+   def test_with_data
+      m = connect
+      fill(m)
+      assert_equal [["1.5", "v1.5"], ["2", "v2"]], m.m_order_batch("^TOB", 1, count: 2, with_data: true)
+      assert_equal [["B", "vB"], ["a", "va"]], m.m_order_batch("^TOB", "10", count: 2, with_data: true)
+      assert_equal [["10", "v10"]], m.m_order_batch("^TOB", "B", count: 1, with_data: true, reverse: true)
+   end
+
+   def test_one_request_per_batch
+      m = connect
+      fill(m)
+      counts(m)
+      m.m_order_batch("^TOB", "", count: 20, with_data: true)
+      assert_equal "OB:1", counts(m)
+   end
+
+   def test_large_values
+      m = connect
+      m.m_kill("^TOB")
+      big = "d" * 90_000
+      m.m_set("^TOB", 1, big)
+      m.m_set("^TOB", 2, big)
+      assert_equal [["1", big], ["2", big]], m.m_order_batch("^TOB", "", count: 5, with_data: true)
+   end
+
+   def test_fallback_without_batched_commands
+      m = connect(nobatch: true)
+      fill(m)
+      assert_equal ["-1", "1", "1.5"], m.m_order_batch("^TOB", "", count: 3)
+      assert_equal [["b", "vb"], ["a", "va"]], m.m_order_batch("^TOB", "", count: 2, with_data: true, reverse: true)
+      counts(m)
+      m.m_order_batch("^TOB", "", count: 3)
+      refute_match(/OB/, counts(m))
+   end
+
+   def test_errors
+      m = connect
+      assert_raises(ArgumentError) { m.m_order_batch("^TOB", "") }
+      assert_raises(StandardError) { m.m_order_batch("^TOB", count: 1) }
+   end
+
+end
@@ -0,0 +1,36 @@
+require_relative 'test_helper'
+
+class TestOrderData < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TOD")
+      @m.m_set("^TOD", 2, "two")
+      @m.m_set("^TOD", 10, "ten")
+      @m.m_set("^TOD", "x", "y", "below")
+   end
+
+   def test_walk
+      assert_equal ["2", "two"], @m.m_order_data("^TOD", "")
+      assert_equal ["10", "ten"], @m.m_order_data("^TOD", 2)
+      assert_equal ["x", ""], @m.m_order_data("^TOD", 10)
+      assert_equal ["", ""], @m.m_order_data("^TOD", "x")
+      assert_equal ["x", ""], @m.m_previous_data("^TOD", "")
+      assert_equal ["2", "two"], @m.m_previous_data("^TOD", 10)
+      assert_equal ["", ""], @m.m_previous_data("^TOD", 2)
+   end
+
+   def test_one_round_trip
+      counts(@m)
+      @m.m_order_data("^TOD", 2)
+      assert_equal 1, counts(@m).split(",").sum { |c| c.split(":")[1].to_i }
+   end
+
+   def test_large_value
+      big = "q" * 80_000
+      @m.m_set("^TOD", 5, big)
+      assert_equal ["5", big], @m.m_order_data("^TOD", 2)
+      assert_equal ["5", big], @m.m_previous_data("^TOD", 10)
+   end
+
+end
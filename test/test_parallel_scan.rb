@@ -0,0 +1,68 @@
+require_relative 'test_helper'
+
+class TestParallelScan < MGTest
+
+   def serial(m, *keys)
+      result = []
+      k = ""
+      while (k = m.m_order(*keys, k)) != ""
+         result << [k, m.m_get(*keys, k)]
+      end
+      result
+   end
+
+   def test_skewed_keys
+      m = connect
+      m.m_kill("^TScan")
+      m.m_pipeline do |p|
+         (1..400).each { |i| p.m_set("^TScan", i, i) }
+         p.m_set("^TScan", 1000000, "far")
+         (1..400).each { |i| p.m_set("^TScan", "customer:%05d" % i, i) }
+         p.m_set("^TScan", "zzz", "last")
+      end
+      expected = serial(m, "^TScan")
+      assert_equal expected, m.parallel_scan("^TScan", partitions: 8, batch: 50)
+
+      sizes = Hash.new(0)
+      seen = []
+      m.parallel_scan("^TScan", partitions: 8, batch: 50) { |i, records| sizes[i] += records.size; seen.concat(records) }
+      assert_equal expected.sort, seen.sort
+      # no partition is left with most of the keys
+      assert_operator sizes.values.max, :<, expected.size / 3
+   end
+
+   def test_order_within_partition
+      m = connect
+      m.m_kill("^TScan")
+      m.m_pipeline { |p| 300.times { |i| p.m_set("^TScan", "k%04d" % i, i) } }
+      parts = Hash.new { |h, k| h[k] = [] }
+      m.parallel_scan("^TScan", partitions: 4, batch: 20) { |i, records| parts[i].concat(records) }
+      parts.each_value { |records| assert_equal records.sort, records }
+      assert_equal 300, parts.values.sum(&:size)
+   end
+
+   def test_below_a_key
+      m = connect
+      m.m_kill("^TScan")
+      m.m_pipeline { |p| 50.times { |i| p.m_set("^TScan", "a", i, "v#{i}") }; p.m_set("^TScan", "b", 1, "other") }
+      assert_equal serial(m, "^TScan", "a"), m.parallel_scan("^TScan", "a", partitions: 3, batch: 7)
+      assert_equal [], m.parallel_scan("^TScan", "none", partitions: 3)
+   end
+
+   def test_large_values
+      m = connect
+      m.m_kill("^TScan")
+      big = "p" * 60_000
+      m.m_pipeline { |p| 6.times { |i| p.m_set("^TScan", i, big + i.to_s) } }
+      assert_equal 6.times.map { |i| [i.to_s, big + i.to_s] }, m.parallel_scan("^TScan", partitions: 3, batch: 2)
+   end
+
+   def test_error_in_block
+      m = connect
+      m.m_kill("^TScan")
+      m.m_pipeline { |p| 100.times { |i| p.m_set("^TScan", i, i) } }
+      assert_raises(RuntimeError) { m.parallel_scan("^TScan", partitions: 4, batch: 10) { raise "stop" } }
+      assert_equal "5", m.m_get("^TScan", 5)
+   end
+
+end
@@ -0,0 +1,52 @@
+require_relative 'test_helper'
+
+class TestPipeline < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TPipe")
+   end
+
+   def test_responses_in_order
+      results = @m.m_pipeline do |p|
+         p.m_set("^TPipe", 1, "one")
+         p.m_get("^TPipe", 1)
+         p.m_increment("^TPipe", "n", 5)
+         p.m_data("^TPipe", 1)
+         p.m_order("^TPipe", "")
+         p.m_function("echo^mock", "a", "b")
+      end
+      assert_equal ["0", "one", "5", "1", "1", "echo^mock(a,b)"], results
+   end
+
+   def test_single_round_trip
+      counts(@m)
+      @m.m_pipeline { |p| 100.times { |i| p.m_set("^TPipe", i, i) } }
+      assert_equal "S:100", counts(@m)
+      elapsed = timed { connect(rtt: 0.02).m_pipeline { |p| 20.times { |i| p.m_get("^TPipe", i) } } }
+      assert_operator elapsed, :<, 0.2
+   end
+
+   def test_execute_and_reuse
+      p = @m.m_pipeline
+      p.m_set("^TPipe", 1, "a").m_get("^TPipe", 1)
+      assert_equal 2, p.m_size
+      assert_equal ["0", "a"], p.m_execute
+      p.m_get("^TPipe", 2)
+      assert_equal [""], p.m_execute
+   end
+
+   def test_large_values
+      big = "v" * 200_000
+      results = @m.m_pipeline { |p| p.m_set("^TPipe", "big", big); p.m_get("^TPipe", "big"); p.m_function("big^mock", 100_000) }
+      assert_equal big, results[1]
+      assert_equal 100_000, results[2].size
+   end
+
+   def test_error_leaves_connection_usable
+      assert_raises(StandardError) { @m.m_pipeline { |p| p.m_get("^TPipe", 1); p.m_function("error^mock"); p.m_get("^TPipe", 2) } }
+      @m.m_set("^TPipe", 1, "after")
+      assert_equal "after", @m.m_get("^TPipe", 1)
+   end
+
+end
@@ -0,0 +1,87 @@
+require_relative 'test_helper'
+
+class TestPrefetch < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TPre")
+      @m.m_pipeline { |p| (1..200).each { |i| p.m_set("^TPre", i, "v#{i}") } }
+   end
+
+   def walk(m, global = "^TPre", direction = :m_order)
+      result = []
+      k = ""
+      while (k = m.send(direction, global, k)) != ""
+         result << [k, m.m_get(global, k)]
+      end
+      result
+   end
+
+   def test_loop_is_prefetched
+      expected = (1..200).map { |i| [i.to_s, "v#{i}"] }
+      counts(@m)
+      assert_equal expected, walk(@m)
+      c = counts(@m)
+      assert_match(/OB:/, c)
+      # a fetch per window, not two requests per record
+      assert_operator c.scan(/\d+/).map(&:to_i).sum, :<, 20
+      assert_equal expected.reverse, walk(@m, "^TPre", :m_previous)
+   end
+
+   def test_disabled
+      @m.m_set_prefetch(0)
+      counts(@m)
+      assert_equal 200, walk(@m).size
+      refute_match(/OB:/, counts(@m))
+   end
+
+   def test_write_discards_the_window
+      result = []
+      k = ""
+      while (k = @m.m_order("^TPre", k)) != ""
+         @m.m_set("^TPre", 150, "changed") if k == "100"
+         result << @m.m_get("^TPre", k)
+      end
+      assert_equal "changed", result[149]
+   end
+
+   def test_invalidate_discards_the_window
+      result = []
+      k = ""
+      while (k = @m.m_order("^TPre", k)) != ""
+         if k == "100"
+            connect.m_set("^TPre", 150, "elsewhere")
+            @m.m_invalidate_cache
+         end
+         result << @m.m_get("^TPre", k)
+      end
+      assert_equal "elsewhere", result[149]
+   end
+
+   def test_threads_walking_at_once
+      m = connect(rtt: 0.002)
+      %w[^TPreA ^TPreB].each { |g| m.m_kill(g); m.m_pipeline { |p| (1..100).each { |i| p.m_set(g, i, "#{g}#{i}") } } }
+      results = %w[^TPreA ^TPreB ^TPreA ^TPreB].map { |g| Thread.new { walk(m, g) == (1..100).map { |i| [i.to_s, "#{g}#{i}"] } } }.map(&:value)
+      assert_equal [true] * 4, results
+   end
+
+   def test_fibers_walking_in_turn
+      a = Fiber.new { r = []; k = ""; while (k = @m.m_order("^TPre", k)) != ""; r << @m.m_get("^TPre", k); Fiber.yield; end; r }
+      b = Fiber.new { r = []; k = ""; while (k = @m.m_previous("^TPre", k)) != ""; r << @m.m_get("^TPre", k); Fiber.yield; end; r }
+      ra = rb = nil
+      while ra.nil? || rb.nil?
+         ra ||= (x = a.resume).is_a?(Array) ? x : nil
+         rb ||= (x = b.resume).is_a?(Array) ? x : nil
+      end
+      assert_equal (1..200).map { |i| "v#{i}" }, ra
+      assert_equal (1..200).map { |i| "v#{i}" }.reverse, rb
+   end
+
+   def test_large_values
+      big = "f" * 50_000
+      @m.m_kill("^TPre")
+      @m.m_pipeline { |p| 10.times { |i| p.m_set("^TPre", i, big + i.to_s) } }
+      assert_equal 10.times.map { |i| [i.to_s, big + i.to_s] }, walk(@m)
+   end
+
+end
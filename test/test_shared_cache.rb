@@ -0,0 +1,144 @@
+require_relative 'test_helper'
+
+class TestSharedCache < MGTest
+
+   def setup
+      skip "no POSIX shared memory" unless File.directory?("/dev/shm")
+      @names = []
+      @m = connect
+      %w[^TShA ^TShB].each { |g| @m.m_kill(g) }
+      @m.m_set("^TShA", 1, "a")
+      @m.m_set("^TShB", 1, "b")
+   end
+
+   def teardown
+      @names.to_a.each { |name| File.delete("/dev/shm#{name}") rescue nil }
+   end
+
+   def segment(tag)
+      name = "/mg_ruby_test_#{Process.pid}_#{tag}"
+      File.delete("/dev/shm#{name}") rescue nil
+      @names << name
+      name
+   end
+
+   def attach(m, name, **options)
+      m.m_set_cache("^TShA", ttl: 60, shared: name, **options)
+      m.m_set_cache("^TShB", ttl: 60, shared: name, **options)
+      m
+   end
+
+   # run the block in a child process (with its own connection) and return its result
+   def in_child
+      rd, wr = IO.pipe
+      pid = fork do
+         rd.close
+         result = begin
+            yield connect
+         rescue StandardError => e
+            e
+         end
+         wr.write(Marshal.dump(result))
+         exit!(0)
+      end
+      wr.close
+      result = Marshal.load(rd.read)
+      Process.wait(pid)
+      raise result if result.is_a?(Exception)
+      result
+   end
+
+   def test_results_are_shared_between_processes
+      name = segment("share")
+      attach(@m, name)
+      assert_equal "a", @m.m_get("^TShA", 1)
+      assert_equal name, @m.m_get_cache_stats[:shared]
+      counts(@m)
+      child = in_child { |c| attach(c, name); [c.m_get("^TShA", 1), c.m_get_cache_stats[:hits]] }
+      assert_equal ["a", 1], child
+      assert_equal "", counts(@m).sub(/,?X:\d+/, "")
+   end
+
+   def test_a_write_invalidates_only_that_global_everywhere
+      name = segment("global")
+      attach(@m, name)
+      @m.m_get("^TShA", 1)
+      @m.m_get("^TShB", 1)
+      in_child { |c| attach(c, name).m_set("^TShA", 1, "a2") }
+      counts(@m)
+      assert_equal "b", @m.m_get("^TShB", 1)
+      assert_equal "a2", @m.m_get("^TShA", 1)
+      assert_equal "G:1", counts(@m)
+   end
+
+   def test_commit_invalidates_the_globals_written
+      name = segment("commit")
+      attach(@m, name)
+      @m.m_get("^TShA", 1)
+      @m.m_get("^TShB", 1)
+      @m.m_tstart
+      @m.m_data("^TShA", 1)
+      @m.m_tcommit
+      counts(@m)
+      @m.m_get("^TShA", 1)
+      @m.m_get("^TShB", 1)
+      assert_equal "", counts(@m)
+      @m.m_tstart
+      @m.m_set("^TShB", 1, "b2")
+      @m.m_get("^TShB", 1)
+      @m.m_tcommit
+      counts(@m)
+      assert_equal "b2", @m.m_get("^TShB", 1)
+      assert_equal "a", @m.m_get("^TShA", 1)
+      assert_equal "G:1", counts(@m)
+   end
+
+   def test_racing_creators_share_one_size
+      name = segment("race")
+      readers = 8.times.map do |i|
+         Thread.new { in_child { |c| attach(c, name, max: 10 + i * 7); c.m_get_cache_stats.values_at(:shared, :max) } }
+      end
+      results = readers.map(&:value)
+      assert_equal [name], results.map(&:first).uniq
+      assert_equal 1, results.map(&:last).uniq.size
+      assert_equal results[0][1], attach(connect, name, max: 500).m_get_cache_stats[:max]
+   end
+
+   def test_a_foreign_segment_is_refused
+      name = segment("foreign")
+      File.write("/dev/shm#{name}", "x" * 5000)
+      error = assert_raises(StandardError) { attach(connect, name) }
+      assert_match(/not an mg_ruby shared cache|size/, error.message)
+      assert_equal "x" * 5000, File.read("/dev/shm#{name}")
+   end
+
+   def test_large_results_are_not_shared
+      name = segment("large")
+      attach(@m, name)
+      big = "L" * 2000
+      @m.m_set("^TShA", "big", big)
+      counts(@m)
+      assert_equal big, @m.m_get("^TShA", "big")
+      assert_equal big, @m.m_get("^TShA", "big")
+      assert_equal "G:2", counts(@m)
+   end
+
+   def test_no_torn_values
+      name = segment("torn")
+      keys = %w[a b c d e f g h]
+      keys.each { |k| @m.m_set("^TShA", k, k * 50) }
+      attach(@m, name, max: 16)
+      readers = 4.times.map do |i|
+         Thread.new do
+            in_child do |c|
+               attach(c, name)
+               rng = Random.new(i)
+               3000.times.count { k = keys.sample(random: rng); ![k * 50, k.upcase * 50].include?(c.m_get("^TShA", k)) }
+            end
+         end
+      end
+      200.times { |i| k = keys[i % keys.size]; @m.m_set("^TShA", k, i.even? ? k.upcase * 50 : k * 50) }
+      assert_equal [0, 0, 0, 0], readers.map(&:value)
+   end
+
+end
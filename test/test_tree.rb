@@ -0,0 +1,92 @@
+require_relative 'test_helper'
+
+class TestTree < MGTest
+
+   def setup
+      @m = connect
+      @m.m_kill("^TTree")
+   end
+
+   def order
+      {_value: "order 1", "customer" => {_value: "Smith"}, "lines" => {"1" => {_value: "widget", "qty" => {_value: "3"}}, "2" => {"qty" => {_value: "5"}}}}
+   end
+
+   def test_get_tree
+      @m.m_set("^TTree", 1, "order 1")
+      @m.m_set("^TTree", 1, "customer", "Smith")
+      @m.m_set("^TTree", 1, "lines", 1, "widget")
+      @m.m_set("^TTree", 1, "lines", 1, "qty", 3)
+      @m.m_set("^TTree", 1, "lines", 2, "qty", 5)
+      counts(@m)
+      assert_equal order, @m.m_get_tree("^TTree", 1)
+      assert_equal "QB:1", counts(@m)
+      assert_equal({"qty" => {_value: "5"}}, @m.m_get_tree("^TTree", 1, "lines", 2))
+      assert_equal({}, @m.m_get_tree("^TTree", 9))
+   end
+
+   def test_keys_in_collating_order
+      [10, 9, "b", "A", -1].each { |k| @m.m_set("^TTree", "c", k, k) }
+      assert_equal ["-1", "9", "10", "A", "b"], @m.m_get_tree("^TTree", "c").keys
+   end
+
+   def test_max_nodes
+      @m.m_pipeline { |p| 50.times { |i| p.m_set("^TTree", 1, i, i) } }
+      assert_raises(RuntimeError) { @m.m_get_tree("^TTree", 1, max_nodes: 49) }
+      assert_equal 50, @m.m_get_tree("^TTree", 1, max_nodes: 50).size
+   end
+
+   def test_subtree_larger_than_a_batch
+      @m.m_pipeline { |p| 12_000.times { |i| p.m_set("^TTree", i / 100, i % 100, i) } }
+      counts(@m)
+      tree = @m.m_get_tree("^TTree", max_nodes: 20_000)
+      assert_equal "QB:2", counts(@m)
+      assert_equal 120, tree.size
+      assert_equal({_value: "11999"}, tree["119"]["99"])
+   end
+
+   def test_large_values
+      big = "t" * 100_000
+      @m.m_set("^TTree", 1, "a", big)
+      @m.m_set("^TTree", 1, "b", big)
+      assert_equal({"a" => {_value: big}, "b" => {_value: big}}, @m.m_get_tree("^TTree", 1))
+   end
+
+   def test_fallback_without_batched_commands
+      m = connect(nobatch: true)
+      m.m_kill("^TTree")
+      m.m_set_tree("^TTree", 1, order)
+      assert_equal order, m.m_get_tree("^TTree", 1)
+   end
+
+   def test_set_tree_round_trip
+      counts(@m)
+      assert_equal 5, @m.m_set_tree("^TTree", 1, order)
+      assert_equal "S:5", counts(@m)
+      assert_equal order, @m.m_get_tree("^TTree", 1)
+      assert_equal "Smith", @m.m_get("^TTree", 1, "customer")
+   end
+
+   def test_set_tree_plain_values
+      doc = {"a" => 1, :b => "two", "c" => {"d" => "deep"}}
+      assert_equal 3, @m.m_set_tree("^TTree", "doc", doc)
+      assert_equal({"a" => {_value: "1"}, "b" => {_value: "two"}, "c" => {"d" => {_value: "deep"}}}, @m.m_get_tree("^TTree", "doc"))
+   end
+
+   def test_set_tree_kill_first
+      @m.m_set("^TTree", 1, "old", "x")
+      @m.m_set_tree("^TTree", 1, {"new" => "y"}, kill_first: true)
+      assert_equal({"new" => {_value: "y"}}, @m.m_get_tree("^TTree", 1))
+   end
+
+   def test_set_tree_large_values
+      big = "u" * 90_000
+      @m.m_set_tree("^TTree", 1, {"a" => big, "b" => {"c" => big}})
+      assert_equal big, @m.m_get("^TTree", 1, "b", "c")
+   end
+
+   def test_set_tree_errors
+      assert_raises(StandardError) { @m.m_set_tree("^TTree", 1) }
+      assert_raises(StandardError) { @m.m_set_tree("^TTree", 1, "not a hash") }
+   end
+
+end